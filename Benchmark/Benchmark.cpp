@@ -0,0 +1,318 @@
+// Renders a fixed set of scenes at fixed seeds, resolution and sample count across thread counts, and reports the
+// median time, Mrays/s, the resident memory each scene adds and the RMSE against a stored reference image as JSON.
+//
+// Usage: Benchmark [--max-threads N] [--repetitions N] [--width N] [--spp N] [--depth N] [--seed N]
+//                  [--scenes a,b,...] [--references DIR] [--update-references] [--output FILE]
+
+#include "PathTracer.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "compressed_mesh.h"
+#include "cpu_dispatch.h"
+#include "heatmap.h"
+#include "hittable_list.h"
+#include "process_stats.h"
+#include "renderer.h"
+#include "scenes.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct benchmark_settings {
+	int max_threads = int(std::max(1u, std::thread::hardware_concurrency()));
+	int repetitions = 3;
+	int image_width = 192;
+	int samples_per_pixel = 16;
+	int max_depth = 16;
+	uint32_t seed = 1;
+	std::string scenes;					// Comma separated names, empty for all
+	std::string reference_directory = ".";
+	bool update_references = false;
+	std::string output_path = "benchmark_results.json";
+};
+
+struct benchmark_scene {
+	const char* name;
+	std::function<hittable_list(thread_pool&)> build;
+
+	vec3 camera_position;
+	vec3 camera_lookat;
+	float vertical_fov;
+	float aperture;
+};
+
+struct benchmark_result {
+	std::string scene;
+	size_t primitives;
+	double build_ms;
+	int threads;
+	double median_ms;
+	double min_ms;
+	double max_ms;
+	double mrays_per_s;
+	double scene_rss_mb;	// Resident after the scene and its tree were built, less before
+	double rmse;		// Negative when there was no reference to compare against
+};
+
+// position_bits of 16 or 21 hold the mesh as quantized clusters, 0 as triangles
+hittable_list large_mesh_scene(thread_pool& pool, int position_bits) {
+	hittable_list world;
+	world.arena = make_shared<scene_arena>();
+	scene_arena& arena = *world.arena;
+
+	auto ground_mat = arena.make<lambertian>(vec3(0.5f, 0.5f, 0.5f));
+	world.add(arena.make<sphere>(vec3(0.f, -1000.5f, 0.f), 1000.f, ground_mat));
+
+	// About a quarter of a million triangles
+	auto mesh_mat = arena.make<metal>(vec3(0.7f, 0.6f, 0.5f), 0.2f);
+	mesh sphere_mesh = make_uv_sphere(256, 512);
+	if (position_bits != 0) {
+		world.add(arena.make<compressed_mesh>(sphere_mesh, mesh_mat, position_bits, pool));
+	}
+	else {
+		add_triangles(sphere_mesh, mesh_mat, world);
+	}
+
+	return world;
+}
+
+std::vector<benchmark_scene> benchmark_scenes() {
+	const vec3 sample_position(0.f, 0.f, 7.f);
+	const vec3 origin(0.f, 0.f, 0.f);
+
+	return {
+		{ "sample", [](thread_pool&) { return sample_scene(); }, sample_position, origin, 20.f, 0.1f },
+		{ "test", [](thread_pool&) { return test_scene(); }, sample_position, origin, 20.f, 0.1f },
+		{ "random_spheres", [](thread_pool&) { return random_spheres_scene(); }, vec3(13.f, 2.f, 3.f), origin, 20.f, 0.1f },
+		{ "large_mesh", [](thread_pool& pool) { return large_mesh_scene(pool, 0); }, sample_position, origin, 20.f, 0.f },
+		{ "large_mesh_q16", [](thread_pool& pool) { return large_mesh_scene(pool, 16); }, sample_position, origin, 20.f, 0.f },
+		{ "large_mesh_q21", [](thread_pool& pool) { return large_mesh_scene(pool, 21); }, sample_position, origin, 20.f, 0.f },
+		{ "many_instances", [](thread_pool& pool) { return instanced_scene(pool); }, vec3(8.f, 6.f, 12.f), origin, 30.f, 0.f }
+	};
+}
+
+bool parse_arguments(int argc, char** argv, benchmark_settings& settings) {
+	for (int i = 1; i < argc; ++i) {
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+		auto needs_value = [&]() {
+			if (value == nullptr) printf("Missing value for %s\n", arg);
+			return value != nullptr;
+		};
+
+		if (strcmp(arg, "--update-references") == 0) {
+			settings.update_references = true;
+			continue;
+		}
+
+		if (!needs_value()) return false;
+		++i;
+
+		if (strcmp(arg, "--max-threads") == 0) settings.max_threads = std::max(1, atoi(value));
+		else if (strcmp(arg, "--repetitions") == 0) settings.repetitions = std::max(1, atoi(value));
+		else if (strcmp(arg, "--width") == 0) settings.image_width = std::max(2, atoi(value));
+		else if (strcmp(arg, "--spp") == 0) settings.samples_per_pixel = std::max(1, atoi(value));
+		else if (strcmp(arg, "--depth") == 0) settings.max_depth = std::max(1, atoi(value));
+		else if (strcmp(arg, "--seed") == 0) settings.seed = uint32_t(strtoul(value, nullptr, 10));
+		else if (strcmp(arg, "--scenes") == 0) settings.scenes = value;
+		else if (strcmp(arg, "--references") == 0) settings.reference_directory = value;
+		else if (strcmp(arg, "--output") == 0) settings.output_path = value;
+		else {
+			printf("Unknown argument: %s\n", arg);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool is_selected(const benchmark_settings& settings, const char* name) {
+	if (settings.scenes.empty()) return true;
+
+	std::string list = "," + settings.scenes + ",";
+	return list.find("," + std::string(name) + ",") != std::string::npos;
+}
+
+// References are binary PPMs, the same 8 bit data the renderer writes to PNG
+bool write_ppm(const std::string& path, int width, int height, const unsigned char* data) {
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) return false;
+
+	fprintf(file, "P6\n%d %d\n255\n", width, height);
+	fwrite(data, 1, size_t(width) * height * 3, file);
+	return fclose(file) == 0;
+}
+
+bool read_ppm(const std::string& path, int width, int height, std::vector<unsigned char>& data) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr) return false;
+
+	int file_width = 0;
+	int file_height = 0;
+	int max_value = 0;
+	bool is_valid = fscanf(file, "P6 %d %d %d", &file_width, &file_height, &max_value) == 3
+		&& file_width == width && file_height == height && max_value == 255 && fgetc(file) != EOF;
+
+	if (is_valid) {
+		data.resize(size_t(width) * height * 3);
+		is_valid = fread(data.data(), 1, data.size(), file) == data.size();
+	}
+
+	fclose(file);
+	return is_valid;
+}
+
+double rmse(const std::vector<unsigned char>& a, const std::vector<unsigned char>& b) {
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		double d = (double(a[i]) - double(b[i])) / 255.0;
+		sum += d * d;
+	}
+	return a.empty() ? 0.0 : std::sqrt(sum / a.size());
+}
+
+bool write_json(const std::string& path, const benchmark_settings& settings, const std::vector<benchmark_result>& results) {
+	FILE* file = fopen(path.c_str(), "w");
+	if (file == nullptr) return false;
+
+	fprintf(file, "{\n");
+	fprintf(file, "  \"settings\": {\"image_width\": %d, \"samples_per_pixel\": %d, \"max_depth\": %d, \"seed\": %u, \"repetitions\": %d, \"kernels\": \"%s\"},\n",
+		settings.image_width, settings.samples_per_pixel, settings.max_depth, settings.seed, settings.repetitions, cpu_kernels().name);
+	fprintf(file, "  \"results\": [\n");
+
+	for (size_t i = 0; i < results.size(); ++i) {
+		const benchmark_result& r = results[i];
+
+		char rmse_text[32] = "null";
+		if (r.rmse >= 0.0) snprintf(rmse_text, sizeof(rmse_text), "%.6f", r.rmse);
+
+		fprintf(file,
+			"    {\"scene\": \"%s\", \"primitives\": %zu, \"build_ms\": %.3f, \"threads\": %d, \"median_ms\": %.3f, "
+			"\"min_ms\": %.3f, \"max_ms\": %.3f, \"mrays_per_s\": %.3f, \"scene_rss_mb\": %.1f, \"rmse\": %s}%s\n",
+			r.scene.c_str(), r.primitives, r.build_ms, r.threads, r.median_ms, r.min_ms, r.max_ms, r.mrays_per_s,
+			r.scene_rss_mb, rmse_text, i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(file, "  ]\n}\n");
+	return fclose(file) == 0;
+}
+
+int main(int argc, char** argv) {
+	benchmark_settings settings;
+	if (!parse_arguments(argc, argv, settings)) return EXIT_FAILURE;
+
+	const float aspect_ratio = 3.f / 2.f;
+	const int image_width = settings.image_width;
+	const int image_height = std::max(2, static_cast<int>(image_width / aspect_ratio));
+	const int image_channels = 3;
+
+	// 1, 2, 4, ... up to and including the maximum
+	std::vector<int> thread_counts;
+	for (int threads = 1; threads < settings.max_threads; threads *= 2) thread_counts.push_back(threads);
+	thread_counts.push_back(settings.max_threads);
+
+	printf("CPU kernels: %s\n", cpu_kernels().name);
+
+	std::vector<benchmark_result> results;
+	std::vector<unsigned char> data(size_t(image_width) * image_height * image_channels);
+
+	for (const benchmark_scene& scene : benchmark_scenes()) {
+		if (!is_selected(settings, scene.name)) continue;
+
+		// Scenes draw from the random generator too, so seed it before every build
+		seed_random(settings.seed);
+
+		// The process's peak covers every scene before this one, so the scene is measured by what it adds
+		thread_pool pool;
+		pool.Start();
+		release_free_memory();
+		const size_t rss_before = current_rss_bytes();
+		hittable_list world = scene.build(pool);
+		bvh world_bvh(world, pool);
+		release_free_memory();
+		const size_t rss_after = current_rss_bytes();
+		pool.Stop();
+
+		float focus_distance = length(scene.camera_position - scene.camera_lookat);
+		camera cam(scene.camera_position, scene.camera_lookat, vec3(0.f, 1.f, 0.f), scene.vertical_fov, aspect_ratio, scene.aperture, focus_distance);
+
+		std::vector<unsigned char> reference;
+		std::string reference_path = settings.reference_directory + "/reference_" + scene.name + ".ppm";
+		bool has_reference = !settings.update_references && read_ppm(reference_path, image_width, image_height, reference);
+
+		for (int threads : thread_counts) {
+			cost_map costs(image_width, image_height);
+			std::vector<double> times;
+
+			for (int repetition = 0; repetition < settings.repetitions; ++repetition) {
+				tile_scheduler scheduler(make_tiles(image_width, image_height, auto_tile_size(image_width, image_height, threads), tile_order::hilbert));
+				scheduler.print_progress = false;
+
+				pool.Start(uint32_t(threads));
+				auto time_s = std::chrono::high_resolution_clock::now();
+
+				scheduler.run(pool, [&](const tile& t, int y_s, int y_f) {
+					sample_rect(t.x, y_s, t.width, y_f - y_s,
+						image_width, image_height, settings.samples_per_pixel, settings.max_depth, image_channels,
+						cam, world_bvh, settings.seed, data.data(), &costs, nullptr);
+				});
+
+				auto time_f = std::chrono::high_resolution_clock::now();
+				pool.Stop();
+
+				times.push_back(std::chrono::duration<double, std::milli>(time_f - time_s).count());
+			}
+
+			std::sort(times.begin(), times.end());
+
+			benchmark_result result;
+			result.scene = scene.name;
+			result.primitives = world_bvh.primitives.size();
+			result.build_ms = world_bvh.build_time_ms;
+			result.threads = threads;
+			result.median_ms = times[times.size() / 2];
+			result.min_ms = times.front();
+			result.max_ms = times.back();
+			result.mrays_per_s = double(costs.total_rays()) / (result.median_ms * 1000.0);
+			result.scene_rss_mb = (double(rss_after) - double(rss_before)) / (1024.0 * 1024.0);
+			result.rmse = -1.0;
+
+			if (has_reference) {
+				result.rmse = rmse(data, reference);
+			}
+			else if (write_ppm(reference_path, image_width, image_height, data.data())) {
+				printf("Wrote reference %s\n", reference_path.c_str());
+				reference = data;
+				has_reference = true;
+			}
+			else {
+				printf("Unable to write reference %s\n", reference_path.c_str());
+			}
+
+			printf("%-16s %2d threads: median %9.2f ms, %7.2f Mrays/s, scene RSS %7.1f MB, RMSE %s\n",
+				scene.name, threads, result.median_ms, result.mrays_per_s, result.scene_rss_mb,
+				result.rmse >= 0.0 ? std::to_string(result.rmse).c_str() : "n/a");
+
+			results.push_back(result);
+		}
+	}
+
+	if (!write_json(settings.output_path, settings, results)) {
+		printf("Unable to write %s\n", settings.output_path.c_str());
+		return EXIT_FAILURE;
+	}
+
+	printf("Wrote %s\n", settings.output_path.c_str());
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+// Microbenchmarks of the intersection, sampling and shading kernels, reporting per operation times over repeated
+// runs and the throughput of a single core.
+//
+// Usage: MicroBenchmark [--filter TEXT] [--min-time MS] [--repetitions N] [--threads N] [--output FILE]
+
+#include "PathTracer.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "cpu_dispatch.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "mesh.h"
+#include "micro_benchmark.h"
+#include "sphere.h"
+#include "triangle.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using glm::vec2;
+
+// Inputs are generated up front and cycled through, so the kernels are timed without the generator
+const int input_count = 1024;
+
+struct kernel_inputs {
+	std::vector<ray> rays;				// About half of them hit the unit sphere and the triangle
+	std::vector<hit_record> records;	// Front and back face hits on the unit sphere
+	std::vector<vec2> uvs;
+};
+
+kernel_inputs make_inputs() {
+	seed_random(1);
+
+	kernel_inputs inputs;
+	for (int i = 0; i < input_count; ++i) {
+		vec3 origin = normalize(random_vec3_in_unit_sphere() + vec3(0.f, 0.f, 1e-3f)) * 4.f;
+		vec3 target = random_vec3(-1.4f, 1.4f);
+		inputs.rays.push_back(ray(origin, target - origin));
+		inputs.uvs.push_back(vec2(random_float(), random_float()));
+	}
+
+	sphere unit_sphere(vec3(0.f), 1.f, nullptr);
+	for (int i = 0; inputs.records.size() < input_count; ++i) {
+		hit_record rec;
+		const ray& r = inputs.rays[i % input_count];
+		if (unit_sphere.hit(r, 0.001f, infinity, rec)) {
+			inputs.records.push_back(rec);
+		}
+	}
+
+	return inputs;
+}
+
+std::vector<micro_benchmark> make_benchmarks(const kernel_inputs& inputs) {
+	const int mask = input_count - 1;
+
+	auto unit_sphere = make_shared<sphere>(vec3(0.f), 1.f, nullptr);
+	auto unit_triangle = make_shared<triangle>(vec3(-1.f, -1.f, 0.f), vec3(1.f, -1.f, 0.f), vec3(0.f, 1.f, 0.f), nullptr);
+
+	// Sixteen small spheres spread over the same volume
+	auto list = make_shared<hittable_list>();
+	for (int i = 0; i < 16; ++i) {
+		list->add(list->make<sphere>(random_vec3(-1.f, 1.f), 0.25f, nullptr));
+	}
+
+	// A unit uv sphere of about two thousand triangles, traversed by the dispatched kernels
+	hittable_list mesh_list;
+	add_triangles(make_uv_sphere(32, 64), nullptr, mesh_list);
+
+	thread_pool pool;
+	pool.Start();
+	auto mesh_bvh = make_shared<bvh>(mesh_list, pool);
+	pool.Stop();
+
+	auto cam = make_shared<camera>(vec3(0.f, 0.f, 7.f), vec3(0.f), vec3(0.f, 1.f, 0.f), 20.f, 1.5f, 0.1f, 7.f);
+	auto lambertian_mat = make_shared<lambertian>(vec3(0.5f));
+	auto metal_mat = make_shared<metal>(vec3(0.7f, 0.6f, 0.5f), 0.2f);
+	auto dielectric_mat = make_shared<dielectric>(1.5f);
+
+	auto hit_benchmark = [&inputs, mask](shared_ptr<hittable> object) {
+		return [&inputs, mask, object](benchmark_state& state) {
+			hit_record rec;
+			int i = 0;
+			while (state.keep_running()) {
+				bool hit = object->hit(inputs.rays[i++ & mask], 0.001f, infinity, rec);
+				do_not_optimize(hit);
+			}
+			do_not_optimize(rec);
+		};
+	};
+
+	auto scatter_benchmark = [&inputs, mask](shared_ptr<material> mat) {
+		return [&inputs, mask, mat](benchmark_state& state) {
+			vec3 attenuation;
+			ray r_out;
+			int i = 0;
+			while (state.keep_running()) {
+				int index = i++ & mask;
+				bool scattered = mat->scatter(inputs.rays[index], inputs.records[index], attenuation, r_out);
+				do_not_optimize(scattered);
+				do_not_optimize(r_out);
+			}
+		};
+	};
+
+	std::vector<micro_benchmark> benchmarks = {
+		{ "sphere::hit", hit_benchmark(unit_sphere) },
+		{ "triangle::hit", hit_benchmark(unit_triangle) },
+		{ "hittable_list::hit (16 spheres)", hit_benchmark(list) },
+		{ std::string("bvh::hit (uv sphere, ") + cpu_kernels().name + ")", hit_benchmark(mesh_bvh) },
+		{ "random_float", [](benchmark_state& state) {
+			while (state.keep_running()) {
+				float f = random_float();
+				do_not_optimize(f);
+			}
+		} },
+		{ "random_vec3_in_unit_sphere", [](benchmark_state& state) {
+			while (state.keep_running()) {
+				vec3 v = random_vec3_in_unit_sphere();
+				do_not_optimize(v);
+			}
+		} },
+		{ "camera::get_ray", [&inputs, mask, cam](benchmark_state& state) {
+			int i = 0;
+			while (state.keep_running()) {
+				const vec2& uv = inputs.uvs[i++ & mask];
+				ray r = cam->get_ray(uv.x, uv.y);
+				do_not_optimize(r);
+			}
+		} },
+		{ "lambertian::scatter", scatter_benchmark(lambertian_mat) },
+		{ "metal::scatter", scatter_benchmark(metal_mat) },
+		{ "dielectric::scatter", scatter_benchmark(dielectric_mat) }
+	};
+
+	// One image row of accumulated colors, for every instruction set this CPU runs
+	const cpu_isa detected = detect_cpu_isa();
+	for (cpu_isa isa : { cpu_isa::generic, cpu_isa::sse42, cpu_isa::avx2, cpu_isa::avx512 }) {
+		if (detected < isa) break;
+
+		const kernel_table& kernels = kernels_for(isa);
+		benchmarks.push_back({ std::string("resolve_rgb8 (256 pixels, ") + kernels.name + ")", [&inputs, &kernels](benchmark_state& state) {
+			std::vector<float> colors(256 * 3);
+			std::vector<unsigned char> rgb(colors.size());
+			for (size_t i = 0; i < colors.size(); ++i) colors[i] = 64.f * inputs.uvs[i % input_count].x;
+
+			while (state.keep_running()) {
+				kernels.resolve_rgb8(colors.data(), int(colors.size()), 1.f / 64.f, rgb.data());
+				do_not_optimize(rgb[0]);
+			}
+		} });
+	}
+
+	return benchmarks;
+}
+
+int main(int argc, char** argv) {
+	micro_benchmark_settings settings;
+	const char* output_path = "micro_benchmark_results.json";
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--filter") == 0) settings.filter = argv[i + 1];
+		else if (strcmp(argv[i], "--min-time") == 0) settings.min_time_ms = std::max(1.0, atof(argv[i + 1]));
+		else if (strcmp(argv[i], "--repetitions") == 0) settings.repetitions = std::max(2, atoi(argv[i + 1]));
+		else if (strcmp(argv[i], "--threads") == 0) settings.threads = std::max(1, atoi(argv[i + 1]));
+		else if (strcmp(argv[i], "--output") == 0) output_path = argv[i + 1];
+		else {
+			printf("Unknown argument: %s\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	kernel_inputs inputs = make_inputs();
+	std::vector<micro_benchmark> benchmarks = make_benchmarks(inputs);
+	std::vector<micro_benchmark_result> results;
+
+	print_micro_benchmark_header();
+	for (const micro_benchmark& benchmark : benchmarks) {
+		if (!settings.filter.empty() && benchmark.name.find(settings.filter) == std::string::npos) continue;
+
+		results.push_back(run_micro_benchmark(benchmark, settings));
+		print_micro_benchmark_result(results.back());
+	}
+
+	if (!write_micro_benchmark_json(output_path, settings, results)) {
+		printf("Unable to write %s\n", output_path);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Small harness in the style of Google Benchmark. A benchmark body loops on keep_running(), the harness picks the
+// iteration count so that one repetition lasts at least the minimum time, then repeats it to get a distribution.
+
+#ifdef _MSC_VER
+__declspec(noinline) void use_char_pointer(char const volatile*) {}
+#endif
+
+// Keep the compiler from discarding a result that is otherwise unused
+template <typename T>
+inline void do_not_optimize(const T& value) {
+#ifdef _MSC_VER
+	use_char_pointer(&reinterpret_cast<char const volatile&>(value));
+	_ReadWriteBarrier();
+#else
+	asm volatile("" : : "r,m"(value) : "memory");
+#endif
+}
+
+class benchmark_state {
+	public:
+		benchmark_state(int64_t iteration_count, int thread) : remaining(iteration_count), iterations(iteration_count), thread_index(thread) {}
+
+		bool keep_running() {
+			return remaining-- > 0;
+		}
+
+	public:
+		int64_t remaining;
+		int64_t iterations;
+		int thread_index;
+};
+
+struct micro_benchmark {
+	std::string name;
+	std::function<void(benchmark_state&)> body;
+};
+
+struct micro_benchmark_settings {
+	double min_time_ms = 100.0;		// Shortest repetition, the iteration count grows until it is reached
+	int repetitions = 10;
+	int threads = 1;				// Copies of the benchmark run at once, one per core
+	std::string filter;				// Only run benchmarks whose name contains this
+};
+
+struct micro_benchmark_result {
+	std::string name;
+	int threads;
+	int64_t iterations;
+
+	// Per operation on one thread, over the repetitions
+	double median_ns;
+	double mean_ns;
+	double stddev_ns;
+	double min_ns;
+
+	double coefficient_of_variation() const { return mean_ns > 0.0 ? stddev_ns / mean_ns : 0.0; }
+	double ops_per_second_per_core() const { return median_ns > 0.0 ? 1e9 / median_ns : 0.0; }
+};
+
+// Time one repetition of iterations on every thread, returns the mean nanoseconds per operation per thread
+double run_repetition(const micro_benchmark& benchmark, thread_pool& pool, int threads, int64_t iterations) {
+	std::atomic<int> ready(0);
+	std::atomic<int64_t> total_ns(0);
+
+	for (int t = 0; t < threads; ++t) {
+		pool.QueueJob([&, t] {
+			benchmark_state state(iterations, t);
+
+			// Start together so every copy competes for the shared caches and memory bandwidth
+			++ready;
+			while (ready.load() < threads) {}
+
+			auto time_s = std::chrono::high_resolution_clock::now();
+			benchmark.body(state);
+			auto time_f = std::chrono::high_resolution_clock::now();
+
+			total_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(time_f - time_s).count();
+		});
+	}
+	pool.Wait();
+
+	return double(total_ns.load()) / threads / double(iterations);
+}
+
+micro_benchmark_result run_micro_benchmark(const micro_benchmark& benchmark, const micro_benchmark_settings& settings) {
+	thread_pool pool;
+	pool.Start(uint32_t(settings.threads));
+
+	// Grow the iteration count until one repetition lasts long enough to time reliably
+	int64_t iterations = 1;
+	while (true) {
+		double ns = run_repetition(benchmark, pool, settings.threads, iterations) * iterations;
+		if (ns >= settings.min_time_ms * 1e6 || iterations >= (int64_t(1) << 40)) break;
+
+		double scale = ns > 0.0 ? settings.min_time_ms * 1e6 / ns : 100.0;
+		iterations = std::max(iterations + 1, int64_t(iterations * std::min(100.0, scale * 1.4)));
+	}
+
+	std::vector<double> samples;
+	for (int r = 0; r < settings.repetitions; ++r) {
+		samples.push_back(run_repetition(benchmark, pool, settings.threads, iterations));
+	}
+	pool.Stop();
+
+	std::sort(samples.begin(), samples.end());
+
+	double mean = 0.0;
+	for (double s : samples) mean += s;
+	mean /= samples.size();
+
+	double variance = 0.0;
+	for (double s : samples) variance += (s - mean) * (s - mean);
+	variance /= std::max<size_t>(1, samples.size() - 1);
+
+	micro_benchmark_result result;
+	result.name = benchmark.name;
+	result.threads = settings.threads;
+	result.iterations = iterations;
+	result.median_ns = samples[samples.size() / 2];
+	result.mean_ns = mean;
+	result.stddev_ns = std::sqrt(variance);
+	result.min_ns = samples.front();
+	return result;
+}
+
+void print_micro_benchmark_header() {
+	printf("%-32s %8s %12s %10s %10s %10s %7s %14s\n", "Benchmark", "Threads", "Iterations", "Median", "Mean", "Stddev", "CV", "Per core");
+}
+
+void print_micro_benchmark_result(const micro_benchmark_result& r) {
+	printf("%-32s %8d %12lld %7.2f ns %7.2f ns %7.2f ns %6.2f%% %10.2f M/s\n",
+		r.name.c_str(), r.threads, (long long)r.iterations, r.median_ns, r.mean_ns, r.stddev_ns,
+		100.0 * r.coefficient_of_variation(), r.ops_per_second_per_core() * 1e-6);
+}
+
+bool write_micro_benchmark_json(const char* path, const micro_benchmark_settings& settings, const std::vector<micro_benchmark_result>& results) {
+	FILE* file = fopen(path, "w");
+	if (file == nullptr) return false;
+
+	fprintf(file, "{\n  \"settings\": {\"min_time_ms\": %.1f, \"repetitions\": %d, \"threads\": %d},\n  \"benchmarks\": [\n",
+		settings.min_time_ms, settings.repetitions, settings.threads);
+
+	for (size_t i = 0; i < results.size(); ++i) {
+		const micro_benchmark_result& r = results[i];
+		fprintf(file,
+			"    {\"name\": \"%s\", \"threads\": %d, \"iterations\": %lld, \"median_ns\": %.4f, \"mean_ns\": %.4f, "
+			"\"stddev_ns\": %.4f, \"min_ns\": %.4f, \"cv\": %.5f, \"ops_per_second_per_core\": %.1f}%s\n",
+			r.name.c_str(), r.threads, (long long)r.iterations, r.median_ns, r.mean_ns, r.stddev_ns, r.min_ns,
+			r.coefficient_of_variation(), r.ops_per_second_per_core(), i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(file, "  ]\n}\n");
+	return fclose(file) == 0;
+}
@@ -1,232 +1,355 @@
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-
 #include "PathTracer.h"
 
+#include "accumulation.h"
+#include "animation.h"
+#include "async_writer.h"
+#include "bvh.h"
+#include "compressed_mesh.h"
 #include "camera.h"
 #include "color.h"
+#include "cpu_dispatch.h"
+#include "denoiser.h"
+#include "distributed.h"
+#include "framebuffer.h"
+#include "hdr_writer.h"
+#include "heatmap.h"
 #include "hittable_list.h"
+#include "instance.h"
 #include "material.h"
+#include "mesh.h"
 #include "obj_reader.h"
-#include "stb_image_write.h"
+#include "paged_mesh.h"
+#include "process_stats.h"
+#include "png_writer.h"
+#include "render_daemon.h"
+#include "render_settings.h"
+#include "renderer.h"
+#include "scene_cache.h"
+#include "scenes.h"
+#include "stream_renderer.h"
 #include "sphere.h"
+#include "telemetry.h"
 #include "thread_pool.h"
+#include "tile_scheduler.h"
 #include "triangle.h"
 
 #include <chrono>
 #include <iostream>
 
+#ifdef USE_EMBREE
 #include <embree3/rtcore.h>
+#endif
 #include "glm/glm.hpp"
+#include "glm/gtc/matrix_transform.hpp"
 
 using std::thread;
 
-vec3 ray_color(const ray& r, const hittable_list& world, int depth) {
-	hit_record rec;
-
-	if (depth <= 0) {
-		return vec3(0.f);
+// Everything the writer writes for one frame, handed over whole rather than copied
+struct frame_outputs {
+	std::vector<unsigned char> rgb;
+	std::vector<unsigned char> denoised_rgb;
+	std::vector<unsigned char> heatmap;
+	framebuffer linear;
+	framebuffer linear_denoised;
+	shared_ptr<accumulation_buffer> accumulation;
+};
+
+// The linear image of one frame in the chosen format. PFM holds a single layer, every other layer gets its own file.
+void write_linear_image(const render_settings& settings, const framebuffer& buffer, const char* suffix, int frame) {
+	bool is_pfm = settings.hdr_output == hdr_format::pfm;
+	std::string path = frame_output_path(settings.output_path, suffix, frame, settings.frame_count, is_pfm ? ".pfm" : ".exr");
+
+	bool is_written = is_pfm
+		? write_pfm(path, buffer, buffer.find_layer(""))
+		: write_exr(path, buffer, settings.hdr_output == hdr_format::exr_float ? exr_pixel_type::float32 : exr_pixel_type::half);
+
+	if (!is_written) {
+		printf("Unable to write %s\n", path.c_str());
 	}
 
-	if (world.hit(r, 0.001f, infinity, rec)) {
-		ray r_out;
-		vec3 attenuation;
+	for (size_t l = 0; is_pfm && l < buffer.layers.size(); ++l) {
+		const std::string& name = buffer.layers[l].name;
+		if (name.empty()) continue;
 
-		if (rec.mat_ptr->scatter(r, rec, attenuation, r_out)) {
-			return attenuation * ray_color(r_out, world, depth - 1);
+		std::string layer_path = frame_output_path(settings.output_path, (suffix + ("_" + name)).c_str(), frame, settings.frame_count, ".pfm");
+		if (!write_pfm(layer_path, buffer, int(l))) {
+			printf("Unable to write %s\n", layer_path.c_str());
 		}
-
-		return vec3(0.f);
 	}
+}
 
-	vec3 unit_direction = normalize(r.direction());
-	float t = 0.5f * (unit_direction.y + 1.f);
-	return (1.f - t) * vec3(1.f, 1.f, 1.f) + t * vec3(0.5f, 0.7f, 1.f);
+// Everything but the sample range that changes a frame's pixels, sums merge only with equal keys
+uint64_t accumulation_key(const render_settings& settings, int frame) {
+	auto add_string = [](const std::string& text, uint64_t key) {
+		uint64_t size = text.size();
+		return fnv1a_64(text.data(), text.size(), fnv1a_64(&size, sizeof(size), key));
+	};
+
+	int values[] = { accumulation_version, settings.image_width, settings.image_height(), settings.max_depth, int(settings.seed), frame,
+		settings.mesh_bits };
+	float camera[] = { settings.camera_position.x, settings.camera_position.y, settings.camera_position.z,
+		settings.camera_lookat.x, settings.camera_lookat.y, settings.camera_lookat.z, settings.camera_up.x, settings.camera_up.y, settings.camera_up.z,
+		settings.vertical_fov, settings.aspect_ratio, settings.aperture, settings.resolved_focus_distance(), settings.frames_per_second,
+		float(settings.animation.type), settings.animation.turntable_rate, settings.animation.wave_amplitude, settings.animation.wave_frequency };
+
+	uint64_t key = fnv1a_64(values, sizeof(values));
+	key = fnv1a_64(camera, sizeof(camera), key);
+	key = add_string(settings.obj_file.empty() ? settings.scene : settings.obj_file, key);
+
+	for (const material_override& value : settings.material_overrides) {
+		int kind[] = { value.id, int(value.kind) };
+		float look[] = { value.albedo.r, value.albedo.g, value.albedo.b, value.parameter };
+		key = fnv1a_64(kind, sizeof(kind), key);
+		key = fnv1a_64(look, sizeof(look), key);
+	}
+	return key;
 }
 
-hittable_list sample_scene() {
-	hittable_list world;
-	
-	auto material_ground = make_shared<lambertian>(vec3(0.8f, 0.8f, 0.f));
-	auto material_left = make_shared<dielectric>(1.5f);
-	auto material_center = make_shared<lambertian>(vec3(0.1f, 0.2f, 0.5f));
-	auto material_right = make_shared<metal>(vec3(0.8f, 0.6f, 0.2f), 0.f);
-
-	world.add(make_shared<sphere>(vec3(0.f, -100.5f, -1.f), 100.f, material_ground));
-	world.add(make_shared<sphere>(vec3(-1.f, 0.f, -1.f), 0.5f, material_left));
-	world.add(make_shared<sphere>(vec3(-1.f, 0.f, -1.f), -0.45f, material_left));
-	world.add(make_shared<sphere>(vec3(0.f, 0.f, -1.f), 0.5f, material_center));
-	world.add(make_shared<sphere>(vec3(1.f, 0.f, -1.f), 0.5f, material_right));
-
-	return world;
+// The sums file of a frame, next to the output unless a path was given
+std::string accumulation_output_path(const render_settings& settings, int frame) {
+	return settings.accumulation_path.empty()
+		? frame_output_path(settings.output_path, "", frame, settings.frame_count, ".ptsum")
+		: frame_output_path(settings.accumulation_path, "", frame, settings.frame_count);
 }
 
-hittable_list test_scene() {
-	auto material_ground = make_shared<lambertian>(vec3(0.5f, 0.5f, 0.5f));
-	auto material_metal = make_shared<metal>(vec3(0.7f, 0.6f, 0.5f), 0.f);
-	auto material_lambertian = make_shared<lambertian>(vec3(0.1f, 0.2f, 0.5f));
-	auto material_normal = make_shared<normal>();
+// Adds up the sums of every input and writes the image they make, with the merged sums when a path was given so more
+// samples can be added later
+bool merge_accumulations(const render_settings& settings) {
+	auto merge_s = std::chrono::high_resolution_clock::now();
 
-	hittable_list world;
+	accumulation_buffer merged;
+	for (size_t i = 0; i < settings.merge_inputs.size(); ++i) {
+		const std::string& path = settings.merge_inputs[i];
 
-	world.add(make_shared<sphere>(vec3(0.f, -1000.f, 0.f), 1000.f, material_ground));
-
-	vec3 p0 = vec3(0.f, 0.f, -1.f);
-	vec3 p1 = vec3(2.f, 0.f, -2.f);
-	vec3 p2 = vec3(0.f, 2.f, -2.f);
-	vec3 p3 = vec3(2.f, 2.f, -1.f);
-
-	world.add(make_shared<triangle>(
-		p0,
-		p1,
-		p2,
-		cross(p1 - p0, p2 - p0),
-		vec3(0.f, 0.f, 1.f),
-		vec3(0.f, 0.f, 1.f),
-		material_normal
-		));
-
-	world.add(make_shared<triangle>(
-		p3,
-		p1,
-		p2,
-		-cross(p1 - p3, p2 - p3),
-		vec3(0.f, 0.f, 1.f),
-		vec3(0.f, 0.f, 1.f),
-		material_normal
-		));
-	
-	world.add(make_shared<sphere>(
-		vec3(0.f, 0.5f, 0.5f),
-		0.5f,
-		material_lambertian
-		));
+		accumulation_buffer input;
+		if (!load_accumulation(path, input)) {
+			printf("Unable to read sums: %s\n", path.c_str());
+			return false;
+		}
 
-	return world;
-}
+		if (i == 0) {
+			merged = std::move(input);
+		}
+		else if (!merged.merge(input)) {
+			printf("Unable to merge %s\n", path.c_str());
+			return false;
+		}
+	}
 
-hittable_list random_spheres_scene() {
-	hittable_list world;
+	std::string ranges;
+	for (const sample_range& range : merged.ranges) {
+		ranges += (ranges.empty() ? "" : ", ") + std::to_string(range.begin) + "-" + std::to_string(range.end);
+	}
+	printf("Merged %zu sums of %dx%d frame %d: %d samples a pixel (%s)\n", settings.merge_inputs.size(), merged.width, merged.height,
+		merged.frame, merged.sample_count(), ranges.c_str());
 
-	auto ground_mat = make_shared<lambertian>(vec3(0.5f, 0.5f, 0.5f));
-	world.add(make_shared<sphere>(vec3(0.f, -1000.f, 0.f), 1000.f, ground_mat));
+	render_settings output = settings;
+	output.frame_count = 1;
 
-	for (int x = -11; x < 11; ++x) {
-		for (int y = -11; y < 11; ++y) {
-			float choose_mat = random_float();
-			vec3 center(x + 0.9f * random_float(), 0.2f, y + 0.9f * random_float());
+	framebuffer linear = merged.resolve();
+	std::vector<unsigned char> rgb = resolve_framebuffer_rgb8(linear, linear.find_layer(""));
 
-			if ((center - vec3(4.f, 0.2f, 0.f)).length() > 0.9f) {
-				shared_ptr<material> next_mat;
+	bool is_written = write_png(output.output_path, merged.width, merged.height, 3, rgb.data(), merged.width * 3);
+	if (!is_written) {
+		printf("Unable to write %s\n", output.output_path.c_str());
+	}
 
-				if (choose_mat < 0.8f) {
-					// lambertian
-					vec3 albedo = random_vec3() * random_vec3();
-					next_mat = make_shared<lambertian>(albedo);
-				}
-				else if (choose_mat < 0.95f) {
-					// metal
-					vec3 albedo = random_vec3(0.5f, 1.f);
-					float roughness = random_float(0.f, 0.5f);
-					next_mat = make_shared<metal>(albedo, roughness);
-				}
-				else {
-					// glass
-					next_mat = make_shared<dielectric>(1.5f);
-				}
+	if (output.hdr_output != hdr_format::none) {
+		write_linear_image(output, linear, "", 0);
+	}
 
-				world.add(make_shared<sphere>(center, 0.2f, next_mat));
-			}
-		}
+	if (!output.accumulation_path.empty() && !save_accumulation(output.accumulation_path, merged)) {
+		printf("Unable to write sums: %s\n", output.accumulation_path.c_str());
+		is_written = false;
 	}
 
-	auto dielectric_mat = make_shared<dielectric>(1.5f);
-	world.add(make_shared<sphere>(vec3(0.f, 1.f, 0.f), 1.f, dielectric_mat));
+	auto merge_f = std::chrono::high_resolution_clock::now();
+	printf("Merge time: %.2f ms\n", std::chrono::duration<double, std::milli>(merge_f - merge_s).count());
+	return is_written;
+}
 
-	auto lambertian_mat = make_shared<lambertian>(vec3(0.4f, 0.2f, 0.1f));
-	world.add(make_shared<sphere>(vec3(-4.f, 1.f, 0.f), 1.f, lambertian_mat));
+// The scene the settings describe, with its tree. Animated scenes fill animation, an OBJ paged from disk sets paged when
+// it is given. The pool must already be started.
+bool load_world(const render_settings& settings, thread_pool& pool, hittable_list& world, bvh& world_bvh, animated_mesh& animation,
+	paged_mesh** paged)
+{
+	if (!settings.obj_file.empty() && settings.geometry_budget_mb > 0) {
+		// Paging needs the compressed clusters, 16 bit unless 21 was asked for
+		const int bits = settings.mesh_bits != 0 ? settings.mesh_bits : 16;
+
+		world.arena = make_shared<scene_arena>();
+		auto paged_ptr = world.arena->make<paged_mesh>();
+		if (!load_obj_paged(settings.obj_file.c_str(), settings.cache_directory.c_str(), bits, size_t(settings.geometry_budget_mb) << 20,
+			pool, world.arena->make<normal>(), *paged_ptr))
+		{
+			return false;
+		}
 
-	auto metal_mat = make_shared<metal>(vec3(0.7f, 0.6f, 0.5f), 0.f);
-	world.add(make_shared<sphere>(vec3(4.f, 1.f, 0.f), 1.f, metal_mat));
+		if (paged != nullptr) *paged = paged_ptr;
+		world.add(paged_ptr);
+		world_bvh = bvh(world, pool, settings.build_options);
 
-	return world;
+		printf("Paged mesh: %zu pages, %.2f MB on disk, %.2f MB resident for the tree top and page table, %d MB budget\n",
+			paged_ptr->pages.size(), paged_ptr->file_bytes() / (1024.0 * 1024.0), paged_ptr->resident_table_bytes() / (1024.0 * 1024.0),
+			settings.geometry_budget_mb);
+	}
+	else if (!settings.obj_file.empty() && settings.mesh_bits != 0) {
+		// The whole mesh becomes one primitive with its own tree over its clusters, the cache holds full triangles
+		mesh obj_mesh;
+		if (!read_obj(settings.obj_file.c_str(), obj_mesh)) return false;
+
+		world.arena = make_shared<scene_arena>();
+		auto compressed = world.arena->make<compressed_mesh>(obj_mesh, world.arena->make<normal>(), settings.mesh_bits, pool);
+		world.add(compressed);
+		world_bvh = bvh(world, pool, settings.build_options);
+
+		printf("Compressed mesh: %zu triangles in %zu clusters, %d bit positions, %.2f MB, %.1f bytes a triangle\n",
+			compressed->triangle_count(), compressed->clusters.size(), compressed->bits,
+			compressed->memory_bytes() / (1024.0 * 1024.0), double(compressed->memory_bytes()) / std::max<size_t>(1, compressed->triangle_count()));
+	}
+	else if (!settings.obj_file.empty()) {
+		if (!load_obj_cached(settings.obj_file.c_str(), settings.cache_directory.c_str(), settings.build_options, pool, world, world_bvh)) return false;
+	}
+	else {
+		if (!make_scene(settings.scene, pool, animation, world)) return false;
+		world_bvh = bvh(world, pool, settings.build_options);
+	}
+
+	return true;
 }
 
-void sample_pixel
-(
-	int w, int h,
-	const int image_width, const int image_height,
-	const int samples_per_pixel, const int max_depth, const int image_channels,
-	camera cam, hittable_list world,
-	unsigned char* data
-)
-{
-	vec3 pixel_color(0.f, 0.f, 0.f);
-	for (int s = 0; s < samples_per_pixel; ++s) {
-		float u = (w + random_float()) / (image_width - 1);
-		float v = (h + random_float()) / (image_height - 1);
+int main(int argc, char** argv) {
+	// Settings come from the defaults, then the scene file, then the command line
+
+	render_settings settings;
+	bool show_help = false;
+	if (!parse_render_arguments(argc, argv, settings, show_help)) {
+		if (show_help) {
+			print_render_usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
 
-		ray r = cam.get_ray(u, v);
-		pixel_color += ray_color(r, world, max_depth);
+		printf("Run with --help for the list of settings\n");
+		return EXIT_FAILURE;
 	}
 
-	const int ind = ((image_height - h - 1) * image_width + w) * image_channels;
-	write_color(&data[ind], pixel_color, samples_per_pixel);
-}
+	// Workers take the rest of their settings from the coordinator and only render the tiles it leases
+	if (!settings.worker_address.empty()) {
+		bool is_finished = run_tile_worker(settings, [](const render_settings& job, thread_pool& pool, hittable_list& world, bvh& world_bvh, animated_mesh& animation) {
+			return load_world(job, pool, world, world_bvh, animation, nullptr);
+		});
+		return is_finished ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
-void sample_rect
-(
-	int x_s, int y_s, const int rect_width, const int rect_height,
-	const int image_width, const int image_height,
-	const int samples_per_pixel, const int max_depth, const int image_channels,
-	camera cam, hittable_list world,
-	unsigned char* data
-)
-{
-	int y_max = std::min(y_s + rect_height, image_height);
-	int x_max = std::min(x_s + rect_width, image_width);
+	// A daemon keeps scenes loaded for the renders submitted to it
+	if (!settings.serve_socket.empty()) {
+		render_daemon daemon(settings);
+		bool is_finished = daemon.run(settings.serve_socket, [](const render_settings& job, thread_pool& pool, hittable_list& world, bvh& world_bvh, animated_mesh& animation) {
+			return load_world(job, pool, world, world_bvh, animation, nullptr);
+		});
+		return is_finished ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
-	for (int y = y_s; y < y_max; ++y) {
-		for (int x = x_s; x < x_max; ++x) {
-			sample_pixel(x, y, image_width, image_height, samples_per_pixel, max_depth, image_channels, cam, world, data);
+	// Stopping a daemon renders nothing
+	if (settings.stop_daemon) {
+		if (settings.daemon_socket.empty()) {
+			printf("Name the daemon to stop with --daemon\n");
+			return EXIT_FAILURE;
 		}
+		return stop_render_daemon(settings.daemon_socket) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// Merging sums renders nothing
+	if (!settings.merge_inputs.empty()) {
+		return merge_accumulations(settings) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	// A coordinator never loads the scene, each worker loads its own, and a daemon client uses the daemon's
+	const bool is_coordinator = settings.coordinator_port > 0;
+	const bool is_daemon_client = !settings.daemon_socket.empty();
+	const bool is_remote = is_coordinator || is_daemon_client;
+
+	// Sample ranges already split the frame between processes, each renders its range in full here
+	if (settings.is_accumulating() && (is_remote || settings.stream_output)) {
+		printf("Sample ranges are rendered here, without workers, a daemon or streaming\n");
+		return EXIT_FAILURE;
+	}
+	if (settings.is_accumulating() && settings.sample_begin + settings.samples_rendered() > accumulation_max_samples) {
+		printf("Summed sample indices end at %d\n", accumulation_max_samples);
+		return EXIT_FAILURE;
 	}
-}
 
-int main() {
 	// Image Settings
 
-	const float aspect_ratio = 3.f / 2.f;
-	const int image_width = 256;
-	const int image_height = static_cast<int>(image_width / aspect_ratio);
+	const float aspect_ratio = settings.aspect_ratio;
+	const int image_width = settings.image_width;
+	const int image_height = settings.image_height();
 	const int image_channels = 3;
 	const int image_data_stride = image_width * image_channels;
-	const int samples_per_pixel = 128;
-	const int max_depth = 64;
+	const int samples_per_pixel = settings.samples_rendered();
+	const int max_depth = settings.max_depth;
+	const uint32_t seed = settings.seed;
 
-	// Camera Settings
+	// Acceleration Settings
+
+	const bvh_build_options& build_options = settings.build_options;
+
+	// Tile Settings
+
+	const uint32_t thread_count = uint32_t(settings.thread_count());
+	const tile_order render_tile_order = settings.render_tile_order;
+	const int tile_size = settings.resolved_tile_size();
+
+	// Animation Settings
+
+	const int frame_count = settings.frame_count;
+	animated_mesh animation;	// Filled by animated scenes
 
-	// Final Render Settings
-	/*
-	point3 camera_position(13.0, 2.0, 3.0);
-	point3 camera_lookat(0.0, 0.0, 0.0);
-	vec3 camera_up(0.0, 1.0, 0.0);
-	float aperture = 0.1f;
-	float focus_distance = 10.f;
-	*/
+	// Camera Settings
 
-	// Sample Settings
-	vec3 camera_position(0.0, 0.0, 7.0);
-	vec3 camera_lookat(0.0, 0.0, 0.0);
-	vec3 camera_up(0.0, 1.0, 0.0);
-	float aperture = 0.1f;
-	float focus_distance = length(camera_position - camera_lookat);
+	camera cam(settings.camera_position, settings.camera_lookat, settings.camera_up, settings.vertical_fov, aspect_ratio,
+		settings.aperture, settings.resolved_focus_distance());
 
-	camera cam(camera_position, camera_lookat, camera_up, 20, aspect_ratio, aperture, focus_distance);
+	printf("Rendering %s at %dx%d, %d spp, depth %d, %u threads\n",
+		settings.obj_file.empty() ? settings.scene.c_str() : settings.obj_file.c_str(),
+		image_width, image_height, samples_per_pixel, max_depth, thread_count);
+	if (settings.is_accumulating()) {
+		printf("Summing samples %d to %d of each pixel\n", settings.sample_begin, settings.sample_begin + samples_per_pixel);
+	}
 
 	// World Setup
 
-	hittable_list world = sample_scene();
+	hittable_list world;
+	bvh world_bvh;
 
+	// Initialize the thread pool
+	thread_pool pool;
+
+	// Build the acceleration structure
+	auto load_s = std::chrono::high_resolution_clock::now();
+	pool.Start(thread_count);
+
+	paged_mesh* paged = nullptr;	// Set when the OBJ is paged from disk
+	seed_random(scene_random_seed);
+	bool is_loaded = is_remote || load_world(settings, pool, world, world_bvh, animation, &paged);
+
+	pool.Stop();
+
+	if (!is_loaded) return EXIT_FAILURE;
+
+	auto load_f = std::chrono::high_resolution_clock::now();
+	printf("Scene load: %.2f ms, %zu objects in %.2f MB of arena, peak RSS %.2f MB\n",
+		std::chrono::duration<double, std::milli>(load_f - load_s).count(),
+		world.arena ? world.arena->objects() : size_t(0), world.arena ? world.arena->bytes_reserved() / (1024.0 * 1024.0) : 0.0,
+		peak_rss_bytes() / (1024.0 * 1024.0));
+
+	printf("BVH build (%s): %zu primitives, %zu nodes, %.2f ms, SAH cost %.2f\n",
+		bvh_build_method_name(build_options.method),
+		world_bvh.primitives.size(), world_bvh.nodes.size(), world_bvh.build_time_ms, world_bvh.sah_cost());
+
+	printf("CPU kernels: %s\n", cpu_kernels().name);
+
+#ifdef USE_EMBREE
 	RTCDevice device = rtcNewDevice("");
 	RTCScene scene = rtcNewScene(device);
 	RTCGeometry geometry = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
@@ -280,52 +403,305 @@ int main() {
 
 	rtcReleaseScene(scene);
 	rtcReleaseDevice(device);
+#endif
 
 	// Render
+
+	// Streamed renders only hold the bands of tiles in flight, so nothing that covers the whole image is kept
+	const bool is_streamed = settings.stream_output && !is_remote;
+	if (settings.stream_output && is_remote) {
+		printf("Streaming is skipped when rendering through workers or a daemon\n");
+	}
+	if (is_streamed && settings.denoise) {
+		printf("Denoising needs the whole image and is skipped when streaming\n");
+	}
+	if (is_streamed && settings.hdr_output == hdr_format::pfm) {
+		printf("PFM output is skipped when streaming, use exr\n");
+	}
 	
-	unsigned char * data = new unsigned char[image_width * image_height * image_channels];
-	const int rect_width = 64;
-	const int rect_height = 64;
+	const size_t image_size = is_streamed ? 0 : size_t(image_width) * image_height * image_channels;
+	std::vector<unsigned char> image(image_size);
+	unsigned char* data = image.data();
+	render_telemetry telemetry;
+	cost_map costs(is_streamed ? 0 : image_width, is_streamed ? 0 : image_height);
+
+	// The denoiser works on the linear image and is guided by the albedo, the normal and the noise variance
+	framebuffer hdr;
+	framebuffer denoised;
+	if (!is_streamed && (settings.hdr_output != hdr_format::none || settings.denoise)) {
+		hdr = make_linear_framebuffer(settings, image_width, image_height);
+	}
+	else if (settings.hdr_output == hdr_format::none && settings.aovs != aov_none) {
+		printf("AOVs are only written with a linear image, see --hdr\n");
+	}
+	tile_scheduler scheduler(make_tiles(image_width, image_height, tile_size, render_tile_order));
+	printf("Rendering %zu %dx%d tiles\n", scheduler.tiles.size(), tile_size, tile_size);
 
-	auto time_s = std::chrono::high_resolution_clock::now();
+	tile_coordinator coordinator;
+	if (is_coordinator && !coordinator.start(settings, argc, argv, image_width, image_height)) {
+		printf("Unable to listen on %s port %d\n", settings.coordinator_bind.c_str(), settings.coordinator_port);
+		return EXIT_FAILURE;
+	}
+	else if (is_coordinator) {
+		printf("Coordinating workers on %s port %d, each loads the scene itself\n", settings.coordinator_bind.c_str(), settings.coordinator_port);
+	}
 
-	// Initialize the thread pool
-	thread_pool pool;
+	daemon_client daemon;
+	if (is_daemon_client && !daemon.connect(settings.daemon_socket, argc, argv, image_width, image_height)) {
+		printf("Unable to connect to the daemon at %s\n", settings.daemon_socket.c_str());
+		return EXIT_FAILURE;
+	}
+
+	// Images are compressed on their own pool and written on the writer's thread, the next frame traces meanwhile
+	thread_pool encode_pool;
+	encode_pool.Start(thread_count);
+	async_writer writer;
+
+	// Material overrides swap materials at each hit, the scene itself is left as it is
+	std::unique_ptr<material_override_world> overridden;
+	if (!settings.material_overrides.empty() && !is_remote) {
+		overridden.reset(new material_override_world(world_bvh, settings.material_overrides));
+	}
+	const hittable& render_world = overridden ? static_cast<const hittable&>(*overridden) : world_bvh;
+	bool is_failed = false;
+
+	// Paging is reported for each frame as the change since the frame before
+	paging_stats paging_s = paged != nullptr ? paged->stats() : paging_stats();
+	size_t minor_faults_s, major_faults_s;
+	page_fault_counts(minor_faults_s, major_faults_s);
+
+	auto report_paging = [&](uint64_t page_touches) {
+		if (paged == nullptr) return;
+
+		paging_stats paging_f = paged->stats();
+		size_t minor_faults_f, major_faults_f;
+		page_fault_counts(minor_faults_f, major_faults_f);
+
+		uint64_t faults = paging_f.faults - paging_s.faults;
+		printf("Geometry paging: %llu page touches, %llu faults, %.2f%% hit rate, %llu evictions, %.2f MB paged in, %.2f MB resident (peak %.2f MB)\n",
+			(unsigned long long)page_touches, (unsigned long long)faults,
+			page_touches > 0 ? 100.0 * double(page_touches - std::min<uint64_t>(faults, page_touches)) / double(page_touches) : 100.0,
+			(unsigned long long)(paging_f.evictions - paging_s.evictions), (paging_f.bytes_paged_in - paging_s.bytes_paged_in) / (1024.0 * 1024.0),
+			paging_f.resident_bytes / (1024.0 * 1024.0), paging_f.peak_resident_bytes / (1024.0 * 1024.0));
+		printf("OS page faults: %zu major, %zu minor\n", major_faults_f - major_faults_s, minor_faults_f - minor_faults_s);
+
+		paging_s = paging_f;
+		minor_faults_s = minor_faults_f;
+		major_faults_s = major_faults_f;
+	};
+
+	for (int frame = 0; frame < frame_count; ++frame) {
+		// Animate
+		
+		if (frame > 0 && !animation.empty()) {
+			auto update_s = std::chrono::high_resolution_clock::now();
+
+			pool.Start(thread_count);
+			pose_animated_mesh(animation, settings.animation, frame / settings.frames_per_second, pool);
+			bool rebuilt = world_bvh.update(world, pool, settings.rebuild_threshold);
+			pool.Stop();
+
+			auto update_f = std::chrono::high_resolution_clock::now();
+			printf("Frame %d update: %.2f ms (%s), SAH cost %.2f\n", frame,
+				std::chrono::duration<double, std::milli>(update_f - update_s).count(),
+				rebuilt ? "rebuilt" : "refit", world_bvh.sah_cost());
+		}
+
+		if (is_streamed) {
+			stream_outputs outputs;
+			outputs.png_path = frame_output_path(settings.output_path, "", frame, frame_count);
+			if (settings.hdr_output == hdr_format::exr_half || settings.hdr_output == hdr_format::exr_float) {
+				outputs.exr_path = frame_output_path(settings.output_path, "", frame, frame_count, ".exr");
+				outputs.exr_type = settings.hdr_output == hdr_format::exr_float ? exr_pixel_type::float32 : exr_pixel_type::half;
+				outputs.aovs = settings.aovs;
+			}
+
+			stream_stats stats;
+			pool.Start(thread_count);
+			bool is_written = render_streamed(image_width, image_height, tile_size, samples_per_pixel, max_depth,
+				cam, render_world, seed + frame, outputs, pool, stats);
+			pool.Stop();
+
+			if (!is_written) {
+				printf("Unable to write the output of frame %d\n", frame);
+			}
 
-	// Queue all jobs in the thread pool
-	printf("Starting work...\n");
-	pool.Start(1, int(std::ceilf(float(image_height) / rect_height) * std::ceilf(float(image_width) / rect_width)));
-
-	for (int y = 0; y < image_height; y += rect_height) {
-		for (int x = 0; x < image_width; x += rect_width) {
-			pool.QueueJob(
-				[x, y, rect_width, rect_height, image_width, image_height, samples_per_pixel, max_depth, image_channels, cam, world, data]
-				{
-					sample_rect(x, y, rect_width, rect_height,
-						image_width, image_height, samples_per_pixel, max_depth, image_channels,
-						cam, world, data);
+			printf("\nStreamed %d bands, %d in flight holding %.2f MB\n", stats.bands, stats.bands_in_flight, stats.buffer_bytes / (1024.0 * 1024.0));
+			printf("Trace time: %.2f ms, BVH build time: %.2f ms\n", stats.render_ms, world_bvh.build_time_ms);
+			printf("Rays: %.2f M, %.2f Mrays/s\n", stats.rays * 1e-6, stats.rays / (stats.render_ms * 1e3));
+			report_paging(stats.page_touches);
+			continue;
+		}
+
+		auto time_s = std::chrono::high_resolution_clock::now();
+
+		// Written by the writer once the frame is done, so every frame gets its own
+		shared_ptr<accumulation_buffer> accumulation;
+		if (settings.is_accumulating()) {
+			accumulation = make_shared<accumulation_buffer>(image_width, image_height);
+			accumulation->frame = frame;
+			accumulation->render_key = accumulation_key(settings, frame);
+			accumulation->ranges.push_back({ settings.sample_begin, settings.sample_begin + samples_per_pixel });
+		}
+
+		if (is_coordinator) {
+			// The workers' tile times order the frames after the first
+			if (!coordinator.render_frame(frame, scheduler.tiles, scheduler.tile_costs, data, &costs, hdr.layers.empty() ? nullptr : &hdr, &telemetry)) {
+				is_failed = true;
+				break;
+			}
+		}
+		else if (is_daemon_client) {
+			if (!daemon.render_frame(frame, data, &costs, hdr.layers.empty() ? nullptr : &hdr, &telemetry)) {
+				is_failed = true;
+				break;
+			}
+		}
+		else {
+			// Queue all jobs in the thread pool
+			printf("Starting work...\n");
+			pool.Start(thread_count);
+
+			// Later frames are ordered by the tile costs measured on the frame before
+			if (scheduler.tile_costs.empty()) {
+				scheduler.estimate_costs(pool, [&](const tile& t) {
+					return estimate_rect_cost(t.x, t.y, t.width, t.height, image_width, image_height, max_depth, cam, render_world);
 				});
+			}
+
+			scheduler.run(pool, [&](const tile& t, int y_s, int y_f) {
+				sample_rect(t.x, y_s, t.width, y_f - y_s,
+					image_width, image_height, samples_per_pixel, max_depth, image_channels,
+					cam, render_world, seed + frame, data, &costs, hdr.layers.empty() ? nullptr : &hdr, 0, 0, accumulation.get());
+			}, &telemetry, frame);
+
+			pool.Stop();
 		}
-	}
 
-	// Wait for all threads to finish
-	while (pool.IsBusy());
-	pool.Stop();
+		auto time_f = std::chrono::high_resolution_clock::now();
+		auto duration = (time_f - time_s);
+		auto hours = std::chrono::duration_cast<std::chrono::hours>(duration);
+		auto minutes = std::chrono::duration_cast<std::chrono::minutes>(duration - hours);
+		auto seconds = std::chrono::duration_cast<std::chrono::seconds>(duration - hours - minutes);
+		auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(duration - hours - minutes - seconds);;
+
+		printf("\nElapsed time: %02d:%02d:%02d:%04d\n", int(hours.count()), int(minutes.count()), int(seconds.count()), int(milliseconds.count()));
+		printf("Trace time: %.2f ms, BVH build time: %.2f ms\n", std::chrono::duration<double, std::milli>(duration).count(), world_bvh.build_time_ms);
+		if (is_coordinator) {
+			printf("Workers: %d connected, %d lost, %d tiles leased again\n", coordinator.workers_connected, coordinator.workers_lost, coordinator.tiles_released);
+		}
+		else if (!is_daemon_client) {
+			printf("Tail: %.2f ms, %d rows stolen\n", scheduler.tail_ms, scheduler.stolen_rows);
+		}
 
-	auto time_f = std::chrono::high_resolution_clock::now();
-	auto duration = (time_f - time_s);
-	auto hours = std::chrono::duration_cast<std::chrono::hours>(duration);
-	auto minutes = std::chrono::duration_cast<std::chrono::minutes>(duration - hours);
-	auto seconds = std::chrono::duration_cast<std::chrono::seconds>(duration - hours - minutes);
-	auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(duration - hours - minutes - seconds);;
+		double frame_rays = double(costs.total_rays());
+		printf("Rays: %.2f M, %.2f Mrays/s\n", frame_rays * 1e-6, frame_rays / std::chrono::duration<double, std::micro>(duration).count());
 
-	printf("\nElapsed time: %02d:%02d:%02lld:%04lld\n", hours.count(), minutes.count(), seconds.count(), milliseconds.count());
+		uint64_t page_touches = 0;
+		for (const tile_record& record : telemetry.records) {
+			if (record.frame == frame) page_touches += record.counters.page_touches;
+		}
+		report_paging(page_touches);
 
-	// Save Output
+		// Denoise
 
-	stbi_write_png("output.png", image_width, image_height, image_channels, data, image_data_stride);
+		bool is_denoised = false;
+		if (settings.denoise) {
+			auto denoise_s = std::chrono::high_resolution_clock::now();
+
+			pool.Start(thread_count);
+			is_denoised = denoise(hdr, denoised, pool, settings.denoise_filter);
+			pool.Stop();
+
+			auto denoise_f = std::chrono::high_resolution_clock::now();
+			if (is_denoised) printf("Denoise time: %.2f ms\n", std::chrono::duration<double, std::milli>(denoise_f - denoise_s).count());
+			else printf("Unable to denoise, the image is missing a layer the denoiser needs\n");
+		}
+
+		// Save Output
+
+		// The job takes the frame's buffers over, the next frame renders into new ones
+		auto outputs = make_shared<frame_outputs>();
+		outputs->rgb.swap(image);
+		if (is_denoised) {
+			outputs->denoised_rgb = resolve_framebuffer_rgb8(denoised, denoised.find_layer(""));
+		}
+		if (settings.write_heatmap) {
+			outputs->heatmap = costs.false_color(settings.heatmap_source);
+		}
+		if (settings.hdr_output != hdr_format::none) {
+			outputs->linear = std::move(hdr);
+			if (is_denoised) outputs->linear_denoised = std::move(denoised);
+		}
+		outputs->accumulation = accumulation;
+
+		if (frame + 1 < frame_count) {
+			image.resize(image_size);
+			data = image.data();
+			if (settings.hdr_output != hdr_format::none) hdr = make_linear_framebuffer(settings, image_width, image_height);
+		}
+
+		writer.queue([&settings, &encode_pool, image_width, image_height, image_data_stride, frame, is_denoised, outputs] {
+			const frame_outputs& out = *outputs;
+			const accumulation_buffer* accumulation = out.accumulation.get();
+
+			auto write_s = std::chrono::high_resolution_clock::now();
+
+			if (accumulation && !save_accumulation(accumulation_output_path(settings, frame), *accumulation)) {
+				printf("Unable to write sums: %s\n", accumulation_output_path(settings, frame).c_str());
+			}
+
+			std::string output_path = frame_output_path(settings.output_path, "", frame, settings.frame_count);
+			if (!write_png(output_path, image_width, image_height, image_channels, out.rgb.data(), image_data_stride, &encode_pool)) {
+				printf("Unable to write %s\n", output_path.c_str());
+			}
+
+			if (settings.hdr_output != hdr_format::none) {
+				write_linear_image(settings, out.linear, "", frame);
+			}
+
+			if (is_denoised) {
+				std::string denoised_path = frame_output_path(settings.output_path, "_denoised", frame, settings.frame_count);
+				if (!write_png(denoised_path, image_width, image_height, 3, out.denoised_rgb.data(), image_width * 3, &encode_pool)) {
+					printf("Unable to write %s\n", denoised_path.c_str());
+				}
+
+				if (settings.hdr_output != hdr_format::none) {
+					write_linear_image(settings, out.linear_denoised, "_denoised", frame);
+				}
+			}
+
+			if (settings.write_heatmap) {
+				std::string heatmap_path = frame_output_path(settings.output_path, "_heatmap", frame, settings.frame_count);
+				write_png(heatmap_path, image_width, image_height, 3, out.heatmap.data(), image_width * 3, &encode_pool);
+			}
+
+			auto write_f = std::chrono::high_resolution_clock::now();
+			printf("Frame %d written: %.2f ms\n", frame, std::chrono::duration<double, std::milli>(write_f - write_s).count());
+		});
+	}
+
+	coordinator.stop();
+	daemon.finish();
+	writer.wait();
+	encode_pool.Stop();
+
+	// Save Telemetry
+
+	if (!is_streamed && !settings.trace_file.empty() && !telemetry.write_chrome_trace(settings.trace_file.c_str())) {
+		printf("Unable to write render trace: %s\n", settings.trace_file.c_str());
+	}
+
+	if (!is_streamed && !settings.tile_csv_file.empty() && !telemetry.write_csv(settings.tile_csv_file.c_str())) {
+		printf("Unable to write tile summary: %s\n", settings.tile_csv_file.c_str());
+	}
 
-	delete[] data;
+	// The tree only points into the scene, so freeing the scene is freeing its arena
+	auto free_s = std::chrono::high_resolution_clock::now();
+	world_bvh = bvh();
+	world = hittable_list();
+	auto free_f = std::chrono::high_resolution_clock::now();
+	printf("Scene free: %.2f ms\n", std::chrono::duration<double, std::milli>(free_f - free_s).count());
 
-	return EXIT_SUCCESS;
+	return is_failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
 #include <memory>
@@ -27,10 +28,88 @@ inline float degrees_to_radians(float degrees) {
 	return degrees * pi / 180;
 }
 
+// Every random number of a thread comes from here. Pixels draw from a Mersenne Twister, which takes far longer to seed
+// than a short path takes to trace, so sample ranges seed a PCG stream for every sample instead.
+class random_stream {
+	public:
+		typedef uint32_t result_type;
+		static constexpr result_type min() { return 0; }
+		static constexpr result_type max() { return 0xffffffffu; }
+
+		void seed(uint32_t value) {
+			is_pcg = false;
+			twister.seed(value);
+		}
+
+		void seed_pcg(uint64_t value) {
+			is_pcg = true;
+			state = 0;
+			next_pcg();
+			state += value;
+			next_pcg();
+		}
+
+		result_type operator()() { return is_pcg ? next_pcg() : twister(); }
+
+	private:
+		// PCG32, XSH RR output
+		uint32_t next_pcg() {
+			uint64_t old = state;
+			state = old * 6364136223846793005ull + 1442695040888963407ull;
+			uint32_t shifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+			uint32_t rotation = uint32_t(old >> 59u);
+			return (shifted >> rotation) | (shifted << ((32u - rotation) & 31u));
+		}
+
+		std::mt19937 twister;
+		uint64_t state = 0;
+		bool is_pcg = false;
+};
+
+inline random_stream& random_generator() {
+	static thread_local random_stream generator;
+	return generator;
+}
+
+// Restart the calling thread's random sequence
+inline void seed_random(uint32_t seed) {
+	random_generator().seed(seed);
+}
+
+// Where a new thread's sequence starts. Scenes are loaded from it, so random ones come out the same in every process.
+const uint32_t scene_random_seed = std::mt19937::default_seed;
+
+// Start the calling thread on the random sequence of one sample
+inline void seed_sample_random(uint64_t seed) {
+	random_generator().seed_pcg(seed);
+}
+
+// Well mixed seed for one pixel, so the image does not depend on which thread renders which pixel
+inline uint32_t pixel_seed(uint32_t seed, int x, int y) {
+	uint32_t h = seed ^ (uint32_t(x) * 0x9e3779b9u) ^ (uint32_t(y) * 0x85ebca6bu);
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+// Seed for one sample of a pixel, so a range of samples renders the same whichever job renders it. Mixed with the
+// splitmix64 finalizer, which never maps two samples to one seed.
+inline uint64_t sample_seed(uint32_t seed, int x, int y, int sample) {
+	uint64_t h = (uint64_t(pixel_seed(seed, x, y)) << 32) | uint32_t(sample);
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebull;
+	h ^= h >> 31;
+	return h;
+}
+
 inline float random_float(float min, float max) {
-	static thread_local std::mt19937 generator;
 	std::uniform_real_distribution<float> distribution(min, max);
-	return distribution(generator);
+	return distribution(random_generator());
 }
 
 inline float random_float() {
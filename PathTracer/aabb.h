@@ -0,0 +1,65 @@
+#pragma once
+
+#include "PathTracer.h"
+
+#include <algorithm>
+
+class aabb {
+	public:
+		aabb() : minimum(infinity), maximum(-infinity) {}
+		aabb(const vec3& a, const vec3& b) : minimum(a), maximum(b) {}
+
+		vec3 min() const { return minimum; }
+		vec3 max() const { return maximum; }
+
+		bool is_empty() const {
+			return minimum.x > maximum.x || minimum.y > maximum.y || minimum.z > maximum.z;
+		}
+
+		vec3 centroid() const { return 0.5f * (minimum + maximum); }
+		vec3 extent() const { return maximum - minimum; }
+
+		float surface_area() const {
+			if (is_empty()) return 0.f;
+
+			vec3 d = extent();
+			return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+		}
+
+		int longest_axis() const {
+			vec3 d = extent();
+			if (d.x > d.y && d.x > d.z) return 0;
+			return d.y > d.z ? 1 : 2;
+		}
+
+		void expand(const vec3& p) {
+			minimum = glm::min(minimum, p);
+			maximum = glm::max(maximum, p);
+		}
+
+		void expand(const aabb& box) {
+			minimum = glm::min(minimum, box.minimum);
+			maximum = glm::max(maximum, box.maximum);
+		}
+
+		// Slab test using the reciprocal ray direction, t_entry is only valid on a hit
+		bool hit(const vec3& origin, const vec3& inv_direction, float t_min, float t_max, float& t_entry) const {
+			vec3 t0 = (minimum - origin) * inv_direction;
+			vec3 t1 = (maximum - origin) * inv_direction;
+			vec3 t_near = glm::min(t0, t1);
+			vec3 t_far = glm::max(t0, t1);
+
+			t_entry = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, t_min));
+			float t_exit = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, t_max));
+
+			return t_entry <= t_exit;
+		}
+
+	public:
+		vec3 minimum;
+		vec3 maximum;
+};
+
+inline aabb surrounding_box(const aabb& a, const aabb& b) {
+	return aabb(glm::min(a.minimum, b.minimum), glm::max(a.maximum, b.maximum));
+}
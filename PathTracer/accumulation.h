@@ -0,0 +1,242 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "framebuffer.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Accumulation files are a fixed header, the sample ranges summed, then every pixel's sums and sample counts as raw
+// little endian arrays. Bump the version on any layout change.
+const char accumulation_magic[8] = { 'P', 'T', 'S', 'U', 'M', 'S', '\0', '\0' };
+const uint32_t accumulation_version = 2;
+
+// Sums are fixed point, so however the samples of a frame are split between jobs they add up to the same bits. A
+// pixel's sum is at most 2^16 clamp * 2^24 unit * 2^22 samples = 2^62, which fits.
+const double accumulation_unit = 16777216.0;		// 2^24 a unit of radiance
+const float accumulation_max_sample = 1 << 16;		// Brighter samples are clamped
+const int32_t accumulation_max_samples = 1 << 22;	// Sample indices of every range end here at most
+
+// Sample indices begin to end of every pixel
+struct sample_range {
+	int32_t begin;
+	int32_t end;
+};
+
+struct accumulation_header {
+	char magic[8];
+	uint32_t version;
+	int32_t width;
+	int32_t height;
+	int32_t frame;
+	uint64_t render_key;	// Everything but the samples that changes the image, only equal keys merge
+	uint32_t range_count;
+	uint32_t padding;
+};
+
+// Per pixel sums of any number of ranges of a frame's samples
+class accumulation_buffer {
+	public:
+		accumulation_buffer() {}
+		accumulation_buffer(int image_width, int image_height)
+			: width(image_width), height(image_height), sums(size_t(image_width) * image_height * 3, 0), counts(size_t(image_width) * image_height, 0) {}
+
+		// Samples that are not finite count as black
+		void add(int x, int y, const vec3& color);
+
+		// Mean of the pixel's samples, resolved the same way for a single job and for any merge of jobs
+		vec3 mean(int x, int y) const;
+
+		// Adds the samples of other, false after printing why when it belongs to another render or holds samples
+		// already summed here
+		bool merge(const accumulation_buffer& other);
+
+		// Linear image of the means
+		framebuffer resolve() const;
+
+		int sample_count() const;
+
+	public:
+		int width = 0;
+		int height = 0;
+		int frame = 0;
+		uint64_t render_key = 0;
+		std::vector<sample_range> ranges;	// In order, never overlapping or meeting
+		std::vector<int64_t> sums;			// RGB a pixel, rows bottom up
+		std::vector<uint32_t> counts;
+};
+
+// Sums one sample can add to a pixel's channel
+const int64_t accumulation_max_fixed = int64_t(double(accumulation_max_sample) * accumulation_unit);
+
+inline int64_t to_accumulation_fixed(float value) {
+	// Also catches NaN
+	if (!(value > 0.f)) return 0;
+	return int64_t(double(std::min(value, accumulation_max_sample)) * accumulation_unit + 0.5);
+}
+
+void accumulation_buffer::add(int x, int y, const vec3& color) {
+	const size_t index = size_t(y) * width + x;
+	sums[index * 3 + 0] += to_accumulation_fixed(color.r);
+	sums[index * 3 + 1] += to_accumulation_fixed(color.g);
+	sums[index * 3 + 2] += to_accumulation_fixed(color.b);
+	++counts[index];
+}
+
+vec3 accumulation_buffer::mean(int x, int y) const {
+	const size_t index = size_t(y) * width + x;
+	if (counts[index] == 0) return vec3(0.f);
+
+	const double scale = 1.0 / (accumulation_unit * counts[index]);
+	return vec3(float(double(sums[index * 3 + 0]) * scale), float(double(sums[index * 3 + 1]) * scale), float(double(sums[index * 3 + 2]) * scale));
+}
+
+bool accumulation_buffer::merge(const accumulation_buffer& other) {
+	if (other.width != width || other.height != height || other.frame != frame || other.render_key != render_key) {
+		printf("Samples of another render, the image size, frame, scene and every other setting must match\n");
+		return false;
+	}
+
+	for (const sample_range& a : ranges) {
+		for (const sample_range& b : other.ranges) {
+			if (a.begin < b.end && b.begin < a.end) {
+				printf("Samples %d to %d are already summed\n", std::max(a.begin, b.begin), std::min(a.end, b.end));
+				return false;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < sums.size(); ++i) sums[i] += other.sums[i];
+	for (size_t i = 0; i < counts.size(); ++i) counts[i] += other.counts[i];
+
+	ranges.insert(ranges.end(), other.ranges.begin(), other.ranges.end());
+	std::sort(ranges.begin(), ranges.end(), [](const sample_range& a, const sample_range& b) { return a.begin < b.begin; });
+
+	// Ranges that meet become one, so the sums of a split frame are stored as those of a single job
+	if (ranges.empty()) return true;
+
+	size_t kept = 0;
+	for (size_t i = 1; i < ranges.size(); ++i) {
+		if (ranges[i].begin == ranges[kept].end) ranges[kept].end = ranges[i].end;
+		else ranges[++kept] = ranges[i];
+	}
+	ranges.resize(kept + 1);
+	return true;
+}
+
+framebuffer accumulation_buffer::resolve() const {
+	framebuffer buffer(width, height);
+	int layer = buffer.add_layer("", { "R", "G", "B" });
+
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			vec3 color = mean(x, y);
+			float* out = buffer.pixel(layer, x, y);
+			out[0] = color.r;
+			out[1] = color.g;
+			out[2] = color.b;
+		}
+	}
+	return buffer;
+}
+
+int accumulation_buffer::sample_count() const {
+	int count = 0;
+	for (const sample_range& range : ranges) count += range.end - range.begin;
+	return count;
+}
+
+bool save_accumulation(const std::string& path, const accumulation_buffer& buffer) {
+	accumulation_header header = {};
+	memcpy(header.magic, accumulation_magic, sizeof(header.magic));
+	header.version = accumulation_version;
+	header.width = buffer.width;
+	header.height = buffer.height;
+	header.frame = buffer.frame;
+	header.render_key = buffer.render_key;
+	header.range_count = uint32_t(buffer.ranges.size());
+
+	// Written whole to a temporary of this writer's own, so neither a merge nor another job saving the same path ever
+	// reads or writes a partial file
+	std::string temp_path = unique_temp_path(path);
+	std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+	if (!out) return false;
+
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(buffer.ranges.data()), std::streamsize(buffer.ranges.size() * sizeof(sample_range)));
+	out.write(reinterpret_cast<const char*>(buffer.sums.data()), std::streamsize(buffer.sums.size() * sizeof(int64_t)));
+	out.write(reinterpret_cast<const char*>(buffer.counts.data()), std::streamsize(buffer.counts.size() * sizeof(uint32_t)));
+	out.close();
+
+	if (!out) {
+		remove(temp_path.c_str());
+		return false;
+	}
+
+	return replace_file(temp_path.c_str(), path.c_str());
+}
+
+// Ranges in order without overlapping or meeting inside the sample indices, and no pixel holding more samples than
+// they cover or more than those samples could sum to, so merging files that pass can never overflow
+bool is_valid_accumulation(const accumulation_buffer& buffer) {
+	int32_t previous_end = -1;
+	for (const sample_range& range : buffer.ranges) {
+		if (range.begin <= previous_end || range.begin < 0 || range.end <= range.begin || range.end > accumulation_max_samples) return false;
+		previous_end = range.end;
+	}
+
+	const int64_t samples = buffer.sample_count();
+	for (size_t i = 0; i < buffer.counts.size(); ++i) {
+		if (buffer.counts[i] > samples) return false;
+
+		const int64_t max_sum = int64_t(buffer.counts[i]) * accumulation_max_fixed;
+		for (int c = 0; c < 3; ++c) {
+			int64_t sum = buffer.sums[i * 3 + c];
+			if (sum < 0 || sum > max_sum) return false;
+		}
+	}
+	return true;
+}
+
+bool load_accumulation(const std::string& path, accumulation_buffer& buffer) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) return false;
+
+	accumulation_header header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+		|| memcmp(header.magic, accumulation_magic, sizeof(header.magic)) != 0
+		|| header.version != accumulation_version
+		|| header.width <= 0 || header.height <= 0 || header.range_count > (1u << 20))
+	{
+		return false;
+	}
+
+	// The header sets what gets allocated, so it has to describe exactly the bytes the file holds
+	const uint64_t pixel_bytes = 3 * sizeof(int64_t) + sizeof(uint32_t);
+	const uint64_t pixels = uint64_t(header.width) * uint64_t(header.height);
+	const uint64_t fixed_bytes = sizeof(header) + uint64_t(header.range_count) * sizeof(sample_range);
+	if (pixels > (UINT64_MAX - fixed_bytes) / pixel_bytes || pixels * 3 > SIZE_MAX / sizeof(int64_t)) return false;
+
+	const uint64_t expected_size = fixed_bytes + pixels * pixel_bytes;
+	const std::streamoff data_start = in.tellg();
+	in.seekg(0, std::ios::end);
+	const std::streamoff file_size = in.tellg();
+	if (file_size < 0 || uint64_t(file_size) != expected_size) return false;
+	in.seekg(data_start);
+
+	buffer = accumulation_buffer(header.width, header.height);
+	buffer.frame = header.frame;
+	buffer.render_key = header.render_key;
+	buffer.ranges.resize(header.range_count);
+
+	in.read(reinterpret_cast<char*>(buffer.ranges.data()), std::streamsize(buffer.ranges.size() * sizeof(sample_range)));
+	in.read(reinterpret_cast<char*>(buffer.sums.data()), std::streamsize(buffer.sums.size() * sizeof(int64_t)));
+	in.read(reinterpret_cast<char*>(buffer.counts.data()), std::streamsize(buffer.counts.size() * sizeof(uint32_t)));
+	return in && is_valid_accumulation(buffer);
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "hittable_list.h"
+#include "mesh.h"
+#include "thread_pool.h"
+#include "triangle.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+enum class animation_type {
+	turntable,	// Rigid spin about the y axis
+	wave		// Ripple along the y axis swelling and sinking
+};
+
+// How animated scenes move, shared by every path that renders their frames
+struct animation_settings {
+	animation_type type = animation_type::turntable;
+	float turntable_rate = 0.25f;	// Revolutions per second
+	float wave_amplitude = 0.1f;	// Fraction of each vertex's distance from the origin
+	float wave_frequency = 4.f;		// Radians per unit of height
+
+	bool operator==(const animation_settings& other) const {
+		return type == other.type && turntable_rate == other.turntable_rate
+			&& wave_amplitude == other.wave_amplitude && wave_frequency == other.wave_frequency;
+	}
+};
+
+inline const char* animation_type_name(animation_type type) {
+	switch (type) {
+		case animation_type::turntable: return "turntable";
+		case animation_type::wave: return "wave";
+	}
+	return "unknown";
+}
+
+// A mesh whose triangles stay linked to it, so each frame's vertices can be written into them in place
+struct animated_mesh {
+	mesh rest;
+	std::vector<vec3> vertices;
+	std::vector<vec3> normals;
+	std::vector<triangle*> triangles;	// One per face of the rest mesh, in the arena of the list they were added to
+
+	bool empty() const { return triangles.empty(); }
+};
+
+void make_animated_mesh(const mesh& m, const material* mat, animated_mesh& out, hittable_list& objects) {
+	out.rest = m;
+	out.vertices = m.vertices;
+	out.normals = m.normals;
+	out.triangles.clear();
+
+	const int object_id = int(objects.objects.size());
+	if (!objects.arena) objects.arena = make_shared<scene_arena>();
+	for (const face& f : m.faces) {
+		auto tri = make_triangle(m, f, mat, *objects.arena);
+		tri->object_id = object_id;
+		out.triangles.push_back(tri);
+		objects.add(tri);
+	}
+}
+
+inline void parallel_chunks(int count, thread_pool& pool, const std::function<void(int, int)>& body) {
+	const int chunk_size = std::max(1024, count / int(4 * std::max(1u, pool.ThreadCount())));
+	for (int chunk_s = 0; chunk_s < count; chunk_s += chunk_size) {
+		int chunk_f = std::min(chunk_s + chunk_size, count);
+		pool.QueueJob([&body, chunk_s, chunk_f] { body(chunk_s, chunk_f); });
+	}
+	pool.Wait();
+}
+
+// Rigid turntable spin about the y axis through the origin
+void animate_turntable(animated_mesh& anim, float time, float revolutions_per_second, thread_pool& pool) {
+	const float angle = 2.f * pi * revolutions_per_second * time;
+	const float c = std::cos(angle);
+	const float s = std::sin(angle);
+
+	auto rotate = [c, s](const vec3& p) { return vec3(c * p.x + s * p.z, p.y, -s * p.x + c * p.z); };
+
+	parallel_chunks(int(anim.vertices.size()), pool, [&](int first, int last) {
+		for (int i = first; i < last; ++i) anim.vertices[i] = rotate(anim.rest.vertices[i]);
+	});
+	parallel_chunks(int(anim.normals.size()), pool, [&](int first, int last) {
+		for (int i = first; i < last; ++i) anim.normals[i] = rotate(anim.rest.normals[i]);
+	});
+}
+
+// Deforming ripple along the y axis that swells and sinks once a second, at rest at time 0 like the turntable.
+// Normals are left at their rest values.
+void animate_wave(animated_mesh& anim, float time, float amplitude, float frequency, thread_pool& pool) {
+	const float swell = amplitude * std::sin(2.f * pi * time);
+	parallel_chunks(int(anim.vertices.size()), pool, [&](int first, int last) {
+		for (int i = first; i < last; ++i) {
+			const vec3& p = anim.rest.vertices[i];
+			anim.vertices[i] = p * (1.f + swell * std::sin(frequency * p.y));
+		}
+	});
+}
+
+// Copy the current vertex buffers into the linked triangles
+void update_triangles(animated_mesh& anim, thread_pool& pool) {
+	const mesh& m = anim.rest;
+
+	parallel_chunks(int(anim.triangles.size()), pool, [&](int first, int last) {
+		for (int i = first; i < last; ++i) {
+			const face& f = m.faces[i];
+			triangle& tri = *anim.triangles[i];
+
+			for (int k = 0; k < 3; ++k) tri.p[k] = anim.vertices[f.v[k]];
+
+			if (m.is_smooth) {
+				for (int k = 0; k < 3; ++k) tri.n[k] = normalize(anim.normals[f.n[k]]);
+			}
+			else {
+				vec3 n = normalize(cross(tri.p[1] - tri.p[0], tri.p[2] - tri.p[0]));
+				for (int k = 0; k < 3; ++k) tri.n[k] = n;
+			}
+		}
+	});
+}
+
+// Poses the mesh at time and writes the pose into its triangles
+void pose_animated_mesh(animated_mesh& anim, const animation_settings& settings, float time, thread_pool& pool) {
+	if (settings.type == animation_type::wave) animate_wave(anim, time, settings.wave_amplitude, settings.wave_frequency, pool);
+	else animate_turntable(anim, time, settings.turntable_rate, pool);
+
+	update_triangles(anim, pool);
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Auxiliary outputs, filled from where each camera ray first meets the scene during the color pass
+enum aov_flags : unsigned {
+	aov_none = 0,
+	aov_albedo = 1 << 0,
+	aov_normal = 1 << 1,
+	aov_depth = 1 << 2,
+	aov_material_id = 1 << 3,
+	aov_object_id = 1 << 4,
+	aov_variance = 1 << 5,
+	aov_all = aov_albedo | aov_normal | aov_depth | aov_material_id | aov_object_id | aov_variance
+};
+
+struct aov_layer_info {
+	aov_flags flag;
+	const char* name;		// Setting name and framebuffer layer name
+	std::vector<std::string> channels;
+	bool keep_float;		// IDs must round trip exactly, even in half images
+};
+
+const std::vector<aov_layer_info>& aov_layers() {
+	static const std::vector<aov_layer_info> layers = {
+		{ aov_albedo, "albedo", { "R", "G", "B" }, false },
+		{ aov_normal, "normal", { "X", "Y", "Z" }, false },
+		{ aov_depth, "depth", { "Z" }, false },
+		{ aov_material_id, "material_id", { "ID" }, true },
+		{ aov_object_id, "object_id", { "ID" }, true },
+		{ aov_variance, "variance", { "Y" }, false }
+	};
+	return layers;
+}
+
+// What one camera ray saw first. Rays that escape keep the sky as their albedo and -1 as their IDs.
+struct aov_sample {
+	vec3 albedo;
+	vec3 normal;
+	float depth;		// Distance from the ray origin, infinity on a miss
+	int material_id;
+	int object_id;
+};
+
+inline float luminance(const vec3& c) {
+	return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+}
+
+// Samples of one pixel. Albedo and normal are averaged, depth and the IDs come from the nearest hit. The luminance
+// moments give the variance of the pixel's estimate, which tells a denoiser how much of a difference is noise.
+struct aov_pixel {
+	vec3 albedo = vec3(0.f);
+	vec3 normal = vec3(0.f);
+	float depth = infinity;
+	int material_id = -1;
+	int object_id = -1;
+	float luminance_sum = 0.f;
+	float luminance_squares = 0.f;
+
+	void add(const aov_sample& sample, const vec3& color) {
+		albedo += sample.albedo;
+		normal += sample.normal;
+
+		float y = luminance(color);
+		luminance_sum += y;
+		luminance_squares += y * y;
+
+		if (sample.depth < depth) {
+			depth = sample.depth;
+			material_id = sample.material_id;
+			object_id = sample.object_id;
+		}
+	}
+};
+
+// Comma separated names, or all or none
+bool parse_aov_list(const std::string& text, unsigned& flags) {
+	unsigned parsed = aov_none;
+
+	size_t first = 0;
+	while (first <= text.size()) {
+		size_t comma = text.find(',', first);
+		if (comma == std::string::npos) comma = text.size();
+		std::string name = text.substr(first, comma - first);
+		first = comma + 1;
+
+		if (name == "all") {
+			parsed |= aov_all;
+			continue;
+		}
+		if (name == "none") continue;
+
+		bool is_known = false;
+		for (const aov_layer_info& layer : aov_layers()) {
+			if (name == layer.name) {
+				parsed |= layer.flag;
+				is_known = true;
+			}
+		}
+		if (!is_known) return false;
+	}
+
+	flags = parsed;
+	return true;
+}
+
+void add_aov_layers(framebuffer& buffer, unsigned flags) {
+	for (const aov_layer_info& layer : aov_layers()) {
+		if ((flags & layer.flag) == 0) continue;
+
+		int index = buffer.add_layer(layer.name, layer.channels);
+		buffer.layers[index].keep_float = layer.keep_float;
+	}
+}
+
+// Layer indices of the outputs present in a framebuffer, -1 for the missing ones
+struct aov_targets {
+	int albedo = -1;
+	int normal = -1;
+	int depth = -1;
+	int material_id = -1;
+	int object_id = -1;
+	int variance = -1;
+
+	aov_targets() {}
+	aov_targets(const framebuffer& buffer) :
+		albedo(buffer.find_layer("albedo")),
+		normal(buffer.find_layer("normal")),
+		depth(buffer.find_layer("depth")),
+		material_id(buffer.find_layer("material_id")),
+		object_id(buffer.find_layer("object_id")),
+		variance(buffer.find_layer("variance")) {}
+
+	bool any() const { return albedo >= 0 || normal >= 0 || depth >= 0 || material_id >= 0 || object_id >= 0 || variance >= 0; }
+
+	void store(framebuffer& buffer, int x, int y, const aov_pixel& pixel, float sample_scale) const {
+		if (albedo >= 0) {
+			float* out = buffer.pixel(albedo, x, y);
+			out[0] = pixel.albedo.r * sample_scale;
+			out[1] = pixel.albedo.g * sample_scale;
+			out[2] = pixel.albedo.b * sample_scale;
+		}
+		if (normal >= 0) {
+			float* out = buffer.pixel(normal, x, y);
+			out[0] = pixel.normal.x * sample_scale;
+			out[1] = pixel.normal.y * sample_scale;
+			out[2] = pixel.normal.z * sample_scale;
+		}
+		if (depth >= 0) buffer.pixel(depth, x, y)[0] = pixel.depth;
+		if (material_id >= 0) buffer.pixel(material_id, x, y)[0] = float(pixel.material_id);
+		if (object_id >= 0) buffer.pixel(object_id, x, y)[0] = float(pixel.object_id);
+
+		if (variance >= 0) {
+			float mean = pixel.luminance_sum * sample_scale;
+			float sample_variance = std::max(0.f, pixel.luminance_squares * sample_scale - mean * mean);
+			buffer.pixel(variance, x, y)[0] = sample_variance * sample_scale;
+		}
+	}
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using std::shared_ptr;
+
+// Bump allocator that owns the primitives and materials of a scene. Objects are placed one after another in large
+// blocks in the order they are made, and are all destroyed together with the arena, so a scene costs a handful of
+// allocations instead of one per object and teardown frees blocks rather than millions of small nodes.
+//
+// make returns a plain pointer the arena owns, so nothing that holds one keeps the object alive. Anything pointing into
+// the arena must be done with it before the arena goes.
+class scene_arena {
+	public:
+		scene_arena(size_t first_block_size = 1 << 16) : next_block_size(first_block_size) {}
+		~scene_arena() { release(); }
+
+		scene_arena(const scene_arena&) = delete;
+		scene_arena& operator=(const scene_arena&) = delete;
+
+		template <class T, class... Args>
+		T* make(Args&&... args) {
+			T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+			if (!std::is_trivially_destructible<T>::value) {
+				destructors.push_back({ [](void* p) { static_cast<T*>(p)->~T(); }, object });
+			}
+			++object_count;
+			return object;
+		}
+
+		// Destroys every object, newest first, and frees the blocks
+		void release();
+
+		size_t objects() const { return object_count; }
+		size_t bytes_used() const { return used_bytes; }
+		size_t bytes_reserved() const { return reserved_bytes; }
+
+	private:
+		void* allocate(size_t size, size_t alignment);
+
+		struct block {
+			unsigned char* data;
+			size_t size;
+		};
+
+		struct destructor {
+			void (*destroy)(void*);
+			void* object;
+		};
+
+		std::vector<block> blocks;
+		std::vector<destructor> destructors;
+		unsigned char* cursor = nullptr;
+		unsigned char* end = nullptr;
+
+		size_t next_block_size;
+		size_t object_count = 0;
+		size_t used_bytes = 0;
+		size_t reserved_bytes = 0;
+};
+
+void* scene_arena::allocate(size_t size, size_t alignment) {
+	size_t padding = (alignment - reinterpret_cast<uintptr_t>(cursor) % alignment) % alignment;
+
+	if (cursor == nullptr || size_t(end - cursor) < padding + size) {
+		// Blocks double up to 16 MB, so small scenes stay small and large ones need few blocks
+		size_t block_size = std::max(next_block_size, size + alignment);
+		next_block_size = std::min<size_t>(next_block_size * 2, size_t(1) << 24);
+
+		unsigned char* data = static_cast<unsigned char*>(malloc(block_size));
+		if (data == nullptr) throw std::bad_alloc();
+
+		blocks.push_back({ data, block_size });
+		cursor = data;
+		end = data + block_size;
+		reserved_bytes += block_size;
+		padding = (alignment - reinterpret_cast<uintptr_t>(cursor) % alignment) % alignment;
+	}
+
+	void* p = cursor + padding;
+	cursor += padding + size;
+	used_bytes += padding + size;
+	return p;
+}
+
+void scene_arena::release() {
+	for (auto it = destructors.rbegin(); it != destructors.rend(); ++it) it->destroy(it->object);
+	destructors.clear();
+
+	for (const block& b : blocks) free(b.data);
+	blocks.clear();
+
+	cursor = nullptr;
+	end = nullptr;
+	object_count = 0;
+	used_bytes = 0;
+	reserved_bytes = 0;
+}
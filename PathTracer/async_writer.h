@@ -0,0 +1,80 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Runs jobs one at a time on a background thread, in the order they were queued, so images can be compressed and
+// written while the next frame renders. At most max_pending jobs wait at once, queue blocks beyond that so a slow
+// disk cannot pile up copies of every frame.
+class async_writer {
+	public:
+		async_writer(size_t pending_limit = 2) : max_pending(pending_limit) {
+			thread = std::thread([this] { thread_loop(); });
+		}
+
+		// Finishes every queued job first
+		~async_writer() {
+			{
+				std::unique_lock<std::mutex> lock(jobs_mutex);
+				do_terminate = true;
+			}
+			queued_condition.notify_all();
+			thread.join();
+		}
+
+		void queue(std::function<void()> job) {
+			{
+				std::unique_lock<std::mutex> lock(jobs_mutex);
+				done_condition.wait(lock, [this] { return jobs.size() < max_pending; });
+				jobs.push_back(std::move(job));
+			}
+			queued_condition.notify_one();
+		}
+
+		// Block until every queued job has finished
+		void wait() {
+			std::unique_lock<std::mutex> lock(jobs_mutex);
+			done_condition.wait(lock, [this] { return jobs.empty() && !is_running; });
+		}
+
+	private:
+		void thread_loop() {
+			while (true) {
+				std::function<void()> job;
+
+				{
+					std::unique_lock<std::mutex> lock(jobs_mutex);
+					queued_condition.wait(lock, [this] { return !jobs.empty() || do_terminate; });
+
+					if (jobs.empty()) return;
+
+					job = std::move(jobs.front());
+					jobs.pop_front();
+					is_running = true;
+				}
+				done_condition.notify_all();
+
+				job();
+
+				{
+					std::unique_lock<std::mutex> lock(jobs_mutex);
+					is_running = false;
+				}
+				done_condition.notify_all();
+			}
+		}
+
+		std::thread thread;
+		std::deque<std::function<void()>> jobs;
+		std::mutex jobs_mutex;
+
+		std::condition_variable queued_condition;
+		std::condition_variable done_condition;		// A job was taken or finished
+
+		size_t max_pending;
+		bool is_running = false;
+		bool do_terminate = false;
+};
@@ -0,0 +1,1219 @@
+#pragma once
+
+#include "aabb.h"
+#include "cpu_dispatch.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "kernels.h"
+#include "morton.h"
+#include "telemetry.h"
+#include "thread_pool.h"
+#include "triangle.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <vector>
+
+enum class bvh_build_method {
+	sah,	// Top down binned SAH, best trees
+	lbvh,	// Morton ordered linear BVH, fastest builds
+	sbvh	// Binned SAH with spatial splits, for long and thin primitives
+};
+
+inline const char* bvh_build_method_name(bvh_build_method method) {
+	switch (method) {
+		case bvh_build_method::sah: return "sah";
+		case bvh_build_method::lbvh: return "lbvh";
+		case bvh_build_method::sbvh: return "sbvh";
+	}
+	return "unknown";
+}
+
+struct bvh_build_options {
+	bvh_build_method method = bvh_build_method::sah;
+
+	int bin_count = 16;			// SAH candidates per axis, at most 64
+	int max_leaf_size = 8;		// Larger nodes are always split
+	int task_threshold = 4096;	// Smaller subtrees are built inline instead of queued on the pool
+	float traversal_cost = 1.f;
+	float intersection_cost = 1.f;
+
+	int morton_bits = 30;			// 30 or 63 bit codes for the LBVH
+	bool optimize_treelets = false;	// Restructure small treelets of the LBVH to lower its SAH cost
+	int treelet_size = 7;			// Leaves per treelet, at most 8
+
+	float max_duplication = 0.3f;			// Extra references the SBVH may create, as a fraction of the primitives
+	float spatial_split_alpha = 1e-5f;		// Only try spatial splits where the children overlap more than this fraction of the root
+};
+
+// Nodes are stored depth first, so the first child of an interior node is always the next node
+struct bvh_node {
+	aabb box;
+	int offset;		// Leaf: index of the first primitive, Interior: index of the second child
+	int count;		// Leaf: number of primitives, Interior: 0
+
+	bool is_leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(bvh_node) == sizeof(kernel_node), "Nodes are handed to the traversal kernels as they are");
+
+// Whether the nodes form one depth first tree, shallow enough for the traversal stack, whose leaves hold ranges of
+// item_count items. Traversal trusts all of it, so trees read from files are checked first.
+bool is_well_formed_tree(const bvh_node* nodes, size_t node_count, size_t item_count);
+
+class bvh : public hittable {
+	public:
+		bvh() {}
+		bvh(const hittable_list& list, thread_pool& pool, const bvh_build_options& build_options = bvh_build_options());
+
+		// Adopt nodes built earlier, the primitives must already be in leaf order
+		bvh(std::vector<bvh_node> built_nodes, std::vector<const hittable*> ordered_primitives)
+			: nodes(std::move(built_nodes)), primitives(std::move(ordered_primitives)), primitive_indices(primitives.size()) {
+			std::iota(primitive_indices.begin(), primitive_indices.end(), 0);
+			built_sah_cost = sah_cost();
+			prepare_kernel_data();
+		}
+
+		virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
+
+		// Hit through the given kernels instead of those picked for this CPU, to compare instruction sets
+		bool hit_with(const kernel_table& kernels, const ray& r, float t_min, float t_max, hit_record& rec) const;
+
+		// Expected cost of a random ray relative to the root, lower is better
+		float sah_cost() const;
+
+		// For nodes read from outside: every node is reached once in depth first order, every leaf's primitives
+		// are in range and the depth fits the traversal stack
+		bool is_well_formed() const;
+
+		// Recompute every box bottom up after primitives moved, the topology is kept
+		void refit(thread_pool& pool);
+
+		// Refit, then rebuild from the source list if the SAH cost grew past rebuild_threshold times its
+		// value at the last build. Returns true when the tree was rebuilt.
+		bool update(const hittable_list& list, thread_pool& pool, float rebuild_threshold);
+
+	public:
+		std::vector<bvh_node> nodes;
+		std::vector<const hittable*> primitives;		// Not owned, the arena of the list the tree was built from keeps them
+		std::vector<int> primitive_indices;		// Index in the source list of each primitive
+
+		bvh_build_options options;
+		double build_time_ms = 0.0;
+		float built_sah_cost = 0.f;
+
+	private:
+		static const int max_depth = kernel_max_depth;
+		static const int max_bins = 64;
+
+		struct build_node {
+			aabb box;
+			int children[2];
+			int first;
+			int count;
+		};
+
+		// Primitive references are partitioned in place, so each subtree owns a contiguous range
+		struct build_ref {
+			aabb box;
+			vec3 centroid;
+			int index;
+		};
+
+		struct build_state {
+			std::vector<build_ref> refs;
+			std::vector<build_node> nodes;
+			std::atomic<int> node_count;
+
+			// Spatial splits duplicate references, so each SBVH node owns its references until it becomes a leaf
+			std::vector<build_ref> leaf_refs;
+			std::mutex leaf_mutex;
+			std::atomic<int> ref_count;
+			int max_refs = 0;
+			float root_area = 0.f;
+		};
+
+		struct split_candidate {
+			float cost = infinity;	// Unnormalized SAH cost of the children
+			int axis = -1;
+			int bin = 0;
+			float position = 0.f;
+			bool spatial = false;
+			aabb left_box;
+			aabb right_box;
+		};
+
+		void find_object_split(const build_ref* refs, int count, const aabb& centroid_box, split_candidate& best) const;
+		int partition_object_split(build_ref* refs, int count, const aabb& centroid_box, const split_candidate& split) const;
+		int partition_median(build_ref* refs, int count, const aabb& centroid_box) const;
+		void build_recursive(build_state& state, thread_pool& pool, int node_index, int begin, int end, int depth) const;
+
+		static aabb clip_ref(const build_ref& ref, const hittable_list& list, int axis, float min, float max);
+		void find_spatial_split(const std::vector<build_ref>& refs, const hittable_list& list, const aabb& node_box, split_candidate& best) const;
+		void build_spatial(build_state& state, const hittable_list& list, thread_pool& pool, int node_index, std::vector<build_ref> refs, int depth) const;
+		void build_linear(build_state& state, thread_pool& pool) const;
+		void optimize_treelet(build_state& state, std::vector<float>& costs, int root) const;
+		int flatten(const build_state& state, const hittable_list& list, int node_index);
+		void refit_range(int first, int last);
+
+		// Trees holding triangles are traversed by the CPU kernels, anything else calls each primitive's hit
+		void prepare_kernel_data();
+		bool hit_kernel(const kernel_table& kernels, const ray& r, float t_min, float t_max, hit_record& rec) const;
+		bool hit_virtual(const ray& r, float t_min, float t_max, hit_record& rec) const;
+
+		// Triangle vertex and edge components in leaf order, nine padded arrays
+		std::vector<float> triangle_data;
+		std::vector<unsigned char> triangle_flags;
+		int triangle_count = 0;
+};
+
+bvh::bvh(const hittable_list& list, thread_pool& pool, const bvh_build_options& build_options) : options(build_options) {
+	auto time_s = std::chrono::high_resolution_clock::now();
+
+	const int n = int(list.objects.size());
+	if (n == 0) return;
+
+	build_state state;
+	state.refs.resize(n);
+	state.nodes.resize(2 * n - 1);
+	state.node_count = 1;
+
+	// Primitive bounds are independent, so gather them in parallel chunks
+	const int chunk_size = std::max(1024, n / int(4 * std::max(1u, pool.ThreadCount())));
+	for (int chunk_s = 0; chunk_s < n; chunk_s += chunk_size) {
+		pool.QueueJob([&state, &list, chunk_s, chunk_size, n] {
+			int chunk_f = std::min(chunk_s + chunk_size, n);
+			for (int i = chunk_s; i < chunk_f; ++i) {
+				build_ref& ref = state.refs[i];
+				list.objects[i]->bounding_box(ref.box);
+				ref.centroid = ref.box.centroid();
+				ref.index = i;
+			}
+		});
+	}
+	pool.Wait();
+
+	if (options.method == bvh_build_method::lbvh) {
+		build_linear(state, pool);
+	}
+	else if (options.method == bvh_build_method::sbvh) {
+		state.max_refs = n + int(std::max(0.f, options.max_duplication) * n);
+		state.ref_count = n;
+		state.nodes.resize(2 * state.max_refs - 1);
+
+		aabb root_box;
+		for (const build_ref& ref : state.refs) root_box.expand(ref.box);
+		state.root_area = root_box.surface_area();
+
+		state.leaf_refs.reserve(state.max_refs);
+		build_spatial(state, list, pool, 0, state.refs, 0);
+		pool.Wait();
+		state.refs.swap(state.leaf_refs);
+	}
+	else {
+		build_recursive(state, pool, 0, 0, n, 0);
+		pool.Wait();
+	}
+
+	const int ref_count = int(state.refs.size());
+	nodes.reserve(state.node_count);
+	primitives.reserve(ref_count);
+	primitive_indices.reserve(ref_count);
+	int depth = flatten(state, list, 0);
+
+	// Heavily duplicated Morton codes can outgrow the traversal stack, the SAH builder bounds its depth
+	if (depth >= max_depth) {
+		nodes.clear();
+		primitives.clear();
+		primitive_indices.clear();
+
+		state.node_count = 1;
+		build_recursive(state, pool, 0, 0, ref_count, 0);
+		pool.Wait();
+		flatten(state, list, 0);
+	}
+
+	built_sah_cost = sah_cost();
+	prepare_kernel_data();
+
+	auto time_f = std::chrono::high_resolution_clock::now();
+	build_time_ms = std::chrono::duration<double, std::milli>(time_f - time_s).count();
+}
+
+void bvh::find_object_split(const build_ref* refs, int count, const aabb& centroid_box, split_candidate& best) const {
+	const int bin_count = std::min(std::max(options.bin_count, 2), max_bins);
+
+	aabb bin_boxes[3][max_bins];
+	int bin_counts[3][max_bins] = {};
+
+	const vec3 centroid_extent = centroid_box.extent();
+	const vec3 scale = vec3(
+		centroid_extent.x > 0.f ? bin_count / centroid_extent.x : 0.f,
+		centroid_extent.y > 0.f ? bin_count / centroid_extent.y : 0.f,
+		centroid_extent.z > 0.f ? bin_count / centroid_extent.z : 0.f);
+
+	// Bin every centroid along all three axes in a single pass
+	for (int i = 0; i < count; ++i) {
+		const build_ref& ref = refs[i];
+		vec3 offset = (ref.centroid - centroid_box.minimum) * scale;
+
+		for (int axis = 0; axis < 3; ++axis) {
+			int bin = std::min(bin_count - 1, int(offset[axis]));
+			bin_boxes[axis][bin].expand(ref.box);
+			++bin_counts[axis][bin];
+		}
+	}
+
+	// Find the cheapest plane, sweeping from the right first to get the cost of everything past each one
+	for (int axis = 0; axis < 3; ++axis) {
+		if (centroid_extent[axis] <= 0.f) continue;
+
+		aabb right_boxes[max_bins];
+		int right_counts[max_bins];
+
+		aabb right_box;
+		int right_count = 0;
+		for (int b = bin_count - 1; b > 0; --b) {
+			right_box.expand(bin_boxes[axis][b]);
+			right_count += bin_counts[axis][b];
+			right_boxes[b] = right_box;
+			right_counts[b] = right_count;
+		}
+
+		aabb left_box;
+		int left_count = 0;
+		for (int b = 1; b < bin_count; ++b) {
+			left_box.expand(bin_boxes[axis][b - 1]);
+			left_count += bin_counts[axis][b - 1];
+
+			if (left_count == 0 || right_counts[b] == 0) continue;
+
+			float cost = left_box.surface_area() * left_count + right_boxes[b].surface_area() * right_counts[b];
+			if (cost < best.cost) {
+				best.cost = cost;
+				best.axis = axis;
+				best.bin = b;
+				best.spatial = false;
+				best.position = centroid_box.minimum[axis] + b / scale[axis];
+				best.left_box = left_box;
+				best.right_box = right_boxes[b];
+			}
+		}
+	}
+}
+
+// Partition refs on the bin of their centroid, returns the first index on the right
+int bvh::partition_object_split(build_ref* refs, int count, const aabb& centroid_box, const split_candidate& split) const {
+	const int bin_count = std::min(std::max(options.bin_count, 2), max_bins);
+	const int axis = split.axis;
+	const int split_bin = split.bin;
+	const float axis_min = centroid_box.minimum[axis];
+	const float axis_extent = centroid_box.extent()[axis];
+	const float axis_scale = bin_count / axis_extent;
+
+	build_ref* middle = std::partition(refs, refs + count,
+		[axis, split_bin, bin_count, axis_scale, axis_min](const build_ref& ref) {
+			int bin = std::min(bin_count - 1, int((ref.centroid[axis] - axis_min) * axis_scale));
+			return bin < split_bin;
+		});
+
+	return int(middle - refs);
+}
+
+// Split on the median centroid of the longest axis, returns the first index on the right
+int bvh::partition_median(build_ref* refs, int count, const aabb& centroid_box) const {
+	int mid = count / 2;
+	int axis = centroid_box.longest_axis();
+	std::nth_element(refs, refs + mid, refs + count,
+		[axis](const build_ref& a, const build_ref& b) { return a.centroid[axis] < b.centroid[axis]; });
+
+	return mid;
+}
+
+void bvh::build_recursive(build_state& state, thread_pool& pool, int node_index, int begin, int end, int depth) const {
+	build_node& node = state.nodes[node_index];
+	const int count = end - begin;
+	build_ref* refs = state.refs.data() + begin;
+
+	aabb centroid_box;
+	node.box = aabb();
+	for (int i = 0; i < count; ++i) {
+		node.box.expand(refs[i].box);
+		centroid_box.expand(refs[i].centroid);
+	}
+
+	auto make_leaf = [&] {
+		node.first = begin;
+		node.count = count;
+	};
+
+	if (count == 1) {
+		make_leaf();
+		return;
+	}
+
+	split_candidate split;
+	find_object_split(refs, count, centroid_box, split);
+
+	const float leaf_cost = options.intersection_cost * count;
+	const float split_cost = options.traversal_cost + options.intersection_cost * split.cost / node.box.surface_area();
+
+	int mid;
+	if (split.axis == -1 || depth >= max_depth / 2) {
+		// Every centroid is in the same place, or the tree is deep enough that median splits must bound the stack
+		if (count <= options.max_leaf_size) {
+			make_leaf();
+			return;
+		}
+
+		mid = begin + partition_median(refs, count, centroid_box);
+	}
+	else {
+		if (split_cost >= leaf_cost && count <= options.max_leaf_size) {
+			make_leaf();
+			return;
+		}
+
+		mid = begin + partition_object_split(refs, count, centroid_box, split);
+	}
+
+	int left = state.node_count.fetch_add(2);
+	node.children[0] = left;
+	node.children[1] = left + 1;
+	node.count = 0;
+
+	// Hand large subtrees to the pool, the rest of the work stays on this thread
+	if (mid - begin >= options.task_threshold) {
+		pool.QueueJob([this, &state, &pool, left, begin, mid, depth] {
+			build_recursive(state, pool, left, begin, mid, depth + 1);
+		});
+	}
+	else {
+		build_recursive(state, pool, left, begin, mid, depth + 1);
+	}
+
+	build_recursive(state, pool, left + 1, mid, end, depth + 1);
+}
+
+// Bounds of the part of a reference between two planes, clipped against the primitive itself where it supports it
+aabb bvh::clip_ref(const build_ref& ref, const hittable_list& list, int axis, float min, float max) {
+	aabb clipped;
+	if (!list.objects[ref.index]->clipped_box(axis, min, max, clipped)) {
+		clipped = ref.box;
+		clipped.minimum[axis] = std::max(clipped.minimum[axis], min);
+		clipped.maximum[axis] = std::min(clipped.maximum[axis], max);
+	}
+
+	clipped.minimum = glm::max(clipped.minimum, ref.box.minimum);
+	clipped.maximum = glm::min(clipped.maximum, ref.box.maximum);
+	return clipped;
+}
+
+void bvh::find_spatial_split(const std::vector<build_ref>& refs, const hittable_list& list, const aabb& node_box, split_candidate& best) const {
+	const int bin_count = std::min(std::max(options.bin_count, 2), max_bins);
+
+	for (int axis = 0; axis < 3; ++axis) {
+		const float axis_min = node_box.minimum[axis];
+		const float bin_width = node_box.extent()[axis] / bin_count;
+		if (bin_width <= 0.f) continue;
+
+		aabb bin_boxes[max_bins];
+		int entries[max_bins] = {};
+		int exits[max_bins] = {};
+
+		auto bin_of = [axis_min, bin_width, bin_count](float x) {
+			return std::min(bin_count - 1, std::max(0, int((x - axis_min) / bin_width)));
+		};
+
+		// Chop every reference into the bins it overlaps
+		for (const build_ref& ref : refs) {
+			int first = bin_of(ref.box.minimum[axis]);
+			int last = bin_of(ref.box.maximum[axis]);
+
+			for (int b = first; b <= last; ++b) {
+				float lo = axis_min + b * bin_width;
+				float hi = (b == bin_count - 1) ? node_box.maximum[axis] : lo + bin_width;
+
+				aabb clipped = (first == last) ? ref.box : clip_ref(ref, list, axis, lo, hi);
+				if (!clipped.is_empty()) bin_boxes[b].expand(clipped);
+			}
+
+			++entries[first];
+			++exits[last];
+		}
+
+		aabb right_boxes[max_bins];
+		int right_counts[max_bins];
+
+		aabb right_box;
+		int right_count = 0;
+		for (int b = bin_count - 1; b > 0; --b) {
+			right_box.expand(bin_boxes[b]);
+			right_count += exits[b];
+			right_boxes[b] = right_box;
+			right_counts[b] = right_count;
+		}
+
+		aabb left_box;
+		int left_count = 0;
+		for (int b = 1; b < bin_count; ++b) {
+			left_box.expand(bin_boxes[b - 1]);
+			left_count += entries[b - 1];
+
+			if (left_count == 0 || right_counts[b] == 0) continue;
+
+			float cost = left_box.surface_area() * left_count + right_boxes[b].surface_area() * right_counts[b];
+			if (cost < best.cost) {
+				best.cost = cost;
+				best.axis = axis;
+				best.bin = b;
+				best.spatial = true;
+				best.position = axis_min + b * bin_width;
+				best.left_box = left_box;
+				best.right_box = right_boxes[b];
+			}
+		}
+	}
+}
+
+void bvh::build_spatial(build_state& state, const hittable_list& list, thread_pool& pool, int node_index, std::vector<build_ref> refs, int depth) const {
+	build_node& node = state.nodes[node_index];
+	const int count = int(refs.size());
+
+	aabb centroid_box;
+	node.box = aabb();
+	for (const build_ref& ref : refs) {
+		node.box.expand(ref.box);
+		centroid_box.expand(ref.centroid);
+	}
+
+	auto make_leaf = [&] {
+		std::lock_guard<std::mutex> lock(state.leaf_mutex);
+		node.first = int(state.leaf_refs.size());
+		node.count = count;
+		state.leaf_refs.insert(state.leaf_refs.end(), refs.begin(), refs.end());
+	};
+
+	if (count == 1) {
+		make_leaf();
+		return;
+	}
+
+	split_candidate split;
+	find_object_split(refs.data(), count, centroid_box, split);
+
+	// Spatial splits only pay off where the object split children overlap noticeably (Stich et al. 2009)
+	const float node_area = node.box.surface_area();
+	if (split.axis != -1 && depth < max_depth / 2) {
+		aabb overlap(glm::max(split.left_box.minimum, split.right_box.minimum), glm::min(split.left_box.maximum, split.right_box.maximum));
+		if (overlap.surface_area() > options.spatial_split_alpha * state.root_area) {
+			find_spatial_split(refs, list, node.box, split);
+		}
+	}
+
+	const float leaf_cost = options.intersection_cost * count;
+	const float split_cost = options.traversal_cost + options.intersection_cost * split.cost / node_area;
+
+	std::vector<build_ref> left_refs;
+	std::vector<build_ref> right_refs;
+
+	if (split.axis == -1 || depth >= max_depth / 2) {
+		if (count <= options.max_leaf_size) {
+			make_leaf();
+			return;
+		}
+
+		int mid = partition_median(refs.data(), count, centroid_box);
+		left_refs.assign(refs.begin(), refs.begin() + mid);
+		right_refs.assign(refs.begin() + mid, refs.end());
+	}
+	else if (split_cost >= leaf_cost && count <= options.max_leaf_size) {
+		make_leaf();
+		return;
+	}
+	else if (split.spatial) {
+		const int axis = split.axis;
+		const float position = split.position;
+		aabb left_box = split.left_box;
+		aabb right_box = split.right_box;
+		int left_count = 0;
+		int right_count = 0;
+
+		for (const build_ref& ref : refs) {
+			if (ref.box.maximum[axis] <= position) ++left_count;
+			else if (ref.box.minimum[axis] >= position) ++right_count;
+			else {
+				++left_count;
+				++right_count;
+			}
+		}
+
+		for (const build_ref& ref : refs) {
+			if (ref.box.maximum[axis] <= position) {
+				left_refs.push_back(ref);
+				continue;
+			}
+			if (ref.box.minimum[axis] >= position) {
+				right_refs.push_back(ref);
+				continue;
+			}
+
+			// Keep straddling references whole when that is cheaper than splitting them
+			const float split_sah = left_box.surface_area() * left_count + right_box.surface_area() * right_count;
+			const float left_sah = surrounding_box(left_box, ref.box).surface_area() * left_count + right_box.surface_area() * (right_count - 1);
+			const float right_sah = left_box.surface_area() * (left_count - 1) + surrounding_box(right_box, ref.box).surface_area() * right_count;
+
+			// Duplicates are only allowed while the reference budget lasts
+			bool can_split = state.ref_count.fetch_add(1) < state.max_refs;
+			if (!can_split) state.ref_count.fetch_sub(1);
+
+			if (!can_split || left_sah < split_sah || right_sah < split_sah) {
+				if (can_split) state.ref_count.fetch_sub(1);
+
+				if (left_sah <= right_sah) {
+					left_box.expand(ref.box);
+					--right_count;
+					left_refs.push_back(ref);
+				}
+				else {
+					right_box.expand(ref.box);
+					--left_count;
+					right_refs.push_back(ref);
+				}
+				continue;
+			}
+
+			build_ref left_part = ref;
+			build_ref right_part = ref;
+			left_part.box = clip_ref(ref, list, axis, -infinity, position);
+			right_part.box = clip_ref(ref, list, axis, position, infinity);
+			left_part.centroid = left_part.box.centroid();
+			right_part.centroid = right_part.box.centroid();
+
+			left_refs.push_back(left_part);
+			right_refs.push_back(right_part);
+		}
+
+		// Unsplitting everything can empty a side, fall back to the median
+		if (left_refs.empty() || right_refs.empty()) {
+			refs.clear();
+			refs.insert(refs.end(), left_refs.begin(), left_refs.end());
+			refs.insert(refs.end(), right_refs.begin(), right_refs.end());
+
+			int mid = partition_median(refs.data(), int(refs.size()), centroid_box);
+			left_refs.assign(refs.begin(), refs.begin() + mid);
+			right_refs.assign(refs.begin() + mid, refs.end());
+		}
+	}
+	else {
+		int mid = partition_object_split(refs.data(), count, centroid_box, split);
+		left_refs.assign(refs.begin(), refs.begin() + mid);
+		right_refs.assign(refs.begin() + mid, refs.end());
+	}
+
+	refs.clear();
+	refs.shrink_to_fit();
+
+	int left = state.node_count.fetch_add(2);
+	node.children[0] = left;
+	node.children[1] = left + 1;
+	node.count = 0;
+
+	if (int(left_refs.size()) >= options.task_threshold) {
+		auto moved_refs = std::make_shared<std::vector<build_ref>>(std::move(left_refs));
+		pool.QueueJob([this, &state, &list, &pool, left, moved_refs, depth] {
+			build_spatial(state, list, pool, left, std::move(*moved_refs), depth + 1);
+		});
+	}
+	else {
+		build_spatial(state, list, pool, left, std::move(left_refs), depth + 1);
+	}
+
+	build_spatial(state, list, pool, left + 1, std::move(right_refs), depth + 1);
+}
+
+void bvh::build_linear(build_state& state, thread_pool& pool) const {
+	const int n = int(state.refs.size());
+
+	if (n == 1) {
+		state.nodes[0].box = state.refs[0].box;
+		state.nodes[0].first = 0;
+		state.nodes[0].count = 1;
+		return;
+	}
+
+	aabb centroid_box;
+	for (const build_ref& ref : state.refs) {
+		centroid_box.expand(ref.centroid);
+	}
+
+	const vec3 extent = centroid_box.extent();
+	const vec3 inv_extent = vec3(
+		extent.x > 0.f ? 1.f / extent.x : 0.f,
+		extent.y > 0.f ? 1.f / extent.y : 0.f,
+		extent.z > 0.f ? 1.f / extent.z : 0.f);
+
+	const int chunk_size = std::max(1024, n / int(4 * std::max(1u, pool.ThreadCount())));
+	auto parallel_for = [&pool, chunk_size](int count, const std::function<void(int, int)>& body) {
+		for (int chunk_s = 0; chunk_s < count; chunk_s += chunk_size) {
+			int chunk_f = std::min(chunk_s + chunk_size, count);
+			pool.QueueJob([&body, chunk_s, chunk_f] { body(chunk_s, chunk_f); });
+		}
+		pool.Wait();
+	};
+
+	std::vector<uint64_t> codes(n);
+	std::vector<int> order(n);
+	const bool wide_codes = (options.morton_bits > 30);
+	parallel_for(n, [&](int s, int f) {
+		for (int i = s; i < f; ++i) {
+			vec3 p = (state.refs[i].centroid - centroid_box.minimum) * inv_extent;
+			codes[i] = wide_codes ? morton_code_63(p) : morton_code_30(p);
+			order[i] = i;
+		}
+	});
+
+	parallel_radix_sort(codes, order, wide_codes ? 63 : 30, pool);
+
+	std::vector<build_ref> sorted_refs(n);
+	parallel_for(n, [&](int s, int f) {
+		for (int i = s; i < f; ++i) sorted_refs[i] = state.refs[order[i]];
+	});
+	state.refs.swap(sorted_refs);
+
+	// Internal nodes take indices [0, n - 1) with the root first, leaves take [n - 1, 2n - 1)
+	const int leaf_base = n - 1;
+	std::vector<int> parents(2 * n - 1, -1);
+
+	// Length of the common prefix of two sorted codes, duplicates are told apart by their index
+	auto delta = [&codes, n](int i, int j) {
+		if (j < 0 || j >= n) return -1;
+		if (codes[i] == codes[j]) return 64 + count_leading_zeros(uint64_t(i ^ j));
+		return count_leading_zeros(codes[i] ^ codes[j]);
+	};
+
+	// Every internal node finds its own range and split independently (Karras 2012)
+	parallel_for(n - 1, [&](int s, int f) {
+		for (int i = s; i < f; ++i) {
+			int d = (delta(i, i + 1) - delta(i, i - 1)) > 0 ? 1 : -1;
+
+			int delta_min = delta(i, i - d);
+			int l_max = 2;
+			while (delta(i, i + l_max * d) > delta_min) l_max *= 2;
+
+			int l = 0;
+			for (int t = l_max / 2; t >= 1; t /= 2) {
+				if (delta(i, i + (l + t) * d) > delta_min) l += t;
+			}
+			int j = i + l * d;
+
+			int delta_node = delta(i, j);
+			int split = 0;
+			int t = l;
+			do {
+				t = (t + 1) / 2;
+				if (delta(i, i + (split + t) * d) > delta_node) split += t;
+			} while (t > 1);
+			int gamma = i + split * d + std::min(d, 0);
+
+			build_node& node = state.nodes[i];
+			node.children[0] = (std::min(i, j) == gamma) ? leaf_base + gamma : gamma;
+			node.children[1] = (std::max(i, j) == gamma + 1) ? leaf_base + gamma + 1 : gamma + 1;
+			node.count = 0;
+
+			parents[node.children[0]] = i;
+			parents[node.children[1]] = i;
+		}
+	});
+
+	for (int i = 0; i < n; ++i) {
+		build_node& leaf = state.nodes[leaf_base + i];
+		leaf.first = i;
+		leaf.count = 1;
+	}
+	state.node_count = 2 * n - 1;
+
+	// Walk up from every leaf, the second child to arrive at a node finishes its bounds
+	std::vector<std::atomic<int>> arrivals(n - 1);
+	for (auto& arrival : arrivals) arrival = 0;
+
+	std::vector<float> costs(2 * n - 1);
+	parallel_for(n, [&](int s, int f) {
+		for (int i = s; i < f; ++i) {
+			int node_index = leaf_base + i;
+			state.nodes[node_index].box = state.refs[i].box;
+			costs[node_index] = options.intersection_cost * state.nodes[node_index].box.surface_area();
+
+			int parent = parents[node_index];
+			while (parent != -1 && arrivals[parent].fetch_add(1, std::memory_order_acq_rel) == 1) {
+				build_node& node = state.nodes[parent];
+				node.box = surrounding_box(state.nodes[node.children[0]].box, state.nodes[node.children[1]].box);
+				costs[parent] = options.traversal_cost * node.box.surface_area() + costs[node.children[0]] + costs[node.children[1]];
+
+				if (options.optimize_treelets) {
+					optimize_treelet(state, costs, parent);
+				}
+
+				parent = parents[parent];
+			}
+		}
+	});
+}
+
+void bvh::optimize_treelet(build_state& state, std::vector<float>& costs, int root) const {
+	const int max_leaves = std::min(std::max(options.treelet_size, 3), 8);
+
+	// Grow the treelet by opening the largest leaf until it is full
+	int leaves[8] = { state.nodes[root].children[0], state.nodes[root].children[1] };
+	int interior[8] = { root };
+	int leaf_count = 2;
+	int interior_count = 1;
+
+	while (leaf_count < max_leaves) {
+		int largest = -1;
+		float largest_area = -1.f;
+		for (int i = 0; i < leaf_count; ++i) {
+			const build_node& node = state.nodes[leaves[i]];
+			if (node.count == 0 && node.box.surface_area() > largest_area) {
+				largest = i;
+				largest_area = node.box.surface_area();
+			}
+		}
+		if (largest == -1) break;
+
+		const build_node& opened = state.nodes[leaves[largest]];
+		interior[interior_count++] = leaves[largest];
+		leaves[largest] = opened.children[0];
+		leaves[leaf_count++] = opened.children[1];
+	}
+
+	if (leaf_count < 3) return;
+
+	// Optimal topology over every subset of the treelet leaves (Karras and Aila 2013)
+	const int subset_count = 1 << leaf_count;
+	aabb boxes[256];
+	float best_costs[256];
+	int best_partitions[256];
+
+	for (int subset = 1; subset < subset_count; ++subset) {
+		boxes[subset] = aabb();
+		for (int i = 0; i < leaf_count; ++i) {
+			if (subset & (1 << i)) boxes[subset].expand(state.nodes[leaves[i]].box);
+		}
+	}
+
+	for (int subset = 1; subset < subset_count; ++subset) {
+		if ((subset & (subset - 1)) == 0) {
+			int i = 0;
+			while (!(subset & (1 << i))) ++i;
+			best_costs[subset] = costs[leaves[i]];
+			continue;
+		}
+
+		// Only partitions holding the lowest leaf are tried, the rest are mirror images
+		int lowest = subset & -subset;
+		float best = infinity;
+		int best_partition = 0;
+		for (int partition = (subset - 1) & subset; partition > 0; partition = (partition - 1) & subset) {
+			if (!(partition & lowest)) continue;
+
+			float cost = best_costs[partition] + best_costs[subset ^ partition];
+			if (cost < best) {
+				best = cost;
+				best_partition = partition;
+			}
+		}
+
+		best_costs[subset] = options.traversal_cost * boxes[subset].surface_area() + best;
+		best_partitions[subset] = best_partition;
+	}
+
+	const int full_set = subset_count - 1;
+	if (best_costs[full_set] >= costs[root] * 0.999f) return;
+
+	// Rebuild the treelet top down, reusing its interior nodes with the root kept in place
+	int next_interior = 1;
+	std::function<int(int)> rebuild = [&](int subset) -> int {
+		if ((subset & (subset - 1)) == 0) {
+			int i = 0;
+			while (!(subset & (1 << i))) ++i;
+			return leaves[i];
+		}
+
+		int node_index = (subset == full_set) ? root : interior[next_interior++];
+		int partition = best_partitions[subset];
+		int left = rebuild(partition);
+		int right = rebuild(subset ^ partition);
+
+		build_node& node = state.nodes[node_index];
+		node.children[0] = left;
+		node.children[1] = right;
+		node.count = 0;
+		node.box = boxes[subset];
+		costs[node_index] = best_costs[subset];
+		return node_index;
+	};
+
+	rebuild(full_set);
+}
+
+// Returns the depth of the flattened subtree
+int bvh::flatten(const build_state& state, const hittable_list& list, int node_index) {
+	const build_node& source = state.nodes[node_index];
+
+	int index = int(nodes.size());
+	nodes.push_back(bvh_node());
+	nodes[index].box = source.box;
+
+	if (source.count > 0) {
+		nodes[index].offset = int(primitives.size());
+		nodes[index].count = source.count;
+
+		for (int i = source.first; i < source.first + source.count; ++i) {
+			primitives.push_back(list.objects[state.refs[i].index]);
+			primitive_indices.push_back(state.refs[i].index);
+		}
+
+		return 1;
+	}
+
+	nodes[index].count = 0;
+	int left_depth = flatten(state, list, source.children[0]);
+	nodes[index].offset = int(nodes.size());
+	int right_depth = flatten(state, list, source.children[1]);
+
+	return 1 + std::max(left_depth, right_depth);
+}
+
+void bvh::prepare_kernel_data() {
+	const size_t n = primitives.size();
+	const size_t stride = n + kernel_triangle_padding;
+	triangle_flags.assign(n, 0);
+	triangle_data.assign(9 * stride, 0.f);
+	triangle_count = 0;
+
+	for (size_t i = 0; i < n; ++i) {
+		const triangle* tri = dynamic_cast<const triangle*>(primitives[i]);
+		if (tri == nullptr) continue;
+
+		vec3 e1 = tri->p[1] - tri->p[0];
+		vec3 e2 = tri->p[2] - tri->p[0];
+		for (int axis = 0; axis < 3; ++axis) {
+			triangle_data[axis * stride + i] = tri->p[0][axis];
+			triangle_data[(3 + axis) * stride + i] = e1[axis];
+			triangle_data[(6 + axis) * stride + i] = e2[axis];
+		}
+
+		triangle_flags[i] = 1;
+		++triangle_count;
+	}
+
+	if (triangle_count == 0) {
+		triangle_flags.clear();
+		triangle_data.clear();
+	}
+}
+
+bool bvh::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	if (nodes.empty()) return false;
+
+	return triangle_count > 0 ? hit_kernel(cpu_kernels(), r, t_min, t_max, rec) : hit_virtual(r, t_min, t_max, rec);
+}
+
+bool bvh::hit_with(const kernel_table& kernels, const ray& r, float t_min, float t_max, hit_record& rec) const {
+	if (nodes.empty()) return false;
+
+	return triangle_count > 0 ? hit_kernel(kernels, r, t_min, t_max, rec) : hit_virtual(r, t_min, t_max, rec);
+}
+
+bool bvh::hit_kernel(const kernel_table& kernels, const ray& r, float t_min, float t_max, hit_record& rec) const {
+	// Primitives other than triangles are hit back here, keeping the record of the latest one
+	struct other_context {
+		const bvh* tree;
+		const ray* r;
+		hit_record rec;
+	};
+
+	other_context context = { this, &r, hit_record() };
+	kernel_hit_callback hit_other = [](void* data, int primitive, float t_min, float t_max, float& t) {
+		other_context& context = *static_cast<other_context*>(data);
+
+		hit_record temp_rec;
+		if (!context.tree->primitives[primitive]->hit(*context.r, t_min, t_max, temp_rec)) return false;
+
+		context.rec = temp_rec;
+		t = temp_rec.t;
+		return true;
+	};
+
+	const size_t stride = primitives.size() + kernel_triangle_padding;
+	const float* data = triangle_data.data();
+
+	kernel_primitives kernel_data = {
+		{ data, data + stride, data + 2 * stride },
+		{ data + 3 * stride, data + 4 * stride, data + 5 * stride },
+		{ data + 6 * stride, data + 7 * stride, data + 8 * stride },
+		triangle_flags.data(),
+		hit_other,
+		&context
+	};
+
+	const vec3 origin = r.origin();
+	const vec3 direction = r.direction();
+	const vec3 inv_direction = 1.f / direction;
+
+	kernel_ray kernel_r = {
+		{ origin.x, origin.y, origin.z },
+		{ direction.x, direction.y, direction.z },
+		{ inv_direction.x, inv_direction.y, inv_direction.z }
+	};
+
+	kernel_hit result;
+	kernel_counters counters = {};
+	bool hit_anything = kernels.traverse(reinterpret_cast<const kernel_node*>(nodes.data()), kernel_data, kernel_r, t_min, t_max, result, counters);
+
+	thread_ray_counters.nodes_visited += counters.nodes_visited;
+	thread_ray_counters.box_tests += counters.box_tests;
+	thread_ray_counters.primitive_tests += counters.primitive_tests;
+
+	if (!hit_anything) return false;
+
+	if (triangle_flags[result.primitive]) {
+		static_cast<const triangle*>(primitives[result.primitive])->set_hit(r, result.t, result.u, result.v, rec);
+	}
+	else {
+		rec = context.rec;
+	}
+	rec.object_id = primitives[result.primitive]->object_id;
+
+	return true;
+}
+
+bool bvh::hit_virtual(const ray& r, float t_min, float t_max, hit_record& rec) const {
+
+	const vec3 origin = r.origin();
+	const vec3 inv_direction = 1.f / r.direction();
+
+	hit_record temp_rec;
+	bool hit_anything = false;
+	float closest_so_far = t_max;
+
+	++thread_ray_counters.box_tests;
+	float t_entry;
+	if (!nodes[0].box.hit(origin, inv_direction, t_min, closest_so_far, t_entry)) return false;
+
+	// Far children wait on the stack with their entry distance so they can be culled later
+	struct stack_entry {
+		int node;
+		float t_entry;
+	};
+
+	stack_entry stack[max_depth];
+	int stack_size = 0;
+	int current = 0;
+	int nodes_visited = 0;
+	int box_tests = 0;
+	int primitive_tests = 0;
+
+	while (true) {
+		const bvh_node& node = nodes[current];
+		++nodes_visited;
+
+		if (node.is_leaf()) {
+			primitive_tests += node.count;
+			for (int i = node.offset; i < node.offset + node.count; ++i) {
+				if (primitives[i]->hit(r, t_min, closest_so_far, temp_rec)) {
+					hit_anything = true;
+					closest_so_far = temp_rec.t;
+					rec = temp_rec;
+					rec.object_id = primitives[i]->object_id;
+				}
+			}
+		}
+		else {
+			int near_child = current + 1;
+			int far_child = node.offset;
+
+			float t_near, t_far;
+			box_tests += 2;
+			bool hit_near = nodes[near_child].box.hit(origin, inv_direction, t_min, closest_so_far, t_near);
+			bool hit_far = nodes[far_child].box.hit(origin, inv_direction, t_min, closest_so_far, t_far);
+
+			if (hit_near && hit_far) {
+				if (t_far < t_near) {
+					std::swap(near_child, far_child);
+					std::swap(t_near, t_far);
+				}
+
+				stack[stack_size++] = { far_child, t_far };
+				current = near_child;
+				continue;
+			}
+			else if (hit_near || hit_far) {
+				current = hit_near ? near_child : far_child;
+				continue;
+			}
+		}
+
+		// Pop the next subtree that could still hold a closer hit
+		current = -1;
+		while (stack_size > 0) {
+			const stack_entry& entry = stack[--stack_size];
+			if (entry.t_entry <= closest_so_far) {
+				current = entry.node;
+				break;
+			}
+		}
+
+		if (current == -1) break;
+	}
+
+	thread_ray_counters.nodes_visited += nodes_visited;
+	thread_ray_counters.box_tests += box_tests;
+	thread_ray_counters.primitive_tests += primitive_tests;
+	return hit_anything;
+}
+
+bool bvh::bounding_box(aabb& output_box) const {
+	if (nodes.empty()) return false;
+
+	output_box = nodes[0].box;
+	return true;
+}
+
+float bvh::sah_cost() const {
+	if (nodes.empty()) return 0.f;
+
+	float root_area = nodes[0].box.surface_area();
+	if (root_area <= 0.f) return 0.f;
+
+	float cost = 0.f;
+	for (const bvh_node& node : nodes) {
+		float relative_area = node.box.surface_area() / root_area;
+		cost += node.is_leaf()
+			? relative_area * node.count * options.intersection_cost
+			: relative_area * options.traversal_cost;
+	}
+
+	return cost;
+}
+
+bool is_well_formed_tree(const bvh_node* nodes, size_t node_count, size_t item_count) {
+	if (node_count == 0) return item_count == 0;
+
+	struct pending {
+		int node;
+		int depth;
+	};
+
+	std::vector<pending> stack = { { 0, 1 } };
+	int64_t expected = 0;
+
+	while (!stack.empty()) {
+		pending current = stack.back();
+		stack.pop_back();
+
+		// Depth first order puts each node right after the subtree before it
+		if (current.node != expected || current.depth >= kernel_max_depth) return false;
+		++expected;
+
+		const bvh_node& node = nodes[current.node];
+		if (node.count > 0) {
+			if (node.offset < 0 || int64_t(node.offset) + node.count > int64_t(item_count)) return false;
+			continue;
+		}
+
+		if (node.count < 0 || node.offset <= current.node + 1 || int64_t(node.offset) >= int64_t(node_count)) return false;
+		stack.push_back({ node.offset, current.depth + 1 });
+		stack.push_back({ current.node + 1, current.depth + 1 });
+	}
+
+	return expected == int64_t(node_count);
+}
+
+bool bvh::is_well_formed() const {
+	return is_well_formed_tree(nodes.data(), nodes.size(), primitives.size());
+}
+
+// Children always follow their parent, so walking a range backwards sees them first
+void bvh::refit_range(int first, int last) {
+	for (int i = last - 1; i >= first; --i) {
+		bvh_node& node = nodes[i];
+
+		if (node.is_leaf()) {
+			aabb box;
+			aabb primitive_box;
+			for (int p = node.offset; p < node.offset + node.count; ++p) {
+				primitives[p]->bounding_box(primitive_box);
+				box.expand(primitive_box);
+			}
+			node.box = box;
+		}
+		else {
+			node.box = surrounding_box(nodes[i + 1].box, nodes[node.offset].box);
+		}
+	}
+}
+
+void bvh::refit(thread_pool& pool) {
+	if (nodes.empty()) return;
+
+	// Split the top of the tree into whole subtrees, which are contiguous in depth first order
+	const int target_subtrees = int(8 * std::max(1u, pool.ThreadCount()));
+	std::vector<int> top_nodes;
+	std::vector<int> subtrees = { 0 };
+
+	while (int(subtrees.size()) < target_subtrees) {
+		std::vector<int> next;
+		for (int node : subtrees) {
+			if (nodes[node].is_leaf()) {
+				next.push_back(node);
+			}
+			else {
+				top_nodes.push_back(node);
+				next.push_back(node + 1);
+				next.push_back(nodes[node].offset);
+			}
+		}
+
+		if (next.size() == subtrees.size()) break;
+		subtrees.swap(next);
+	}
+
+	for (int root : subtrees) {
+		int last = root;
+		while (!nodes[last].is_leaf()) last = nodes[last].offset;
+
+		pool.QueueJob([this, root, last] { refit_range(root, last + 1); });
+	}
+	pool.Wait();
+
+	// The remaining interior nodes only need their children merged
+	std::sort(top_nodes.begin(), top_nodes.end(), std::greater<int>());
+	for (int i : top_nodes) {
+		nodes[i].box = surrounding_box(nodes[i + 1].box, nodes[nodes[i].offset].box);
+	}
+
+	prepare_kernel_data();
+}
+
+bool bvh::update(const hittable_list& list, thread_pool& pool, float rebuild_threshold) {
+	refit(pool);
+
+	if (sah_cost() <= built_sah_cost * rebuild_threshold) {
+		return false;
+	}
+
+	// The tree keeps the id its owner gave it
+	const int id = object_id;
+	*this = bvh(list, pool, options);
+	object_id = id;
+	return true;
+}
\ No newline at end of file
@@ -17,9 +17,9 @@ int* get_RGB(glm::vec3 pixel_color, int samples_per_pixel) {
 	g = sqrtf(scale * g);
 	b = sqrtf(scale * b);
 
-	RGB[0] = unsigned char(256 * clamp(r, 0.f, 0.999f));
-	RGB[1] = unsigned char(256 * clamp(g, 0.f, 0.999f));
-	RGB[2] = unsigned char(256 * clamp(b, 0.f, 0.999f));
+	RGB[0] = static_cast<unsigned char>(256 * clamp(r, 0.f, 0.999f));
+	RGB[1] = static_cast<unsigned char>(256 * clamp(g, 0.f, 0.999f));
+	RGB[2] = static_cast<unsigned char>(256 * clamp(b, 0.f, 0.999f));
 
 	return RGB;
 }
@@ -30,6 +30,8 @@ void write_color(std::ostream& out, glm::vec3 pixel_color, int samples_per_pixel
 	out << RGB[0] << ' '
 		<< RGB[1] << ' '
 		<< RGB[2] << '\n';
+
+	delete[] RGB;
 }
 
 void write_color(unsigned char* data, glm::vec3 pixel_color, int samples_per_pixel) {
@@ -38,4 +40,6 @@ void write_color(unsigned char* data, glm::vec3 pixel_color, int samples_per_pix
 	data[0] = RGB[0];
 	data[1] = RGB[1];
 	data[2] = RGB[2];
+
+	delete[] RGB;
 }
\ No newline at end of file
@@ -0,0 +1,475 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "aabb.h"
+#include "arena.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "mesh.h"
+#include "morton.h"
+#include "telemetry.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Unit vector folded onto an octahedron and unfolded into a square (Meyer et al. 2010), 16 bits a component
+inline uint32_t encode_octahedral(const vec3& n) {
+	float sum = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	vec3 a = sum > 0.f ? n / sum : vec3(0.f, 0.f, 1.f);
+
+	float u = a.x;
+	float v = a.y;
+	if (a.z < 0.f) {
+		u = (1.f - std::abs(a.y)) * (a.x >= 0.f ? 1.f : -1.f);
+		v = (1.f - std::abs(a.x)) * (a.y >= 0.f ? 1.f : -1.f);
+	}
+
+	auto to_snorm = [](float x) { return uint32_t(int32_t(std::round(glm::clamp(x, -1.f, 1.f) * 32767.f)) & 0xffff); };
+	return to_snorm(u) | (to_snorm(v) << 16);
+}
+
+inline vec3 decode_octahedral(uint32_t encoded) {
+	vec3 n(float(int16_t(encoded & 0xffff)) / 32767.f, float(int16_t(encoded >> 16)) / 32767.f, 0.f);
+	n.z = 1.f - std::abs(n.x) - std::abs(n.y);
+
+	if (n.z < 0.f) {
+		float x = n.x;
+		n.x = (1.f - std::abs(n.y)) * (x >= 0.f ? 1.f : -1.f);
+		n.y = (1.f - std::abs(x)) * (n.y >= 0.f ? 1.f : -1.f);
+	}
+
+	return normalize(n);
+}
+
+// A run of nearby triangles with their own small vertex list. Positions are stored on one grid for the whole mesh,
+// as offsets from the cluster's corner, so a vertex shared by two clusters decodes to the same point in both.
+struct mesh_cluster {
+	int64_t base[3];			// Grid cell of the cluster's corner, wide meshes on a fine grid pass 2^31 cells
+	uint32_t first_vertex;
+	uint32_t first_triangle;
+	uint8_t vertex_count;
+	uint8_t triangle_count;
+};
+
+// Positions of a cluster's vertices, first_vertex indexes whichever of the two position arrays the bits select
+inline void decode_cluster_positions(const mesh_cluster& cluster, int bits, const uint16_t* positions16, const uint64_t* positions21,
+	const double* grid_origin, double grid_step, vec3* out)
+{
+	for (int i = 0; i < cluster.vertex_count; ++i) {
+		const size_t vertex = cluster.first_vertex + i;
+
+		uint32_t q[3];
+		if (bits == 16) {
+			for (int k = 0; k < 3; ++k) q[k] = positions16[3 * vertex + k];
+		}
+		else {
+			const uint64_t packed = positions21[vertex];
+			for (int k = 0; k < 3; ++k) q[k] = uint32_t(packed >> (21 * k)) & 0x1fffff;
+		}
+
+		// Whole grid cells in double, so the same cell always gives the same float
+		for (int k = 0; k < 3; ++k) {
+			out[i][k] = float(grid_origin[k] + double(cluster.base[k] + q[k]) * grid_step);
+		}
+	}
+}
+
+const int max_cluster_triangles = 16;
+
+// Closest of a decoded cluster's triangles that is nearer than closest, or -1. The triangles are gathered into one
+// array per component, then tested without branches like the kernels' leaf loop.
+inline int intersect_cluster(const vec3* p, const uint8_t* tri, int count, const vec3& origin, const vec3& d, float t_min,
+	float& closest, float& hit_u, float& hit_v)
+{
+	float tri_p0[3][max_cluster_triangles];
+	float tri_e1[3][max_cluster_triangles];
+	float tri_e2[3][max_cluster_triangles];
+	int hits[max_cluster_triangles];
+	float ts[max_cluster_triangles];
+	float us[max_cluster_triangles];
+	float vs[max_cluster_triangles];
+
+	for (int i = 0; i < count; ++i) {
+		const vec3& p0 = p[tri[3 * i]];
+		const vec3 e1 = p[tri[3 * i + 1]] - p0;
+		const vec3 e2 = p[tri[3 * i + 2]] - p0;
+		for (int k = 0; k < 3; ++k) {
+			tri_p0[k][i] = p0[k];
+			tri_e1[k][i] = e1[k];
+			tri_e2[k][i] = e2[k];
+		}
+	}
+
+	for (int i = 0; i < count; ++i) {
+		float T[3] = { origin.x - tri_p0[0][i], origin.y - tri_p0[1][i], origin.z - tri_p0[2][i] };
+		float e1[3] = { tri_e1[0][i], tri_e1[1][i], tri_e1[2][i] };
+		float e2[3] = { tri_e2[0][i], tri_e2[1][i], tri_e2[2][i] };
+
+		float P[3] = { d.y * e2[2] - e2[1] * d.z, d.z * e2[0] - e2[2] * d.x, d.x * e2[1] - e2[0] * d.y };
+		float Q[3] = { T[1] * e1[2] - e1[1] * T[2], T[2] * e1[0] - e1[2] * T[0], T[0] * e1[1] - e1[0] * T[1] };
+		float Pe1 = P[0] * e1[0] + P[1] * e1[1] + P[2] * e1[2];
+
+		float t = (Q[0] * e2[0] + Q[1] * e2[1] + Q[2] * e2[2]) / Pe1;
+		float u = (P[0] * T[0] + P[1] * T[1] + P[2] * T[2]) / Pe1;
+		float v = (Q[0] * d.x + Q[1] * d.y + Q[2] * d.z) / Pe1;
+
+		hits[i] = (Pe1 != 0.f) & !(u < 0.f) & !(v < 0.f) & !(u + v > 1.f) & !(t < t_min);
+		ts[i] = t;
+		us[i] = u;
+		vs[i] = v;
+	}
+
+	int hit_triangle = -1;
+	for (int i = 0; i < count; ++i) {
+		if (!hits[i] || closest < ts[i]) continue;
+
+		closest = ts[i];
+		hit_u = us[i];
+		hit_v = vs[i];
+		hit_triangle = i;
+	}
+
+	return hit_triangle;
+}
+
+// Near child first walk of a flat tree like bvh::hit_virtual. leaf is called with each leaf the ray reaches and may
+// lower closest, which prunes the rest of the walk.
+template <class Leaf>
+void walk_cluster_tree(const bvh_node* nodes, const vec3& origin, const vec3& inv_direction, float t_min, const float& closest,
+	int& nodes_visited, int& box_tests, Leaf&& leaf)
+{
+	float t_entry;
+	++box_tests;
+	if (!nodes[0].box.hit(origin, inv_direction, t_min, closest, t_entry)) return;
+
+	struct stack_entry {
+		int node;
+		float t_entry;
+	};
+
+	stack_entry stack[kernel_max_depth];
+	int stack_size = 0;
+	int current = 0;
+
+	while (true) {
+		const bvh_node& node = nodes[current];
+		++nodes_visited;
+
+		if (node.is_leaf()) {
+			leaf(node);
+		}
+		else {
+			int near_child = current + 1;
+			int far_child = node.offset;
+
+			float t_near, t_far;
+			box_tests += 2;
+			bool hit_near = nodes[near_child].box.hit(origin, inv_direction, t_min, closest, t_near);
+			bool hit_far = nodes[far_child].box.hit(origin, inv_direction, t_min, closest, t_far);
+
+			if (hit_near && hit_far) {
+				if (t_far < t_near) {
+					std::swap(near_child, far_child);
+					std::swap(t_near, t_far);
+				}
+
+				stack[stack_size++] = { far_child, t_far };
+				current = near_child;
+				continue;
+			}
+			else if (hit_near || hit_far) {
+				current = hit_near ? near_child : far_child;
+				continue;
+			}
+		}
+
+		current = -1;
+		while (stack_size > 0) {
+			const stack_entry& entry = stack[--stack_size];
+			if (entry.t_entry <= closest) {
+				current = entry.node;
+				break;
+			}
+		}
+
+		if (current == -1) break;
+	}
+}
+
+// Stands in for a cluster while the tree over the clusters is built
+class cluster_bounds : public hittable {
+	public:
+		cluster_bounds(const aabb& b) : box(b) {}
+
+		virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override { return false; }
+		virtual bool bounding_box(aabb& output_box) const override {
+			output_box = box;
+			return true;
+		}
+
+	public:
+		aabb box;
+};
+
+// A whole mesh as one primitive, for scans too large to hold as triangles. Triangles are grouped into clusters along
+// a Morton curve, positions are quantized to 16 or 21 bits within each cluster and normals are octahedral, which
+// takes a triangle from about 200 bytes to about 22. Clusters are decoded when the tree over them reaches a leaf.
+class compressed_mesh : public hittable {
+	public:
+		compressed_mesh() {}
+
+		// The pool must already be started
+		compressed_mesh(const mesh& m, const material* mat, int position_bits, thread_pool& pool);
+
+		virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
+
+		size_t triangle_count() const { return indices.size() / 3; }
+		size_t memory_bytes() const;
+
+	public:
+		int bits = 16;
+		double grid_origin[3] = { 0.0, 0.0, 0.0 };
+		double grid_step = 1.0;
+
+		std::vector<bvh_node> nodes;			// Leaves index clusters
+		std::vector<mesh_cluster> clusters;		// In leaf order
+		std::vector<uint16_t> positions16;		// Three a vertex in 16 bit mode
+		std::vector<uint64_t> positions21;		// 21 bits an axis, packed x first, in 21 bit mode
+		std::vector<uint32_t> normals;			// Octahedral, empty for flat shaded meshes
+		std::vector<uint8_t> indices;			// Three cluster vertices a triangle
+		const material* mat_ptr;
+
+	private:
+		void decode_positions(const mesh_cluster& cluster, vec3* out) const {
+			decode_cluster_positions(cluster, bits, positions16.data(), positions21.data(), grid_origin, grid_step, out);
+		}
+};
+
+compressed_mesh::compressed_mesh(const mesh& m, const material* mat, int position_bits, thread_pool& pool) : bits(position_bits == 21 ? 21 : 16), mat_ptr(mat) {
+	const int n = int(m.faces.size());
+	if (n == 0) return;
+
+	// Order the triangles along a Morton curve through their centroids, so each run of them is compact
+	aabb centroid_box;
+	aabb vertex_box;
+	std::vector<vec3> centroids(n);
+	for (int i = 0; i < n; ++i) {
+		const face& f = m.faces[i];
+		centroids[i] = (m.vertices[f.v[0]] + m.vertices[f.v[1]] + m.vertices[f.v[2]]) / 3.f;
+		centroid_box.expand(centroids[i]);
+		for (int k = 0; k < 3; ++k) vertex_box.expand(m.vertices[f.v[k]]);
+	}
+
+	const vec3 centroid_extent = glm::max(centroid_box.extent(), vec3(1e-20f));
+	std::vector<uint64_t> keys(n);
+	std::vector<int> order(n);
+	for (int i = 0; i < n; ++i) {
+		keys[i] = morton_code_63((centroids[i] - centroid_box.minimum) / centroid_extent);
+		order[i] = i;
+	}
+	parallel_radix_sort(keys, order, 63, pool);
+
+	// Consecutive triangles on the curve form the clusters
+	struct cluster_build {
+		int first;
+		int count;
+		aabb box;
+	};
+
+	std::vector<cluster_build> builds;
+	float max_extent = 0.f;
+	for (int first = 0; first < n; first += max_cluster_triangles) {
+		cluster_build build = { first, std::min(max_cluster_triangles, n - first), aabb() };
+		for (int i = first; i < first + build.count; ++i) {
+			const face& f = m.faces[order[i]];
+			for (int k = 0; k < 3; ++k) build.box.expand(m.vertices[f.v[k]]);
+		}
+
+		vec3 extent = build.box.extent();
+		max_extent = std::max(max_extent, std::max(extent.x, std::max(extent.y, extent.z)));
+		builds.push_back(build);
+	}
+
+	// The grid is fine enough for the largest cluster to span the quantized range, with cells to spare for rounding
+	for (int k = 0; k < 3; ++k) grid_origin[k] = vertex_box.minimum[k];
+	grid_step = max_extent > 0.f ? double(max_extent) / double((1 << bits) - 3) : 1.0;
+
+	// The tree over the clusters comes from the usual builder, with one cluster a leaf
+	hittable_list proxies;
+	proxies.arena = make_shared<scene_arena>();
+	const float padding = float(grid_step) + 1e-4f;
+	for (const cluster_build& build : builds) {
+		proxies.add(proxies.arena->make<cluster_bounds>(aabb(build.box.minimum - padding, build.box.maximum + padding)));
+	}
+
+	bvh_build_options options;
+	options.max_leaf_size = 1;
+	bvh tree(proxies, pool, options);
+	nodes = tree.nodes;
+
+	// Clusters, their vertices and their triangles are laid out in the order traversal meets them
+	const uint32_t max_quantized = (1u << bits) - 1;
+	std::vector<int> stamp(m.vertices.size(), -1);			// Cluster that last used each position
+	std::vector<int> local_index(m.vertices.size(), 0);
+	std::vector<int> local_vertices;
+	std::vector<int> local_normals;
+
+	clusters.reserve(builds.size());
+	indices.reserve(size_t(n) * 3);
+
+	for (size_t c = 0; c < tree.primitive_indices.size(); ++c) {
+		const cluster_build& build = builds[tree.primitive_indices[c]];
+		const int cluster_index = int(c);
+
+		mesh_cluster cluster = {};
+		for (int k = 0; k < 3; ++k) {
+			cluster.base[k] = int64_t(std::floor((double(build.box.minimum[k]) - grid_origin[k]) / grid_step));
+		}
+		cluster.first_vertex = uint32_t(positions16.size() / 3 + positions21.size());
+		cluster.first_triangle = uint32_t(indices.size() / 3);
+		cluster.triangle_count = uint8_t(build.count);
+
+		local_vertices.clear();
+		local_normals.clear();
+
+		for (int i = build.first; i < build.first + build.count; ++i) {
+			const face& f = m.faces[order[i]];
+
+			for (int k = 0; k < 3; ++k) {
+				const int v = f.v[k];
+				const int normal_index = m.is_smooth ? f.n[k] : -1;
+
+				// Smooth meshes may pair one position with several normals, those become separate vertices
+				int local = -1;
+				if (stamp[v] == cluster_index && local_normals[local_index[v]] == normal_index) {
+					local = local_index[v];
+				}
+				else if (stamp[v] == cluster_index) {
+					for (int j = 0; j < int(local_vertices.size()) && local < 0; ++j) {
+						if (local_vertices[j] == v && local_normals[j] == normal_index) local = j;
+					}
+				}
+
+				if (local < 0) {
+					local = int(local_vertices.size());
+					local_vertices.push_back(v);
+					local_normals.push_back(normal_index);
+					stamp[v] = cluster_index;
+					local_index[v] = local;
+				}
+
+				indices.push_back(uint8_t(local));
+			}
+		}
+
+		for (size_t j = 0; j < local_vertices.size(); ++j) {
+			const vec3& p = m.vertices[local_vertices[j]];
+
+			uint32_t q[3];
+			for (int k = 0; k < 3; ++k) {
+				int64_t cell = int64_t(std::llround((double(p[k]) - grid_origin[k]) / grid_step)) - cluster.base[k];
+				q[k] = uint32_t(std::min<int64_t>(std::max<int64_t>(cell, 0), max_quantized));
+			}
+
+			if (bits == 16) {
+				for (int k = 0; k < 3; ++k) positions16.push_back(uint16_t(q[k]));
+			}
+			else {
+				positions21.push_back(uint64_t(q[0]) | (uint64_t(q[1]) << 21) | (uint64_t(q[2]) << 42));
+			}
+
+			if (m.is_smooth) normals.push_back(encode_octahedral(normalize(m.normals[local_normals[j]])));
+		}
+
+		cluster.vertex_count = uint8_t(local_vertices.size());
+		clusters.push_back(cluster);
+	}
+
+	positions16.shrink_to_fit();
+	positions21.shrink_to_fit();
+	normals.shrink_to_fit();
+}
+
+bool compressed_mesh::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	if (nodes.empty()) return false;
+
+	const vec3 origin = r.origin();
+	const vec3 d = r.direction();
+	const vec3 inv_direction = 1.f / d;
+
+	float closest_so_far = t_max;
+	int hit_cluster = -1;
+	int hit_triangle = 0;
+	float hit_u = 0.f;
+	float hit_v = 0.f;
+
+	int nodes_visited = 0;
+	int box_tests = 0;
+	int primitive_tests = 0;
+	vec3 p[3 * max_cluster_triangles];
+
+	walk_cluster_tree(nodes.data(), origin, inv_direction, t_min, closest_so_far, nodes_visited, box_tests, [&](const bvh_node& node) {
+		for (int c = node.offset; c < node.offset + node.count; ++c) {
+			const mesh_cluster& cluster = clusters[c];
+			decode_positions(cluster, p);
+			primitive_tests += cluster.triangle_count;
+
+			const uint8_t* tri = &indices[3 * size_t(cluster.first_triangle)];
+			int triangle = intersect_cluster(p, tri, cluster.triangle_count, origin, d, t_min, closest_so_far, hit_u, hit_v);
+			if (triangle >= 0) {
+				hit_cluster = c;
+				hit_triangle = triangle;
+			}
+		}
+	});
+
+	thread_ray_counters.nodes_visited += nodes_visited;
+	thread_ray_counters.box_tests += box_tests;
+	thread_ray_counters.primitive_tests += primitive_tests;
+
+	if (hit_cluster < 0) return false;
+
+	// Only the triangle that was hit needs its normals
+	const mesh_cluster& cluster = clusters[hit_cluster];
+	const uint8_t* tri = &indices[3 * (size_t(cluster.first_triangle) + hit_triangle)];
+
+	vec3 outward_normal;
+	if (normals.empty()) {
+		decode_positions(cluster, p);
+		outward_normal = cross(p[tri[1]] - p[tri[0]], p[tri[2]] - p[tri[0]]);
+	}
+	else {
+		vec3 n0 = decode_octahedral(normals[cluster.first_vertex + tri[0]]);
+		vec3 n1 = decode_octahedral(normals[cluster.first_vertex + tri[1]]);
+		vec3 n2 = decode_octahedral(normals[cluster.first_vertex + tri[2]]);
+		outward_normal = n0 * (1 - hit_u - hit_v) + n1 * hit_u + n2 * hit_v;
+	}
+
+	rec.t = closest_so_far;
+	rec.p = r.at(rec.t);
+
+	rec.set_face_normal(r, normalize(outward_normal));
+	rec.mat_ptr = mat_ptr;
+	return true;
+}
+
+bool compressed_mesh::bounding_box(aabb& output_box) const {
+	if (nodes.empty()) return false;
+
+	output_box = nodes[0].box;
+	return true;
+}
+
+size_t compressed_mesh::memory_bytes() const {
+	return nodes.capacity() * sizeof(bvh_node)
+		+ clusters.capacity() * sizeof(mesh_cluster)
+		+ positions16.capacity() * sizeof(uint16_t)
+		+ positions21.capacity() * sizeof(uint64_t)
+		+ normals.capacity() * sizeof(uint32_t)
+		+ indices.capacity() * sizeof(uint8_t);
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "kernels.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+enum class cpu_isa {
+	generic,
+	sse42,
+	avx2,	// With FMA
+	avx512	// F, VL, BW and DQ
+};
+
+inline const char* cpu_isa_name(cpu_isa isa) {
+	switch (isa) {
+		case cpu_isa::generic: return "generic";
+		case cpu_isa::sse42: return "sse4.2";
+		case cpu_isa::avx2: return "avx2";
+		case cpu_isa::avx512: return "avx512";
+	}
+	return "unknown";
+}
+
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+struct cpuid_registers {
+	uint32_t eax, ebx, ecx, edx;
+};
+
+cpuid_registers cpuid(uint32_t leaf, uint32_t subleaf) {
+	cpuid_registers r = {};
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuidex(info, int(leaf), int(subleaf));
+	r = { uint32_t(info[0]), uint32_t(info[1]), uint32_t(info[2]), uint32_t(info[3]) };
+#else
+	__cpuid_count(leaf, subleaf, r.eax, r.ebx, r.ecx, r.edx);
+#endif
+	return r;
+}
+
+// Register state the OS saves on context switches, only valid once CPUID reports OSXSAVE
+uint64_t xgetbv0() {
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return (uint64_t(edx) << 32) | eax;
+#endif
+}
+#endif
+
+// Best instruction set both the CPU and the OS support
+cpu_isa detect_cpu_isa() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+	const uint32_t max_leaf = cpuid(0, 0).eax;
+	if (max_leaf < 1) return cpu_isa::generic;
+
+	const cpuid_registers leaf1 = cpuid(1, 0);
+	const bool has_sse42 = (leaf1.ecx >> 20) & 1;
+	const bool has_fma = (leaf1.ecx >> 12) & 1;
+	const bool has_osxsave = (leaf1.ecx >> 27) & 1;
+	const bool has_avx = (leaf1.ecx >> 28) & 1;
+
+	if (!has_sse42) return cpu_isa::generic;
+	if (!has_osxsave || !has_avx || max_leaf < 7) return cpu_isa::sse42;
+
+	// XMM and YMM state, then opmask and both halves of ZMM state
+	const uint64_t xcr0 = xgetbv0();
+	const bool os_avx = (xcr0 & 0x6) == 0x6;
+	const bool os_avx512 = (xcr0 & 0xe6) == 0xe6;
+
+	const cpuid_registers leaf7 = cpuid(7, 0);
+	const bool has_avx2 = (leaf7.ebx >> 5) & 1;
+	const bool has_avx512 = ((leaf7.ebx >> 16) & 1) && ((leaf7.ebx >> 17) & 1) && ((leaf7.ebx >> 30) & 1) && ((leaf7.ebx >> 31) & 1);
+
+	if (!os_avx || !has_avx2 || !has_fma) return cpu_isa::sse42;
+	if (!os_avx512 || !has_avx512) return cpu_isa::avx2;
+	return cpu_isa::avx512;
+#else
+	return cpu_isa::generic;
+#endif
+}
+
+// PATHTRACER_ISA=generic|sse4.2|avx2|avx512 caps the detected instruction set, to compare kernels on one machine
+cpu_isa select_cpu_isa() {
+	cpu_isa isa = detect_cpu_isa();
+
+	const char* requested = std::getenv("PATHTRACER_ISA");
+	if (requested == nullptr) return isa;
+
+	for (cpu_isa candidate : { cpu_isa::generic, cpu_isa::sse42, cpu_isa::avx2, cpu_isa::avx512 }) {
+		if (strcmp(requested, cpu_isa_name(candidate)) == 0) {
+			return candidate < isa ? candidate : isa;
+		}
+	}
+
+	return isa;
+}
+
+const kernel_table& kernels_for(cpu_isa isa) {
+	switch (isa) {
+		case cpu_isa::avx512: return avx512_kernels;
+		case cpu_isa::avx2: return avx2_kernels;
+		case cpu_isa::sse42: return sse42_kernels;
+		default: return generic_kernels;
+	}
+}
+
+// Kernels for the selected instruction set, chosen on first use
+const kernel_table& cpu_kernels() {
+	static const kernel_table& table = kernels_for(select_cpu_isa());
+	return table;
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Deflate (RFC 1951) with the fixed Huffman codes and a hash chain match finder, the same kind of compression
+// stb_image_write uses. Parts of a stream are compressed independently and end on a byte boundary, so they can be
+// compressed in parallel and joined in order.
+
+const int deflate_window = 32768;
+
+// Bits are packed least significant first, as deflate reads them
+class deflate_bit_writer {
+	public:
+		deflate_bit_writer(std::vector<unsigned char>& output) : out(output) {}
+
+		void write(uint32_t bits, int count) {
+			buffer |= uint64_t(bits) << bit_count;
+			bit_count += count;
+			while (bit_count >= 8) {
+				out.push_back((unsigned char)(buffer & 0xff));
+				buffer >>= 8;
+				bit_count -= 8;
+			}
+		}
+
+		void align() {
+			if (bit_count > 0) write(0, 8 - bit_count);
+		}
+
+	private:
+		std::vector<unsigned char>& out;
+		uint64_t buffer = 0;
+		int bit_count = 0;
+};
+
+struct deflate_code {
+	uint16_t bits;		// Already reversed, ready for deflate_bit_writer
+	uint8_t length;
+};
+
+// Length symbols 257 to 285 and distance symbols 0 to 29, with their first value and extra bits
+struct deflate_tables {
+	deflate_code literals[288];
+	uint8_t length_symbol[259];			// Indexed by match length
+	uint8_t distance_symbol[deflate_window + 1];
+	uint16_t length_base[29];
+	uint8_t length_extra[29];
+	uint16_t distance_base[30];
+	uint8_t distance_extra[30];
+	deflate_code distances[30];
+};
+
+uint32_t reverse_bits(uint32_t code, int length) {
+	uint32_t reversed = 0;
+	for (int i = 0; i < length; ++i) {
+		reversed = (reversed << 1) | (code & 1);
+		code >>= 1;
+	}
+	return reversed;
+}
+
+const deflate_tables& fixed_deflate_tables() {
+	static const deflate_tables tables = [] {
+		deflate_tables t;
+
+		for (int s = 0; s < 288; ++s) {
+			uint32_t code;
+			int length;
+			if (s < 144) { code = 0x30 + s; length = 8; }
+			else if (s < 256) { code = 0x190 + (s - 144); length = 9; }
+			else if (s < 280) { code = s - 256; length = 7; }
+			else { code = 0xc0 + (s - 280); length = 8; }
+			t.literals[s] = { uint16_t(reverse_bits(code, length)), uint8_t(length) };
+		}
+
+		const uint16_t length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		const uint8_t length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		const uint16_t distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		const uint8_t distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+		std::copy(length_base, length_base + 29, t.length_base);
+		std::copy(length_extra, length_extra + 29, t.length_extra);
+		std::copy(distance_base, distance_base + 30, t.distance_base);
+		std::copy(distance_extra, distance_extra + 30, t.distance_extra);
+
+		for (int s = 0; s < 29; ++s) {
+			int last = s + 1 < 29 ? length_base[s + 1] : 259;
+			for (int length = length_base[s]; length < last; ++length) t.length_symbol[length] = uint8_t(s);
+		}
+
+		for (int s = 0; s < 30; ++s) {
+			int last = s + 1 < 30 ? distance_base[s + 1] : deflate_window + 1;
+			for (int distance = distance_base[s]; distance < last; ++distance) t.distance_symbol[distance] = uint8_t(s);
+			t.distances[s] = { uint16_t(reverse_bits(s, 5)), 5 };
+		}
+
+		return t;
+	}();
+	return tables;
+}
+
+// Compresses data[begin, end) as one fixed Huffman block and an empty stored block, which leaves the output byte
+// aligned and the stream open for the next part. Matches may reach back up to 32 KB before begin, the decoder has
+// already seen those bytes. A longer max_chain finds longer matches at the cost of speed.
+void deflate_part(const unsigned char* data, size_t begin, size_t end, int max_chain, std::vector<unsigned char>& out) {
+	const deflate_tables& tables = fixed_deflate_tables();
+	deflate_bit_writer bits(out);
+
+	bits.write(0, 1);	// Not the final block
+	bits.write(1, 2);	// Fixed Huffman codes
+
+	const int hash_bits = 15;
+	const size_t first = begin > size_t(deflate_window) ? begin - deflate_window : 0;
+	std::vector<int> head(size_t(1) << hash_bits, -1);
+	std::vector<int> previous(end - first);
+
+	auto hash = [&](size_t i) {
+		uint32_t key = uint32_t(data[i]) | (uint32_t(data[i + 1]) << 8) | (uint32_t(data[i + 2]) << 16);
+		return (key * 2654435761u) >> (32 - hash_bits);
+	};
+
+	// Positions are stored relative to first, so they fit in an int for any part size
+	auto insert = [&](size_t i) {
+		uint32_t h = hash(i);
+		previous[i - first] = head[h];
+		head[h] = int(i - first);
+	};
+
+	for (size_t i = first; i < begin && i + 3 <= end; ++i) insert(i);
+
+	size_t i = begin;
+	while (i < end) {
+		int best_length = 0;
+		size_t best_distance = 0;
+
+		if (i + 3 <= end) {
+			const int max_length = int(std::min<size_t>(258, end - i));
+			int candidate = head[hash(i)];
+
+			for (int chain = 0; candidate >= 0 && chain < max_chain; ++chain) {
+				const size_t match = first + size_t(candidate);
+				const size_t distance = i - match;
+				if (distance > size_t(deflate_window)) break;
+
+				if (data[match + best_length] == data[i + best_length]) {
+					int length = 0;
+					while (length < max_length && data[match + length] == data[i + length]) ++length;
+
+					if (length > best_length) {
+						best_length = length;
+						best_distance = distance;
+						if (length == max_length) break;
+					}
+				}
+
+				candidate = previous[size_t(candidate)];
+			}
+
+			insert(i);
+		}
+
+		if (best_length >= 3) {
+			const int length_symbol = tables.length_symbol[best_length];
+			const deflate_code& length_code = tables.literals[257 + length_symbol];
+			bits.write(length_code.bits, length_code.length);
+			bits.write(uint32_t(best_length - tables.length_base[length_symbol]), tables.length_extra[length_symbol]);
+
+			const int distance_symbol = tables.distance_symbol[best_distance];
+			const deflate_code& distance_code = tables.distances[distance_symbol];
+			bits.write(distance_code.bits, distance_code.length);
+			bits.write(uint32_t(best_distance - tables.distance_base[distance_symbol]), tables.distance_extra[distance_symbol]);
+
+			for (size_t j = i + 1; j < i + best_length && j + 3 <= end; ++j) insert(j);
+			i += best_length;
+		}
+		else {
+			const deflate_code& literal = tables.literals[data[i]];
+			bits.write(literal.bits, literal.length);
+			++i;
+		}
+	}
+
+	const deflate_code& end_of_block = tables.literals[256];
+	bits.write(end_of_block.bits, end_of_block.length);
+
+	// Empty stored block, the same as zlib's sync flush
+	bits.write(0, 3);
+	bits.align();
+	out.push_back(0x00);
+	out.push_back(0x00);
+	out.push_back(0xff);
+	out.push_back(0xff);
+}
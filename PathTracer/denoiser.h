@@ -0,0 +1,143 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "aov.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <vector>
+
+struct denoise_options {
+	int passes = 5;				// Taps spread 1, 2, 4... pixels apart, five passes reach 62 pixels out
+	float color_sigma = 4.f;	// Luminance differences are measured in standard deviations of the noise
+	float normal_sigma = 0.3f;
+	float albedo_sigma = 0.1f;
+	int tile_size = 64;
+};
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010), a joint bilateral filter whose wide footprint is built
+// from a few sparse 5x5 passes. As in SVGF, luminance differences are judged against the variance of each pixel's
+// estimate, so noise is smoothed away while real edges are kept, and the variance is filtered along with the color.
+// The albedo and normal AOVs stop the filter at edges the noisy color cannot show. Writes the color layer of output.
+bool denoise(const framebuffer& input, framebuffer& output, thread_pool& pool, const denoise_options& options = denoise_options());
+
+// Runs body on every tile of the image, in parallel
+void for_each_denoise_tile(int width, int height, int tile_size, thread_pool& pool, const std::function<void(const tile&)>& body) {
+	for (const tile& t : make_tiles(width, height, tile_size, tile_order::row_major)) {
+		pool.QueueJob([&body, t] { body(t); });
+	}
+	pool.Wait();
+}
+
+bool denoise(const framebuffer& input, framebuffer& output, thread_pool& pool, const denoise_options& options) {
+	const int color_layer = input.find_layer("");
+	const int albedo_layer = input.find_layer("albedo");
+	const int normal_layer = input.find_layer("normal");
+	const int variance_layer = input.find_layer("variance");
+	if (color_layer < 0 || albedo_layer < 0 || normal_layer < 0 || variance_layer < 0) return false;
+
+	const int width = input.width;
+	const int height = input.height;
+	const size_t pixel_count = size_t(width) * height;
+
+	const vec3* albedo = reinterpret_cast<const vec3*>(input.pixel(albedo_layer, 0, 0));
+	const vec3* normal = reinterpret_cast<const vec3*>(input.pixel(normal_layer, 0, 0));
+
+	// Color and variance are ping ponged between the passes. Pixels the renderer got no finite value for are dropped
+	// rather than spread around.
+	std::vector<vec3> color(pixel_count);
+	std::vector<float> variance(pixel_count);
+	std::vector<vec3> next_color(pixel_count);
+	std::vector<float> next_variance(pixel_count);
+	std::vector<float> deviation(pixel_count);
+
+	const vec3* input_color = reinterpret_cast<const vec3*>(input.pixel(color_layer, 0, 0));
+	const float* input_variance = input.pixel(variance_layer, 0, 0);
+	for (size_t i = 0; i < pixel_count; ++i) {
+		bool is_finite = std::isfinite(input_color[i].r) && std::isfinite(input_color[i].g) && std::isfinite(input_color[i].b);
+		color[i] = is_finite ? input_color[i] : vec3(0.f);
+		variance[i] = is_finite ? input_variance[i] : 0.f;
+	}
+
+	const float kernel[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+	const float normal_scale = -1.f / (2.f * options.normal_sigma * options.normal_sigma);
+	const float albedo_scale = -1.f / (2.f * options.albedo_sigma * options.albedo_sigma);
+
+	for (int pass = 0; pass < options.passes; ++pass) {
+		const int step = 1 << pass;
+
+		// Standard deviation from a 3x3 blur of the variance, a single pixel's variance is itself noisy at low spp
+		for_each_denoise_tile(width, height, options.tile_size, pool, [&](const tile& t) {
+			const float blur[3] = { 1.f / 4.f, 1.f / 2.f, 1.f / 4.f };
+			for (int y = t.y; y < t.y + t.height; ++y) {
+				for (int x = t.x; x < t.x + t.width; ++x) {
+					float sum = 0.f;
+					float weight_sum = 0.f;
+					for (int dy = -1; dy <= 1; ++dy) {
+						for (int dx = -1; dx <= 1; ++dx) {
+							int sx = x + dx;
+							int sy = y + dy;
+							if (sx < 0 || sx >= width || sy < 0 || sy >= height) continue;
+
+							float weight = blur[dx + 1] * blur[dy + 1];
+							sum += weight * variance[size_t(sy) * width + sx];
+							weight_sum += weight;
+						}
+					}
+					deviation[size_t(y) * width + x] = std::sqrt(sum / weight_sum);
+				}
+			}
+		});
+
+		for_each_denoise_tile(width, height, options.tile_size, pool, [&](const tile& t) {
+			for (int y = t.y; y < t.y + t.height; ++y) {
+				for (int x = t.x; x < t.x + t.width; ++x) {
+					const size_t i = size_t(y) * width + x;
+					const float center_luminance = luminance(color[i]);
+					const float luminance_scale = -1.f / (options.color_sigma * deviation[i] + 1e-4f);
+
+					vec3 sum(0.f);
+					float variance_sum = 0.f;
+					float weight_sum = 0.f;
+
+					for (int ky = 0; ky < 5; ++ky) {
+						const int sy = y + (ky - 2) * step;
+						if (sy < 0 || sy >= height) continue;
+
+						for (int kx = 0; kx < 5; ++kx) {
+							const int sx = x + (kx - 2) * step;
+							if (sx < 0 || sx >= width) continue;
+
+							const size_t j = size_t(sy) * width + sx;
+							const float distance = std::abs(luminance(color[j]) - center_luminance) * luminance_scale
+								+ length2(normal[j] - normal[i]) * normal_scale
+								+ length2(albedo[j] - albedo[i]) * albedo_scale;
+
+							const float weight = kernel[kx] * kernel[ky] * std::exp(distance);
+							sum += weight * color[j];
+							variance_sum += weight * weight * variance[j];
+							weight_sum += weight;
+						}
+					}
+
+					// The center tap always has full weight, so the sum is never zero
+					next_color[i] = sum / weight_sum;
+					next_variance[i] = variance_sum / (weight_sum * weight_sum);
+				}
+			}
+		});
+
+		color.swap(next_color);
+		variance.swap(next_variance);
+	}
+
+	output = framebuffer(width, height);
+	const int output_layer = output.add_layer("", { "R", "G", "B" });
+	std::copy(color.begin(), color.end(), reinterpret_cast<vec3*>(output.pixel(output_layer, 0, 0)));
+
+	return true;
+}
@@ -0,0 +1,719 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "animation.h"
+#include "bvh.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "heatmap.h"
+#include "hittable_list.h"
+#include "material_override.h"
+#include "net_socket.h"
+#include "render_settings.h"
+#include "renderer.h"
+#include "telemetry.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Messages are a header and a payload of raw little endian structs, so every process must come from the same build.
+// Bump the version on any change to them.
+const uint32_t render_protocol_version = 4;
+
+enum class render_message : uint32_t {
+	hello,		// Worker to coordinator, a worker_hello then the token
+	job,		// Coordinator to worker or client to daemon, a command line with a zero after each argument
+	lease,		// Coordinator to worker, a tile_lease
+	result,		// Worker to coordinator or daemon to client, a tile_result_header then the tile's pixels
+	done,		// Coordinator to worker or client to daemon, no more tiles are coming
+	frame,		// Client to daemon, the int32_t number of a frame to render every tile of
+	frame_done,	// Daemon to client, every tile of the frame has been sent
+	status,		// Daemon to client, a line of text to print
+	failed,		// Daemon to client, why the job cannot be rendered
+	stop		// Client to daemon instead of a job, exit and remove the socket
+};
+
+struct render_message_header {
+	uint32_t type;
+	uint32_t padding;
+	uint64_t size;
+};
+
+struct worker_hello {
+	uint32_t version;
+	uint32_t slots;		// Tiles the worker renders at once
+};
+
+const size_t max_token_size = 1024;
+
+// Takes as long whichever character differs, so the time to refuse a worker tells it nothing about the token
+inline bool same_token(const std::string& a, const std::string& b) {
+	unsigned char difference = a.size() == b.size() ? 0 : 1;
+	for (size_t i = 0; i < a.size(); ++i) difference |= (unsigned char)(a[i] ^ (i < b.size() ? b[i] : 0));
+	return difference == 0;
+}
+
+struct tile_lease {
+	int32_t frame;
+	int32_t tile;
+	int32_t x;
+	int32_t y;
+	int32_t width;
+	int32_t height;
+};
+
+// Followed by the 8 bit colors, then each linear layer's floats, then the pixel costs, every one a row at a time from
+// the bottom of the tile up
+struct tile_result_header {
+	tile_lease lease;
+	uint32_t linear_channels;	// Summed over the layers
+	uint32_t padding;
+	double render_ms;
+	ray_counters counters;
+};
+
+inline size_t tile_result_size(const tile_lease& lease, uint32_t linear_channels) {
+	const size_t pixels = size_t(lease.width) * size_t(lease.height);
+	return sizeof(tile_result_header) + pixels * (3 + linear_channels * sizeof(float) + sizeof(pixel_cost));
+}
+
+inline uint32_t linear_channel_count(const framebuffer* buffer) {
+	uint32_t channels = 0;
+	for (size_t l = 0; buffer != nullptr && l < buffer->layers.size(); ++l) channels += uint32_t(buffer->layers[l].channel_count());
+	return channels;
+}
+
+// The message for a tile rendered into buffers holding rows first_row to first_row + row_count of the image. data
+// holds them top down as sample_rect writes them, costs covers the whole image.
+std::vector<unsigned char> pack_tile_result(const tile_result_header& header, int image_width, int first_row, int row_count,
+	const unsigned char* data, const framebuffer* linear, const cost_map& costs)
+{
+	const tile_lease& lease = header.lease;
+	std::vector<unsigned char> message(tile_result_size(lease, header.linear_channels));
+	unsigned char* out = message.data();
+	memcpy(out, &header, sizeof(header));
+	out += sizeof(header);
+
+	const size_t width = size_t(lease.width);
+	for (int row = 0; row < lease.height; ++row) {
+		const int y = lease.y + row;
+		memcpy(out, &data[(size_t(first_row + row_count - 1 - y) * image_width + lease.x) * 3], width * 3);
+		out += width * 3;
+	}
+
+	for (size_t l = 0; linear != nullptr && l < linear->layers.size(); ++l) {
+		const size_t row_bytes = width * linear->layers[l].channels.size() * sizeof(float);
+		for (int row = 0; row < lease.height; ++row) {
+			memcpy(out, linear->pixel(int(l), lease.x, lease.y + row - first_row), row_bytes);
+			out += row_bytes;
+		}
+	}
+
+	for (int row = 0; row < lease.height; ++row) {
+		memcpy(out, &costs.pixels[size_t(lease.y + row) * image_width + lease.x], width * sizeof(pixel_cost));
+		out += width * sizeof(pixel_cost);
+	}
+	return message;
+}
+
+// Copies the pixels following a result's header into whole image buffers. hdr and costs may be null.
+void unpack_tile_result(const tile_result_header& header, const unsigned char* pixels, int image_width, int image_height,
+	unsigned char* data, framebuffer* hdr, cost_map* costs)
+{
+	const tile_lease& lease = header.lease;
+	const size_t width = size_t(lease.width);
+
+	for (int row = 0; row < lease.height; ++row) {
+		const int y = lease.y + row;
+		memcpy(&data[(size_t(image_height - 1 - y) * image_width + lease.x) * 3], pixels, width * 3);
+		pixels += width * 3;
+	}
+
+	for (size_t l = 0; hdr != nullptr && l < hdr->layers.size(); ++l) {
+		const size_t row_bytes = width * hdr->layers[l].channels.size() * sizeof(float);
+		for (int row = 0; row < lease.height; ++row) {
+			memcpy(hdr->pixel(int(l), lease.x, lease.y + row), pixels, row_bytes);
+			pixels += row_bytes;
+		}
+	}
+
+	for (int row = 0; row < lease.height; ++row) {
+		if (costs != nullptr) {
+			memcpy(&costs->pixels[size_t(lease.y + row) * image_width + lease.x], pixels, width * sizeof(pixel_cost));
+		}
+		pixels += width * sizeof(pixel_cost);
+	}
+}
+
+bool send_render_message(tcp_socket& socket, render_message type, const void* payload, size_t size) {
+	render_message_header header = { uint32_t(type), 0, uint64_t(size) };
+	return socket.send_all(&header, sizeof(header)) && (size == 0 || socket.send_all(payload, size));
+}
+
+// Payloads over limit are refused, so a stray connection cannot make the receiver allocate without bound
+bool receive_render_message(tcp_socket& socket, render_message& type, std::vector<unsigned char>& payload, uint64_t limit) {
+	render_message_header header;
+	if (!socket.receive_all(&header, sizeof(header)) || header.size > limit) return false;
+
+	type = render_message(header.type);
+	payload.resize(size_t(header.size));
+	return header.size == 0 || socket.receive_all(payload.data(), payload.size());
+}
+
+// Leases the tiles of each frame to whichever workers are connected and merges what they send back into the buffers
+// a local render would have filled, so everything after the render is unchanged. Workers may join at any time. A
+// worker that disconnects, sends something unexpected or holds a tile past the lease timeout is dropped and its
+// tiles go back to the front of the queue.
+class tile_coordinator {
+	public:
+		tile_coordinator() {}
+		~tile_coordinator() { stop(); }
+
+		tile_coordinator(const tile_coordinator&) = delete;
+		tile_coordinator& operator=(const tile_coordinator&) = delete;
+
+		// Listens where the settings say. Every worker presenting their token is sent argv to build its settings from.
+		bool start(const render_settings& settings, int argc, char** argv, int width, int height);
+
+		// Blocks until every tile of the frame is back, leasing the most expensive first once tile_costs holds the
+		// times of an earlier frame. tile_costs is updated with the times the workers report. False after printing why
+		// when no worker was connected for the worker timeout, or the coordinator was stopped.
+		bool render_frame(int frame, const std::vector<tile>& tiles, std::vector<double>& tile_costs,
+			unsigned char* data, cost_map* costs, framebuffer* hdr, render_telemetry* telemetry);
+
+		// Sends every worker home
+		void stop();
+
+	public:
+		int port = 0;
+		int image_width = 0;
+		int image_height = 0;
+
+		int workers_connected = 0;
+		int workers_lost = 0;
+		int tiles_released = 0;		// Leased again after their worker was lost
+
+	private:
+		struct worker_connection {
+			tcp_socket socket;
+			int index = 0;
+			std::thread thread;
+			std::atomic<bool> is_finished{ false };
+		};
+
+		struct outstanding_lease {
+			tile_lease lease;
+			std::chrono::steady_clock::time_point leased;
+			double leased_ms;		// On the telemetry clock
+		};
+
+		void accept_loop();
+		void serve(worker_connection& worker);
+		void merge(const tile_result_header& header, const unsigned char* pixels, int worker, double leased_ms);
+
+		tcp_socket listener;
+		std::vector<unsigned char> job;
+		std::string token;
+		int lease_timeout_ms = 0;
+		int worker_timeout_ms = 0;
+
+		std::thread accept_thread;
+		std::vector<std::unique_ptr<worker_connection>> workers;	// Only the accept loop touches them until it ends
+		std::atomic<bool> is_stopping{ false };
+
+		// Everything below is guarded by frame_mutex
+		std::mutex frame_mutex;
+		std::condition_variable frame_changed;
+		int current_frame = -1;
+		const std::vector<tile>* frame_tiles = nullptr;
+		std::vector<double>* frame_tile_costs = nullptr;
+		unsigned char* frame_data = nullptr;
+		cost_map* frame_costs = nullptr;
+		framebuffer* frame_hdr = nullptr;
+		render_telemetry* frame_telemetry = nullptr;
+		uint32_t frame_channels = 0;
+		uint64_t frame_result_limit = 0;
+		std::deque<int> pending;
+		std::vector<char> is_done;
+		int tiles_left = 0;
+};
+
+bool tile_coordinator::start(const render_settings& settings, int argc, char** argv, int width, int height) {
+	// The job names files on this machine, anyone who can reach the port must know the token to be sent it
+	if (!is_loopback_host(settings.coordinator_bind) && settings.token.empty()) {
+		printf("Listening on %s needs a token shared with the workers, see --token\n", settings.coordinator_bind.c_str());
+		return false;
+	}
+	if (settings.token.size() > max_token_size) {
+		printf("Tokens are at most %zu characters\n", max_token_size);
+		return false;
+	}
+	if (!listener.listen(settings.coordinator_bind, settings.coordinator_port)) return false;
+
+	port = settings.coordinator_port;
+	image_width = width;
+	image_height = height;
+	token = settings.token;
+	lease_timeout_ms = settings.lease_timeout * 1000;
+	worker_timeout_ms = settings.worker_timeout * 1000;
+
+	job.clear();
+	for (int i = 0; i < argc; ++i) {
+		job.insert(job.end(), argv[i], argv[i] + strlen(argv[i]) + 1);
+	}
+
+	is_stopping = false;
+	accept_thread = std::thread([this] { accept_loop(); });
+	return true;
+}
+
+void tile_coordinator::accept_loop() {
+	int next_index = 0;
+
+	// Wakes up now and then to notice stop
+	while (!is_stopping) {
+		// Connections that ended, refused ones included, are joined as they go, so a coordinator that runs for long on
+		// a port anyone can reach does not keep a thread for each
+		for (size_t i = 0; i < workers.size();) {
+			if (!workers[i]->is_finished) {
+				++i;
+				continue;
+			}
+
+			workers[i]->thread.join();
+			workers[i] = std::move(workers.back());
+			workers.pop_back();
+		}
+
+		tcp_socket client;
+		if (!listener.accept(client, 200)) continue;
+
+		std::unique_ptr<worker_connection> worker(new worker_connection());
+		worker->socket = std::move(client);
+		worker->index = next_index++;
+
+		worker_connection* connection = worker.get();
+		worker->thread = std::thread([this, connection] {
+			serve(*connection);
+			connection->socket.close();
+			connection->is_finished = true;
+		});
+		workers.push_back(std::move(worker));
+	}
+}
+
+void tile_coordinator::serve(worker_connection& worker) {
+	render_message type;
+	std::vector<unsigned char> payload;
+
+	worker_hello hello;
+	if (!worker.socket.wait_readable(10000) || !receive_render_message(worker.socket, type, payload, sizeof(hello) + max_token_size)
+		|| type != render_message::hello || payload.size() < sizeof(hello))
+	{
+		printf("Worker %d sent no hello and was dropped\n", worker.index);
+		return;
+	}
+
+	memcpy(&hello, payload.data(), sizeof(hello));
+	if (hello.version != render_protocol_version) {
+		printf("Worker %d speaks protocol %u, this build speaks %u\n", worker.index, hello.version, render_protocol_version);
+		return;
+	}
+
+	if (!same_token(std::string(payload.begin() + sizeof(hello), payload.end()), token)) {
+		printf("Worker %d presented the wrong token and was dropped\n", worker.index);
+		return;
+	}
+
+	if (!send_render_message(worker.socket, render_message::job, job.data(), job.size())) return;
+
+	// One lease past the worker's threads keeps it busy while a result is on its way back
+	const size_t max_leases = size_t(std::max(1u, hello.slots)) + 1;
+	{
+		std::lock_guard<std::mutex> lock(frame_mutex);
+		++workers_connected;
+	}
+	printf("Worker %d connected with %u threads\n", worker.index, hello.slots);
+
+	std::vector<outstanding_lease> leases;
+	bool is_lost = false;
+	const char* reason = "disconnected";
+
+	while (!is_lost) {
+		size_t first_new = leases.size();
+		{
+			std::unique_lock<std::mutex> lock(frame_mutex);
+			frame_changed.wait(lock, [&] { return is_stopping || !leases.empty() || !pending.empty(); });
+			if (is_stopping && leases.empty()) break;
+
+			while (!is_stopping && leases.size() < max_leases && !pending.empty()) {
+				const int index = pending.front();
+				pending.pop_front();
+
+				const tile& t = (*frame_tiles)[index];
+				outstanding_lease lease = { { current_frame, index, t.x, t.y, t.width, t.height }, std::chrono::steady_clock::now(),
+					frame_telemetry != nullptr ? frame_telemetry->now_ms() : 0.0 };
+				leases.push_back(lease);
+			}
+		}
+
+		for (size_t i = first_new; i < leases.size() && !is_lost; ++i) {
+			is_lost = !send_render_message(worker.socket, render_message::lease, &leases[i].lease, sizeof(tile_lease));
+		}
+		if (is_lost || leases.empty()) continue;
+
+		// Waits in short steps to notice stop and the oldest lease running out
+		bool is_readable = false;
+		while (!is_readable && !is_lost) {
+			is_readable = worker.socket.wait_readable(200);
+
+			double held_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - leases.front().leased).count();
+			if (!is_readable && lease_timeout_ms > 0 && held_ms > lease_timeout_ms) {
+				is_lost = true;
+				reason = "held a tile past the lease timeout";
+			}
+			else if (!is_readable && is_stopping) {
+				is_lost = true;
+				reason = "was still rendering when the coordinator stopped";
+			}
+		}
+		if (is_lost) continue;
+
+		uint64_t limit;
+		uint32_t channels;
+		{
+			std::lock_guard<std::mutex> lock(frame_mutex);
+			limit = frame_result_limit;
+			channels = frame_channels;
+		}
+
+		tile_result_header header;
+		if (!receive_render_message(worker.socket, type, payload, limit) || type != render_message::result || payload.size() < sizeof(header)) {
+			is_lost = true;
+			continue;
+		}
+		memcpy(&header, payload.data(), sizeof(header));
+
+		auto match = std::find_if(leases.begin(), leases.end(), [&header](const outstanding_lease& l) {
+			return l.lease.frame == header.lease.frame && l.lease.tile == header.lease.tile;
+		});
+
+		if (match == leases.end() || memcmp(&match->lease, &header.lease, sizeof(tile_lease)) != 0
+			|| header.linear_channels != channels || payload.size() != tile_result_size(header.lease, channels))
+		{
+			is_lost = true;
+			reason = "sent a result that does not match its lease";
+			continue;
+		}
+
+		double leased_ms = match->leased_ms;
+		leases.erase(match);
+
+		std::lock_guard<std::mutex> lock(frame_mutex);
+		merge(header, payload.data() + sizeof(header), worker.index, leased_ms);
+	}
+
+	if (!is_lost) {
+		send_render_message(worker.socket, render_message::done, nullptr, 0);
+		return;
+	}
+
+	// Tiles of this frame that are not already in go to the front of the queue for the next free worker
+	int released = 0;
+	{
+		std::lock_guard<std::mutex> lock(frame_mutex);
+		for (const outstanding_lease& l : leases) {
+			if (l.lease.frame != current_frame || is_done[l.lease.tile]) continue;
+
+			pending.push_front(l.lease.tile);
+			++released;
+		}
+
+		tiles_released += released;
+		++workers_lost;
+	}
+	frame_changed.notify_all();
+
+	printf("Worker %d %s, %d tiles leased again\n", worker.index, reason, released);
+}
+
+void tile_coordinator::merge(const tile_result_header& header, const unsigned char* pixels, int worker, double leased_ms) {
+	const tile_lease& lease = header.lease;
+	if (lease.frame != current_frame || is_done[lease.tile]) return;
+
+	unpack_tile_result(header, pixels, image_width, image_height, frame_data, frame_hdr, frame_costs);
+
+	is_done[lease.tile] = 1;
+	--tiles_left;
+	(*frame_tile_costs)[lease.tile] = header.render_ms;
+
+	if (frame_telemetry != nullptr) {
+		frame_telemetry->add({ lease.frame, lease.tile, worker, lease.x, lease.y, lease.width, lease.height,
+			leased_ms, frame_telemetry->now_ms(), header.counters });
+	}
+
+	const int tile_count = int(frame_tiles->size());
+	printf("%f%%\n", 100.f * (tile_count - tiles_left) / tile_count);
+	frame_changed.notify_all();
+}
+
+bool tile_coordinator::render_frame(int frame, const std::vector<tile>& tiles, std::vector<double>& tile_costs,
+	unsigned char* data, cost_map* costs, framebuffer* hdr, render_telemetry* telemetry)
+{
+	if (tiles.empty()) return true;
+
+	// Most expensive first, so the long tiles start early instead of setting the end of the frame
+	std::vector<int> order(tiles.size());
+	std::iota(order.begin(), order.end(), 0);
+	if (tile_costs.size() == tiles.size()) {
+		std::stable_sort(order.begin(), order.end(), [&tile_costs](int a, int b) { return tile_costs[a] > tile_costs[b]; });
+	}
+	else {
+		tile_costs.assign(tiles.size(), 0.0);
+	}
+
+	int waiting_workers;
+	{
+		std::lock_guard<std::mutex> lock(frame_mutex);
+		current_frame = frame;
+		frame_tiles = &tiles;
+		frame_tile_costs = &tile_costs;
+		frame_data = data;
+		frame_costs = costs;
+		frame_hdr = hdr != nullptr && !hdr->layers.empty() ? hdr : nullptr;
+		frame_telemetry = telemetry;
+		frame_channels = linear_channel_count(frame_hdr);
+
+		frame_result_limit = 0;
+		for (const tile& t : tiles) {
+			frame_result_limit = std::max<uint64_t>(frame_result_limit, tile_result_size({ frame, 0, t.x, t.y, t.width, t.height }, frame_channels));
+		}
+
+		pending.assign(order.begin(), order.end());
+		is_done.assign(tiles.size(), 0);
+		tiles_left = int(tiles.size());
+		waiting_workers = workers_connected - workers_lost;
+	}
+	frame_changed.notify_all();
+
+	if (waiting_workers == 0) {
+		printf("Waiting for workers on port %d\n", port);
+	}
+
+	// Wakes up now and then to notice stop and how long the frame has gone without a worker
+	std::unique_lock<std::mutex> lock(frame_mutex);
+	auto attended = std::chrono::steady_clock::now();
+	bool is_abandoned = false;
+	while (tiles_left > 0 && !is_stopping && !is_abandoned) {
+		frame_changed.wait_for(lock, std::chrono::milliseconds(200));
+
+		auto now = std::chrono::steady_clock::now();
+		if (workers_connected > workers_lost) attended = now;
+		is_abandoned = worker_timeout_ms > 0 && now - attended > std::chrono::milliseconds(worker_timeout_ms);
+	}
+
+	const bool is_finished = tiles_left == 0;
+	pending.clear();
+	if (is_finished) return true;
+
+	// Results still on their way belong to no frame now
+	current_frame = -1;
+	if (is_abandoned) printf("No worker connected for %d seconds, frame %d has %d tiles left\n", worker_timeout_ms / 1000, frame, tiles_left);
+	else printf("The coordinator stopped with %d tiles of frame %d left\n", tiles_left, frame);
+	return false;
+}
+
+void tile_coordinator::stop() {
+	if (!accept_thread.joinable()) return;
+
+	{
+		std::lock_guard<std::mutex> lock(frame_mutex);
+		is_stopping = true;
+	}
+	frame_changed.notify_all();
+	accept_thread.join();
+
+	// No more threads are added once the accept loop is done
+	for (std::unique_ptr<worker_connection>& worker : workers) worker->thread.join();
+	workers.clear();
+	listener.close();
+}
+
+// Loads the scene the settings describe, with the pool running. Animated scenes fill animation.
+typedef std::function<bool(const render_settings&, thread_pool&, hittable_list&, bvh&, animated_mesh&)> scene_loader;
+
+// Connects to the coordinator at local.worker_address and renders the tiles it leases until it sends no more. The
+// render settings come from the coordinator's command line, the thread count and cache directory stay this machine's.
+// Scene and OBJ paths must resolve the same on every machine.
+bool run_tile_worker(const render_settings& local, const scene_loader& load_scene) {
+	std::string host;
+	int port;
+	if (!parse_net_address(local.worker_address, host, port)) {
+		printf("Expected host:port, got: %s\n", local.worker_address.c_str());
+		return false;
+	}
+
+	// The coordinator may still be starting
+	tcp_socket socket;
+	for (int attempt = 0; !socket.connect(host, port); ++attempt) {
+		if (attempt == 100) {
+			printf("Unable to connect to %s\n", local.worker_address.c_str());
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	const uint32_t thread_count = uint32_t(local.thread_count());
+	worker_hello hello = { render_protocol_version, thread_count };
+
+	std::vector<unsigned char> greeting(sizeof(hello));
+	memcpy(greeting.data(), &hello, sizeof(hello));
+	greeting.insert(greeting.end(), local.token.begin(), local.token.end());
+
+	render_message type;
+	std::vector<unsigned char> payload;
+	if (!send_render_message(socket, render_message::hello, greeting.data(), greeting.size())
+		|| !receive_render_message(socket, type, payload, 1 << 20) || type != render_message::job)
+	{
+		printf("The coordinator at %s sent no job, it may expect another token\n", local.worker_address.c_str());
+		return false;
+	}
+
+	std::vector<char*> args;
+	for (size_t i = 0; i < payload.size(); i += strlen(reinterpret_cast<char*>(&payload[i])) + 1) {
+		args.push_back(reinterpret_cast<char*>(&payload[i]));
+	}
+	if (payload.empty() || payload.back() != '\0') args.clear();
+
+	render_settings settings;
+	bool show_help;
+	if (args.empty() || !parse_render_arguments(int(args.size()), args.data(), settings, show_help)) {
+		printf("Unable to use the settings sent by the coordinator\n");
+		return false;
+	}
+
+	settings.threads = local.threads;
+	settings.cache_directory = local.cache_directory;
+	settings.coordinator_port = 0;
+
+	const int image_width = settings.image_width;
+	const int image_height = settings.image_height();
+	const bool has_linear = settings.hdr_output != hdr_format::none || settings.denoise;
+	const framebuffer linear_layout = make_linear_framebuffer(settings, 0, 0);
+	const uint32_t linear_channels = has_linear ? linear_channel_count(&linear_layout) : 0;
+
+	thread_pool pool;
+	pool.Start(thread_count);
+
+	hittable_list world;
+	bvh world_bvh;
+	animated_mesh animation;
+
+	auto load_s = std::chrono::high_resolution_clock::now();
+	seed_random(scene_random_seed);
+	if (!load_scene(settings, pool, world, world_bvh, animation)) {
+		pool.Stop();
+		return false;
+	}
+	auto load_f = std::chrono::high_resolution_clock::now();
+	printf("Scene load: %.2f ms, rendering tiles for %s with %u threads\n",
+		std::chrono::duration<double, std::milli>(load_f - load_s).count(), local.worker_address.c_str(), thread_count);
+
+	camera cam(settings.camera_position, settings.camera_lookat, settings.camera_up, settings.vertical_fov, settings.aspect_ratio,
+		settings.aperture, settings.resolved_focus_distance());
+
+	std::unique_ptr<material_override_world> overridden;
+	if (!settings.material_overrides.empty()) overridden.reset(new material_override_world(world_bvh, settings.material_overrides));
+	const hittable& render_world = overridden ? static_cast<const hittable&>(*overridden) : world_bvh;
+
+	// Tiles never overlap, so every job records into the one map
+	cost_map costs(image_width, image_height);
+
+	std::mutex send_mutex;
+	std::atomic<bool> is_lost(false);
+	bool is_done = false;		// Only once the coordinator said so were all the tiles it leased delivered
+	int current_frame = 0;
+	int tiles_rendered = 0;
+
+	while (!is_lost) {
+		if (!receive_render_message(socket, type, payload, sizeof(tile_lease))) {
+			printf("Lost the connection to %s\n", local.worker_address.c_str());
+			break;
+		}
+
+		is_done = type == render_message::done;
+		if (is_done) break;
+
+		tile_lease lease;
+		if (type != render_message::lease || payload.size() != sizeof(lease)) {
+			printf("The coordinator at %s sent something other than a lease\n", local.worker_address.c_str());
+			break;
+		}
+		memcpy(&lease, payload.data(), sizeof(lease));
+
+		if (lease.x < 0 || lease.y < 0 || lease.width <= 0 || lease.height <= 0
+			|| lease.x + lease.width > image_width || lease.y + lease.height > image_height)
+		{
+			printf("Lease for tile %d is outside the image\n", lease.tile);
+			break;
+		}
+
+		// Frames arrive in order, each after every tile of the one before is back
+		if (lease.frame != current_frame) {
+			pool.Wait();
+			if (!animation.empty()) {
+				pose_animated_mesh(animation, settings.animation, lease.frame / settings.frames_per_second, pool);
+				world_bvh.update(world, pool, settings.rebuild_threshold);
+			}
+			current_frame = lease.frame;
+		}
+
+		++tiles_rendered;
+		pool.QueueJob([&, lease] {
+			// sample_rect works in whole image rows, only the tile's part of them is sent
+			std::vector<unsigned char> rgb(size_t(image_width) * lease.height * 3);
+			framebuffer linear = has_linear ? make_linear_framebuffer(settings, image_width, lease.height) : framebuffer();
+
+			auto tile_s = std::chrono::high_resolution_clock::now();
+			ray_counters counters_s = thread_ray_counters;
+			sample_rect(lease.x, lease.y, lease.width, lease.height, image_width, image_height,
+				settings.samples_per_pixel, settings.max_depth, 3, cam, render_world, settings.seed + lease.frame,
+				rgb.data(), &costs, has_linear ? &linear : nullptr, lease.y, lease.height);
+			auto tile_f = std::chrono::high_resolution_clock::now();
+
+			tile_result_header header = {};
+			header.lease = lease;
+			header.linear_channels = linear_channels;
+			header.render_ms = std::chrono::duration<double, std::milli>(tile_f - tile_s).count();
+			header.counters = thread_ray_counters - counters_s;
+
+			std::vector<unsigned char> message = pack_tile_result(header, image_width, lease.y, lease.height, rgb.data(),
+				has_linear ? &linear : nullptr, costs);
+
+			std::lock_guard<std::mutex> lock(send_mutex);
+			if (!is_lost && !send_render_message(socket, render_message::result, message.data(), message.size())) is_lost = true;
+		});
+	}
+
+	pool.Wait();
+	pool.Stop();
+
+	if (is_lost) printf("Unable to send a result to %s\n", local.worker_address.c_str());
+	printf("Rendered %d tiles for %s\n", tiles_rendered, local.worker_address.c_str());
+	return is_done && !is_lost;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// A named set of float channels stored interleaved, one value per channel for every pixel
+struct framebuffer_layer {
+	std::string name;					// Empty for the main color layer, otherwise the prefix of its channel names
+	std::vector<std::string> channels;
+	std::vector<float> data;
+	bool keep_float = false;			// Written as 32 bit floats even when the rest of the image is half
+
+	int channel_count() const { return int(channels.size()); }
+};
+
+// Linear float image with any number of layers. Rows are stored in render order, so row 0 is the bottom of the image.
+class framebuffer {
+	public:
+		framebuffer() {}
+		framebuffer(int image_width, int image_height) : width(image_width), height(image_height) {}
+
+		// Returns the index of the new layer, every value starts at zero
+		int add_layer(const std::string& name, const std::vector<std::string>& channels) {
+			framebuffer_layer layer;
+			layer.name = name;
+			layer.channels = channels;
+			layer.data.assign(size_t(width) * height * channels.size(), 0.f);
+
+			layers.push_back(std::move(layer));
+			return int(layers.size()) - 1;
+		}
+
+		// -1 when there is no layer of that name
+		int find_layer(const std::string& name) const {
+			for (size_t i = 0; i < layers.size(); ++i) {
+				if (layers[i].name == name) return int(i);
+			}
+			return -1;
+		}
+
+		float* pixel(int layer, int x, int y) {
+			framebuffer_layer& l = layers[layer];
+			return &l.data[(size_t(y) * width + x) * l.channels.size()];
+		}
+
+		const float* pixel(int layer, int x, int y) const {
+			const framebuffer_layer& l = layers[layer];
+			return &l.data[(size_t(y) * width + x) * l.channels.size()];
+		}
+
+	public:
+		int width = 0;
+		int height = 0;
+		std::vector<framebuffer_layer> layers;
+};
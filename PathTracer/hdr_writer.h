@@ -0,0 +1,294 @@
+#pragma once
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+enum class exr_pixel_type {
+	half = 1,
+	float32 = 2
+};
+
+// IEEE half with round to nearest even, overflow becomes infinity
+uint16_t float_to_half(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	const uint32_t sign = (bits >> 16) & 0x8000;
+	const uint32_t exponent = (bits >> 23) & 0xff;
+	uint32_t mantissa = bits & 0x7fffff;
+
+	if (exponent == 0xff) return uint16_t(sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0));
+
+	const int half_exponent = int(exponent) - 127 + 15;
+	if (half_exponent >= 0x1f) return uint16_t(sign | 0x7c00);
+
+	// Subnormal halves keep the implicit bit in the mantissa
+	if (half_exponent <= 0) {
+		if (half_exponent < -10) return uint16_t(sign);
+
+		mantissa |= 0x800000;
+		const int shift = 14 - half_exponent;
+		uint32_t half = mantissa >> shift;
+		const uint32_t remainder = mantissa & ((1u << shift) - 1);
+		const uint32_t halfway = 1u << (shift - 1);
+		if (remainder > halfway || (remainder == halfway && (half & 1))) ++half;
+		return uint16_t(sign | half);
+	}
+
+	// A carry out of the mantissa correctly rounds up into the exponent
+	uint32_t half = sign | (uint32_t(half_exponent) << 10) | (mantissa >> 13);
+	const uint32_t remainder = mantissa & 0x1fff;
+	if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) ++half;
+	return uint16_t(half);
+}
+
+bool seek_file(FILE* file, uint64_t position) {
+#ifdef _WIN32
+	return _fseeki64(file, int64_t(position), SEEK_SET) == 0;
+#else
+	return fseeko(file, off_t(position), SEEK_SET) == 0;
+#endif
+}
+
+// One channel of a scanline, stride is the distance in floats between neighbouring pixels
+struct exr_channel_row {
+	const float* data;
+	int stride;
+};
+
+// Uncompressed single part scanline OpenEXR. Every line has the same size, so the offset table is written up front
+// and lines can be written in any order, one at a time, without holding the image.
+class exr_writer {
+	public:
+		~exr_writer() { close(); }
+
+		// Channel names are sorted in the file, rows passed to write_line follow the order given here. Each channel
+		// has its own pixel type.
+		bool open(const std::string& path, int image_width, int image_height, const std::vector<std::string>& channel_names,
+			const std::vector<exr_pixel_type>& channel_types);
+
+		// Line y counts down from the top of the image
+		bool write_line(int y, const std::vector<exr_channel_row>& rows);
+
+		bool close();
+
+	private:
+		FILE* file = nullptr;
+		int width = 0;
+		int height = 0;
+		std::vector<exr_pixel_type> pixel_types;
+		std::vector<int> file_order;		// Index into the rows of write_line for each channel in file order
+		uint64_t first_line = 0;
+		uint64_t line_size = 0;
+		uint64_t position = 0;
+		std::vector<unsigned char> line;
+};
+
+void append_bytes(std::vector<unsigned char>& out, const void* data, size_t size) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	out.insert(out.end(), bytes, bytes + size);
+}
+
+// OpenEXR is little endian throughout
+void append_le32(std::vector<unsigned char>& out, uint32_t value) {
+	for (int i = 0; i < 4; ++i) out.push_back((unsigned char)(value >> (8 * i)));
+}
+
+void append_le64(std::vector<unsigned char>& out, uint64_t value) {
+	for (int i = 0; i < 8; ++i) out.push_back((unsigned char)(value >> (8 * i)));
+}
+
+void append_exr_attribute(std::vector<unsigned char>& out, const char* name, const char* type, const std::vector<unsigned char>& value) {
+	append_bytes(out, name, strlen(name) + 1);
+	append_bytes(out, type, strlen(type) + 1);
+	append_le32(out, uint32_t(value.size()));
+	append_bytes(out, value.data(), value.size());
+}
+
+uint32_t float_bits(float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+bool exr_writer::open(const std::string& path, int image_width, int image_height, const std::vector<std::string>& channel_names,
+	const std::vector<exr_pixel_type>& channel_types) {
+	close();
+	if (channel_types.size() != channel_names.size()) return false;
+
+	width = image_width;
+	height = image_height;
+	pixel_types = channel_types;
+
+	file_order.resize(channel_names.size());
+	for (size_t i = 0; i < channel_names.size(); ++i) file_order[i] = int(i);
+	std::sort(file_order.begin(), file_order.end(), [&](int a, int b) { return channel_names[a] < channel_names[b]; });
+
+	std::vector<unsigned char> header;
+	append_le32(header, 20000630);	// Magic number
+	append_le32(header, 2);			// Version 2, single part scanline
+
+	std::vector<unsigned char> channels;
+	for (int c : file_order) {
+		append_bytes(channels, channel_names[c].c_str(), channel_names[c].size() + 1);
+		append_le32(channels, uint32_t(channel_types[c]));
+		append_le32(channels, 0);	// Perceptually linear flag and reserved bytes
+		append_le32(channels, 1);	// x and y sampling
+		append_le32(channels, 1);
+	}
+	channels.push_back(0);
+	append_exr_attribute(header, "channels", "chlist", channels);
+
+	append_exr_attribute(header, "compression", "compression", { 0 });
+
+	std::vector<unsigned char> window;
+	append_le32(window, 0);
+	append_le32(window, 0);
+	append_le32(window, uint32_t(width - 1));
+	append_le32(window, uint32_t(height - 1));
+	append_exr_attribute(header, "dataWindow", "box2i", window);
+	append_exr_attribute(header, "displayWindow", "box2i", window);
+
+	append_exr_attribute(header, "lineOrder", "lineOrder", { 0 });
+
+	std::vector<unsigned char> one;
+	append_le32(one, float_bits(1.f));
+	append_exr_attribute(header, "pixelAspectRatio", "float", one);
+	append_exr_attribute(header, "screenWindowCenter", "v2f", std::vector<unsigned char>(8, 0));
+	append_exr_attribute(header, "screenWindowWidth", "float", one);
+	header.push_back(0);
+
+	uint64_t pixel_size = 0;
+	for (exr_pixel_type type : channel_types) pixel_size += type == exr_pixel_type::half ? 2 : 4;
+	line_size = 8 + uint64_t(width) * pixel_size;
+	first_line = header.size() + 8 * uint64_t(height);
+
+	for (int y = 0; y < height; ++y) {
+		append_le64(header, first_line + uint64_t(y) * line_size);
+	}
+
+	file = fopen(path.c_str(), "wb");
+	if (file == nullptr) return false;
+
+	if (fwrite(header.data(), 1, header.size(), file) != header.size()) {
+		close();
+		return false;
+	}
+
+	position = header.size();
+	line.reserve(size_t(line_size));
+	return true;
+}
+
+bool exr_writer::write_line(int y, const std::vector<exr_channel_row>& rows) {
+	if (file == nullptr || y < 0 || y >= height || rows.size() != file_order.size()) return false;
+
+	line.clear();
+	append_le32(line, uint32_t(y));
+	append_le32(line, uint32_t(line_size - 8));
+
+	// Each channel's samples are contiguous within the line
+	for (int c : file_order) {
+		const exr_channel_row& row = rows[c];
+		for (int x = 0; x < width; ++x) {
+			float value = row.data[size_t(x) * row.stride];
+			if (pixel_types[c] == exr_pixel_type::half) {
+				uint16_t half = float_to_half(value);
+				line.push_back((unsigned char)(half & 0xff));
+				line.push_back((unsigned char)(half >> 8));
+			}
+			else {
+				append_le32(line, float_bits(value));
+			}
+		}
+	}
+
+	const uint64_t offset = first_line + uint64_t(y) * line_size;
+	if (offset != position && !seek_file(file, offset)) return false;
+
+	if (fwrite(line.data(), 1, line.size(), file) != line.size()) return false;
+	position = offset + line.size();
+	return true;
+}
+
+bool exr_writer::close() {
+	if (file == nullptr) return true;
+
+	bool is_valid = fclose(file) == 0;
+	file = nullptr;
+	return is_valid;
+}
+
+// Every channel of every layer, named layer.channel except for the unnamed color layer
+std::vector<std::string> framebuffer_channel_names(const framebuffer& buffer) {
+	std::vector<std::string> names;
+	for (const framebuffer_layer& layer : buffer.layers) {
+		for (const std::string& channel : layer.channels) {
+			names.push_back(layer.name.empty() ? channel : layer.name + "." + channel);
+		}
+	}
+	return names;
+}
+
+// The pixel type of every channel, layers that keep floats stay 32 bit in half images
+std::vector<exr_pixel_type> framebuffer_channel_types(const framebuffer& buffer, exr_pixel_type type) {
+	std::vector<exr_pixel_type> types;
+	for (const framebuffer_layer& layer : buffer.layers) {
+		types.insert(types.end(), layer.channels.size(), layer.keep_float ? exr_pixel_type::float32 : type);
+	}
+	return types;
+}
+
+bool write_exr(const std::string& path, const framebuffer& buffer, exr_pixel_type type) {
+	exr_writer writer;
+	if (!writer.open(path, buffer.width, buffer.height, framebuffer_channel_names(buffer), framebuffer_channel_types(buffer, type))) return false;
+
+	// Lines are read straight out of the layers, the file's top line is the last rendered row
+	std::vector<exr_channel_row> rows;
+	for (int y = 0; y < buffer.height; ++y) {
+		const int row = buffer.height - y - 1;
+
+		rows.clear();
+		for (size_t l = 0; l < buffer.layers.size(); ++l) {
+			const framebuffer_layer& layer = buffer.layers[l];
+			for (int c = 0; c < layer.channel_count(); ++c) {
+				rows.push_back({ buffer.pixel(int(l), 0, row) + c, layer.channel_count() });
+			}
+		}
+
+		if (!writer.write_line(y, rows)) return false;
+	}
+
+	return writer.close();
+}
+
+// Portable float map of a one or three channel layer. PFM stores rows bottom up like the framebuffer.
+bool write_pfm(const std::string& path, const framebuffer& buffer, int layer) {
+	const framebuffer_layer& source = buffer.layers[layer];
+	const int channels = source.channel_count();
+	if (channels != 1 && channels != 3) return false;
+
+	FILE* file = fopen(path.c_str(), "wb");
+	if (file == nullptr) return false;
+
+	// A negative scale marks little endian samples
+	fprintf(file, "%s\n%d %d\n-1.0\n", channels == 3 ? "PF" : "Pf", buffer.width, buffer.height);
+
+	bool is_valid = true;
+	std::vector<unsigned char> line;
+	for (int y = 0; is_valid && y < buffer.height; ++y) {
+		const float* row = buffer.pixel(layer, 0, y);
+
+		line.clear();
+		for (int i = 0; i < buffer.width * channels; ++i) append_le32(line, float_bits(row[i]));
+		is_valid = fwrite(line.data(), 1, line.size(), file) == line.size();
+	}
+
+	return fclose(file) == 0 && is_valid;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "telemetry.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Per pixel totals over every sample, kept narrow since there is one for every pixel of the image
+struct pixel_cost {
+	uint32_t rays;
+	uint32_t box_tests;
+	uint32_t primitive_tests;
+	uint32_t bounces;
+	uint32_t samples;
+};
+
+enum class heatmap_metric {
+	traversal_cost,		// Box and primitive tests per sample
+	rays,				// Rays per sample
+	bounces				// Mean path length
+};
+
+class cost_map {
+	public:
+		cost_map(int image_width, int image_height) : width(image_width), height(image_height), pixels(size_t(image_width) * image_height) {}
+
+		// Store the counters a thread accumulated while rendering one pixel
+		void record(int x, int y, const ray_counters& counters) {
+			pixel_cost& p = pixels[size_t(y) * width + x];
+			p.rays = uint32_t(counters.rays());
+			p.box_tests = uint32_t(counters.box_tests);
+			p.primitive_tests = uint32_t(counters.primitive_tests);
+			p.bounces = uint32_t(counters.bounces);
+			p.samples = uint32_t(counters.samples);
+		}
+
+		uint64_t total_rays() const {
+			uint64_t total = 0;
+			for (const pixel_cost& p : pixels) total += p.rays;
+			return total;
+		}
+
+		float value(const pixel_cost& p, heatmap_metric metric) const;
+
+		// False color RGB image of the metric in output row order, scaled so the 99th percentile pixel is the
+		// hottest color
+		std::vector<unsigned char> false_color(heatmap_metric metric) const;
+
+	public:
+		int width;
+		int height;
+		std::vector<pixel_cost> pixels;
+};
+
+float cost_map::value(const pixel_cost& p, heatmap_metric metric) const {
+	if (p.samples == 0) return 0.f;
+
+	switch (metric) {
+		case heatmap_metric::rays: return float(p.rays) / p.samples;
+		case heatmap_metric::bounces: return float(p.bounces) / p.samples;
+		default: return float(p.box_tests + p.primitive_tests) / p.samples;
+	}
+}
+
+// Dark blue through cyan, green and yellow to red
+inline vec3 heat_color(float t) {
+	static const vec3 stops[] = {
+		vec3(0.05f, 0.03f, 0.3f),
+		vec3(0.f, 0.6f, 0.9f),
+		vec3(0.1f, 0.8f, 0.2f),
+		vec3(1.f, 0.9f, 0.f),
+		vec3(0.9f, 0.05f, 0.f)
+	};
+	const int last = int(sizeof(stops) / sizeof(stops[0])) - 1;
+
+	t = glm::clamp(t, 0.f, 1.f) * last;
+	int i = std::min(int(t), last - 1);
+	return glm::mix(stops[i], stops[i + 1], t - i);
+}
+
+std::vector<unsigned char> cost_map::false_color(heatmap_metric metric) const {
+	std::vector<float> values(pixels.size());
+	for (size_t i = 0; i < pixels.size(); ++i) {
+		values[i] = value(pixels[i], metric);
+	}
+
+	// A few extreme pixels would otherwise wash out the rest of the image
+	std::vector<float> sorted = values;
+	size_t percentile = std::min(sorted.size() - 1, sorted.size() * 99 / 100);
+	std::nth_element(sorted.begin(), sorted.begin() + percentile, sorted.end());
+	float scale = sorted[percentile] > 0.f ? 1.f / sorted[percentile] : 0.f;
+
+	std::vector<unsigned char> image(pixels.size() * 3);
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			vec3 color = heat_color(values[size_t(y) * width + x] * scale);
+
+			// Rendered rows count up from the bottom of the image
+			unsigned char* out = &image[(size_t(height - y - 1) * width + x) * 3];
+			out[0] = (unsigned char)(255.f * color.r);
+			out[1] = (unsigned char)(255.f * color.g);
+			out[2] = (unsigned char)(255.f * color.b);
+		}
+	}
+
+	return image;
+}
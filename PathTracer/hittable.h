@@ -1,15 +1,17 @@
 #pragma once
 
 #include "PathTracer.h"
+#include "aabb.h"
 
 class material;
 
 struct hit_record {
 	vec3 p;
 	vec3 normal;
-	shared_ptr<material> mat_ptr;
+	const material* mat_ptr = nullptr;
 	float t;
 	bool front_face;
+	int object_id = -1;		// Set by the list or BVH holding the primitive, the outermost one wins
 
 	inline void set_face_normal(const ray& r, const vec3& outward_normal) {
 		front_face = dot(r.direction(), outward_normal) < 0;
@@ -20,4 +22,12 @@ struct hit_record {
 class hittable {
 	public:
 		virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
+		virtual bool bounding_box(aabb& output_box) const = 0;
+
+		// Bounds of the part of the primitive between min and max along axis, for spatial splits.
+		// Returns false when only the bounding box can be clipped.
+		virtual bool clipped_box(int axis, float min, float max, aabb& output_box) const { return false; }
+
+	public:
+		int object_id = -1;		// Given by the first list the object is added to, unless set before
 };
\ No newline at end of file
@@ -1,8 +1,11 @@
 #pragma once
 
+#include "arena.h"
 #include "hittable.h"
+#include "telemetry.h"
 
 #include <memory>
+#include <utility>
 #include <vector>
 
 using std::shared_ptr;
@@ -11,15 +14,26 @@ using std::make_shared;
 class hittable_list : public hittable {
 	public:
 		hittable_list() {}
-		hittable_list(shared_ptr<hittable> object) { add(object); }
 
 		void clear() { objects.clear(); }
-		void add(shared_ptr<hittable> object) { objects.push_back(object); }
+		void add(hittable* object) {
+			if (object->object_id < 0) object->object_id = int(objects.size());
+			objects.push_back(object);
+		}
+
+		// Made in the list's arena, which is started on first use
+		template <class T, class... Args>
+		T* make(Args&&... args) {
+			if (!arena) arena = make_shared<scene_arena>();
+			return arena->make<T>(std::forward<Args>(args)...);
+		}
 
 		virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
 
 	public:
-		std::vector<shared_ptr<hittable>> objects;
+		std::vector<hittable*> objects;		// Not owned, the arena keeps them
+		shared_ptr<scene_arena> arena;		// Owns the objects made in it, lists may share one
 };
 
 bool hittable_list::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
@@ -27,13 +41,29 @@ bool hittable_list::hit(const ray& r, float t_min, float t_max, hit_record& rec)
 	bool hit_anything = false;
 	auto closest_so_far = t_max;
 
+	thread_ray_counters.primitive_tests += objects.size();
 	for (const auto& object : objects) {
 		if (object->hit(r, t_min, closest_so_far, temp_rec)) {
 			hit_anything = true;
 			closest_so_far = temp_rec.t;
 			rec = temp_rec;
+			rec.object_id = object->object_id;
 		}
 	}
 
 	return hit_anything;
+}
+
+bool hittable_list::bounding_box(aabb& output_box) const {
+	if (objects.empty()) return false;
+
+	aabb temp_box;
+	output_box = aabb();
+
+	for (const auto& object : objects) {
+		if (!object->bounding_box(temp_box)) return false;
+		output_box.expand(temp_box);
+	}
+
+	return true;
 }
\ No newline at end of file
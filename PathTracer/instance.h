@@ -0,0 +1,73 @@
+#pragma once
+
+#include "hittable.h"
+#include "glm/glm.hpp"
+
+// A transformed reference to a shared object, usually a bvh, so repeated meshes are stored once
+class instance : public hittable {
+	public:
+		instance() {}
+		instance(const hittable* obj, const glm::mat4& transform, const material* m = nullptr);
+
+		virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
+
+	public:
+		const hittable* object = nullptr;
+		const material* mat_ptr = nullptr;	// Replaces the object's materials when set
+
+		// Affine transforms are kept as a linear part and a translation
+		glm::mat3 object_to_world;
+		vec3 object_to_world_offset;
+		glm::mat3 world_to_object;
+		vec3 world_to_object_offset;
+
+		aabb world_box;
+		bool has_box = false;
+};
+
+instance::instance(const hittable* obj, const glm::mat4& transform, const material* m) : object(obj), mat_ptr(m) {
+	glm::mat4 inverse = glm::inverse(transform);
+
+	object_to_world = glm::mat3(transform);
+	object_to_world_offset = vec3(transform[3]);
+	world_to_object = glm::mat3(inverse);
+	world_to_object_offset = vec3(inverse[3]);
+
+	aabb object_box;
+	has_box = object->bounding_box(object_box);
+
+	if (has_box) {
+		for (int corner = 0; corner < 8; ++corner) {
+			vec3 p(
+				(corner & 1) ? object_box.maximum.x : object_box.minimum.x,
+				(corner & 2) ? object_box.maximum.y : object_box.minimum.y,
+				(corner & 4) ? object_box.maximum.z : object_box.minimum.z);
+			world_box.expand(object_to_world * p + object_to_world_offset);
+		}
+	}
+}
+
+bool instance::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	// Parametric distances are unchanged by an affine transform, so t needs no conversion
+	ray local(world_to_object * r.origin() + world_to_object_offset, world_to_object * r.direction());
+
+	if (!object->hit(local, t_min, t_max, rec)) {
+		return false;
+	}
+
+	// Normals use the inverse transpose, which keeps the facing of the local hit
+	rec.p = r.at(rec.t);
+	rec.normal = normalize(glm::transpose(world_to_object) * rec.normal);
+
+	if (mat_ptr) {
+		rec.mat_ptr = mat_ptr;
+	}
+
+	return true;
+}
+
+bool instance::bounding_box(aabb& output_box) const {
+	output_box = world_box;
+	return has_box;
+}
@@ -0,0 +1,202 @@
+// Included once by each kernels_<isa>.cpp, which defines KERNEL_NAMESPACE, KERNEL_TABLE and KERNEL_NAME first. The
+// namespace keeps every copy of these functions distinct, so the linker can never swap an AVX-512 copy into a caller
+// compiled for an older CPU.
+//
+// The math follows triangle::hit and aabb::hit operation for operation, so every instruction set renders the same
+// image as the scalar path.
+
+#include "kernels.h"
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+namespace KERNEL_NAMESPACE {
+
+const int leaf_chunk = kernel_triangle_padding;
+
+// Same argument order and NaN behaviour as glm::min and glm::max
+static inline float min(float a, float b) { return b < a ? b : a; }
+static inline float max(float a, float b) { return a < b ? b : a; }
+
+static inline float square_root(float x) {
+#if defined(_MSC_VER) && !defined(__clang__)
+	return _mm_cvtss_f32(_mm_sqrt_ss(_mm_set_ss(x)));
+#else
+	return __builtin_sqrtf(x);
+#endif
+}
+
+static inline bool box_hit(const kernel_node& node, const kernel_ray& ray, float t_min, float t_max, float& t_entry) {
+	float t_near[3];
+	float t_far[3];
+	for (int axis = 0; axis < 3; ++axis) {
+		float t0 = (node.minimum[axis] - ray.origin[axis]) * ray.inv_direction[axis];
+		float t1 = (node.maximum[axis] - ray.origin[axis]) * ray.inv_direction[axis];
+		t_near[axis] = min(t0, t1);
+		t_far[axis] = max(t0, t1);
+	}
+
+	t_entry = max(max(t_near[0], t_near[1]), max(t_near[2], t_min));
+	float t_exit = min(min(t_far[0], t_far[1]), min(t_far[2], t_max));
+
+	return t_entry <= t_exit;
+}
+
+// Triangles are tested a fixed size chunk at a time without early outs so the loop vectorizes, then hits are accepted
+// in primitive order exactly as the scalar loop would. Chunks can read past the leaf, into the padding at the end.
+static bool leaf_hit(const kernel_primitives& primitives, int first, int count, const kernel_ray& ray, float t_min, float& closest, kernel_hit& hit) {
+	const float o[3] = { ray.origin[0], ray.origin[1], ray.origin[2] };
+	const float d[3] = { ray.direction[0], ray.direction[1], ray.direction[2] };
+	const float* p0x = primitives.p0[0] + first;
+	const float* p0y = primitives.p0[1] + first;
+	const float* p0z = primitives.p0[2] + first;
+	const float* e1x = primitives.e1[0] + first;
+	const float* e1y = primitives.e1[1] + first;
+	const float* e1z = primitives.e1[2] + first;
+	const float* e2x = primitives.e2[0] + first;
+	const float* e2y = primitives.e2[1] + first;
+	const float* e2z = primitives.e2[2] + first;
+	bool hit_anything = false;
+
+	for (int chunk_s = 0; chunk_s < count; chunk_s += leaf_chunk) {
+		const int n = count - chunk_s < leaf_chunk ? count - chunk_s : leaf_chunk;
+		const int base = first + chunk_s;
+
+		int hits[leaf_chunk];
+		float ts[leaf_chunk];
+		float us[leaf_chunk];
+		float vs[leaf_chunk];
+
+		for (int i = 0; i < leaf_chunk; ++i) {
+			const int p = chunk_s + i;
+			float e1[3] = { e1x[p], e1y[p], e1z[p] };
+			float e2[3] = { e2x[p], e2y[p], e2z[p] };
+			float T[3] = { o[0] - p0x[p], o[1] - p0y[p], o[2] - p0z[p] };
+
+			float P[3] = { d[1] * e2[2] - e2[1] * d[2], d[2] * e2[0] - e2[2] * d[0], d[0] * e2[1] - e2[0] * d[1] };
+			float Q[3] = { T[1] * e1[2] - e1[1] * T[2], T[2] * e1[0] - e1[2] * T[0], T[0] * e1[1] - e1[0] * T[1] };
+			float Pe1 = P[0] * e1[0] + P[1] * e1[1] + P[2] * e1[2];
+
+			float t = (Q[0] * e2[0] + Q[1] * e2[1] + Q[2] * e2[2]) / Pe1;
+			float u = (P[0] * T[0] + P[1] * T[1] + P[2] * T[2]) / Pe1;
+			float v = (Q[0] * d[0] + Q[1] * d[1] + Q[2] * d[2]) / Pe1;
+
+			// Bitwise rather than logical operators keep the loop free of branches
+			hits[i] = (Pe1 != 0.f) & !(u < 0.f) & !(v < 0.f) & !(u + v > 1.f) & !(t < t_min);
+			ts[i] = t;
+			us[i] = u;
+			vs[i] = v;
+		}
+
+		for (int i = 0; i < n; ++i) {
+			const int p = base + i;
+
+			if (primitives.is_triangle[p]) {
+				if (hits[i] && !(closest < ts[i])) {
+					closest = ts[i];
+					hit = { p, ts[i], us[i], vs[i] };
+					hit_anything = true;
+				}
+			}
+			else {
+				float t;
+				if (primitives.hit_other(primitives.context, p, t_min, closest, t)) {
+					closest = t;
+					hit = { p, t, 0.f, 0.f };
+					hit_anything = true;
+				}
+			}
+		}
+	}
+
+	return hit_anything;
+}
+
+bool traverse(const kernel_node* nodes, const kernel_primitives& primitives, const kernel_ray& ray, float t_min, float t_max, kernel_hit& hit, kernel_counters& counters) {
+	bool hit_anything = false;
+	float closest_so_far = t_max;
+
+	++counters.box_tests;
+	float t_entry;
+	if (!box_hit(nodes[0], ray, t_min, closest_so_far, t_entry)) return false;
+
+	struct stack_entry {
+		int node;
+		float t_entry;
+	};
+
+	stack_entry stack[kernel_max_depth];
+	int stack_size = 0;
+	int current = 0;
+
+	while (true) {
+		const kernel_node& node = nodes[current];
+		++counters.nodes_visited;
+
+		if (node.count > 0) {
+			counters.primitive_tests += node.count;
+			if (leaf_hit(primitives, node.offset, node.count, ray, t_min, closest_so_far, hit)) {
+				hit_anything = true;
+			}
+		}
+		else {
+			int near_child = current + 1;
+			int far_child = node.offset;
+
+			float t_near, t_far;
+			counters.box_tests += 2;
+			bool hit_near = box_hit(nodes[near_child], ray, t_min, closest_so_far, t_near);
+			bool hit_far = box_hit(nodes[far_child], ray, t_min, closest_so_far, t_far);
+
+			if (hit_near && hit_far) {
+				if (t_far < t_near) {
+					int child = near_child;
+					near_child = far_child;
+					far_child = child;
+
+					float t = t_near;
+					t_near = t_far;
+					t_far = t;
+				}
+
+				stack[stack_size++] = { far_child, t_far };
+				current = near_child;
+				continue;
+			}
+			else if (hit_near || hit_far) {
+				current = hit_near ? near_child : far_child;
+				continue;
+			}
+		}
+
+		current = -1;
+		while (stack_size > 0) {
+			const stack_entry& entry = stack[--stack_size];
+			if (entry.t_entry <= closest_so_far) {
+				current = entry.node;
+				break;
+			}
+		}
+
+		if (current == -1) break;
+	}
+
+	return hit_anything;
+}
+
+void resolve_rgb8(const float* colors, int count, float scale, unsigned char* out) {
+	for (int i = 0; i < count; ++i) {
+		float c = square_root(scale * colors[i]);
+		c = min(max(c, 0.f), 0.999f);
+		out[i] = (unsigned char)(int)(256 * c);
+	}
+}
+
+}
+
+const kernel_table KERNEL_TABLE = {
+	KERNEL_NAME,
+	KERNEL_NAMESPACE::traverse,
+	KERNEL_NAMESPACE::resolve_rgb8
+};
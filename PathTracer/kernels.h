@@ -0,0 +1,66 @@
+#pragma once
+
+// Hot loops compiled once per instruction set in their own translation units, see kernel_impl.h. Those are built with
+// different compiler flags, so everything shared with them is plain data and no inline code (glm, the standard
+// library) may cross this boundary.
+
+const int kernel_max_depth = 128;		// Traversal stack size, the BVH bounds its depth to this
+const int kernel_triangle_padding = 8;	// Readable entries past the last triangle of each array
+
+// Same layout as bvh_node
+struct kernel_node {
+	float minimum[3];
+	float maximum[3];
+	int offset;
+	int count;
+};
+
+struct kernel_ray {
+	float origin[3];
+	float direction[3];
+	float inv_direction[3];
+};
+
+struct kernel_hit {
+	int primitive;
+	float t;
+	float u;
+	float v;
+};
+
+struct kernel_counters {
+	int nodes_visited;
+	int box_tests;
+	int primitive_tests;
+};
+
+// Intersects a primitive the kernels know nothing about, returning its distance in t on a hit
+typedef bool (*kernel_hit_callback)(void* context, int primitive, float t_min, float t_max, float& t);
+
+// Primitives of a BVH in leaf order. Triangles are stored as one array per component, padded with degenerate
+// triangles. Anything else goes through the callback.
+struct kernel_primitives {
+	const float* p0[3];
+	const float* e1[3];
+	const float* e2[3];
+	const unsigned char* is_triangle;
+
+	kernel_hit_callback hit_other;
+	void* context;
+};
+
+struct kernel_table {
+	const char* name;
+
+	// Closest hit in the flattened depth first tree
+	bool (*traverse)(const kernel_node* nodes, const kernel_primitives& primitives, const kernel_ray& ray,
+		float t_min, float t_max, kernel_hit& hit, kernel_counters& counters);
+
+	// Gamma corrected 8 bit values of count accumulated color channels
+	void (*resolve_rgb8)(const float* colors, int count, float scale, unsigned char* out);
+};
+
+extern const kernel_table generic_kernels;
+extern const kernel_table sse42_kernels;
+extern const kernel_table avx2_kernels;
+extern const kernel_table avx512_kernels;
@@ -0,0 +1,6 @@
+// Built with AVX2 and FMA enabled
+#define KERNEL_NAMESPACE avx2_kernel
+#define KERNEL_TABLE avx2_kernels
+#define KERNEL_NAME "avx2"
+
+#include "kernel_impl.h"
@@ -0,0 +1,6 @@
+// Built with AVX-512 F, VL, BW and DQ enabled
+#define KERNEL_NAMESPACE avx512_kernel
+#define KERNEL_TABLE avx512_kernels
+#define KERNEL_NAME "avx512"
+
+#include "kernel_impl.h"
@@ -0,0 +1,6 @@
+// Baseline build, used when CPUID reports nothing better
+#define KERNEL_NAMESPACE generic_kernel
+#define KERNEL_TABLE generic_kernels
+#define KERNEL_NAME "generic"
+
+#include "kernel_impl.h"
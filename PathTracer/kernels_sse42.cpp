@@ -0,0 +1,6 @@
+// Built with SSE4.2 enabled
+#define KERNEL_NAMESPACE sse42_kernel
+#define KERNEL_TABLE sse42_kernels
+#define KERNEL_NAME "sse4.2"
+
+#include "kernel_impl.h"
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <random>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read only view of a whole file, pages are loaded by the OS as they are touched
+class mapped_file {
+	public:
+		mapped_file() {}
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+		~mapped_file() { close(); }
+
+		bool open(const char* path);
+		void close();
+
+		bool is_open() const { return view != nullptr; }
+		const unsigned char* data() const { return static_cast<const unsigned char*>(view); }
+		size_t size() const { return length; }
+
+		// Hints for callers that manage their own resident set, neither changes what the view reads
+		void will_need(size_t offset, size_t count) const;
+		void release(size_t offset, size_t count) const;	// Drops the range's pages from the process until touched again
+
+	private:
+		void* view = nullptr;
+		size_t length = 0;
+
+#ifdef _WIN32
+		HANDLE file = INVALID_HANDLE_VALUE;
+		HANDLE mapping = nullptr;
+#endif
+};
+
+// Replaces to with from in one step, so a crash leaves either file whole and readers never find neither
+bool replace_file(const char* from, const char* to);
+
+// A temporary next to path that no other writer of path uses, from this process or another, to write the file whole
+// before it replaces path
+std::string unique_temp_path(const std::string& path) {
+#ifdef _WIN32
+	const unsigned long process = GetCurrentProcessId();
+#else
+	const unsigned long process = (unsigned long)getpid();
+#endif
+	std::random_device device;
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%lu.%08x%08x.tmp", process, device(), device());
+	return path + suffix;
+}
+
+#ifdef _WIN32
+
+bool replace_file(const char* from, const char* to) {
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+bool mapped_file::open(const char* path) {
+	close();
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+		close();
+		return false;
+	}
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		close();
+		return false;
+	}
+
+	view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == nullptr) {
+		close();
+		return false;
+	}
+
+	length = size_t(file_size.QuadPart);
+	return true;
+}
+
+void mapped_file::will_need(size_t offset, size_t count) const {
+	// Windows reads ahead on the first fault, PrefetchVirtualMemory needs Windows 8
+}
+
+void mapped_file::release(size_t offset, size_t count) const {
+	// Unlocking pages that were never locked takes them out of the working set
+	if (view != nullptr && count > 0) VirtualUnlock(static_cast<unsigned char*>(view) + offset, count);
+}
+
+void mapped_file::close() {
+	if (view != nullptr) UnmapViewOfFile(view);
+	if (mapping != nullptr) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+
+	view = nullptr;
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+	length = 0;
+}
+
+#else
+
+bool replace_file(const char* from, const char* to) {
+	return rename(from, to) == 0;
+}
+
+bool mapped_file::open(const char* path) {
+	close();
+
+	int fd = ::open(path, O_RDONLY);
+	if (fd == -1) return false;
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+
+	void* address = mmap(nullptr, size_t(file_stat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (address == MAP_FAILED) return false;
+
+	view = address;
+	length = size_t(file_stat.st_size);
+	return true;
+}
+
+void mapped_file::will_need(size_t offset, size_t count) const {
+	const size_t page = size_t(sysconf(_SC_PAGESIZE));
+	const size_t first = offset / page * page;
+	if (view != nullptr && count > 0) madvise(static_cast<unsigned char*>(view) + first, offset + count - first, MADV_WILLNEED);
+}
+
+void mapped_file::release(size_t offset, size_t count) const {
+	// Only whole pages inside the range, a page shared with a neighbouring range stays
+	const size_t page = size_t(sysconf(_SC_PAGESIZE));
+	const size_t first = (offset + page - 1) / page * page;
+	const size_t last = (offset + count) / page * page;
+	if (view != nullptr && first < last) madvise(static_cast<unsigned char*>(view) + first, last - first, MADV_DONTNEED);
+}
+
+void mapped_file::close() {
+	if (view != nullptr) munmap(view, length);
+
+	view = nullptr;
+	length = 0;
+}
+
+#endif
@@ -3,11 +3,40 @@
 #include "PathTracer.h"
 #include "hittable.h"
 
+#include <atomic>
+
 struct hit_record;
 
+std::atomic<int>& material_id_counter() {
+	static std::atomic<int> next(0);
+	return next;
+}
+
+// Materials are numbered in the order they are made, which is repeatable for a given scene
+int next_material_id() {
+	return material_id_counter()++;
+}
+
+// A process that loads several scenes numbers each one's materials as a process of its own would, from 0 before
+// loading it and on from its last material for anything made for it later
+void reset_material_ids(int next = 0) {
+	material_id_counter() = next;
+}
+
 class material {
 	public:
+		material() : id(next_material_id()) {}
+
 		virtual bool scatter(const ray& r_in, const hit_record& rec, vec3& attenuation, ray& r_out) const = 0;
+
+		// Reflectance of the surface without lighting, for the albedo output
+		virtual vec3 base_color(const hit_record& rec) const { return vec3(1.f); }
+
+		// Perfect mirrors and glass, the albedo and normal outputs look through them at what they show
+		virtual bool is_specular() const { return false; }
+
+	public:
+		const int id;
 };
 
 class lambertian : public material {
@@ -27,6 +56,8 @@ class lambertian : public material {
 			return true;
 		}
 
+		virtual vec3 base_color(const hit_record& rec) const override { return albedo; }
+
 	public:
 		vec3 albedo;
 };
@@ -43,6 +74,9 @@ class metal : public material {
 			return dot(r_out.direction(), rec.normal) > 0;
 		}
 
+		virtual vec3 base_color(const hit_record& rec) const override { return albedo; }
+		virtual bool is_specular() const override { return roughness == 0.f; }
+
 	public:
 		vec3 albedo;
 		float roughness;
@@ -74,6 +108,8 @@ class dielectric : public material {
 			return true;
 		}
 
+		virtual bool is_specular() const override { return true; }
+
 	public:
 		float ior;
 
@@ -99,17 +135,14 @@ class normal : public material {
 			}
 
 			r_out = ray(rec.p, scatter_direction);
-			
-			if (rec.front_face) {
-				attenuation = (standard_unit_vector + rec.normal) / 2.f;
-			}
-			else {
-				attenuation = (standard_unit_vector - rec.normal) / 2.f;
-			}
-
+			attenuation = base_color(rec);
 			return true;
 		}
 
+		virtual vec3 base_color(const hit_record& rec) const override {
+			return rec.front_face ? (standard_unit_vector + rec.normal) / 2.f : (standard_unit_vector - rec.normal) / 2.f;
+		}
+
 	private:
 		const vec3 standard_unit_vector = normalize(vec3(1, 1, 1));
 };
\ No newline at end of file
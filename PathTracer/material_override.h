@@ -0,0 +1,125 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+enum class material_kind {
+	lambertian,
+	metal,
+	dielectric,
+	normal
+};
+
+// A material swapped in at render time, so a loaded scene can be tried with other looks without loading it again
+struct material_override {
+	int id = -1;			// Material replaced, as numbered in the material_id output, -1 for every material
+	material_kind kind = material_kind::lambertian;
+	vec3 albedo = vec3(0.5f);
+	float parameter = 0.f;	// Roughness of metal, index of refraction of dielectric
+};
+
+// "id: kind values" or "*: kind values", as "3: lambertian 0.8 0.1 0.1", "*: metal 0.9 0.9 0.9 0.05",
+// "2: dielectric 1.5" or "0: normal"
+bool parse_material_override(const std::string& text, material_override& value) {
+	size_t colon = text.find(':');
+	if (colon == std::string::npos) return false;
+
+	material_override parsed;
+	char target[16];
+	char extra;
+	if (sscanf(text.substr(0, colon).c_str(), " %15s %c", target, &extra) != 1) return false;
+
+	if (strcmp(target, "*") != 0) {
+		char* end = nullptr;
+		long id = strtol(target, &end, 10);
+		if (end == target || *end != '\0' || id < 0) return false;
+		parsed.id = int(id);
+	}
+
+	char kind[16];
+	int kind_end = 0;
+	const char* rest = text.c_str() + colon + 1;
+	if (sscanf(rest, " %15s%n", kind, &kind_end) != 1) return false;
+
+	const char* values = rest + kind_end;
+	float r, g, b, p;
+
+	if (strcmp(kind, "lambertian") == 0 && sscanf(values, " %f %f %f %c", &r, &g, &b, &extra) == 3) {
+		parsed.kind = material_kind::lambertian;
+		parsed.albedo = vec3(r, g, b);
+	}
+	else if (strcmp(kind, "metal") == 0 && sscanf(values, " %f %f %f %f %c", &r, &g, &b, &p, &extra) == 4) {
+		parsed.kind = material_kind::metal;
+		parsed.albedo = vec3(r, g, b);
+		parsed.parameter = p;
+	}
+	else if (strcmp(kind, "dielectric") == 0 && sscanf(values, " %f %c", &p, &extra) == 1 && p > 0.f) {
+		parsed.kind = material_kind::dielectric;
+		parsed.parameter = p;
+	}
+	else if (strcmp(kind, "normal") == 0 && sscanf(values, " %c", &extra) != 1) {
+		parsed.kind = material_kind::normal;
+	}
+	else {
+		return false;
+	}
+
+	value = parsed;
+	return true;
+}
+
+shared_ptr<material> make_override_material(const material_override& value) {
+	switch (value.kind) {
+		case material_kind::metal: return make_shared<metal>(value.albedo, value.parameter);
+		case material_kind::dielectric: return make_shared<dielectric>(value.parameter);
+		case material_kind::normal: return make_shared<normal>();
+		default: return make_shared<lambertian>(value.albedo);
+	}
+}
+
+// Hits the world as it is, then swaps the material of every hit that has an override. Later overrides of the same
+// material win, one for a single material wins over one for every material.
+class material_override_world : public hittable {
+	public:
+		material_override_world(const hittable& inner, const std::vector<material_override>& overrides);
+
+		virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+		virtual bool bounding_box(aabb& output_box) const override { return world.bounding_box(output_box); }
+
+	private:
+		const hittable& world;
+		shared_ptr<material> every;							// Replaces materials without one of their own
+		std::vector<shared_ptr<material>> replacements;		// By material id, null where there is none
+};
+
+material_override_world::material_override_world(const hittable& inner, const std::vector<material_override>& overrides) : world(inner) {
+	for (const material_override& value : overrides) {
+		if (value.id < 0) {
+			every = make_override_material(value);
+			continue;
+		}
+
+		if (size_t(value.id) >= replacements.size()) replacements.resize(size_t(value.id) + 1);
+		replacements[value.id] = make_override_material(value);
+	}
+}
+
+bool material_override_world::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	if (!world.hit(r, t_min, t_max, rec)) return false;
+
+	const int id = rec.mat_ptr->id;
+	if (id >= 0 && size_t(id) < replacements.size() && replacements[id]) {
+		rec.mat_ptr = replacements[id].get();
+	}
+	else if (every) {
+		rec.mat_ptr = every.get();
+	}
+	return true;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "hittable_list.h"
+#include "triangle.h"
+
+#include <vector>
+
+struct face {
+	int v[3];
+	int t[3];
+	int n[3];
+};
+
+// Indexed triangle data as loaded from disk, before it is turned into hittables
+struct mesh {
+	std::vector<vec3> vertices;
+	std::vector<vec3> normals;
+	std::vector<face> faces;
+	bool is_smooth = false;
+};
+
+inline triangle* make_triangle(const mesh& m, const face& f, const material* mat, scene_arena& arena) {
+	if (m.is_smooth) {
+		return arena.make<triangle>(
+			m.vertices[f.v[0]],
+			m.vertices[f.v[1]],
+			m.vertices[f.v[2]],
+			m.normals[f.n[0]],
+			m.normals[f.n[1]],
+			m.normals[f.n[2]],
+			mat
+			);
+	}
+
+	return arena.make<triangle>(
+		m.vertices[f.v[0]],
+		m.vertices[f.v[1]],
+		m.vertices[f.v[2]],
+		mat
+		);
+}
+
+// Smooth shaded unit sphere, mostly useful as a stand in mesh for procedural scenes
+mesh make_uv_sphere(int rings, int segments) {
+	mesh m;
+	m.is_smooth = true;
+
+	for (int i = 0; i <= rings; ++i) {
+		float theta = pi * i / rings;
+
+		for (int j = 0; j < segments; ++j) {
+			float phi = 2.f * pi * j / segments;
+			vec3 p(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+
+			m.vertices.push_back(p);
+			m.normals.push_back(p);
+		}
+	}
+
+	auto index = [segments](int i, int j) { return i * segments + (j % segments); };
+
+	for (int i = 0; i < rings; ++i) {
+		for (int j = 0; j < segments; ++j) {
+			int a = index(i, j);
+			int b = index(i, j + 1);
+			int c = index(i + 1, j);
+			int d = index(i + 1, j + 1);
+
+			// The poles collapse one triangle of each quad, skip it
+			if (i != 0) m.faces.push_back({ { a, c, b }, { 0, 0, 0 }, { a, c, b } });
+			if (i != rings - 1) m.faces.push_back({ { b, c, d }, { 0, 0, 0 }, { b, c, d } });
+		}
+	}
+
+	return m;
+}
+
+// Long, thin triangles at arbitrary angles inside the unit cube, like the slivers in architectural and CAD exports
+mesh make_sliver_mesh(int count, float width) {
+	mesh m;
+
+	for (int i = 0; i < count; ++i) {
+		vec3 a = random_vec3(-1.f, 1.f);
+		vec3 b = random_vec3(-1.f, 1.f);
+		vec3 side = normalize(cross(b - a, random_vec3_in_unit_sphere() + vec3(0.f, 0.f, 1e-3f))) * width;
+
+		int base = int(m.vertices.size());
+		m.vertices.push_back(a);
+		m.vertices.push_back(b);
+		m.vertices.push_back(a + side);
+		m.faces.push_back({ { base, base + 1, base + 2 }, { 0, 0, 0 }, { 0, 0, 0 } });
+	}
+
+	return m;
+}
+
+// Every triangle shares one object ID. The triangles go in the list's arena.
+void add_triangles(const mesh& m, const material* mat, hittable_list& objects) {
+	const int object_id = int(objects.objects.size());
+	objects.objects.reserve(objects.objects.size() + m.faces.size());
+	if (!objects.arena) objects.arena = make_shared<scene_arena>();
+	for (const face& f : m.faces) {
+		auto tri = make_triangle(m, f, mat, *objects.arena);
+		tri->object_id = object_id;
+		objects.add(tri);
+	}
+}
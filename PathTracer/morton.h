@@ -0,0 +1,122 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+inline int count_leading_zeros(uint64_t x) {
+	if (x == 0) return 64;
+
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return 63 - int(index);
+#else
+	return __builtin_clzll(x);
+#endif
+}
+
+// Spread the low 10 bits of v so that each is followed by two zero bits
+inline uint32_t expand_bits_10(uint32_t v) {
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+// Spread the low 21 bits of v so that each is followed by two zero bits
+inline uint64_t expand_bits_21(uint64_t v) {
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x001f00000000ffffull;
+	v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+	v = (v | (v << 8)) & 0x100f00f00f00f00full;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+	v = (v | (v << 2)) & 0x1249249249249249ull;
+	return v;
+}
+
+// Interleaved code for a point inside the unit cube
+inline uint32_t morton_code_30(const vec3& p) {
+	vec3 q = glm::clamp(p * 1024.f, vec3(0.f), vec3(1023.f));
+	return (expand_bits_10(uint32_t(q.x)) << 2) | (expand_bits_10(uint32_t(q.y)) << 1) | expand_bits_10(uint32_t(q.z));
+}
+
+inline uint64_t morton_code_63(const vec3& p) {
+	const float scale = float(1 << 21);
+	vec3 q = glm::clamp(p * scale, vec3(0.f), vec3(scale - 1.f));
+	return (expand_bits_21(uint64_t(q.x)) << 2) | (expand_bits_21(uint64_t(q.y)) << 1) | expand_bits_21(uint64_t(q.z));
+}
+
+// Stable LSD radix sort of keys, carrying values along, using 8 bit digits split across the pool
+void parallel_radix_sort(std::vector<uint64_t>& keys, std::vector<int>& values, int key_bits, thread_pool& pool) {
+	const int n = int(keys.size());
+	if (n <= 1) return;
+
+	const int chunk_count = std::max(1, std::min(int(4 * std::max(1u, pool.ThreadCount())), n / 4096));
+	const int chunk_size = (n + chunk_count - 1) / chunk_count;
+
+	std::vector<uint64_t> keys_out(n);
+	std::vector<int> values_out(n);
+	std::vector<std::array<int, 256>> offsets(chunk_count);
+
+	for (int shift = 0; shift < key_bits; shift += 8) {
+		for (int c = 0; c < chunk_count; ++c) {
+			pool.QueueJob([&, c, shift] {
+				std::array<int, 256>& histogram = offsets[c];
+				histogram.fill(0);
+
+				int end = std::min(n, (c + 1) * chunk_size);
+				for (int i = c * chunk_size; i < end; ++i) {
+					++histogram[(keys[i] >> shift) & 0xff];
+				}
+			});
+		}
+		pool.Wait();
+
+		// Skip digits that every key shares
+		bool is_uniform = false;
+		for (int digit = 0; digit < 256 && !is_uniform; ++digit) {
+			int total = 0;
+			for (int c = 0; c < chunk_count; ++c) total += offsets[c][digit];
+			is_uniform = (total == n);
+		}
+		if (is_uniform) continue;
+
+		// Turn the histograms into each chunk's starting position for every digit
+		int sum = 0;
+		for (int digit = 0; digit < 256; ++digit) {
+			for (int c = 0; c < chunk_count; ++c) {
+				int count = offsets[c][digit];
+				offsets[c][digit] = sum;
+				sum += count;
+			}
+		}
+
+		for (int c = 0; c < chunk_count; ++c) {
+			pool.QueueJob([&, c, shift] {
+				std::array<int, 256>& position = offsets[c];
+
+				int end = std::min(n, (c + 1) * chunk_size);
+				for (int i = c * chunk_size; i < end; ++i) {
+					int dst = position[(keys[i] >> shift) & 0xff]++;
+					keys_out[dst] = keys[i];
+					values_out[dst] = values[i];
+				}
+			});
+		}
+		pool.Wait();
+
+		keys.swap(keys_out);
+		values.swap(values_out);
+	}
+}
@@ -0,0 +1,309 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <afunix.h>
+#include <windows.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET socket_handle;
+const socket_handle invalid_socket_handle = INVALID_SOCKET;
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+typedef int socket_handle;
+const socket_handle invalid_socket_handle = -1;
+#endif
+
+// Blocking TCP or local socket connection or listener. Sends and receives return false once the connection is gone and
+// leave closing to the owner, so one thread may send while another receives.
+class tcp_socket {
+	public:
+		tcp_socket() {}
+		explicit tcp_socket(socket_handle h) : handle(h) {}
+		tcp_socket(const tcp_socket&) = delete;
+		tcp_socket& operator=(const tcp_socket&) = delete;
+		tcp_socket(tcp_socket&& other) : handle(other.handle) { other.handle = invalid_socket_handle; }
+		tcp_socket& operator=(tcp_socket&& other);
+		~tcp_socket() { close(); }
+
+		bool connect(const std::string& host, int port);
+		bool listen(const std::string& host, int port);	// On the interface with this address, 0.0.0.0 for every one
+		bool connect_local(const std::string& path);		// A Unix domain socket, on Windows too
+		bool listen_local(const std::string& path);			// Replaces a socket left at path by an earlier listener
+		bool accept(tcp_socket& client, int timeout_ms);	// False when nothing connected in time
+
+		bool send_all(const void* data, size_t size);
+		bool receive_all(void* data, size_t size);
+		bool wait_readable(int timeout_ms);					// A negative timeout waits forever
+		bool set_timeout(int timeout_ms);					// Sends and receives stalled this long fail, 0 never does
+
+		void close();
+		bool is_open() const { return handle != invalid_socket_handle; }
+
+	private:
+		socket_handle handle = invalid_socket_handle;
+};
+
+// Winsock needs starting once per process, other platforms need nothing
+inline bool net_startup() {
+#ifdef _WIN32
+	static bool is_started = [] {
+		WSADATA data;
+		return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	}();
+	return is_started;
+#else
+	return true;
+#endif
+}
+
+// "host:port", the host may be a name or an address
+bool parse_net_address(const std::string& address, std::string& host, int& port) {
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos || colon == 0) return false;
+
+	char* end = nullptr;
+	long parsed = strtol(address.c_str() + colon + 1, &end, 10);
+	if (end == address.c_str() + colon + 1 || *end != '\0' || parsed <= 0 || parsed > 65535) return false;
+
+	host = address.substr(0, colon);
+	port = int(parsed);
+	return true;
+}
+
+tcp_socket& tcp_socket::operator=(tcp_socket&& other) {
+	if (this != &other) {
+		close();
+		handle = other.handle;
+		other.handle = invalid_socket_handle;
+	}
+	return *this;
+}
+
+bool tcp_socket::connect(const std::string& host, int port) {
+	close();
+	if (!net_startup()) return false;
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	addrinfo* addresses = nullptr;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) return false;
+
+	for (addrinfo* a = addresses; a != nullptr && !is_open(); a = a->ai_next) {
+		handle = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (!is_open()) continue;
+
+		if (::connect(handle, a->ai_addr, int(a->ai_addrlen)) != 0) close();
+	}
+	freeaddrinfo(addresses);
+
+	if (!is_open()) return false;
+
+	// Leases and results are small messages answered straight away, so they should not wait to be coalesced
+	int no_delay = 1;
+	setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+	return true;
+}
+
+bool tcp_socket::listen(const std::string& host, int port) {
+	close();
+	if (!net_startup()) return false;
+
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	addrinfo* addresses = nullptr;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) return false;
+
+	for (addrinfo* a = addresses; a != nullptr && !is_open(); a = a->ai_next) {
+		handle = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if (!is_open()) continue;
+
+		int reuse = 1;
+		setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+		if (::bind(handle, a->ai_addr, int(a->ai_addrlen)) != 0 || ::listen(handle, 64) != 0) close();
+	}
+	freeaddrinfo(addresses);
+	return is_open();
+}
+
+// Loopback addresses, which only processes on this machine can reach
+inline bool is_loopback_host(const std::string& host) {
+	return host == "localhost" || host == "::1" || host.compare(0, 4, "127.") == 0;
+}
+
+// Whether the call was cut short by a signal before anything was sent or received, and should simply be made again
+inline bool is_interrupted() {
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEINTR;
+#else
+	return errno == EINTR;
+#endif
+}
+
+// Fills address with path, false when it does not fit
+inline bool local_socket_address(const std::string& path, sockaddr_un& address) {
+	address = {};
+	address.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+
+	memcpy(address.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+bool tcp_socket::connect_local(const std::string& path) {
+	close();
+	sockaddr_un address;
+	if (!net_startup() || !local_socket_address(path, address)) return false;
+
+	handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (!is_open()) return false;
+
+	if (::connect(handle, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+// Removes the file a local listener leaves at path, and nothing else that may be there
+inline void remove_local_socket(const std::string& path) {
+#ifdef _WIN32
+	// Socket files are reparse points
+	DWORD attributes = GetFileAttributesA(path.c_str());
+	if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0) DeleteFileA(path.c_str());
+#else
+	struct stat status;
+	if (stat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode)) unlink(path.c_str());
+#endif
+}
+
+bool tcp_socket::listen_local(const std::string& path) {
+	close();
+	sockaddr_un address;
+	if (!net_startup() || !local_socket_address(path, address)) return false;
+
+	// A listener that is still running answers, one that exited left only the file behind
+	tcp_socket probe;
+	if (probe.connect_local(path)) return false;
+
+	remove_local_socket(path);
+
+	handle = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (!is_open()) return false;
+
+	if (::bind(handle, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || ::listen(handle, 64) != 0) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool tcp_socket::accept(tcp_socket& client, int timeout_ms) {
+	if (!wait_readable(timeout_ms)) return false;
+
+	socket_handle accepted = ::accept(handle, nullptr, nullptr);
+	if (accepted == invalid_socket_handle) return false;
+
+	int no_delay = 1;
+	setsockopt(accepted, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+	client = tcp_socket(accepted);
+	return true;
+}
+
+bool tcp_socket::send_all(const void* data, size_t size) {
+	const char* bytes = static_cast<const char*>(data);
+	while (size > 0) {
+		// Large results go out in pieces, Winsock takes an int
+		int chunk = int(std::min<size_t>(size, 1 << 30));
+#ifdef _WIN32
+		int sent = ::send(handle, bytes, chunk, 0);
+#else
+		int sent = int(::send(handle, bytes, size_t(chunk), MSG_NOSIGNAL));
+#endif
+		if (sent < 0 && is_interrupted()) continue;
+		if (sent <= 0) return false;
+
+		bytes += sent;
+		size -= size_t(sent);
+	}
+	return true;
+}
+
+bool tcp_socket::receive_all(void* data, size_t size) {
+	char* bytes = static_cast<char*>(data);
+	while (size > 0) {
+		int chunk = int(std::min<size_t>(size, 1 << 30));
+		int received = int(::recv(handle, bytes, chunk, 0));
+		if (received < 0 && is_interrupted()) continue;
+		if (received <= 0) return false;
+
+		bytes += received;
+		size -= size_t(received);
+	}
+	return true;
+}
+
+bool tcp_socket::wait_readable(int timeout_ms) {
+	if (!is_open()) return false;
+
+	int ready;
+	do {
+#ifdef _WIN32
+		WSAPOLLFD entry = { handle, POLLRDNORM, 0 };
+		ready = WSAPoll(&entry, 1, timeout_ms);
+#else
+		pollfd entry = { handle, POLLIN, 0 };
+		ready = ::poll(&entry, 1, timeout_ms);
+#endif
+	} while (ready < 0 && is_interrupted());
+	return ready > 0;
+}
+
+bool tcp_socket::set_timeout(int timeout_ms) {
+#ifdef _WIN32
+	DWORD timeout = DWORD(timeout_ms);
+#else
+	timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+#endif
+	const char* value = reinterpret_cast<const char*>(&timeout);
+	return setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, value, sizeof(timeout)) == 0
+		&& setsockopt(handle, SOL_SOCKET, SO_SNDTIMEO, value, sizeof(timeout)) == 0;
+}
+
+void tcp_socket::close() {
+	if (!is_open()) return;
+
+#ifdef _WIN32
+	closesocket(handle);
+#else
+	::close(handle);
+#endif
+	handle = invalid_socket_handle;
+}
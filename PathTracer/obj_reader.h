@@ -2,6 +2,7 @@
 
 #include "hittable_list.h"
 #include "material.h"
+#include "mesh.h"
 #include "triangle.h"
 
 #include <fstream>
@@ -10,12 +11,6 @@
 
 using namespace std;
 
-struct face {
-	int v[3];
-	int t[3];
-	int n[3];
-};
-
 inline string pop_next(string& str, const string delimiter, string& out) {
 	size_t next_token = str.find(delimiter);
 	out = str.substr(0, next_token);
@@ -32,7 +27,7 @@ inline string pop_next(string& str, const string delimiter) {
 	return out;
 }
 
-void read_obj(const char* file_location, hittable_list& objects) {
+bool read_obj(const char* file_location, mesh& out) {
 	const string VERT = "v";
 	const string NORM = "vn";
 	//const string TEXTC = "vt";
@@ -42,11 +37,11 @@ void read_obj(const char* file_location, hittable_list& objects) {
 	const string SPACE = " ";
 	const string FSLASH = "/";
 
-	vector<vec3> vertices;
-	vector<vec3> normals;
+	vector<vec3>& vertices = out.vertices;
+	vector<vec3>& normals = out.normals;
 	//std::vector<vec3> textureCoords;
-	vector<face> faces;
-	bool isSmooth = false;
+	vector<face>& faces = out.faces;
+	bool& isSmooth = out.is_smooth;
 
 	ifstream obj_file(file_location, ios::in);
 
@@ -93,32 +88,18 @@ void read_obj(const char* file_location, hittable_list& objects) {
 		}
 		
 		obj_file.close();
-
-		auto test_mat = make_shared<normal>();
-
-		for (int i = 0; i < faces.size(); ++i) {
-			if (isSmooth) {
-				objects.add(make_shared<triangle>(
-					vertices[faces[i].v[0]],
-					vertices[faces[i].v[1]],
-					vertices[faces[i].v[2]],
-					normals[faces[i].n[0]],
-					normals[faces[i].n[1]],
-					normals[faces[i].n[2]],
-					test_mat
-					));
-			}
-			else {
-				objects.add(make_shared<triangle>(
-					vertices[faces[i].v[0]],
-					vertices[faces[i].v[1]],
-					vertices[faces[i].v[2]],
-					test_mat
-					));
-			}
-		}
+		return true;
 	}
-	else {
-		printf("Unable to open file: %s", file_location);
+
+	printf("Unable to open file: %s", file_location);
+	return false;
+}
+
+void read_obj(const char* file_location, hittable_list& objects) {
+	mesh obj_mesh;
+
+	if (read_obj(file_location, obj_mesh)) {
+		auto test_mat = objects.make<normal>();
+		add_triangles(obj_mesh, test_mat, objects);
 	}
 }
\ No newline at end of file
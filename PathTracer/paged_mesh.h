@@ -0,0 +1,596 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "compressed_mesh.h"
+#include "hittable.h"
+#include "mapped_file.h"
+#include "mesh.h"
+#include "obj_reader.h"
+#include "scene_cache.h"
+#include "telemetry.h"
+#include "thread_pool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Page files are a fixed header, the top of the tree and the page table, then the pages on 4 KB boundaries so each
+// can be dropped from memory on its own. Bump the version on any layout change.
+const char mesh_page_magic[8] = { 'P', 'T', 'P', 'A', 'G', 'E', 'S', '\0' };
+const uint32_t mesh_page_version = 1;
+const uint64_t mesh_page_alignment = 4096;
+
+// A subtree of clusters stored together. Its nodes, clusters, positions, normals and indices follow one another,
+// with node offsets, cluster offsets and cluster vertex and triangle numbers counted from the start of the page.
+struct mesh_page {
+	uint64_t offset;
+	uint32_t size;
+	uint32_t node_count;
+	uint32_t cluster_count;
+	uint32_t vertex_count;
+	uint32_t triangle_count;
+	uint32_t padding;
+};
+
+struct mesh_page_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size;
+	uint64_t content_hash;
+
+	int32_t bits;
+	uint32_t has_normals;
+	double grid_origin[3];
+	double grid_step;
+
+	cached_section top_nodes;
+	cached_section pages;
+};
+
+// Where each array starts within a page
+struct mesh_page_layout {
+	size_t nodes;
+	size_t clusters;
+	size_t positions;
+	size_t normals;
+	size_t indices;
+	size_t size;
+};
+
+inline mesh_page_layout page_layout(const mesh_page& page, int bits, bool has_normals) {
+	auto align = [](size_t offset) { return (offset + 15) & ~size_t(15); };
+
+	mesh_page_layout layout;
+	layout.nodes = 0;
+	layout.clusters = align(layout.nodes + page.node_count * sizeof(bvh_node));
+	layout.positions = align(layout.clusters + page.cluster_count * sizeof(mesh_cluster));
+	layout.normals = align(layout.positions + page.vertex_count * (bits == 16 ? 3 * sizeof(uint16_t) : sizeof(uint64_t)));
+	layout.indices = align(layout.normals + (has_normals ? page.vertex_count * sizeof(uint32_t) : 0));
+	layout.size = layout.indices + page.triangle_count * 3;
+	return layout;
+}
+
+struct paging_stats {
+	uint64_t faults = 0;		// Pages that were not resident when traversal reached them
+	uint64_t evictions = 0;
+	uint64_t bytes_paged_in = 0;
+	size_t resident_bytes = 0;
+	size_t peak_resident_bytes = 0;
+	size_t resident_pages = 0;
+};
+
+// A compressed mesh kept in a memory mapped file, for meshes larger than the memory a render may use. The top of the
+// tree and the page table stay resident. Pages of clusters are left to the OS to read on first touch, and once more
+// than the budget is resident the least recently used are dropped from the mapping with a second chance clock, so
+// the resident set stays near the budget however large the file. A dropped page is read again if a ray returns.
+class paged_mesh : public hittable {
+	public:
+		paged_mesh() {}
+
+		// A budget of 0 never evicts
+		bool open(const char* path, uint64_t key, const material* mat, size_t budget_bytes);
+
+		// Pages are subtrees of the source's tree of about page_bytes each, in the order traversal meets them
+		static bool write(const std::string& path, uint64_t key, const compressed_mesh& source, size_t page_bytes = 1 << 16);
+
+		virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
+
+		size_t file_bytes() const { return file.size(); }
+		size_t resident_table_bytes() const { return nodes.capacity() * sizeof(bvh_node) + pages.capacity() * sizeof(mesh_page); }
+		paging_stats stats() const;
+
+	public:
+		int bits = 16;
+		bool has_normals = false;
+		double grid_origin[3] = { 0.0, 0.0, 0.0 };
+		double grid_step = 1.0;
+		size_t budget = 0;
+
+		std::vector<bvh_node> nodes;		// Leaves are single pages
+		std::vector<mesh_page> pages;
+		const material* mat_ptr = nullptr;
+
+	private:
+		bool is_valid_page(const mesh_page& page) const;
+		const unsigned char* touch(int page) const;
+		void fault(int page) const;
+
+		static const uint8_t page_resident = 1;
+		static const uint8_t page_referenced = 2;
+
+		mapped_file file;
+		std::unique_ptr<std::atomic<uint8_t>[]> page_state;
+
+		// Only taken on a fault
+		mutable std::mutex paging_mutex;
+		mutable paging_stats paging;
+		mutable size_t clock_hand = 0;
+};
+
+bool paged_mesh::open(const char* path, uint64_t key, const material* mat, size_t budget_bytes) {
+	if (!file.open(path)) return false;
+
+	mesh_page_header header;
+	if (file.size() < sizeof(header)) {
+		file.close();
+		return false;
+	}
+	memcpy(&header, file.data(), sizeof(header));
+
+	auto section_fits = [this](const cached_section& section, uint64_t element_size) {
+		return section.offset <= file.size() && section.count <= (file.size() - section.offset) / element_size;
+	};
+
+	if (memcmp(header.magic, mesh_page_magic, sizeof(header.magic)) != 0 || header.version != mesh_page_version
+		|| header.node_size != sizeof(bvh_node) || header.content_hash != key || (header.bits != 16 && header.bits != 21)
+		|| header.has_normals > 1 || !section_fits(header.top_nodes, sizeof(bvh_node)) || !section_fits(header.pages, sizeof(mesh_page)))
+	{
+		file.close();
+		return false;
+	}
+
+	bits = header.bits;
+	has_normals = header.has_normals != 0;
+	memcpy(grid_origin, header.grid_origin, sizeof(grid_origin));
+	grid_step = header.grid_step;
+	budget = budget_bytes;
+	mat_ptr = mat;
+
+	nodes.resize(size_t(header.top_nodes.count));
+	memcpy(nodes.data(), file.data() + header.top_nodes.offset, nodes.size() * sizeof(bvh_node));
+	pages.resize(size_t(header.pages.count));
+	memcpy(pages.data(), file.data() + header.pages.offset, pages.size() * sizeof(mesh_page));
+
+	for (const mesh_page& page : pages) {
+		if (page.offset > file.size() || page.size > file.size() - page.offset || page.size < page_layout(page, bits, has_normals).size) {
+			file.close();
+			return false;
+		}
+	}
+
+	// Traversal trusts the trees and clusters, so a damaged file is refused here rather than read out of bounds. Each
+	// page is dropped again once checked, so opening leaves nothing resident.
+	bool is_valid = is_well_formed_tree(nodes.data(), nodes.size(), pages.size());
+	for (size_t i = 0; i < pages.size() && is_valid; ++i) {
+		is_valid = is_valid_page(pages[i]);
+		file.release(size_t(pages[i].offset), pages[i].size);
+	}
+
+	if (!is_valid) {
+		nodes.clear();
+		pages.clear();
+		file.close();
+		return false;
+	}
+
+	page_state.reset(new std::atomic<uint8_t>[pages.size()]);
+	for (size_t i = 0; i < pages.size(); ++i) page_state[i].store(0, std::memory_order_relaxed);
+	paging = paging_stats();
+	clock_hand = 0;
+	return true;
+}
+
+// The page's tree over its clusters, and every cluster's vertices, triangles and indices within the page
+bool paged_mesh::is_valid_page(const mesh_page& page) const {
+	const mesh_page_layout layout = page_layout(page, bits, has_normals);
+	const unsigned char* data = file.data() + page.offset;
+	const bvh_node* page_nodes = reinterpret_cast<const bvh_node*>(data + layout.nodes);
+	const mesh_cluster* clusters = reinterpret_cast<const mesh_cluster*>(data + layout.clusters);
+	const uint8_t* indices = data + layout.indices;
+
+	if (page.node_count == 0 || !is_well_formed_tree(page_nodes, page.node_count, page.cluster_count)) return false;
+
+	for (uint32_t c = 0; c < page.cluster_count; ++c) {
+		const mesh_cluster& cluster = clusters[c];
+		if (cluster.triangle_count > max_cluster_triangles || cluster.vertex_count > 3 * max_cluster_triangles
+			|| uint64_t(cluster.first_vertex) + cluster.vertex_count > page.vertex_count
+			|| uint64_t(cluster.first_triangle) + cluster.triangle_count > page.triangle_count)
+		{
+			return false;
+		}
+
+		const uint8_t* tri = &indices[3 * size_t(cluster.first_triangle)];
+		for (int i = 0; i < 3 * cluster.triangle_count; ++i) {
+			if (tri[i] >= cluster.vertex_count) return false;
+		}
+	}
+	return true;
+}
+
+bool paged_mesh::write(const std::string& path, uint64_t key, const compressed_mesh& source, size_t page_bytes) {
+	const std::vector<bvh_node>& source_nodes = source.nodes;
+	const bool smooth = !source.normals.empty();
+	const size_t vertex_bytes = (source.bits == 16 ? 3 * sizeof(uint16_t) : sizeof(uint64_t)) + (smooth ? sizeof(uint32_t) : 0);
+
+	auto vertex_end = [&source](size_t cluster) {
+		return cluster < source.clusters.size() ? size_t(source.clusters[cluster].first_vertex) : source.positions16.size() / 3 + source.positions21.size();
+	};
+	auto triangle_end = [&source](size_t cluster) {
+		return cluster < source.clusters.size() ? size_t(source.clusters[cluster].first_triangle) : source.triangle_count();
+	};
+
+	// Nodes and clusters under each node, both contiguous as the tree is laid out depth first
+	struct subtree {
+		int node_end;
+		int cluster_begin;
+		int cluster_end;
+	};
+
+	std::vector<subtree> subtrees(source_nodes.size());
+	std::function<void(int)> measure = [&](int index) {
+		const bvh_node& node = source_nodes[index];
+		if (node.is_leaf()) {
+			subtrees[index] = { index + 1, node.offset, node.offset + node.count };
+			return;
+		}
+
+		measure(index + 1);
+		measure(node.offset);
+		subtrees[index] = { subtrees[node.offset].node_end, subtrees[index + 1].cluster_begin, subtrees[node.offset].cluster_end };
+	};
+
+	// Nodes above the pages are copied as they are, the highest subtree that fits becomes a leaf holding one page
+	std::vector<bvh_node> top_nodes;
+	std::vector<int> page_roots;
+	std::function<void(int)> split = [&](int index) {
+		const bvh_node& node = source_nodes[index];
+		const subtree& s = subtrees[index];
+		size_t bytes = size_t(s.node_end - index) * sizeof(bvh_node) + size_t(s.cluster_end - s.cluster_begin) * sizeof(mesh_cluster)
+			+ (vertex_end(s.cluster_end) - vertex_end(s.cluster_begin)) * vertex_bytes
+			+ (triangle_end(s.cluster_end) - triangle_end(s.cluster_begin)) * 3;
+
+		if (node.is_leaf() || bytes <= page_bytes) {
+			top_nodes.push_back({ node.box, int(page_roots.size()), 1 });
+			page_roots.push_back(index);
+			return;
+		}
+
+		size_t interior = top_nodes.size();
+		top_nodes.push_back({ node.box, 0, 0 });
+		split(index + 1);
+		top_nodes[interior].offset = int(top_nodes.size());
+		split(node.offset);
+	};
+
+	if (!source_nodes.empty()) {
+		measure(0);
+		split(0);
+	}
+
+	mesh_page_header header = {};
+	memcpy(header.magic, mesh_page_magic, sizeof(header.magic));
+	header.version = mesh_page_version;
+	header.node_size = sizeof(bvh_node);
+	header.content_hash = key;
+	header.bits = source.bits;
+	header.has_normals = smooth ? 1 : 0;
+	memcpy(header.grid_origin, source.grid_origin, sizeof(header.grid_origin));
+	header.grid_step = source.grid_step;
+
+	uint64_t offset = sizeof(mesh_page_header);
+	auto place = [&offset](cached_section& section, uint64_t count, uint64_t element_size) {
+		offset = (offset + 15) & ~uint64_t(15);
+		section.offset = offset;
+		section.count = count;
+		offset += count * element_size;
+	};
+
+	place(header.top_nodes, top_nodes.size(), sizeof(bvh_node));
+	place(header.pages, page_roots.size(), sizeof(mesh_page));
+
+	std::vector<mesh_page> page_table(page_roots.size());
+	for (size_t i = 0; i < page_roots.size(); ++i) {
+		const int root = page_roots[i];
+		const subtree& s = subtrees[root];
+
+		mesh_page& page = page_table[i];
+		page.node_count = uint32_t(s.node_end - root);
+		page.cluster_count = uint32_t(s.cluster_end - s.cluster_begin);
+		page.vertex_count = uint32_t(vertex_end(s.cluster_end) - vertex_end(s.cluster_begin));
+		page.triangle_count = uint32_t(triangle_end(s.cluster_end) - triangle_end(s.cluster_begin));
+		page.padding = 0;
+
+		offset = (offset + mesh_page_alignment - 1) & ~(mesh_page_alignment - 1);
+		page.offset = offset;
+		page.size = uint32_t(page_layout(page, source.bits, smooth).size);
+		offset += page.size;
+	}
+
+	// Each writer fills its own temporary and swaps it in whole, so processes missing the same file at once never
+	// write into one file and readers never see a partial one
+	std::string temp_path = unique_temp_path(path);
+	std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+	if (!out) return false;
+
+	auto pad_to = [&out](uint64_t target) {
+		static const char padding[mesh_page_alignment] = {};
+		out.write(padding, std::streamsize(target - uint64_t(out.tellp())));
+	};
+
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	pad_to(header.top_nodes.offset);
+	out.write(reinterpret_cast<const char*>(top_nodes.data()), std::streamsize(top_nodes.size() * sizeof(bvh_node)));
+	pad_to(header.pages.offset);
+	out.write(reinterpret_cast<const char*>(page_table.data()), std::streamsize(page_table.size() * sizeof(mesh_page)));
+
+	std::vector<bvh_node> page_nodes;
+	std::vector<mesh_cluster> page_clusters;
+	for (size_t i = 0; i < page_roots.size(); ++i) {
+		const int root = page_roots[i];
+		const subtree& s = subtrees[root];
+		const mesh_page& page = page_table[i];
+		const mesh_page_layout layout = page_layout(page, source.bits, smooth);
+		const size_t first_vertex = vertex_end(s.cluster_begin);
+		const size_t first_triangle = triangle_end(s.cluster_begin);
+
+		page_nodes.assign(source_nodes.begin() + root, source_nodes.begin() + s.node_end);
+		for (bvh_node& node : page_nodes) node.offset -= node.is_leaf() ? s.cluster_begin : root;
+
+		page_clusters.assign(source.clusters.begin() + s.cluster_begin, source.clusters.begin() + s.cluster_end);
+		for (mesh_cluster& cluster : page_clusters) {
+			cluster.first_vertex -= uint32_t(first_vertex);
+			cluster.first_triangle -= uint32_t(first_triangle);
+		}
+
+		pad_to(page.offset + layout.nodes);
+		out.write(reinterpret_cast<const char*>(page_nodes.data()), std::streamsize(page_nodes.size() * sizeof(bvh_node)));
+		pad_to(page.offset + layout.clusters);
+		out.write(reinterpret_cast<const char*>(page_clusters.data()), std::streamsize(page_clusters.size() * sizeof(mesh_cluster)));
+
+		pad_to(page.offset + layout.positions);
+		if (source.bits == 16) {
+			out.write(reinterpret_cast<const char*>(&source.positions16[3 * first_vertex]), std::streamsize(size_t(page.vertex_count) * 3 * sizeof(uint16_t)));
+		}
+		else {
+			out.write(reinterpret_cast<const char*>(&source.positions21[first_vertex]), std::streamsize(size_t(page.vertex_count) * sizeof(uint64_t)));
+		}
+
+		if (smooth) {
+			pad_to(page.offset + layout.normals);
+			out.write(reinterpret_cast<const char*>(&source.normals[first_vertex]), std::streamsize(size_t(page.vertex_count) * sizeof(uint32_t)));
+		}
+
+		pad_to(page.offset + layout.indices);
+		out.write(reinterpret_cast<const char*>(&source.indices[3 * first_triangle]), std::streamsize(size_t(page.triangle_count) * 3));
+	}
+	out.close();
+
+	if (!out) {
+		remove(temp_path.c_str());
+		return false;
+	}
+
+	return replace_file(temp_path.c_str(), path.c_str());
+}
+
+const unsigned char* paged_mesh::touch(int page) const {
+	++thread_ray_counters.page_touches;
+
+	// Resident pages only need their referenced bit, which is already set on most touches
+	std::atomic<uint8_t>& state = page_state[page];
+	uint8_t current = state.load(std::memory_order_relaxed);
+	if (!(current & page_resident)) fault(page);
+	else if (!(current & page_referenced)) state.fetch_or(page_referenced, std::memory_order_relaxed);
+
+	return file.data() + pages[page].offset;
+}
+
+void paged_mesh::fault(int page) const {
+	std::lock_guard<std::mutex> lock(paging_mutex);
+
+	// Another thread may have brought it in while this one waited
+	if (page_state[page].load(std::memory_order_relaxed) & page_resident) return;
+
+	const mesh_page& loaded = pages[page];
+	file.will_need(size_t(loaded.offset), loaded.size);
+	page_state[page].store(page_resident | page_referenced, std::memory_order_relaxed);
+
+	++paging.faults;
+	++paging.resident_pages;
+	paging.bytes_paged_in += loaded.size;
+	paging.resident_bytes += loaded.size;
+	paging.peak_resident_bytes = std::max(paging.peak_resident_bytes, paging.resident_bytes);
+
+	// Pages used since the hand last passed get a second chance, the first one that was not is dropped. A ray still
+	// reading a dropped page only faults it back in from the file.
+	while (budget > 0 && paging.resident_bytes > budget && paging.resident_pages > 1) {
+		const size_t candidate = clock_hand;
+		clock_hand = (clock_hand + 1) % pages.size();
+		if (candidate == size_t(page)) continue;
+
+		std::atomic<uint8_t>& state = page_state[candidate];
+		uint8_t current = state.load(std::memory_order_relaxed);
+		if (!(current & page_resident)) continue;
+
+		if (current & page_referenced) {
+			state.fetch_and(uint8_t(~page_referenced), std::memory_order_relaxed);
+			continue;
+		}
+
+		state.store(0, std::memory_order_relaxed);
+		file.release(size_t(pages[candidate].offset), pages[candidate].size);
+
+		++paging.evictions;
+		--paging.resident_pages;
+		paging.resident_bytes -= pages[candidate].size;
+	}
+}
+
+paging_stats paged_mesh::stats() const {
+	std::lock_guard<std::mutex> lock(paging_mutex);
+	return paging;
+}
+
+bool paged_mesh::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
+	if (nodes.empty()) return false;
+
+	const vec3 origin = r.origin();
+	const vec3 d = r.direction();
+	const vec3 inv_direction = 1.f / d;
+
+	float closest_so_far = t_max;
+	const unsigned char* hit_page = nullptr;
+	mesh_page_layout hit_layout = {};
+	int hit_cluster = -1;
+	int hit_triangle = 0;
+	float hit_u = 0.f;
+	float hit_v = 0.f;
+
+	int nodes_visited = 0;
+	int box_tests = 0;
+	int primitive_tests = 0;
+	vec3 p[3 * max_cluster_triangles];
+
+	// The walk over the top of the tree reaches pages, the walk over each page reaches clusters
+	walk_cluster_tree(nodes.data(), origin, inv_direction, t_min, closest_so_far, nodes_visited, box_tests, [&](const bvh_node& top) {
+		const unsigned char* data = touch(top.offset);
+		const mesh_page_layout layout = page_layout(pages[top.offset], bits, has_normals);
+
+		const bvh_node* page_nodes = reinterpret_cast<const bvh_node*>(data + layout.nodes);
+		const mesh_cluster* clusters = reinterpret_cast<const mesh_cluster*>(data + layout.clusters);
+		const uint16_t* positions16 = reinterpret_cast<const uint16_t*>(data + layout.positions);
+		const uint64_t* positions21 = reinterpret_cast<const uint64_t*>(data + layout.positions);
+		const uint8_t* indices = data + layout.indices;
+
+		walk_cluster_tree(page_nodes, origin, inv_direction, t_min, closest_so_far, nodes_visited, box_tests, [&](const bvh_node& node) {
+			for (int c = node.offset; c < node.offset + node.count; ++c) {
+				const mesh_cluster& cluster = clusters[c];
+				decode_cluster_positions(cluster, bits, positions16, positions21, grid_origin, grid_step, p);
+				primitive_tests += cluster.triangle_count;
+
+				const uint8_t* tri = &indices[3 * size_t(cluster.first_triangle)];
+				int triangle = intersect_cluster(p, tri, cluster.triangle_count, origin, d, t_min, closest_so_far, hit_u, hit_v);
+				if (triangle >= 0) {
+					hit_page = data;
+					hit_layout = layout;
+					hit_cluster = c;
+					hit_triangle = triangle;
+				}
+			}
+		});
+	});
+
+	thread_ray_counters.nodes_visited += nodes_visited;
+	thread_ray_counters.box_tests += box_tests;
+	thread_ray_counters.primitive_tests += primitive_tests;
+
+	if (hit_cluster < 0) return false;
+
+	// Read straight after the walk, a page evicted meanwhile is faulted back in by the OS
+	const mesh_cluster& cluster = reinterpret_cast<const mesh_cluster*>(hit_page + hit_layout.clusters)[hit_cluster];
+	const uint8_t* tri = hit_page + hit_layout.indices + 3 * (size_t(cluster.first_triangle) + hit_triangle);
+
+	vec3 outward_normal;
+	if (!has_normals) {
+		decode_cluster_positions(cluster, bits, reinterpret_cast<const uint16_t*>(hit_page + hit_layout.positions),
+			reinterpret_cast<const uint64_t*>(hit_page + hit_layout.positions), grid_origin, grid_step, p);
+		outward_normal = cross(p[tri[1]] - p[tri[0]], p[tri[2]] - p[tri[0]]);
+	}
+	else {
+		const uint32_t* normals = reinterpret_cast<const uint32_t*>(hit_page + hit_layout.normals) + cluster.first_vertex;
+		vec3 n0 = decode_octahedral(normals[tri[0]]);
+		vec3 n1 = decode_octahedral(normals[tri[1]]);
+		vec3 n2 = decode_octahedral(normals[tri[2]]);
+		outward_normal = n0 * (1 - hit_u - hit_v) + n1 * hit_u + n2 * hit_v;
+	}
+
+	rec.t = closest_so_far;
+	rec.p = r.at(rec.t);
+
+	rec.set_face_normal(r, normalize(outward_normal));
+	rec.mat_ptr = mat_ptr;
+	return true;
+}
+
+bool paged_mesh::bounding_box(aabb& output_box) const {
+	if (nodes.empty()) return false;
+
+	output_box = nodes[0].box;
+	return true;
+}
+
+// The page file is keyed by the OBJ's content, the position bits and the page size
+bool mesh_page_key(const char* obj_path, int bits, size_t page_bytes, uint64_t& key) {
+	key = fnv1a_64(&mesh_page_version, sizeof(mesh_page_version));
+	if (!hash_file(obj_path, key)) return false;
+
+	uint64_t settings[] = { uint64_t(bits), uint64_t(page_bytes), uint64_t(max_cluster_triangles) };
+	key = fnv1a_64(settings, sizeof(settings), key);
+	return true;
+}
+
+std::string mesh_page_path(const char* cache_directory, uint64_t key) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.ptpages", (unsigned long long)key);
+	return std::string(cache_directory) + "/" + name;
+}
+
+// Opens the OBJ's page file, compressing the OBJ and writing the file first when it is missing or stale. Only a
+// miss holds the whole mesh in memory. The pool must already be started.
+bool load_obj_paged(const char* obj_path, const char* cache_directory, int bits, size_t budget_bytes,
+	thread_pool& pool, const material* mat, paged_mesh& out)
+{
+	auto time_s = std::chrono::high_resolution_clock::now();
+	const size_t page_bytes = 1 << 16;
+
+	uint64_t key;
+	if (!mesh_page_key(obj_path, bits, page_bytes, key)) {
+		printf("Unable to open file: %s\n", obj_path);
+		return false;
+	}
+
+	std::string page_path = mesh_page_path(cache_directory, key);
+	if (out.open(page_path.c_str(), key, mat, budget_bytes)) {
+		auto time_f = std::chrono::high_resolution_clock::now();
+		printf("Page file hit: %s (%.2f ms)\n", page_path.c_str(), std::chrono::duration<double, std::milli>(time_f - time_s).count());
+		return true;
+	}
+
+	bool written;
+	{
+		mesh obj_mesh;
+		if (!read_obj(obj_path, obj_mesh)) return false;
+
+		compressed_mesh compressed(obj_mesh, mat, bits, pool);
+		written = paged_mesh::write(page_path, key, compressed, page_bytes);
+	}
+
+	if (!written || !out.open(page_path.c_str(), key, mat, budget_bytes)) {
+		printf("Unable to write page file: %s\n", page_path.c_str());
+		return false;
+	}
+
+	printf("Page file miss, wrote %s\n", page_path.c_str());
+	return true;
+}
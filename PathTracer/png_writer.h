@@ -0,0 +1,282 @@
+#pragma once
+
+#include "deflate.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+uint32_t png_crc32(uint32_t crc, const unsigned char* data, size_t size) {
+	static const std::vector<uint32_t> table = [] {
+		std::vector<uint32_t> t(256);
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+uint32_t png_adler32(uint32_t adler, const unsigned char* data, size_t size) {
+	uint32_t a = adler & 0xffff;
+	uint32_t b = adler >> 16;
+
+	// 5552 bytes is the most that can be summed before b has to be reduced
+	while (size > 0) {
+		size_t block = size < 5552 ? size : 5552;
+		for (size_t i = 0; i < block; ++i) {
+			a += data[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+		data += block;
+		size -= block;
+	}
+
+	return (b << 16) | a;
+}
+
+// Checksum of two pieces joined, from the checksum of each and the size of the second, as in zlib
+uint32_t png_adler32_combine(uint32_t first, uint32_t second, size_t second_size) {
+	const uint32_t base = 65521;
+	const uint32_t remainder = uint32_t(second_size % base);
+
+	uint32_t sum1 = first & 0xffff;
+	uint32_t sum2 = uint32_t(uint64_t(remainder) * sum1 % base);
+	sum1 += (second & 0xffff) + base - 1;
+	sum2 += (first >> 16) + (second >> 16) + base - remainder;
+
+	if (sum1 >= base) sum1 -= base;
+	if (sum1 >= base) sum1 -= base;
+	if (sum2 >= 2 * base) sum2 -= 2 * base;
+	if (sum2 >= base) sum2 -= base;
+	return (sum2 << 16) | sum1;
+}
+
+inline unsigned char png_paeth(int a, int b, int c) {
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+	if (pa <= pb && pa <= pc) return (unsigned char)a;
+	if (pb <= pc) return (unsigned char)b;
+	return (unsigned char)c;
+}
+
+// Writes the filter type and the filtered row to out, picking the filter with the smallest sum of absolute values like
+// stb_image_write does. The row above the first one is all zeros.
+void png_filter_row(const unsigned char* row, const unsigned char* above, int row_size, int channels, unsigned char* out) {
+	auto predict = [&](int filter, int i) -> int {
+		int a = i >= channels ? row[i - channels] : 0;
+		int b = above[i];
+		int c = i >= channels ? above[i - channels] : 0;
+
+		switch (filter) {
+			case 1: return a;
+			case 2: return b;
+			case 3: return (a + b) >> 1;
+			case 4: return png_paeth(a, b, c);
+		}
+		return 0;
+	};
+
+	int best_filter = 0;
+	int best_estimate = 0x7fffffff;
+	for (int filter = 0; filter < 5; ++filter) {
+		int estimate = 0;
+		for (int i = 0; i < row_size; ++i) {
+			estimate += abs(int(static_cast<signed char>(row[i] - predict(filter, i))));
+		}
+
+		if (estimate < best_estimate) {
+			best_estimate = estimate;
+			best_filter = filter;
+		}
+	}
+
+	out[0] = (unsigned char)best_filter;
+	for (int i = 0; i < row_size; ++i) out[i + 1] = (unsigned char)(row[i] - predict(best_filter, i));
+}
+
+// Runs body for every part, on the pool when there is one
+void png_for_each_part(int part_count, thread_pool* pool, const std::function<void(int)>& body) {
+	if (pool == nullptr || pool->ThreadCount() == 0) {
+		for (int part = 0; part < part_count; ++part) body(part);
+		return;
+	}
+
+	for (int part = 0; part < part_count; ++part) {
+		pool->QueueJob([&body, part] { body(part); });
+	}
+	pool->Wait();
+}
+
+// 8 bit PNG written a few rows at a time, top row first, so the image never has to be held whole. Rows are filtered
+// and deflated in strips of about 256 KB, in parallel when a pool is given, and each strip becomes one IDAT chunk.
+// The strips continue one deflate stream, so the file is the same whether they were compressed together or not.
+class png_writer {
+	public:
+		~png_writer() { close(); }
+
+		bool open(const std::string& path, int image_width, int image_height, int image_channels);
+
+		// row_count rows starting at the next unwritten one, stride bytes apart
+		bool write_rows(const unsigned char* rows, int row_count, int stride, thread_pool* pool = nullptr);
+
+		// Ends the deflate stream, fails if not every row was written
+		bool close();
+
+		int max_chain = 32;		// Matches tried per byte, more compresses better and slower
+
+	private:
+		bool write_chunk(const char* type, const std::vector<unsigned char>& data);
+
+		FILE* file = nullptr;
+		int width = 0;
+		int height = 0;
+		int channels = 0;
+		int rows_written = 0;
+		uint32_t adler = 1;
+		std::vector<unsigned char> above;		// Last row written, the filters of the next one predict from it
+		std::vector<unsigned char> history;		// Filtered bytes the next strip's matches may reach back into
+		std::vector<unsigned char> filtered;
+};
+
+void png_append_be32(std::vector<unsigned char>& out, uint32_t value) {
+	for (int i = 3; i >= 0; --i) out.push_back((unsigned char)(value >> (8 * i)));
+}
+
+bool png_writer::write_chunk(const char* type, const std::vector<unsigned char>& data) {
+	std::vector<unsigned char> header;
+	png_append_be32(header, uint32_t(data.size()));
+	header.insert(header.end(), type, type + 4);
+
+	uint32_t crc = png_crc32(0, &header[4], 4);
+	crc = png_crc32(crc, data.data(), data.size());
+
+	std::vector<unsigned char> footer;
+	png_append_be32(footer, crc);
+
+	return fwrite(header.data(), 1, header.size(), file) == header.size()
+		&& fwrite(data.data(), 1, data.size(), file) == data.size()
+		&& fwrite(footer.data(), 1, footer.size(), file) == footer.size();
+}
+
+bool png_writer::open(const std::string& path, int image_width, int image_height, int image_channels) {
+	close();
+	if (image_channels < 1 || image_channels > 4) return false;
+
+	width = image_width;
+	height = image_height;
+	channels = image_channels;
+	rows_written = 0;
+	adler = 1;
+	above.assign(size_t(width) * channels, 0);
+	history.clear();
+
+	file = fopen(path.c_str(), "wb");
+	if (file == nullptr) return false;
+
+	const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	const unsigned char color_types[5] = { 0, 0, 4, 2, 6 };
+
+	std::vector<unsigned char> header;
+	png_append_be32(header, uint32_t(width));
+	png_append_be32(header, uint32_t(height));
+	header.push_back(8);						// Bit depth
+	header.push_back(color_types[channels]);
+	header.push_back(0);						// Deflate, adaptive filtering, no interlace
+	header.push_back(0);
+	header.push_back(0);
+
+	// The zlib stream header opens the first data chunk
+	std::vector<unsigned char> stream_header = { 0x78, 0x01 };
+
+	if (fwrite(signature, 1, sizeof(signature), file) != sizeof(signature) || !write_chunk("IHDR", header) || !write_chunk("IDAT", stream_header)) {
+		fclose(file);
+		file = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+bool png_writer::write_rows(const unsigned char* rows, int row_count, int stride, thread_pool* pool) {
+	if (file == nullptr || row_count < 0 || rows_written + row_count > height) return false;
+	if (row_count == 0) return true;
+
+	const size_t row_size = size_t(width) * channels;
+	const size_t filtered_row_size = row_size + 1;
+	const int strip_rows = int(std::max<size_t>(1, (256 * 1024) / filtered_row_size));
+	const int strip_count = (row_count + strip_rows - 1) / strip_rows;
+
+	// The history goes first, so matches across the strips and the calls are found like in one long stream
+	const size_t offset = history.size();
+	filtered.resize(offset + filtered_row_size * row_count);
+	std::copy(history.begin(), history.end(), filtered.begin());
+
+	std::vector<std::vector<unsigned char>> compressed(strip_count);
+	std::vector<uint32_t> checksums(strip_count);
+
+	png_for_each_part(strip_count, pool, [&](int strip) {
+		const int y_s = strip * strip_rows;
+		const int y_f = std::min(row_count, y_s + strip_rows);
+		for (int y = y_s; y < y_f; ++y) {
+			const unsigned char* row = rows + size_t(y) * stride;
+			const unsigned char* row_above = y > 0 ? rows + size_t(y - 1) * stride : above.data();
+			png_filter_row(row, row_above, int(row_size), channels, &filtered[offset + filtered_row_size * y]);
+		}
+	});
+
+	png_for_each_part(strip_count, pool, [&](int strip) {
+		const size_t begin = offset + filtered_row_size * size_t(strip) * strip_rows;
+		const size_t end = offset + filtered_row_size * size_t(std::min(row_count, (strip + 1) * strip_rows));
+		deflate_part(filtered.data(), begin, end, max_chain, compressed[strip]);
+		checksums[strip] = png_adler32(1, &filtered[begin], end - begin);
+	});
+
+	bool is_valid = true;
+	for (int strip = 0; strip < strip_count; ++strip) {
+		const size_t strip_size = filtered_row_size * size_t(std::min(row_count - strip * strip_rows, strip_rows));
+		adler = png_adler32_combine(adler, checksums[strip], strip_size);
+		is_valid = is_valid && write_chunk("IDAT", compressed[strip]);
+	}
+
+	const size_t history_size = std::min<size_t>(deflate_window, filtered.size());
+	history.assign(filtered.end() - history_size, filtered.end());
+	above.assign(rows + size_t(row_count - 1) * stride, rows + size_t(row_count - 1) * stride + row_size);
+
+	rows_written += row_count;
+	return is_valid;
+}
+
+bool png_writer::close() {
+	if (file == nullptr) return true;
+
+	// An empty final stored block and the checksum end the deflate stream
+	std::vector<unsigned char> stream_end = { 1, 0, 0, 0xff, 0xff };
+	png_append_be32(stream_end, adler);
+
+	bool is_valid = rows_written == height && write_chunk("IDAT", stream_end) && write_chunk("IEND", {});
+	is_valid = fclose(file) == 0 && is_valid;
+	file = nullptr;
+	return is_valid;
+}
+
+bool write_png(const std::string& path, int image_width, int image_height, int image_channels, const unsigned char* data, int stride, thread_pool* pool = nullptr) {
+	png_writer writer;
+	return writer.open(path, image_width, image_height, image_channels)
+		&& writer.write_rows(data, image_height, stride, pool)
+		&& writer.close();
+}
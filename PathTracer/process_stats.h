@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#include <malloc.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#endif
+
+// Largest resident set of the process so far, in bytes
+size_t peak_rss_bytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return size_t(counters.PeakWorkingSetSize);
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+	return size_t(usage.ru_maxrss);
+#else
+	return size_t(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// Resident set of the process right now, in bytes
+size_t current_rss_bytes() {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return size_t(counters.WorkingSetSize);
+#else
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file == nullptr) return 0;
+
+	long pages = 0;
+	long resident = 0;
+	int read = fscanf(file, "%ld %ld", &pages, &resident);
+	fclose(file);
+
+	return read == 2 ? size_t(resident) * size_t(sysconf(_SC_PAGESIZE)) : 0;
+#endif
+}
+
+// Hands memory freed on the heap back to the OS, so the resident set holds only what is still allocated. Without it
+// the memory of whatever was freed last stays resident and is reused, hiding what the next allocations add.
+void release_free_memory() {
+#ifdef _WIN32
+	_heapmin();
+#elif defined(__GLIBC__)
+	malloc_trim(0);
+#endif
+}
+
+// Page faults of the process so far. Major faults had to read from disk, Windows counts them all as minor.
+void page_fault_counts(size_t& minor, size_t& major) {
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	minor = GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? size_t(counters.PageFaultCount) : 0;
+	major = 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		minor = 0;
+		major = 0;
+		return;
+	}
+	minor = size_t(usage.ru_minflt);
+	major = size_t(usage.ru_majflt);
+#endif
+}
@@ -0,0 +1,492 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "animation.h"
+#include "bvh.h"
+#include "camera.h"
+#include "distributed.h"
+#include "framebuffer.h"
+#include "heatmap.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "material_override.h"
+#include "net_socket.h"
+#include "render_settings.h"
+#include "renderer.h"
+#include "scene_cache.h"
+#include "telemetry.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
+
+inline std::string current_directory() {
+	char buffer[4096];
+#ifdef _WIN32
+	return _getcwd(buffer, sizeof(buffer)) != nullptr ? buffer : "";
+#else
+	return getcwd(buffer, sizeof(buffer)) != nullptr ? buffer : "";
+#endif
+}
+
+inline bool change_directory(const std::string& path) {
+#ifdef _WIN32
+	return _chdir(path.c_str()) == 0;
+#else
+	return chdir(path.c_str()) == 0;
+#endif
+}
+
+// Changes back to the directory it was made in when it goes out of scope
+struct directory_restorer {
+	directory_restorer() : path(current_directory()) {}
+	~directory_restorer() {
+		if (!path.empty()) change_directory(path);
+	}
+
+	std::string path;
+};
+
+// Set by SIGINT and SIGTERM, the daemon exits once the job in hand is done
+inline volatile std::sig_atomic_t& daemon_stop_signaled() {
+	static volatile std::sig_atomic_t is_signaled = 0;
+	return is_signaled;
+}
+
+extern "C" inline void signal_daemon_stop(int) {
+	daemon_stop_signaled() = 1;
+}
+
+// Everything a loaded scene and its tree depend on. An OBJ is known by its path, size and modification time, so an
+// edited file is loaded again without hashing its contents on every job. False when the OBJ cannot be found.
+bool daemon_scene_key(const render_settings& settings, const std::string& directory, uint64_t& key) {
+	auto add_string = [](const std::string& text, uint64_t key) {
+		uint64_t size = text.size();
+		return fnv1a_64(text.data(), text.size(), fnv1a_64(&size, sizeof(size), key));
+	};
+
+	const bvh_build_options& options = settings.build_options;
+	int values[] = { settings.mesh_bits, settings.geometry_budget_mb,
+		int(options.method), options.bin_count, options.max_leaf_size, options.morton_bits, options.optimize_treelets, options.treelet_size };
+	float costs[] = { options.traversal_cost, options.intersection_cost, options.max_duplication, options.spatial_split_alpha };
+
+	key = fnv1a_64(values, sizeof(values));
+	key = fnv1a_64(costs, sizeof(costs), key);
+
+	if (settings.obj_file.empty()) {
+		key = add_string(settings.scene, key);
+		return true;
+	}
+
+	struct stat status;
+	if (stat(settings.obj_file.c_str(), &status) != 0) return false;
+	int64_t file[] = { int64_t(status.st_size), int64_t(status.st_mtime) };
+
+	key = add_string(directory, key);
+	key = add_string(settings.obj_file, key);
+	key = add_string(settings.cache_directory, key);
+	key = fnv1a_64(file, sizeof(file), key);
+	return true;
+}
+
+// Keeps loaded scenes and their trees for the renders submitted on a local socket, so a render only pays for its own
+// pixels. Jobs are the client's command line and run one at a time on every thread of the daemon. Each finished tile
+// is sent straight back, the client writes the outputs as if it had rendered them itself.
+class render_daemon {
+	public:
+		render_daemon(const render_settings& local)
+			: threads(local.threads), max_scenes(local.daemon_scenes), timeout_ms(local.daemon_timeout * 1000) {}
+
+		// Serves jobs until a client sends stop or the process gets SIGINT or SIGTERM, then removes the socket
+		bool run(const std::string& path, const scene_loader& load_scene);
+
+	private:
+		struct loaded_scene {
+			uint64_t key = 0;
+			uint64_t last_used = 0;
+			hittable_list world;
+			bvh world_bvh;
+			animated_mesh animation;
+			float pose_time = 0.f;		// The animation's current pose
+			animation_settings pose;
+			int material_count = 0;		// Materials made while loading, numbered from 0
+		};
+
+		void serve(tcp_socket& client, const scene_loader& load_scene);
+		loaded_scene* find_scene(const render_settings& settings, const std::string& directory, const scene_loader& load_scene,
+			tcp_socket& client);
+		bool render_frame(tcp_socket& client, const render_settings& settings, loaded_scene& scene, int frame);
+
+		int threads;
+		int max_scenes;
+		int timeout_ms;
+		bool is_stopping = false;
+		thread_pool pool;
+		std::vector<std::unique_ptr<loaded_scene>> scenes;
+		uint64_t jobs = 0;
+};
+
+bool send_daemon_text(tcp_socket& client, render_message type, const std::string& text) {
+	return send_render_message(client, type, text.c_str(), text.size());
+}
+
+// Closing with the client's requests still unread would reset the connection before the reason is read, so they are
+// read until the client hangs up
+void fail_daemon_job(tcp_socket& client, const std::string& reason) {
+	send_daemon_text(client, render_message::failed, reason);
+
+	render_message type;
+	std::vector<unsigned char> payload;
+	while (client.wait_readable(10000) && receive_render_message(client, type, payload, 1 << 20)) {}
+}
+
+bool render_daemon::run(const std::string& path, const scene_loader& load_scene) {
+	tcp_socket listener;
+	if (!listener.listen_local(path)) {
+		printf("Unable to listen on %s, or another daemon already is\n", path.c_str());
+		return false;
+	}
+
+	render_settings defaults;
+	defaults.threads = threads;
+	const uint32_t thread_count = uint32_t(defaults.thread_count());
+	pool.Start(thread_count);
+	printf("Render daemon on %s with %u threads, keeping up to %d scenes\n", path.c_str(), thread_count, max_scenes);
+
+	daemon_stop_signaled() = 0;
+	std::signal(SIGINT, signal_daemon_stop);
+	std::signal(SIGTERM, signal_daemon_stop);
+
+	// Wakes up now and then to notice a signal. A client that stalls a send or receive for the timeout is dropped.
+	while (!is_stopping && daemon_stop_signaled() == 0) {
+		tcp_socket client;
+		if (!listener.accept(client, 200)) continue;
+
+		client.set_timeout(timeout_ms);
+		serve(client, load_scene);
+	}
+
+	std::signal(SIGINT, SIG_DFL);
+	std::signal(SIGTERM, SIG_DFL);
+
+	listener.close();
+	remove_local_socket(path);
+	pool.Stop();
+	printf("Render daemon on %s stopped after %llu jobs\n", path.c_str(), (unsigned long long)jobs);
+	return true;
+}
+
+void render_daemon::serve(tcp_socket& client, const scene_loader& load_scene) {
+	auto job_s = std::chrono::high_resolution_clock::now();
+
+	render_message type;
+	std::vector<unsigned char> payload;
+	if (!client.wait_readable(10000) || !receive_render_message(client, type, payload, 1 << 20)) {
+		printf("Client sent no job\n");
+		return;
+	}
+
+	if (type == render_message::stop) {
+		printf("Asked to stop\n");
+		is_stopping = true;
+		return;
+	}
+
+	if (type != render_message::job || payload.empty() || payload.back() != '\0') {
+		printf("Client sent no job\n");
+		return;
+	}
+	++jobs;
+
+	// The client's working directory comes first, its paths are relative to it. The daemon's own is back when the
+	// job ends, however it ends, so the next job's paths never resolve against this one's.
+	const directory_restorer restore_directory;
+	std::vector<char*> args;
+	for (size_t i = 0; i < payload.size(); i += strlen(reinterpret_cast<char*>(&payload[i])) + 1) {
+		args.push_back(reinterpret_cast<char*>(&payload[i]));
+	}
+
+	const std::string directory = args[0];
+	render_settings settings;
+	bool show_help;
+	if (!change_directory(directory) || args.size() < 2 || !parse_render_arguments(int(args.size()) - 1, args.data() + 1, settings, show_help)) {
+		fail_daemon_job(client, "The daemon is unable to use the job's settings");
+		return;
+	}
+
+	settings.threads = threads;
+
+	loaded_scene* scene = find_scene(settings, directory, load_scene, client);
+	if (scene == nullptr) {
+		fail_daemon_job(client, "The daemon is unable to load the scene");
+		return;
+	}
+
+	// A client that neither asks for a frame nor hangs up would keep every other job waiting
+	int frames = 0;
+	bool is_silent = false;
+	while (!is_silent) {
+		is_silent = !client.wait_readable(timeout_ms);
+		if (is_silent || !receive_render_message(client, type, payload, sizeof(int32_t)) || type != render_message::frame
+			|| payload.size() != sizeof(int32_t))
+		{
+			break;
+		}
+
+		int32_t frame;
+		memcpy(&frame, payload.data(), sizeof(frame));
+		if (!render_frame(client, settings, *scene, frame)) break;
+		++frames;
+	}
+	if (is_silent) printf("Job %llu: the client sent nothing for %d seconds and was dropped\n", (unsigned long long)jobs, timeout_ms / 1000);
+
+	auto job_f = std::chrono::high_resolution_clock::now();
+	printf("Job %llu: %d frames of %dx%d at %d spp, %.2f ms\n", (unsigned long long)jobs, frames, settings.image_width, settings.image_height(),
+		settings.samples_per_pixel, std::chrono::duration<double, std::milli>(job_f - job_s).count());
+}
+
+render_daemon::loaded_scene* render_daemon::find_scene(const render_settings& settings, const std::string& directory,
+	const scene_loader& load_scene, tcp_socket& client)
+{
+	uint64_t key;
+	if (!daemon_scene_key(settings, directory, key)) {
+		printf("Unable to open file: %s\n", settings.obj_file.c_str());
+		return nullptr;
+	}
+
+	for (std::unique_ptr<loaded_scene>& scene : scenes) {
+		if (scene->key != key) continue;
+
+		scene->last_used = jobs;
+		send_daemon_text(client, render_message::status, "Daemon scene cache hit, " + std::to_string(scenes.size()) + " scenes loaded");
+		return scene.get();
+	}
+
+	auto load_s = std::chrono::high_resolution_clock::now();
+
+	std::unique_ptr<loaded_scene> scene(new loaded_scene());
+	scene->key = key;
+	scene->last_used = jobs;
+
+	// Material ids then match those of a process that loaded only this scene, which overrides refer to, and random
+	// scenes are built from the same numbers
+	reset_material_ids();
+	seed_random(scene_random_seed);
+	if (!load_scene(settings, pool, scene->world, scene->world_bvh, scene->animation)) return nullptr;
+	scene->material_count = material_id_counter();
+
+	auto load_f = std::chrono::high_resolution_clock::now();
+	char text[256];
+	snprintf(text, sizeof(text), "Daemon scene cache miss, loaded in %.2f ms with %zu primitives",
+		std::chrono::duration<double, std::milli>(load_f - load_s).count(), scene->world_bvh.primitives.size());
+	printf("%s\n", text);
+	send_daemon_text(client, render_message::status, text);
+
+	// The least recently used scene makes room only once the new one loaded, a failed load keeps every warm scene
+	if (int(scenes.size()) >= max_scenes) {
+		auto oldest = std::min_element(scenes.begin(), scenes.end(), [](const std::unique_ptr<loaded_scene>& a, const std::unique_ptr<loaded_scene>& b) {
+			return a->last_used < b->last_used;
+		});
+		scenes.erase(oldest);
+	}
+
+	scenes.push_back(std::move(scene));
+	return scenes.back().get();
+}
+
+bool render_daemon::render_frame(tcp_socket& client, const render_settings& settings, loaded_scene& scene, int frame) {
+	const int image_width = settings.image_width;
+	const int image_height = settings.image_height();
+	const bool has_linear = settings.hdr_output != hdr_format::none || settings.denoise;
+
+	// Animations are posed by time, so a scene left at another job's frame goes straight to this one. Every animation
+	// is at rest at time 0.
+	const float time = frame / settings.frames_per_second;
+	const bool is_posed = time == scene.pose_time && (time == 0.f || settings.animation == scene.pose);
+	if (!is_posed && !scene.animation.empty()) {
+		pose_animated_mesh(scene.animation, settings.animation, time, pool);
+		scene.world_bvh.update(scene.world, pool, settings.rebuild_threshold);
+	}
+	scene.pose_time = time;
+	scene.pose = settings.animation;
+
+	camera cam(settings.camera_position, settings.camera_lookat, settings.camera_up, settings.vertical_fov, settings.aspect_ratio,
+		settings.aperture, settings.resolved_focus_distance());
+
+	// Overrides are numbered after the scene's materials, as in a process that loaded only this scene
+	reset_material_ids(scene.material_count);
+	std::unique_ptr<material_override_world> overridden;
+	if (!settings.material_overrides.empty()) overridden.reset(new material_override_world(scene.world_bvh, settings.material_overrides));
+	const hittable& world = overridden ? static_cast<const hittable&>(*overridden) : scene.world_bvh;
+
+	std::vector<unsigned char> data(size_t(image_width) * image_height * 3);
+	framebuffer linear = has_linear ? make_linear_framebuffer(settings, image_width, image_height) : framebuffer();
+	cost_map costs(image_width, image_height);
+	const uint32_t linear_channels = linear_channel_count(&linear);
+
+	tile_scheduler scheduler(make_tiles(image_width, image_height, settings.resolved_tile_size(), settings.render_tile_order));
+	scheduler.print_progress = false;
+	scheduler.estimate_costs(pool, [&](const tile& t) {
+		return estimate_rect_cost(t.x, t.y, t.width, t.height, image_width, image_height, settings.max_depth, cam, world);
+	});
+
+	// Rows of one tile may be rendered by several threads, their time and rays are summed for the tile's result
+	std::vector<tile_result_header> headers(scheduler.tiles.size());
+	std::mutex headers_mutex;
+	std::mutex send_mutex;
+	bool is_lost = false;
+
+	scheduler.tile_done = [&](int index) {
+		const tile& t = scheduler.tiles[index];
+		tile_result_header header;
+		{
+			std::lock_guard<std::mutex> lock(headers_mutex);
+			header = headers[index];
+		}
+		header.lease = { frame, index, t.x, t.y, t.width, t.height };
+		header.linear_channels = linear_channels;
+
+		std::vector<unsigned char> message = pack_tile_result(header, image_width, 0, image_height, data.data(),
+			has_linear ? &linear : nullptr, costs);
+
+		std::lock_guard<std::mutex> lock(send_mutex);
+		if (!is_lost && !send_render_message(client, render_message::result, message.data(), message.size())) is_lost = true;
+	};
+
+	scheduler.run(pool, [&](const tile& t, int y_s, int y_f) {
+		auto rows_s = std::chrono::high_resolution_clock::now();
+		ray_counters counters_s = thread_ray_counters;
+		sample_rect(t.x, y_s, t.width, y_f - y_s, image_width, image_height, settings.samples_per_pixel, settings.max_depth, 3,
+			cam, world, settings.seed + frame, data.data(), &costs, has_linear ? &linear : nullptr);
+		auto rows_f = std::chrono::high_resolution_clock::now();
+
+		std::lock_guard<std::mutex> lock(headers_mutex);
+		tile_result_header& header = headers[&t - scheduler.tiles.data()];
+		header.render_ms += std::chrono::duration<double, std::milli>(rows_f - rows_s).count();
+		header.counters += thread_ray_counters - counters_s;
+	});
+
+	return !is_lost && send_render_message(client, render_message::frame_done, nullptr, 0);
+}
+
+// Renders through the daemon on a local socket, merging the tiles it sends back into the buffers a local render would
+// have filled
+class daemon_client {
+	public:
+		// Sends the job, the daemon reads its settings from argv relative to this process's working directory
+		bool connect(const std::string& path, int argc, char** argv, int width, int height);
+
+		// Blocks until every tile of the frame is in, false after printing why when the daemon cannot render it
+		bool render_frame(int frame, unsigned char* data, cost_map* costs, framebuffer* hdr, render_telemetry* telemetry);
+
+		// Ends the job, the daemon keeps the scene for the next one
+		void finish();
+
+	private:
+		tcp_socket socket;
+		int image_width = 0;
+		int image_height = 0;
+};
+
+bool daemon_client::connect(const std::string& path, int argc, char** argv, int width, int height) {
+	if (!socket.connect_local(path)) return false;
+
+	image_width = width;
+	image_height = height;
+
+	const std::string directory = current_directory();
+	std::vector<unsigned char> job(directory.begin(), directory.end());
+	job.push_back(0);
+	for (int i = 0; i < argc; ++i) {
+		job.insert(job.end(), argv[i], argv[i] + strlen(argv[i]) + 1);
+	}
+
+	return send_render_message(socket, render_message::job, job.data(), job.size());
+}
+
+bool daemon_client::render_frame(int frame, unsigned char* data, cost_map* costs, framebuffer* hdr, render_telemetry* telemetry) {
+	int32_t number = frame;
+	if (!send_render_message(socket, render_message::frame, &number, sizeof(number))) {
+		printf("The daemon closed the connection\n");
+		return false;
+	}
+
+	hdr = hdr != nullptr && !hdr->layers.empty() ? hdr : nullptr;
+	const uint32_t channels = linear_channel_count(hdr);
+	const uint64_t limit = tile_result_size({ frame, 0, 0, 0, image_width, image_height }, channels);
+	const size_t image_pixels = size_t(image_width) * image_height;
+	size_t pixels_done = 0;
+
+	render_message type;
+	std::vector<unsigned char> payload;
+	while (receive_render_message(socket, type, payload, limit)) {
+		if (type == render_message::frame_done) return true;
+
+		if (type == render_message::status || type == render_message::failed) {
+			printf("%.*s\n", int(payload.size()), reinterpret_cast<const char*>(payload.data()));
+			if (type == render_message::failed) return false;
+			continue;
+		}
+
+		tile_result_header header;
+		if (type != render_message::result || payload.size() < sizeof(header)) break;
+		memcpy(&header, payload.data(), sizeof(header));
+
+		const tile_lease& lease = header.lease;
+		if (lease.frame != frame || lease.x < 0 || lease.y < 0 || lease.width <= 0 || lease.height <= 0
+			|| lease.x + lease.width > image_width || lease.y + lease.height > image_height
+			|| header.linear_channels != channels || payload.size() != tile_result_size(lease, channels))
+		{
+			printf("The daemon sent a tile that does not fit the image\n");
+			return false;
+		}
+
+		unpack_tile_result(header, payload.data() + sizeof(header), image_width, image_height, data, hdr, costs);
+
+		if (telemetry != nullptr) {
+			double arrived_ms = telemetry->now_ms();
+			telemetry->add({ frame, lease.tile, 0, lease.x, lease.y, lease.width, lease.height,
+				arrived_ms - header.render_ms, arrived_ms, header.counters });
+		}
+
+		pixels_done += size_t(lease.width) * lease.height;
+		printf("%f%%\n", 100.f * float(pixels_done) / float(image_pixels));
+	}
+
+	printf("The daemon closed the connection\n");
+	return false;
+}
+
+// Asks the daemon on path to exit once its current job is done
+bool stop_render_daemon(const std::string& path) {
+	tcp_socket socket;
+	if (!socket.connect_local(path) || !send_render_message(socket, render_message::stop, nullptr, 0)) {
+		printf("Unable to connect to the daemon at %s\n", path.c_str());
+		return false;
+	}
+
+	printf("Asked the daemon at %s to stop\n", path.c_str());
+	return true;
+}
+
+void daemon_client::finish() {
+	if (socket.is_open()) send_render_message(socket, render_message::done, nullptr, 0);
+	socket.close();
+}
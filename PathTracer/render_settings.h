@@ -0,0 +1,433 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "animation.h"
+#include "aov.h"
+#include "bvh.h"
+#include "denoiser.h"
+#include "heatmap.h"
+#include "material_override.h"
+#include "tile_scheduler.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class hdr_format {
+	none,
+	exr_half,
+	exr_float,
+	pfm		// One file per layer
+};
+
+// Everything a render needs that is not the scene itself. Defaults match the sample render, a scene file and then
+// the command line override them.
+struct render_settings {
+	// Image
+	int image_width = 256;
+	float aspect_ratio = 3.f / 2.f;
+	int samples_per_pixel = 128;
+	int max_depth = 64;
+	uint32_t seed = 1;		// Every pixel of every frame is seeded from this, so renders are repeatable
+	std::string output_path = "output.png";
+	hdr_format hdr_output = hdr_format::exr_half;	// Linear float image written next to the PNG
+	unsigned aovs = aov_none;		// First hit outputs added to the linear image, a mask of aov_flags
+	bool stream_output = false;		// Write bands of tile rows as they finish instead of holding the whole image
+
+	// Sample ranges, jobs that each render some of a frame's samples and a merge of their sums
+	int sample_begin = 0;
+	int sample_end = 0;				// 0 for every sample up to samples_per_pixel
+	std::string accumulation_path;	// Where each frame's sums are written, which also renders with per sample seeds
+	std::vector<std::string> merge_inputs;	// Sums merged into the output instead of rendering
+
+	// Denoising, written next to the raw output with _denoised appended
+	bool denoise = false;
+	denoise_options denoise_filter;
+
+	// Acceleration
+	bvh_build_options build_options;
+
+	// Threads and tiles
+	int threads = 0;		// 0 for one per hardware thread
+	int tile_size = 0;		// 0 to pick from the image size and thread count
+	tile_order render_tile_order = tile_order::hilbert;
+
+	// Distribution, a coordinator leases tiles to worker processes and writes the image they send back
+	int coordinator_port = 0;		// Coordinate workers connecting on this port instead of rendering here
+	std::string coordinator_bind = "127.0.0.1";	// Address the coordinator listens on
+	std::string worker_address;		// host:port of a coordinator to render tiles for
+	std::string token;				// Shared by the coordinator and its workers, only a worker presenting it is sent the job
+	int lease_timeout = 300;		// Seconds a worker may hold a tile before it is leased to another, 0 to wait forever
+	int worker_timeout = 300;		// Seconds a frame waits with no worker connected before the render fails, 0 to wait forever
+
+	// Daemon, a long lived process on a local socket keeps scenes loaded between renders submitted to it
+	std::string serve_socket;		// Run as the daemon on this socket
+	std::string daemon_socket;		// Render through the daemon on this socket instead of loading the scene here
+	int daemon_scenes = 4;			// Scenes the daemon keeps loaded, the least recently used goes first
+	int daemon_timeout = 60;		// Seconds the daemon waits on a client before dropping it
+	bool stop_daemon = false;		// Ask the daemon on daemon_socket to exit instead of rendering
+
+	// Telemetry, off unless asked for, empty paths are skipped
+	std::string trace_file;
+	std::string tile_csv_file;
+	bool write_heatmap = false;		// False color cost written next to each output image
+	heatmap_metric heatmap_source = heatmap_metric::traversal_cost;
+
+	// Scene
+	std::string scene = "sample";	// A built in scene, or an OBJ file when obj_file is set
+	std::string obj_file;
+	std::string cache_directory = ".";
+	int mesh_bits = 0;				// 16 or 21 to hold the OBJ as quantized clusters, 0 for full float triangles
+	int geometry_budget_mb = 0;		// Page the OBJ's clusters from a file in cache_directory, at most this much resident
+	std::vector<material_override> material_overrides;	// Applied in order over the scene's own materials
+
+	// Animation
+	int frame_count = 1;			// Frames past the first get their number appended to the output path
+	float frames_per_second = 24.f;
+	animation_settings animation;
+	float rebuild_threshold = 1.5f;	// Rebuild once refitting has raised the SAH cost by this factor
+
+	// Camera
+	vec3 camera_position = vec3(0.f, 0.f, 7.f);
+	vec3 camera_lookat = vec3(0.f, 0.f, 0.f);
+	vec3 camera_up = vec3(0.f, 1.f, 0.f);
+	float vertical_fov = 20.f;
+	float aperture = 0.1f;
+	float focus_distance = 0.f;		// 0 to focus on the look at point
+
+	int image_height() const { return std::max(1, static_cast<int>(image_width / aspect_ratio)); }
+	bool is_accumulating() const { return sample_end > 0 || !accumulation_path.empty(); }
+	int samples_rendered() const { return sample_end > 0 ? sample_end - sample_begin : samples_per_pixel; }
+	int thread_count() const { return threads > 0 ? threads : int(std::max(1u, std::thread::hardware_concurrency())); }
+	int resolved_tile_size() const { return tile_size > 0 ? tile_size : auto_tile_size(image_width, image_height(), thread_count()); }
+	float resolved_focus_distance() const { return focus_distance > 0.f ? focus_distance : length(camera_position - camera_lookat); }
+};
+
+// Layers of the linear image a render keeps next to the 8 bit one: the color, the AOVs asked for and whatever the
+// denoiser needs
+framebuffer make_linear_framebuffer(const render_settings& settings, int width, int height) {
+	framebuffer buffer(width, height);
+	buffer.add_layer("", { "R", "G", "B" });
+	add_aov_layers(buffer, settings.aovs | (settings.denoise ? aov_albedo | aov_normal | aov_variance : aov_none));
+	return buffer;
+}
+
+// One key, usable as "key = value" in a scene file or "--key value" on the command line
+struct render_setting_option {
+	const char* name;
+	const char* usage;
+	std::function<bool(render_settings&, const std::string&)> parse;
+};
+
+bool parse_setting_int(const std::string& text, int min, int& value) {
+	char* end = nullptr;
+	long parsed = strtol(text.c_str(), &end, 10);
+	if (end == text.c_str() || *end != '\0' || parsed < min) return false;
+
+	value = int(parsed);
+	return true;
+}
+
+bool parse_setting_float(const std::string& text, float& value) {
+	char* end = nullptr;
+	float parsed = strtof(text.c_str(), &end);
+	if (end == text.c_str() || *end != '\0') return false;
+
+	value = parsed;
+	return true;
+}
+
+bool parse_setting_bool(const std::string& text, bool& value) {
+	if (text == "true" || text == "on" || text == "1") value = true;
+	else if (text == "false" || text == "off" || text == "0") value = false;
+	else return false;
+	return true;
+}
+
+bool parse_setting_vec3(const std::string& text, vec3& value) {
+	float x, y, z;
+	char extra;
+	if (sscanf(text.c_str(), " %f %f %f %c", &x, &y, &z, &extra) != 3) return false;
+
+	value = vec3(x, y, z);
+	return true;
+}
+
+// "1.5" or "3:2"
+bool parse_setting_aspect(const std::string& text, float& value) {
+	float width, height;
+	char extra;
+	if (sscanf(text.c_str(), " %f : %f %c", &width, &height, &extra) == 2) {
+		if (width <= 0.f || height <= 0.f) return false;
+		value = width / height;
+		return true;
+	}
+
+	return parse_setting_float(text, value) && value > 0.f;
+}
+
+std::vector<render_setting_option> render_setting_options() {
+	auto int_option = [](int render_settings::* field, int min) {
+		return [field, min](render_settings& s, const std::string& v) { return parse_setting_int(v, min, s.*field); };
+	};
+	auto float_option = [](float render_settings::* field) {
+		return [field](render_settings& s, const std::string& v) { return parse_setting_float(v, s.*field); };
+	};
+	auto vec3_option = [](vec3 render_settings::* field) {
+		return [field](render_settings& s, const std::string& v) { return parse_setting_vec3(v, s.*field); };
+	};
+	auto string_option = [](std::string render_settings::* field) {
+		return [field](render_settings& s, const std::string& v) { s.*field = v; return true; };
+	};
+
+	return {
+		{ "width", "Image width in pixels", int_option(&render_settings::image_width, 1) },
+		{ "aspect", "Width over height, as 1.5 or 3:2", [](render_settings& s, const std::string& v) { return parse_setting_aspect(v, s.aspect_ratio); } },
+		{ "spp", "Samples per pixel", int_option(&render_settings::samples_per_pixel, 1) },
+		{ "depth", "Maximum path length", int_option(&render_settings::max_depth, 1) },
+		{ "seed", "Random seed of the render", [](render_settings& s, const std::string& v) {
+			int seed;
+			if (!parse_setting_int(v, 0, seed)) return false;
+			s.seed = uint32_t(seed);
+			return true;
+		} },
+		{ "output", "Output PNG path", string_option(&render_settings::output_path) },
+		{ "hdr", "Linear image next to the PNG: exr, exr_float, pfm or none", [](render_settings& s, const std::string& v) {
+			if (v == "exr") s.hdr_output = hdr_format::exr_half;
+			else if (v == "exr_float") s.hdr_output = hdr_format::exr_float;
+			else if (v == "pfm") s.hdr_output = hdr_format::pfm;
+			else if (v == "none") s.hdr_output = hdr_format::none;
+			else return false;
+			return true;
+		} },
+		{ "aovs", "Outputs in the linear image: albedo, normal, depth, material_id, object_id, variance, all or none", [](render_settings& s, const std::string& v) {
+			return parse_aov_list(v, s.aovs);
+		} },
+
+		{ "sample_range", "Render only samples a to b of each pixel, as a:b, and write their sums for --merge", [](render_settings& s, const std::string& v) {
+			int begin, end;
+			char extra;
+			if (sscanf(v.c_str(), " %d : %d %c", &begin, &end, &extra) != 2 || begin < 0 || end <= begin) return false;
+			s.sample_begin = begin;
+			s.sample_end = end;
+			return true;
+		} },
+		{ "accumulation", "Sums file path, by default the output path with .ptsum", string_option(&render_settings::accumulation_path) },
+		{ "merge", "Sums file to merge into the output instead of rendering, repeatable", [](render_settings& s, const std::string& v) {
+			s.merge_inputs.push_back(v);
+			return true;
+		} },
+
+		{ "stream", "Write rows as they finish, for images too large to hold, true or false", [](render_settings& s, const std::string& v) { return parse_setting_bool(v, s.stream_output); } },
+		{ "denoise", "Also write a denoised image, true or false", [](render_settings& s, const std::string& v) { return parse_setting_bool(v, s.denoise); } },
+		{ "denoise_passes", "Filter passes, each doubles the reach of the denoiser", [](render_settings& s, const std::string& v) {
+			return parse_setting_int(v, 1, s.denoise_filter.passes) && s.denoise_filter.passes <= 12;
+		} },
+		{ "denoise_sigma", "Luminance difference the denoiser smooths over, in standard deviations of the noise", [](render_settings& s, const std::string& v) {
+			return parse_setting_float(v, s.denoise_filter.color_sigma) && s.denoise_filter.color_sigma > 0.f;
+		} },
+
+		{ "backend", "BVH builder: sah, lbvh or sbvh", [](render_settings& s, const std::string& v) {
+			for (bvh_build_method method : { bvh_build_method::sah, bvh_build_method::lbvh, bvh_build_method::sbvh }) {
+				if (v == bvh_build_method_name(method)) {
+					s.build_options.method = method;
+					return true;
+				}
+			}
+			return false;
+		} },
+		{ "morton_bits", "Morton code bits of the lbvh builder, 30 or 63", [](render_settings& s, const std::string& v) {
+			return parse_setting_int(v, 30, s.build_options.morton_bits) && (s.build_options.morton_bits == 30 || s.build_options.morton_bits == 63);
+		} },
+		{ "optimize_treelets", "Restructure lbvh treelets, true or false", [](render_settings& s, const std::string& v) { return parse_setting_bool(v, s.build_options.optimize_treelets); } },
+		{ "max_duplication", "Reference budget of the sbvh builder", [](render_settings& s, const std::string& v) { return parse_setting_float(v, s.build_options.max_duplication); } },
+
+		{ "threads", "Render threads, 0 for all hardware threads", int_option(&render_settings::threads, 0) },
+		{ "tile_size", "Tile edge in pixels, 0 to pick automatically", int_option(&render_settings::tile_size, 0) },
+		{ "tile_order", "row_major, hilbert or spiral", [](render_settings& s, const std::string& v) {
+			if (v == "row_major") s.render_tile_order = tile_order::row_major;
+			else if (v == "hilbert") s.render_tile_order = tile_order::hilbert;
+			else if (v == "spiral") s.render_tile_order = tile_order::spiral;
+			else return false;
+			return true;
+		} },
+
+		{ "trace", "Chrome trace path, empty to skip", string_option(&render_settings::trace_file) },
+		{ "tile_csv", "Per tile CSV path, empty to skip", string_option(&render_settings::tile_csv_file) },
+		{ "heatmap", "traversal_cost, rays, bounces or none, the default", [](render_settings& s, const std::string& v) {
+			s.write_heatmap = v != "none";
+			if (v == "traversal_cost") s.heatmap_source = heatmap_metric::traversal_cost;
+			else if (v == "rays") s.heatmap_source = heatmap_metric::rays;
+			else if (v == "bounces") s.heatmap_source = heatmap_metric::bounces;
+			else return v == "none";
+			return true;
+		} },
+
+		{ "scene", "sample, test, random_spheres, instanced, animated or sliver", string_option(&render_settings::scene) },
+		{ "obj", "OBJ file rendered instead of the scene", string_option(&render_settings::obj_file) },
+		{ "cache_directory", "Where built OBJ BVHs are cached", string_option(&render_settings::cache_directory) },
+		{ "mesh_bits", "Quantize the OBJ to 16 or 21 bit positions in compressed clusters, 0 keeps full floats", [](render_settings& s, const std::string& v) {
+			int bits;
+			if (!parse_setting_int(v, 0, bits) || (bits != 0 && bits != 16 && bits != 21)) return false;
+			s.mesh_bits = bits;
+			return true;
+		} },
+		{ "geometry_budget_mb", "Page the compressed OBJ from disk keeping at most this many MB resident, 0 keeps it all in memory", int_option(&render_settings::geometry_budget_mb, 0) },
+		{ "material", "Replace a material, as \"3: lambertian r g b\", \"*: metal r g b roughness\", \"id: dielectric ior\" or \"id: normal\", repeatable", [](render_settings& s, const std::string& v) {
+			material_override value;
+			if (!parse_material_override(v, value)) return false;
+			s.material_overrides.push_back(value);
+			return true;
+		} },
+
+		{ "coordinator_port", "Lease tiles to workers connecting on this port instead of rendering here", int_option(&render_settings::coordinator_port, 0) },
+		{ "coordinator_bind", "Address the coordinator listens on, 0.0.0.0 for every interface, which needs a token", string_option(&render_settings::coordinator_bind) },
+		{ "worker", "Render tiles for the coordinator at host:port, which sends the rest of the settings", string_option(&render_settings::worker_address) },
+		{ "token", "Secret shared by the coordinator and its workers, a worker without it is not sent the job", string_option(&render_settings::token) },
+		{ "lease_timeout", "Seconds a worker may hold a tile before it is leased to another, 0 to wait forever", int_option(&render_settings::lease_timeout, 0) },
+		{ "worker_timeout", "Seconds a frame waits with no worker connected before the render fails, 0 to wait forever", int_option(&render_settings::worker_timeout, 0) },
+
+		{ "serve", "Run as a daemon on this local socket path, keeping scenes loaded for the renders submitted to it", string_option(&render_settings::serve_socket) },
+		{ "daemon", "Render through the daemon on this local socket path instead of loading the scene here", string_option(&render_settings::daemon_socket) },
+		{ "daemon_scenes", "Scenes a daemon keeps loaded", int_option(&render_settings::daemon_scenes, 1) },
+		{ "daemon_timeout", "Seconds a daemon waits on a client before dropping it", int_option(&render_settings::daemon_timeout, 1) },
+		{ "stop_daemon", "Ask the daemon on --daemon to exit once its current job is done, true or false", [](render_settings& s, const std::string& v) { return parse_setting_bool(v, s.stop_daemon); } },
+
+		{ "frames", "Number of frames", int_option(&render_settings::frame_count, 1) },
+		{ "fps", "Frames per second of animated scenes", float_option(&render_settings::frames_per_second) },
+		{ "animation", "How animated scenes move: turntable or wave", [](render_settings& s, const std::string& v) {
+			for (animation_type type : { animation_type::turntable, animation_type::wave }) {
+				if (v == animation_type_name(type)) {
+					s.animation.type = type;
+					return true;
+				}
+			}
+			return false;
+		} },
+		{ "turntable_rate", "Turntable revolutions per second", [](render_settings& s, const std::string& v) { return parse_setting_float(v, s.animation.turntable_rate); } },
+		{ "wave_amplitude", "Wave height as a fraction of the distance from the origin", [](render_settings& s, const std::string& v) { return parse_setting_float(v, s.animation.wave_amplitude); } },
+		{ "wave_frequency", "Wave radians per unit of height", [](render_settings& s, const std::string& v) { return parse_setting_float(v, s.animation.wave_frequency); } },
+		{ "rebuild_threshold", "SAH growth that triggers a BVH rebuild", float_option(&render_settings::rebuild_threshold) },
+
+		{ "camera_position", "Camera position, as x y z", vec3_option(&render_settings::camera_position) },
+		{ "camera_lookat", "Point the camera looks at, as x y z", vec3_option(&render_settings::camera_lookat) },
+		{ "camera_up", "Camera up direction, as x y z", vec3_option(&render_settings::camera_up) },
+		{ "vfov", "Vertical field of view in degrees", float_option(&render_settings::vertical_fov) },
+		{ "aperture", "Lens aperture, 0 for a pinhole", float_option(&render_settings::aperture) },
+		{ "focus_distance", "Focus distance, 0 for the look at point", float_option(&render_settings::focus_distance) }
+	};
+}
+
+bool apply_render_setting(render_settings& settings, const std::string& key, const std::string& value) {
+	for (const render_setting_option& option : render_setting_options()) {
+		if (key != option.name) continue;
+
+		if (!option.parse(settings, value)) {
+			printf("Invalid value for %s: %s\n", key.c_str(), value.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	printf("Unknown setting: %s\n", key.c_str());
+	return false;
+}
+
+std::string trim_setting(const std::string& text) {
+	const char* whitespace = " \t\r\n";
+	size_t first = text.find_first_not_of(whitespace);
+	if (first == std::string::npos) return "";
+
+	size_t last = text.find_last_not_of(whitespace);
+	return text.substr(first, last - first + 1);
+}
+
+// Lines of "key = value", blank lines and lines starting with # are skipped
+bool load_render_settings(const std::string& path, render_settings& settings) {
+	FILE* file = fopen(path.c_str(), "r");
+	if (file == nullptr) {
+		printf("Unable to open scene file: %s\n", path.c_str());
+		return false;
+	}
+
+	bool is_valid = true;
+	char buffer[1024];
+	for (int line_number = 1; is_valid && fgets(buffer, sizeof(buffer), file) != nullptr; ++line_number) {
+		std::string line = trim_setting(buffer);
+		if (line.empty() || line[0] == '#') continue;
+
+		size_t equals = line.find('=');
+		if (equals == std::string::npos) {
+			printf("%s:%d: expected key = value\n", path.c_str(), line_number);
+			is_valid = false;
+			break;
+		}
+
+		if (!apply_render_setting(settings, trim_setting(line.substr(0, equals)), trim_setting(line.substr(equals + 1)))) {
+			printf("%s:%d: in this line\n", path.c_str(), line_number);
+			is_valid = false;
+		}
+	}
+
+	fclose(file);
+	return is_valid;
+}
+
+void print_render_usage(const char* program) {
+	printf("Usage: %s [scene_file] [--key value]...\n\n", program);
+	printf("Settings come from the defaults, then the scene file, then the command line. Scene files hold one\n");
+	printf("\"key = value\" per line, # starts a comment.\n\n");
+
+	for (const render_setting_option& option : render_setting_options()) {
+		printf("  --%-18s %s\n", option.name, option.usage);
+	}
+}
+
+// Returns false after printing the problem, or the usage when help was asked for
+bool parse_render_arguments(int argc, char** argv, render_settings& settings, bool& show_help) {
+	show_help = false;
+
+	int first = 1;
+	if (argc > 1 && strncmp(argv[1], "--", 2) != 0) {
+		if (!load_render_settings(argv[1], settings)) return false;
+		first = 2;
+	}
+
+	for (int i = first; i < argc; ++i) {
+		std::string arg = argv[i];
+		if (arg == "--help" || arg == "-h") {
+			show_help = true;
+			return false;
+		}
+
+		if (arg.compare(0, 2, "--") != 0 || i + 1 >= argc) {
+			printf("Expected --key value, got: %s\n", arg.c_str());
+			return false;
+		}
+
+		if (!apply_render_setting(settings, arg.substr(2), argv[++i])) return false;
+	}
+
+	return true;
+}
+
+// The output path with the suffix and then the frame number before its extension, when there is more than one frame.
+// A non null extension replaces the original one.
+std::string frame_output_path(const std::string& path, const char* suffix, int frame, int frame_count, const char* extension = nullptr) {
+	size_t dot = path.find_last_of('.');
+	size_t slash = path.find_last_of("/\\");
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) dot = path.size();
+
+	std::string stem = path.substr(0, dot) + suffix;
+	if (frame_count > 1) {
+		char number[16];
+		snprintf(number, sizeof(number), "_%03d", frame);
+		stem += number;
+	}
+
+	return stem + (extension != nullptr ? std::string(extension) : path.substr(dot));
+}
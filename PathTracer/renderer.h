@@ -0,0 +1,241 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "accumulation.h"
+#include "aov.h"
+#include "camera.h"
+#include "cpu_dispatch.h"
+#include "framebuffer.h"
+#include "heatmap.h"
+#include "hittable.h"
+#include "material.h"
+#include "telemetry.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// The first hit of a camera ray is also described in first_hit, when one is given. Its albedo and normal are carried
+// on through specular surfaces, tinted by them, so a denoiser guided by them keeps reflections and refractions sharp.
+vec3 ray_color(const ray& r, const hittable& world, int depth, aov_sample* first_hit = nullptr, bool is_camera_ray = true) {
+	hit_record rec;
+
+	if (depth <= 0) {
+		return vec3(0.f);
+	}
+
+	if (world.hit(r, 0.001f, infinity, rec)) {
+		aov_sample* next_hit = nullptr;
+		if (first_hit != nullptr) {
+			if (is_camera_ray) {
+				first_hit->albedo = rec.mat_ptr->base_color(rec);
+				first_hit->depth = rec.t * length(r.direction());
+				first_hit->material_id = rec.mat_ptr->id;
+				first_hit->object_id = rec.object_id;
+			}
+			else {
+				first_hit->albedo *= rec.mat_ptr->base_color(rec);
+			}
+
+			first_hit->normal = rec.normal;
+			if (rec.mat_ptr->is_specular()) next_hit = first_hit;
+		}
+
+		ray r_out;
+		vec3 attenuation;
+
+		if (rec.mat_ptr->scatter(r, rec, attenuation, r_out)) {
+			++thread_ray_counters.bounces;
+			if (depth > 1) ++thread_ray_counters.secondary_rays;
+			return attenuation * ray_color(r_out, world, depth - 1, next_hit, false);
+		}
+
+		return vec3(0.f);
+	}
+
+	vec3 unit_direction = normalize(r.direction());
+	float t = 0.5f * (unit_direction.y + 1.f);
+	vec3 sky = (1.f - t) * vec3(1.f, 1.f, 1.f) + t * vec3(0.5f, 0.7f, 1.f);
+
+	if (first_hit != nullptr && is_camera_ray) {
+		*first_hit = { sky, vec3(0.f), infinity, -1, -1 };
+	}
+	else if (first_hit != nullptr) {
+		first_hit->albedo *= sky;
+		first_hit->normal = vec3(0.f);
+	}
+
+	return sky;
+}
+
+// Sum of every sample of a pixel, resolved to 8 bit later. The first hits of the same samples go into aovs when given.
+vec3 sample_pixel
+(
+	int w, int h,
+	const int image_width, const int image_height,
+	const int samples_per_pixel, const int max_depth,
+	const camera& cam, const hittable& world, uint32_t seed,
+	aov_pixel* aovs = nullptr
+)
+{
+	seed_random(pixel_seed(seed, w, h));
+
+	vec3 pixel_color(0.f, 0.f, 0.f);
+	aov_sample first_hit;
+	for (int s = 0; s < samples_per_pixel; ++s) {
+		float u = (w + random_float()) / (image_width - 1);
+		float v = (h + random_float()) / (image_height - 1);
+
+		ray r = cam.get_ray(u, v);
+		if (aovs != nullptr) {
+			vec3 sample_color = ray_color(r, world, max_depth, &first_hit);
+			pixel_color += sample_color;
+			aovs->add(first_hit, sample_color);
+		}
+		else {
+			pixel_color += ray_color(r, world, max_depth);
+		}
+	}
+
+	thread_ray_counters.primary_rays += samples_per_pixel;
+	thread_ray_counters.samples += samples_per_pixel;
+
+	return pixel_color;
+}
+
+// The samples of the buffer's last range, each seeded on its own so the range renders the same however the frame's
+// samples are split. Returns the mean of every sample the buffer holds for the pixel.
+vec3 accumulate_pixel
+(
+	int w, int h,
+	const int image_width, const int image_height, const int max_depth,
+	const camera& cam, const hittable& world, uint32_t seed,
+	accumulation_buffer& accumulation, aov_pixel* aovs = nullptr
+)
+{
+	const sample_range& range = accumulation.ranges.back();
+
+	aov_sample first_hit;
+	for (int s = range.begin; s < range.end; ++s) {
+		seed_sample_random(sample_seed(seed, w, h, s));
+
+		float u = (w + random_float()) / (image_width - 1);
+		float v = (h + random_float()) / (image_height - 1);
+
+		ray r = cam.get_ray(u, v);
+		vec3 sample_color = ray_color(r, world, max_depth, aovs != nullptr ? &first_hit : nullptr);
+		if (aovs != nullptr) aovs->add(first_hit, sample_color);
+
+		accumulation.add(w, h, sample_color);
+	}
+
+	thread_ray_counters.primary_rays += range.end - range.begin;
+	thread_ray_counters.samples += range.end - range.begin;
+
+	return accumulation.mean(w, h);
+}
+
+void sample_rect
+(
+	int x_s, int y_s, const int rect_width, const int rect_height,
+	const int image_width, const int image_height,
+	const int samples_per_pixel, const int max_depth, const int image_channels,
+	const camera& cam, const hittable& world, uint32_t seed,
+	unsigned char* data, cost_map* costs, framebuffer* hdr,
+	const int first_row = 0, int row_count = 0,		// The rows data and hdr hold, 0 for all of them up to the top
+	accumulation_buffer* accumulation = nullptr		// Sums the samples of its last range instead, samples_per_pixel must match it
+)
+{
+	if (row_count == 0) row_count = image_height - first_row;
+
+	int y_max = std::min(y_s + rect_height, image_height);
+	int x_max = std::min(x_s + rect_width, image_width);
+	if (x_max <= x_s) return;
+
+	// Rows are resolved a whole span at a time
+	const int row_width = x_max - x_s;
+	std::vector<float> row_colors(size_t(row_width) * 3);
+	std::vector<unsigned char> row_rgb(row_colors.size());
+
+	// Linear color averaged over the samples, when a float image is kept too
+	const int hdr_layer = hdr != nullptr ? hdr->find_layer("") : -1;
+	const float sample_scale = 1.f / samples_per_pixel;
+	const float color_scale = accumulation != nullptr ? 1.f : sample_scale;	// Accumulated colors are already means
+
+	const aov_targets aovs = hdr != nullptr ? aov_targets(*hdr) : aov_targets();
+	const bool has_aovs = aovs.any();
+
+	for (int y = y_s; y < y_max; ++y) {
+		for (int x = x_s; x < x_max; ++x) {
+			ray_counters counters_s = thread_ray_counters;
+			aov_pixel aov;
+			vec3 pixel_color = accumulation != nullptr
+				? accumulate_pixel(x, y, image_width, image_height, max_depth, cam, world, seed, *accumulation, has_aovs ? &aov : nullptr)
+				: sample_pixel(x, y, image_width, image_height, samples_per_pixel, max_depth, cam, world, seed, has_aovs ? &aov : nullptr);
+
+			float* color = &row_colors[size_t(x - x_s) * 3];
+			color[0] = pixel_color.r;
+			color[1] = pixel_color.g;
+			color[2] = pixel_color.b;
+
+			if (hdr_layer >= 0) {
+				float* linear = hdr->pixel(hdr_layer, x, y - first_row);
+				linear[0] = pixel_color.r * color_scale;
+				linear[1] = pixel_color.g * color_scale;
+				linear[2] = pixel_color.b * color_scale;
+			}
+
+			if (has_aovs) {
+				aovs.store(*hdr, x, y - first_row, aov, sample_scale);
+			}
+
+			if (costs != nullptr) {
+				costs->record(x, y, thread_ray_counters - counters_s);
+			}
+		}
+
+		cpu_kernels().resolve_rgb8(row_colors.data(), int(row_colors.size()), color_scale, row_rgb.data());
+
+		unsigned char* out = &data[(size_t(first_row + row_count - y - 1) * image_width + x_s) * image_channels];
+		for (int x = 0; x < row_width; ++x) {
+			out[x * image_channels + 0] = row_rgb[x * 3 + 0];
+			out[x * image_channels + 1] = row_rgb[x * 3 + 1];
+			out[x * image_channels + 2] = row_rgb[x * 3 + 2];
+		}
+	}
+}
+
+// 8 bit top down image of a color layer holding averaged linear values
+std::vector<unsigned char> resolve_framebuffer_rgb8(const framebuffer& buffer, int layer) {
+	std::vector<unsigned char> rgb(size_t(buffer.width) * buffer.height * 3);
+	for (int y = 0; y < buffer.height; ++y) {
+		cpu_kernels().resolve_rgb8(buffer.pixel(layer, 0, y), buffer.width * 3, 1.f, &rgb[size_t(buffer.height - y - 1) * buffer.width * 3]);
+	}
+	return rgb;
+}
+
+// Time a single sample on every fourth pixel of the rect, a rough prediction of how long the rect takes to render
+double estimate_rect_cost
+(
+	int x_s, int y_s, const int rect_width, const int rect_height,
+	const int image_width, const int image_height, const int max_depth,
+	const camera& cam, const hittable& world
+)
+{
+	const int stride = 4;
+	int y_max = std::min(y_s + rect_height, image_height);
+	int x_max = std::min(x_s + rect_width, image_width);
+
+	auto time_s = std::chrono::high_resolution_clock::now();
+
+	for (int y = y_s; y < y_max; y += stride) {
+		for (int x = x_s; x < x_max; x += stride) {
+			float u = (x + random_float()) / (image_width - 1);
+			float v = (y + random_float()) / (image_height - 1);
+			ray_color(cam.get_ray(u, v), world, max_depth);
+		}
+	}
+
+	auto time_f = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::milli>(time_f - time_s).count();
+}
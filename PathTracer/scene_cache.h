@@ -0,0 +1,359 @@
+#pragma once
+
+#include "bvh.h"
+#include "hittable_list.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "mesh.h"
+#include "obj_reader.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Cache files are a fixed header followed by raw little endian sections, bump the version on any layout change
+const char scene_cache_magic[8] = { 'P', 'T', 'C', 'A', 'C', 'H', 'E', '\0' };
+const uint32_t scene_cache_version = 2;
+
+enum class cached_material_type : uint32_t {
+	lambertian,
+	metal,
+	dielectric,
+	normal
+};
+
+struct cached_material {
+	uint32_t type;
+	float albedo[3];
+	float parameter;	// Metal roughness or dielectric index of refraction
+};
+
+// Triangles are stored in BVH leaf order
+struct cached_triangle {
+	uint32_t v[3];
+	int32_t n[3];		// -1 for flat shaded triangles
+	uint32_t material;
+};
+
+struct cached_section {
+	uint64_t offset;
+	uint64_t count;
+};
+
+struct scene_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t node_size;
+	uint64_t content_hash;
+	uint64_t payload_hash;		// Of every byte after the header
+
+	cached_section materials;
+	cached_section vertices;
+	cached_section normals;
+	cached_section triangles;
+	cached_section nodes;
+};
+
+inline uint64_t fnv1a_64(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+bool hash_file(const char* path, uint64_t& hash) {
+	mapped_file file;
+	if (!file.open(path)) return false;
+
+	hash = fnv1a_64(file.data(), file.size(), hash);
+	return true;
+}
+
+// Everything that changes the cached result takes part in the key
+bool scene_cache_key(const char* source_path, const bvh_build_options& options, uint64_t& key) {
+	key = fnv1a_64(&scene_cache_version, sizeof(scene_cache_version));
+	if (!hash_file(source_path, key)) return false;
+
+	int settings[] = { int(options.method), options.bin_count, options.max_leaf_size, options.morton_bits, options.optimize_treelets, options.treelet_size };
+	float costs[] = { options.traversal_cost, options.intersection_cost, options.max_duplication, options.spatial_split_alpha };
+	key = fnv1a_64(settings, sizeof(settings), key);
+	key = fnv1a_64(costs, sizeof(costs), key);
+	return true;
+}
+
+std::string scene_cache_path(const char* cache_directory, uint64_t key) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.ptcache", (unsigned long long)key);
+	return std::string(cache_directory) + "/" + name;
+}
+
+cached_material to_cached_material(const material& mat) {
+	cached_material out = {};
+
+	if (const lambertian* l = dynamic_cast<const lambertian*>(&mat)) {
+		out.type = uint32_t(cached_material_type::lambertian);
+		memcpy(out.albedo, &l->albedo, sizeof(out.albedo));
+	}
+	else if (const metal* m = dynamic_cast<const metal*>(&mat)) {
+		out.type = uint32_t(cached_material_type::metal);
+		memcpy(out.albedo, &m->albedo, sizeof(out.albedo));
+		out.parameter = m->roughness;
+	}
+	else if (const dielectric* d = dynamic_cast<const dielectric*>(&mat)) {
+		out.type = uint32_t(cached_material_type::dielectric);
+		out.parameter = d->ior;
+	}
+	else {
+		out.type = uint32_t(cached_material_type::normal);
+	}
+
+	return out;
+}
+
+material* from_cached_material(const cached_material& mat, scene_arena& arena) {
+	vec3 albedo(mat.albedo[0], mat.albedo[1], mat.albedo[2]);
+
+	switch (cached_material_type(mat.type)) {
+		case cached_material_type::lambertian: return arena.make<lambertian>(albedo);
+		case cached_material_type::metal: return arena.make<metal>(albedo, mat.parameter);
+		case cached_material_type::dielectric: return arena.make<dielectric>(mat.parameter);
+		default: return arena.make<normal>();
+	}
+}
+
+// The BVH must have been built over the faces of m in order
+bool save_scene_cache(const std::string& path, uint64_t key, const mesh& m,
+	const std::vector<const material*>& materials, const std::vector<uint32_t>& face_materials, const bvh& b)
+{
+	std::vector<cached_material> cached_materials;
+	for (const auto& mat : materials) {
+		cached_materials.push_back(to_cached_material(*mat));
+	}
+
+	std::vector<cached_triangle> triangles(b.primitive_indices.size());
+	for (size_t i = 0; i < triangles.size(); ++i) {
+		int face_index = b.primitive_indices[i];
+		const face& f = m.faces[face_index];
+
+		for (int k = 0; k < 3; ++k) {
+			triangles[i].v[k] = uint32_t(f.v[k]);
+			triangles[i].n[k] = m.is_smooth ? f.n[k] : -1;
+		}
+		triangles[i].material = face_materials[face_index];
+	}
+
+	scene_cache_header header = {};
+	memcpy(header.magic, scene_cache_magic, sizeof(header.magic));
+	header.version = scene_cache_version;
+	header.node_size = sizeof(bvh_node);
+	header.content_hash = key;
+
+	// Sections start on 16 byte boundaries so they can be read in place from the mapping
+	uint64_t offset = sizeof(scene_cache_header);
+	auto place = [&offset](cached_section& section, uint64_t count, uint64_t element_size) {
+		offset = (offset + 15) & ~uint64_t(15);
+		section.offset = offset;
+		section.count = count;
+		offset += count * element_size;
+	};
+
+	place(header.materials, cached_materials.size(), sizeof(cached_material));
+	place(header.vertices, m.vertices.size(), sizeof(vec3));
+	place(header.normals, m.normals.size(), sizeof(vec3));
+	place(header.triangles, triangles.size(), sizeof(cached_triangle));
+	place(header.nodes, b.nodes.size(), sizeof(bvh_node));
+
+	// Each writer fills its own temporary and swaps it in whole, so processes missing the same cache at once never
+	// write into one file and readers never see a partial one
+	std::string temp_path = unique_temp_path(path);
+	std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+	if (!out) return false;
+
+	uint64_t payload_hash = fnv1a_64(nullptr, 0);
+	auto write_section = [&out, &payload_hash](const cached_section& section, const void* data, uint64_t element_size) {
+		static const char padding[16] = {};
+		const size_t padding_size = size_t(section.offset - uint64_t(out.tellp()));
+		out.write(padding, std::streamsize(padding_size));
+		out.write(static_cast<const char*>(data), std::streamsize(section.count * element_size));
+
+		payload_hash = fnv1a_64(padding, padding_size, payload_hash);
+		payload_hash = fnv1a_64(data, size_t(section.count * element_size), payload_hash);
+	};
+
+	// The header goes in again once the payload's hash is known
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	write_section(header.materials, cached_materials.data(), sizeof(cached_material));
+	write_section(header.vertices, m.vertices.data(), sizeof(vec3));
+	write_section(header.normals, m.normals.data(), sizeof(vec3));
+	write_section(header.triangles, triangles.data(), sizeof(cached_triangle));
+	write_section(header.nodes, b.nodes.data(), sizeof(bvh_node));
+
+	header.payload_hash = payload_hash;
+	out.seekp(0);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.close();
+
+	if (!out) {
+		remove(temp_path.c_str());
+		return false;
+	}
+
+	return replace_file(temp_path.c_str(), path.c_str());
+}
+
+bool load_scene_cache(const std::string& path, uint64_t key, hittable_list& world, bvh& world_bvh) {
+	mapped_file file;
+	if (!file.open(path.c_str()) || file.size() < sizeof(scene_cache_header)) return false;
+
+	scene_cache_header header;
+	memcpy(&header, file.data(), sizeof(header));
+
+	if (memcmp(header.magic, scene_cache_magic, sizeof(header.magic)) != 0
+		|| header.version != scene_cache_version
+		|| header.node_size != sizeof(bvh_node)
+		|| header.content_hash != key
+		|| header.payload_hash != fnv1a_64(file.data() + sizeof(header), file.size() - sizeof(header)))
+	{
+		return false;
+	}
+
+	auto is_valid = [&file](const cached_section& section, uint64_t element_size) {
+		return section.offset % 16 == 0
+			&& section.offset <= file.size()
+			&& section.count <= (file.size() - section.offset) / element_size;
+	};
+
+	if (!is_valid(header.materials, sizeof(cached_material))
+		|| !is_valid(header.vertices, sizeof(vec3))
+		|| !is_valid(header.normals, sizeof(vec3))
+		|| !is_valid(header.triangles, sizeof(cached_triangle))
+		|| !is_valid(header.nodes, sizeof(bvh_node)))
+	{
+		return false;
+	}
+
+	const cached_material* materials = reinterpret_cast<const cached_material*>(file.data() + header.materials.offset);
+	const vec3* vertices = reinterpret_cast<const vec3*>(file.data() + header.vertices.offset);
+	const vec3* normals = reinterpret_cast<const vec3*>(file.data() + header.normals.offset);
+	const cached_triangle* triangles = reinterpret_cast<const cached_triangle*>(file.data() + header.triangles.offset);
+	const bvh_node* nodes = reinterpret_cast<const bvh_node*>(file.data() + header.nodes.offset);
+
+	// Triangles are stored in leaf order, so they land in the arena in the order traversal visits them
+	auto arena = make_shared<scene_arena>();
+
+	std::vector<const material*> scene_materials;
+	for (uint64_t i = 0; i < header.materials.count; ++i) {
+		scene_materials.push_back(from_cached_material(materials[i], *arena));
+	}
+
+	std::vector<hittable*> objects;
+	std::vector<const hittable*> primitives;
+	objects.reserve(size_t(header.triangles.count));
+	primitives.reserve(size_t(header.triangles.count));
+
+	for (uint64_t i = 0; i < header.triangles.count; ++i) {
+		const cached_triangle& tri = triangles[i];
+
+		for (int k = 0; k < 3; ++k) {
+			if (tri.v[k] >= header.vertices.count) return false;
+			if (tri.n[k] >= int64_t(header.normals.count)) return false;
+		}
+		if (tri.material >= header.materials.count) return false;
+
+		const vec3* p = vertices;
+		const material* mat = scene_materials[tri.material];
+
+		if (tri.n[0] >= 0 && tri.n[1] >= 0 && tri.n[2] >= 0) {
+			objects.push_back(arena->make<triangle>(p[tri.v[0]], p[tri.v[1]], p[tri.v[2]], normals[tri.n[0]], normals[tri.n[1]], normals[tri.n[2]], mat));
+		}
+		else {
+			objects.push_back(arena->make<triangle>(p[tri.v[0]], p[tri.v[1]], p[tri.v[2]], mat));
+		}
+		primitives.push_back(objects.back());
+	}
+
+	// A damaged tree would send traversal out of bounds, so it is checked before it is adopted
+	bvh cached_bvh(std::vector<bvh_node>(nodes, nodes + header.nodes.count), std::move(primitives));
+	if (!cached_bvh.is_well_formed()) return false;
+
+	world_bvh = bvh();
+	world.objects = std::move(objects);
+	world.arena = arena;
+	world_bvh = std::move(cached_bvh);
+	return true;
+}
+
+// Copies the triangles of a tree built over source into world's arena in leaf order, so traversal walks the arena
+// front to back, and points the tree at the copies. Every primitive must be a triangle.
+void place_in_leaf_order(const hittable_list& source, bvh& tree, hittable_list& world) {
+	std::vector<int> placed(source.objects.size(), -1);		// Index in world of each source object, once copied
+	world.objects.clear();
+	world.objects.reserve(source.objects.size());
+
+	for (size_t i = 0; i < tree.primitives.size(); ++i) {
+		int& index = placed[tree.primitive_indices[i]];
+		if (index < 0) {
+			index = int(world.objects.size());
+			world.objects.push_back(world.make<triangle>(*static_cast<const triangle*>(tree.primitives[i])));
+		}
+
+		tree.primitives[i] = world.objects[index];
+		tree.primitive_indices[i] = index;
+	}
+}
+
+// Loads an OBJ through a cache keyed by its content, rebuilding and rewriting the cache when it is missing or stale.
+// The pool must already be started.
+bool load_obj_cached(const char* obj_path, const char* cache_directory, const bvh_build_options& options,
+	thread_pool& pool, hittable_list& world, bvh& world_bvh)
+{
+	auto time_s = std::chrono::high_resolution_clock::now();
+
+	uint64_t key;
+	if (!scene_cache_key(obj_path, options, key)) {
+		printf("Unable to open file: %s\n", obj_path);
+		return false;
+	}
+
+	std::string cache_path = scene_cache_path(cache_directory, key);
+	if (load_scene_cache(cache_path, key, world, world_bvh)) {
+		auto time_f = std::chrono::high_resolution_clock::now();
+		printf("Scene cache hit: %s (%.2f ms)\n", cache_path.c_str(), std::chrono::duration<double, std::milli>(time_f - time_s).count());
+		return true;
+	}
+
+	mesh obj_mesh;
+	if (!read_obj(obj_path, obj_mesh)) return false;
+
+	world_bvh = bvh();
+	world.clear();
+	world.arena = make_shared<scene_arena>();
+	auto test_mat = world.arena->make<normal>();
+
+	// Built from triangles in face order, then copied into the scene's arena in the order of the leaves
+	hittable_list faces;
+	faces.arena = make_shared<scene_arena>();
+	add_triangles(obj_mesh, test_mat, faces);
+
+	world_bvh = bvh(faces, pool, options);
+
+	std::vector<const material*> materials = { test_mat };
+	std::vector<uint32_t> face_materials(obj_mesh.faces.size(), 0);
+
+	if (save_scene_cache(cache_path, key, obj_mesh, materials, face_materials, world_bvh)) {
+		printf("Scene cache miss, wrote %s\n", cache_path.c_str());
+	}
+	else {
+		printf("Unable to write scene cache: %s\n", cache_path.c_str());
+	}
+
+	place_in_leaf_order(faces, world_bvh, world);
+	return true;
+}
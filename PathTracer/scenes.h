@@ -0,0 +1,212 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "animation.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "mesh.h"
+#include "sphere.h"
+#include "thread_pool.h"
+#include "triangle.h"
+
+#include "glm/gtc/matrix_transform.hpp"
+
+#include <string>
+
+hittable_list sample_scene() {
+	hittable_list world;
+	world.arena = make_shared<scene_arena>();
+	scene_arena& arena = *world.arena;
+	
+	auto material_ground = arena.make<lambertian>(vec3(0.8f, 0.8f, 0.f));
+	auto material_left = arena.make<dielectric>(1.5f);
+	auto material_center = arena.make<lambertian>(vec3(0.1f, 0.2f, 0.5f));
+	auto material_right = arena.make<metal>(vec3(0.8f, 0.6f, 0.2f), 0.f);
+
+	world.add(arena.make<sphere>(vec3(0.f, -100.5f, -1.f), 100.f, material_ground));
+	world.add(arena.make<sphere>(vec3(-1.f, 0.f, -1.f), 0.5f, material_left));
+	world.add(arena.make<sphere>(vec3(-1.f, 0.f, -1.f), -0.45f, material_left));
+	world.add(arena.make<sphere>(vec3(0.f, 0.f, -1.f), 0.5f, material_center));
+	world.add(arena.make<sphere>(vec3(1.f, 0.f, -1.f), 0.5f, material_right));
+
+	return world;
+}
+
+hittable_list test_scene() {
+	hittable_list world;
+	world.arena = make_shared<scene_arena>();
+	scene_arena& arena = *world.arena;
+
+	auto material_ground = arena.make<lambertian>(vec3(0.5f, 0.5f, 0.5f));
+	auto material_metal = arena.make<metal>(vec3(0.7f, 0.6f, 0.5f), 0.f);
+	auto material_lambertian = arena.make<lambertian>(vec3(0.1f, 0.2f, 0.5f));
+	auto material_normal = arena.make<normal>();
+
+	world.add(arena.make<sphere>(vec3(0.f, -1000.f, 0.f), 1000.f, material_ground));
+
+	vec3 p0 = vec3(0.f, 0.f, -1.f);
+	vec3 p1 = vec3(2.f, 0.f, -2.f);
+	vec3 p2 = vec3(0.f, 2.f, -2.f);
+	vec3 p3 = vec3(2.f, 2.f, -1.f);
+
+	world.add(arena.make<triangle>(
+		p0,
+		p1,
+		p2,
+		cross(p1 - p0, p2 - p0),
+		vec3(0.f, 0.f, 1.f),
+		vec3(0.f, 0.f, 1.f),
+		material_normal
+		));
+
+	world.add(arena.make<triangle>(
+		p3,
+		p1,
+		p2,
+		-cross(p1 - p3, p2 - p3),
+		vec3(0.f, 0.f, 1.f),
+		vec3(0.f, 0.f, 1.f),
+		material_normal
+		));
+	
+	world.add(arena.make<sphere>(
+		vec3(0.f, 0.5f, 0.5f),
+		0.5f,
+		material_lambertian
+		));
+
+	return world;
+}
+
+hittable_list random_spheres_scene() {
+	hittable_list world;
+	world.arena = make_shared<scene_arena>();
+	scene_arena& arena = *world.arena;
+
+	auto ground_mat = arena.make<lambertian>(vec3(0.5f, 0.5f, 0.5f));
+	world.add(arena.make<sphere>(vec3(0.f, -1000.f, 0.f), 1000.f, ground_mat));
+
+	for (int x = -11; x < 11; ++x) {
+		for (int y = -11; y < 11; ++y) {
+			float choose_mat = random_float();
+			vec3 center(x + 0.9f * random_float(), 0.2f, y + 0.9f * random_float());
+
+			if ((center - vec3(4.f, 0.2f, 0.f)).length() > 0.9f) {
+				material* next_mat;
+
+				if (choose_mat < 0.8f) {
+					// lambertian
+					vec3 albedo = random_vec3() * random_vec3();
+					next_mat = arena.make<lambertian>(albedo);
+				}
+				else if (choose_mat < 0.95f) {
+					// metal
+					vec3 albedo = random_vec3(0.5f, 1.f);
+					float roughness = random_float(0.f, 0.5f);
+					next_mat = arena.make<metal>(albedo, roughness);
+				}
+				else {
+					// glass
+					next_mat = arena.make<dielectric>(1.5f);
+				}
+
+				world.add(arena.make<sphere>(center, 0.2f, next_mat));
+			}
+		}
+	}
+
+	auto dielectric_mat = arena.make<dielectric>(1.5f);
+	world.add(arena.make<sphere>(vec3(0.f, 1.f, 0.f), 1.f, dielectric_mat));
+
+	auto lambertian_mat = arena.make<lambertian>(vec3(0.4f, 0.2f, 0.1f));
+	world.add(arena.make<sphere>(vec3(-4.f, 1.f, 0.f), 1.f, lambertian_mat));
+
+	auto metal_mat = arena.make<metal>(vec3(0.7f, 0.6f, 0.5f), 0.f);
+	world.add(arena.make<sphere>(vec3(4.f, 1.f, 0.f), 1.f, metal_mat));
+
+	return world;
+}
+
+hittable_list instanced_scene(thread_pool& pool) {
+	hittable_list world;
+	world.arena = make_shared<scene_arena>();
+	scene_arena& arena = *world.arena;
+
+	auto ground_mat = arena.make<lambertian>(vec3(0.5f, 0.5f, 0.5f));
+	world.add(arena.make<sphere>(vec3(0.f, -1000.f, 0.f), 1000.f, ground_mat));
+
+	// Every instance shares one bottom level BVH, only the transforms are stored per copy
+	hittable_list sphere_mesh;
+	sphere_mesh.arena = world.arena;
+	add_triangles(make_uv_sphere(32, 64), arena.make<lambertian>(vec3(0.8f)), sphere_mesh);
+	auto shared_mesh = arena.make<bvh>(sphere_mesh, pool);
+
+	material* palette[] = {
+		arena.make<lambertian>(vec3(0.1f, 0.2f, 0.5f)),
+		arena.make<lambertian>(vec3(0.8f, 0.3f, 0.1f)),
+		arena.make<metal>(vec3(0.7f, 0.6f, 0.5f), 0.1f),
+		arena.make<dielectric>(1.5f)
+	};
+
+	const int grid_size = 100;
+	for (int x = 0; x < grid_size; ++x) {
+		for (int z = 0; z < grid_size; ++z) {
+			float scale = random_float(0.05f, 0.15f);
+			vec3 position((x - grid_size / 2) * 0.3f, scale, (z - grid_size / 2) * 0.3f);
+
+			glm::mat4 transform = glm::translate(glm::mat4(1.f), position);
+			transform = glm::rotate(transform, random_float(0.f, 2.f * pi), vec3(0.f, 1.f, 0.f));
+			transform = glm::scale(transform, vec3(scale, scale * random_float(0.5f, 1.5f), scale));
+
+			world.add(arena.make<instance>(shared_mesh, transform, palette[(x + z) % 4]));
+		}
+	}
+
+	printf("Instanced scene: %d instances of a %zu triangle mesh\n", grid_size * grid_size, shared_mesh->primitives.size());
+
+	return world;
+}
+
+hittable_list animated_scene(animated_mesh& animation) {
+	hittable_list world;
+	world.arena = make_shared<scene_arena>();
+	scene_arena& arena = *world.arena;
+
+	auto ground_mat = arena.make<lambertian>(vec3(0.5f, 0.5f, 0.5f));
+	world.add(arena.make<sphere>(vec3(0.f, -1000.f, 0.f), 1000.f, ground_mat));
+
+	auto mesh_mat = arena.make<metal>(vec3(0.7f, 0.6f, 0.5f), 0.1f);
+	make_animated_mesh(make_uv_sphere(64, 128), mesh_mat, animation, world);
+
+	return world;
+}
+
+// Sliver heavy geometry, where spatial splits pay off
+hittable_list sliver_scene() {
+	hittable_list world;
+	world.arena = make_shared<scene_arena>();
+	scene_arena& arena = *world.arena;
+
+	auto sliver_mat = arena.make<lambertian>(vec3(0.7f, 0.6f, 0.5f));
+	add_triangles(make_sliver_mesh(20000, 0.01f), sliver_mat, world);
+
+	return world;
+}
+
+// Built in scene by name, animated scenes fill in the animation
+bool make_scene(const std::string& name, thread_pool& pool, animated_mesh& animation, hittable_list& world) {
+	if (name == "sample") world = sample_scene();
+	else if (name == "test") world = test_scene();
+	else if (name == "random_spheres") world = random_spheres_scene();
+	else if (name == "instanced") world = instanced_scene(pool);
+	else if (name == "animated") world = animated_scene(animation);
+	else if (name == "sliver") world = sliver_scene();
+	else {
+		printf("Unknown scene: %s\n", name.c_str());
+		return false;
+	}
+
+	return true;
+}
@@ -7,14 +7,15 @@
 class sphere : public hittable {
 	public:
 		sphere() {}
-		sphere(glm::vec3 cen, float r, shared_ptr<material> m) : center(cen), radius(r), mat_ptr(m) {}
+		sphere(glm::vec3 cen, float r, const material* m) : center(cen), radius(r), mat_ptr(m) {}
 
 		virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
 
 	public:
 		glm::vec3 center;
 		float radius;
-		shared_ptr<material> mat_ptr;
+		const material* mat_ptr;
 };
 
 bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
@@ -30,20 +31,25 @@ bool sphere::hit(const ray& r, float t_min, float t_max, hit_record& rec) const
 
 	// Find the nearest root within the range [t_min, t_max]
 	float root = (-half_b - sqrtd) / a;
-	float dist = root * r.direction().length();
-	if (dist < t_min || t_max < dist) {
+	if (root < t_min || t_max < root) {
 		root = (-half_b + sqrtd) / a;
-		dist = root * r.direction().length();
-		if (dist < t_min || t_max < dist) {
+		if (root < t_min || t_max < root) {
 			return false;
 		}
 	}
 
-	rec.t = dist;
+	rec.t = root;
 	rec.p = r.at(root);
 	glm::vec3 outward_normal = (rec.p - center) / radius;
 	rec.set_face_normal(r, outward_normal);
 	rec.mat_ptr = mat_ptr;
 
+	return true;
+}
+
+bool sphere::bounding_box(aabb& output_box) const {
+	// Hollow spheres use a negative radius
+	glm::vec3 r = glm::vec3(fabs(radius));
+	output_box = aabb(center - r, center + r);
 	return true;
 }
\ No newline at end of file
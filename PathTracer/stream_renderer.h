@@ -0,0 +1,174 @@
+#pragma once
+
+#include "PathTracer.h"
+#include "aov.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "hdr_writer.h"
+#include "hittable.h"
+#include "png_writer.h"
+#include "renderer.h"
+#include "telemetry.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Files a streamed render writes, empty paths are skipped
+struct stream_outputs {
+	std::string png_path;
+	std::string exr_path;
+	exr_pixel_type exr_type = exr_pixel_type::half;
+	unsigned aovs = aov_none;		// Layers added to the EXR next to the color
+};
+
+struct stream_stats {
+	int bands = 0;
+	int bands_in_flight = 0;
+	size_t buffer_bytes = 0;		// Everything held for the bands in flight, independent of the image height
+	uint64_t rays = 0;
+	uint64_t page_touches = 0;
+	double render_ms = 0.0;
+};
+
+// One row of tiles, rendered in parallel and written out once all of its tiles are done
+struct stream_band {
+	int first_row = 0;
+	int row_count = 0;
+	int tiles_left = 0;
+	std::vector<unsigned char> rgb;		// Top down, like the PNG
+	framebuffer linear;
+};
+
+// Renders the image as bands of tile rows from the top down, keeping only a few bands in flight. Each finished band
+// is appended to the PNG and its lines written to the EXR straight away, so memory depends on the image width and
+// tile size but not on the height. The pool must be running.
+bool render_streamed
+(
+	const int image_width, const int image_height, const int tile_size,
+	const int samples_per_pixel, const int max_depth,
+	const camera& cam, const hittable& world, uint32_t seed,
+	const stream_outputs& outputs, thread_pool& pool, stream_stats& stats
+)
+{
+	const int image_channels = 3;
+	const int band_count = (image_height + tile_size - 1) / tile_size;
+	const int tiles_per_band = (image_width + tile_size - 1) / tile_size;
+
+	// Enough bands that every thread has a couple of tiles while the oldest band waits on its last one
+	const int thread_count = std::max(1, int(pool.ThreadCount()));
+	const int window = std::min(band_count, std::max(2, (2 * thread_count + tiles_per_band - 1) / tiles_per_band + 1));
+
+	png_writer png;
+	if (!outputs.png_path.empty() && !png.open(outputs.png_path, image_width, image_height, image_channels)) {
+		printf("Unable to write %s\n", outputs.png_path.c_str());
+		return false;
+	}
+
+	const bool has_linear = !outputs.exr_path.empty();
+	std::vector<stream_band> bands(window);
+	for (stream_band& band : bands) {
+		band.rgb.resize(size_t(image_width) * tile_size * image_channels);
+		if (has_linear) {
+			band.linear = framebuffer(image_width, tile_size);
+			band.linear.add_layer("", { "R", "G", "B" });
+			add_aov_layers(band.linear, outputs.aovs);
+		}
+	}
+
+	exr_writer exr;
+	if (has_linear) {
+		const framebuffer& layout = bands[0].linear;
+		if (!exr.open(outputs.exr_path, image_width, image_height, framebuffer_channel_names(layout), framebuffer_channel_types(layout, outputs.exr_type))) {
+			printf("Unable to write %s\n", outputs.exr_path.c_str());
+			return false;
+		}
+	}
+
+	std::mutex band_mutex;
+	std::condition_variable band_done;
+	std::atomic<uint64_t> rays(0);
+	std::atomic<uint64_t> page_touches(0);
+
+	auto queue_band = [&](int index) {
+		stream_band& band = bands[index % window];
+		const int row_end = image_height - index * tile_size;
+		band.first_row = std::max(0, row_end - tile_size);
+		band.row_count = row_end - band.first_row;
+		band.tiles_left = tiles_per_band;
+
+		stream_band* target = &band;
+		for (int x = 0; x < image_width; x += tile_size) {
+			pool.QueueJob([&, target, x] {
+				ray_counters counters_s = thread_ray_counters;
+				sample_rect(x, target->first_row, tile_size, target->row_count,
+					image_width, image_height, samples_per_pixel, max_depth, image_channels,
+					cam, world, seed, target->rgb.data(), nullptr, has_linear ? &target->linear : nullptr,
+					target->first_row, target->row_count);
+				ray_counters counters = thread_ray_counters - counters_s;
+				rays += counters.rays();
+				page_touches += counters.page_touches;
+
+				std::lock_guard<std::mutex> lock(band_mutex);
+				if (--target->tiles_left == 0) band_done.notify_all();
+			});
+		}
+	};
+
+	auto time_s = std::chrono::high_resolution_clock::now();
+
+	for (int index = 0; index < window; ++index) queue_band(index);
+
+	bool is_valid = true;
+	std::vector<exr_channel_row> rows;
+	for (int index = 0; index < band_count; ++index) {
+		stream_band& band = bands[index % window];
+		{
+			std::unique_lock<std::mutex> lock(band_mutex);
+			band_done.wait(lock, [&band] { return band.tiles_left == 0; });
+		}
+
+		// Written while the other bands in flight keep rendering
+		if (!outputs.png_path.empty()) {
+			is_valid = png.write_rows(band.rgb.data(), band.row_count, image_width * image_channels) && is_valid;
+		}
+
+		for (int y = band.row_count - 1; has_linear && y >= 0; --y) {
+			rows.clear();
+			for (size_t l = 0; l < band.linear.layers.size(); ++l) {
+				const int channel_count = band.linear.layers[l].channel_count();
+				for (int c = 0; c < channel_count; ++c) {
+					rows.push_back({ band.linear.pixel(int(l), 0, y) + c, channel_count });
+				}
+			}
+			is_valid = exr.write_line(image_height - 1 - (band.first_row + y), rows) && is_valid;
+		}
+
+		if (index + window < band_count) queue_band(index + window);
+	}
+
+	pool.Wait();
+
+	auto time_f = std::chrono::high_resolution_clock::now();
+
+	if (!outputs.png_path.empty() && !png.close()) is_valid = false;
+	if (has_linear && !exr.close()) is_valid = false;
+
+	stats.bands = band_count;
+	stats.bands_in_flight = window;
+	stats.buffer_bytes = 0;
+	for (const stream_band& band : bands) {
+		stats.buffer_bytes += band.rgb.size();
+		for (const framebuffer_layer& layer : band.linear.layers) stats.buffer_bytes += layer.data.size() * sizeof(float);
+	}
+	stats.rays = rays;
+	stats.page_touches = page_touches;
+	stats.render_ms = std::chrono::duration<double, std::milli>(time_f - time_s).count();
+
+	return is_valid;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct ray_counters {
+	uint64_t primary_rays = 0;
+	uint64_t secondary_rays = 0;
+	uint64_t nodes_visited = 0;		// BVH nodes popped during traversal, including nested instance BVHs
+	uint64_t box_tests = 0;
+	uint64_t primitive_tests = 0;	// Calls into primitive hit functions from a BVH leaf or a list
+	uint64_t bounces = 0;			// Scatter events along every path
+	uint64_t samples = 0;
+	uint64_t page_touches = 0;		// Geometry pages reached by traversal of a paged mesh, resident or not
+
+	uint64_t rays() const { return primary_rays + secondary_rays; }
+
+	ray_counters& operator+=(const ray_counters& other) {
+		primary_rays += other.primary_rays;
+		secondary_rays += other.secondary_rays;
+		nodes_visited += other.nodes_visited;
+		box_tests += other.box_tests;
+		primitive_tests += other.primitive_tests;
+		bounces += other.bounces;
+		samples += other.samples;
+		page_touches += other.page_touches;
+		return *this;
+	}
+};
+
+inline ray_counters operator-(const ray_counters& a, const ray_counters& b) {
+	ray_counters out;
+	out.primary_rays = a.primary_rays - b.primary_rays;
+	out.secondary_rays = a.secondary_rays - b.secondary_rays;
+	out.nodes_visited = a.nodes_visited - b.nodes_visited;
+	out.box_tests = a.box_tests - b.box_tests;
+	out.primitive_tests = a.primitive_tests - b.primitive_tests;
+	out.bounces = a.bounces - b.bounces;
+	out.samples = a.samples - b.samples;
+	out.page_touches = a.page_touches - b.page_touches;
+	return out;
+}
+
+// Counted by whichever thread traces the ray, never shared, so updates need no synchronization
+thread_local ray_counters thread_ray_counters;
+
+// One contiguous stretch of rows of a tile rendered by a single thread
+struct tile_record {
+	int frame;
+	int tile;
+	int thread;
+	int x, y, width, height;
+	double start_ms;	// Relative to the creation of the telemetry
+	double end_ms;
+	ray_counters counters;
+};
+
+class render_telemetry {
+	public:
+		render_telemetry() : origin(std::chrono::high_resolution_clock::now()) {}
+
+		double now_ms() const {
+			return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - origin).count();
+		}
+
+		void add(const tile_record& record) {
+			std::lock_guard<std::mutex> lock(records_mutex);
+			records.push_back(record);
+		}
+
+		// Chrome trace_event format, open in chrome://tracing or Perfetto
+		bool write_chrome_trace(const char* path) const;
+
+		// One line per tile per frame, summed over every thread that worked on it
+		bool write_csv(const char* path) const;
+
+	public:
+		std::vector<tile_record> records;
+
+	private:
+		std::chrono::high_resolution_clock::time_point origin;
+		std::mutex records_mutex;
+};
+
+bool render_telemetry::write_chrome_trace(const char* path) const {
+	FILE* file = fopen(path, "w");
+	if (file == nullptr) return false;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	int max_thread = -1;
+	for (const tile_record& record : records) {
+		max_thread = std::max(max_thread, record.thread);
+	}
+	for (int thread = 0; thread <= max_thread; ++thread) {
+		fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}},\n", thread, thread);
+	}
+
+	for (size_t i = 0; i < records.size(); ++i) {
+		const tile_record& r = records[i];
+		fprintf(file,
+			"{\"name\":\"tile %d\",\"cat\":\"frame %d\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+			"\"args\":{\"x\":%d,\"y\":%d,\"width\":%d,\"height\":%d,\"rays\":%llu,\"primary_rays\":%llu,"
+			"\"secondary_rays\":%llu,\"nodes_visited\":%llu,\"box_tests\":%llu,\"primitive_tests\":%llu,"
+			"\"bounces\":%llu,\"samples\":%llu}}%s\n",
+			r.tile, r.frame, r.thread, r.start_ms * 1000.0, (r.end_ms - r.start_ms) * 1000.0,
+			r.x, r.y, r.width, r.height,
+			(unsigned long long)r.counters.rays(), (unsigned long long)r.counters.primary_rays,
+			(unsigned long long)r.counters.secondary_rays, (unsigned long long)r.counters.nodes_visited,
+			(unsigned long long)r.counters.box_tests, (unsigned long long)r.counters.primitive_tests,
+			(unsigned long long)r.counters.bounces, (unsigned long long)r.counters.samples,
+			i + 1 < records.size() ? "," : "");
+	}
+
+	fprintf(file, "]}\n");
+	return fclose(file) == 0;
+}
+
+bool render_telemetry::write_csv(const char* path) const {
+	struct tile_summary {
+		tile_record first;
+		double busy_ms = 0.0;
+		double end_ms = 0.0;
+		int spans = 0;
+		ray_counters counters;
+	};
+
+	// Ordered by frame, then tile
+	std::map<std::pair<int, int>, tile_summary> summaries;
+	for (const tile_record& record : records) {
+		tile_summary& summary = summaries[std::make_pair(record.frame, record.tile)];
+		if (summary.spans == 0 || record.start_ms < summary.first.start_ms) summary.first = record;
+
+		summary.busy_ms += record.end_ms - record.start_ms;
+		summary.end_ms = std::max(summary.end_ms, record.end_ms);
+		summary.counters += record.counters;
+		++summary.spans;
+	}
+
+	FILE* file = fopen(path, "w");
+	if (file == nullptr) return false;
+
+	fprintf(file, "frame,tile,x,y,width,height,first_thread,spans,start_ms,end_ms,busy_ms,rays,primary_rays,secondary_rays,nodes_visited,box_tests,primitive_tests,bounces,samples,mrays_per_s\n");
+	for (const auto& entry : summaries) {
+		const tile_summary& s = entry.second;
+		const tile_record& f = s.first;
+		double mrays = s.busy_ms > 0.0 ? s.counters.rays() / (s.busy_ms * 1000.0) : 0.0;
+
+		fprintf(file, "%d,%d,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.3f\n",
+			f.frame, f.tile, f.x, f.y, f.width, f.height, f.thread, s.spans, f.start_ms, s.end_ms, s.busy_ms,
+			(unsigned long long)s.counters.rays(), (unsigned long long)s.counters.primary_rays,
+			(unsigned long long)s.counters.secondary_rays, (unsigned long long)s.counters.nodes_visited,
+			(unsigned long long)s.counters.box_tests, (unsigned long long)s.counters.primitive_tests,
+			(unsigned long long)s.counters.bounces, (unsigned long long)s.counters.samples, mrays);
+	}
+
+	return fclose(file) == 0;
+}
@@ -10,9 +10,12 @@
 class thread_pool {
 	public:
 		void Start() {
+			Start(std::thread::hardware_concurrency());
+		}
+
+		void Start(uint32_t num_threads) {
 			do_terminate = false;
 
-			const uint32_t num_threads = std::thread::hardware_concurrency();
 			threads.resize(num_threads);
 
 			// Initialize the maximum number of concurrent threads
@@ -43,6 +46,8 @@ class thread_pool {
 				thread.join();
 			}
 			threads.clear();
+
+			do_print = false;
 		}
 
 		void QueueJob(const std::function<void()>& job) {
@@ -50,10 +55,23 @@ class thread_pool {
 			{
 				std::unique_lock<std::mutex> lock(jobs_mutex);
 				jobs.push(job);
+				++jobs_in_flight;
 			}
 			wait_condition.notify_one();
 		}
 
+		// Block until every queued job, including any queued by running jobs, has finished
+		void Wait() {
+			std::unique_lock<std::mutex> lock(jobs_mutex);
+			done_condition.wait(lock, [this] {
+				return jobs_in_flight == 0;
+			});
+		}
+
+		uint32_t ThreadCount() const {
+			return uint32_t(threads.size());
+		}
+
 		bool IsBusy() {
 			std::unique_lock<std::mutex> lock(jobs_mutex);
 			return !jobs.empty();
@@ -80,6 +98,13 @@ class thread_pool {
 
 				job();
 
+				{
+					std::unique_lock<std::mutex> lock(jobs_mutex);
+					if (--jobs_in_flight == 0) {
+						done_condition.notify_all();
+					}
+				}
+
 				if (do_print) {
 					std::unique_lock<std::mutex> lock(completed_mutex);
 					++jobs_completed;
@@ -98,6 +123,9 @@ class thread_pool {
 		std::mutex jobs_mutex;
 
 		std::condition_variable wait_condition;
+		std::condition_variable done_condition;
+
+		uint32_t jobs_in_flight = 0;
 
 		uint32_t jobs_total = 0;
 		uint32_t jobs_completed = 0;
@@ -0,0 +1,307 @@
+#pragma once
+
+#include "telemetry.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <vector>
+
+enum class tile_order {
+	row_major,	// Scanline order, the original behaviour
+	hilbert,	// Neighbouring tiles are issued together, so concurrent threads share scene data
+	spiral		// Center outwards, the usually interesting part of the image finishes first
+};
+
+inline const char* tile_order_name(tile_order order) {
+	switch (order) {
+		case tile_order::row_major: return "row major";
+		case tile_order::hilbert: return "hilbert";
+		case tile_order::spiral: return "spiral";
+	}
+	return "unknown";
+}
+
+struct tile {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+// Largest power of two tile between 16 and 64 pixels that still gives every thread several tiles to balance with
+inline int auto_tile_size(int image_width, int image_height, int thread_count) {
+	const int tiles_per_thread = 8;
+	const int target_tiles = tiles_per_thread * std::max(1, thread_count);
+
+	int size = 64;
+	while (size > 16) {
+		int tiles = ((image_width + size - 1) / size) * ((image_height + size - 1) / size);
+		if (tiles >= target_tiles) break;
+		size /= 2;
+	}
+
+	return size;
+}
+
+// Position d along the Hilbert curve filling an n by n grid, n must be a power of two
+inline void hilbert_to_xy(int n, int d, int& x, int& y) {
+	x = 0;
+	y = 0;
+
+	for (int s = 1; s < n; s *= 2) {
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+
+		// Rotate the quadrant
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
+
+// Cover the image with tiles in the order they should be rendered, edge tiles are clipped to the image
+std::vector<tile> make_tiles(int image_width, int image_height, int tile_size, tile_order order) {
+	const int columns = (image_width + tile_size - 1) / tile_size;
+	const int rows = (image_height + tile_size - 1) / tile_size;
+
+	std::vector<tile> tiles;
+	tiles.reserve(columns * rows);
+
+	auto add_tile = [&](int column, int row) {
+		int x = column * tile_size;
+		int y = row * tile_size;
+		tiles.push_back({ x, y, std::min(tile_size, image_width - x), std::min(tile_size, image_height - y) });
+	};
+
+	switch (order) {
+		case tile_order::hilbert: {
+			// Walk the curve over the smallest power of two grid that covers the tiles, skipping cells outside the image
+			int n = 1;
+			while (n < columns || n < rows) n *= 2;
+
+			for (int d = 0; d < n * n; ++d) {
+				int column, row;
+				hilbert_to_xy(n, d, column, row);
+				if (column < columns && row < rows) add_tile(column, row);
+			}
+			break;
+		}
+
+		case tile_order::spiral: {
+			for (int row = 0; row < rows; ++row) {
+				for (int column = 0; column < columns; ++column) {
+					add_tile(column, row);
+				}
+			}
+
+			// Order by square ring around the center, then by angle within each ring
+			const float center_x = 0.5f * image_width;
+			const float center_y = 0.5f * image_height;
+			auto ring = [&](const tile& t) {
+				float dx = std::fabs(t.x + 0.5f * t.width - center_x);
+				float dy = std::fabs(t.y + 0.5f * t.height - center_y);
+				return int(std::max(dx, dy) / tile_size);
+			};
+			auto angle = [&](const tile& t) {
+				return std::atan2(t.y + 0.5f * t.height - center_y, t.x + 0.5f * t.width - center_x);
+			};
+
+			std::stable_sort(tiles.begin(), tiles.end(), [&](const tile& a, const tile& b) {
+				int ring_a = ring(a);
+				int ring_b = ring(b);
+				if (ring_a != ring_b) return ring_a < ring_b;
+				return angle(a) < angle(b);
+			});
+			break;
+		}
+
+		default: {
+			for (int row = 0; row < rows; ++row) {
+				for (int column = 0; column < columns; ++column) {
+					add_tile(column, row);
+				}
+			}
+			break;
+		}
+	}
+
+	return tiles;
+}
+
+// Hands tiles to every thread of the pool, most expensive first. Threads that run out of tiles steal rows from
+// the running tile with the most rows left, so a heavy tile is split between however many threads are idle.
+class tile_scheduler {
+	public:
+		tile_scheduler() {}
+		tile_scheduler(std::vector<tile> frame_tiles) : tiles(std::move(frame_tiles)) {}
+
+		// Time a cheap approximation of every tile, such as a sparse single sample pass, to order the first frame
+		void estimate_costs(thread_pool& pool, const std::function<double(const tile&)>& estimate);
+
+		// Render every row of every tile through render_rows(tile, y_begin, y_end), measuring each tile's cost for the
+		// next frame. Each stretch of rows a thread renders is recorded when telemetry is given. The pool must already
+		// be started.
+		void run(thread_pool& pool, const std::function<void(const tile&, int, int)>& render_rows,
+			render_telemetry* telemetry = nullptr, int frame = 0);
+
+	public:
+		std::vector<tile> tiles;
+		std::vector<double> tile_costs;		// Milliseconds spent on each tile, empty until estimated or run
+
+		bool print_progress = true;			// Print the completed percent after every tile
+		std::function<void(int)> tile_done;	// Given each tile's index once its last row is in, on the thread that rendered it
+		double tail_ms = 0.0;				// Time between the first thread running out of work and the end of the frame
+		int stolen_rows = 0;
+
+	private:
+		struct tile_work {
+			std::atomic<int> next_row;
+			std::atomic<int> rows_done;
+			std::atomic<int64_t> cost_ns;
+		};
+};
+
+void tile_scheduler::estimate_costs(thread_pool& pool, const std::function<double(const tile&)>& estimate) {
+	tile_costs.assign(tiles.size(), 0.0);
+
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		pool.QueueJob([this, &estimate, i] {
+			tile_costs[i] = estimate(tiles[i]);
+		});
+	}
+	pool.Wait();
+}
+
+void tile_scheduler::run(thread_pool& pool, const std::function<void(const tile&, int, int)>& render_rows,
+	render_telemetry* telemetry, int frame)
+{
+	const int tile_count = int(tiles.size());
+	if (tile_count == 0) return;
+
+	// Most expensive first, so the long tiles start early instead of setting the end of the frame
+	std::vector<int> order(tile_count);
+	std::iota(order.begin(), order.end(), 0);
+	if (int(tile_costs.size()) == tile_count) {
+		std::stable_sort(order.begin(), order.end(), [this](int a, int b) { return tile_costs[a] > tile_costs[b]; });
+	}
+
+	std::unique_ptr<tile_work[]> work(new tile_work[tile_count]);
+	for (int i = 0; i < tile_count; ++i) {
+		work[i].next_row = 0;
+		work[i].rows_done = 0;
+		work[i].cost_ns = 0;
+	}
+
+	std::atomic<int> next_tile(0);
+	std::atomic<int> next_worker(0);
+	std::atomic<int> tiles_done(0);
+	std::atomic<int> steals(0);
+	std::atomic<bool> is_draining(false);
+	std::mutex timing_mutex;
+
+	auto time_s = std::chrono::high_resolution_clock::now();
+	auto first_idle = time_s;
+	auto last_finish = time_s;
+
+	// Render one row of a tile, returns false once the tile has no rows left to claim
+	auto render_row = [&](int index) {
+		const tile& t = tiles[index];
+		int row = work[index].next_row.fetch_add(1);
+		if (row >= t.height) return false;
+
+		auto row_s = std::chrono::high_resolution_clock::now();
+		render_rows(t, t.y + row, t.y + row + 1);
+		auto row_f = std::chrono::high_resolution_clock::now();
+		work[index].cost_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(row_f - row_s).count();
+
+		if (work[index].rows_done.fetch_add(1) + 1 == t.height) {
+			int done = tiles_done.fetch_add(1) + 1;
+			if (print_progress) printf("%f%%\n", 100.f * done / tile_count);
+			if (tile_done) tile_done(index);
+		}
+		return true;
+	};
+
+	// Render up to max_rows rows of a tile as one telemetry record, returns the number rendered
+	auto render_span = [&](int worker_index, int index, int max_rows) {
+		double start_ms = telemetry ? telemetry->now_ms() : 0.0;
+		ray_counters counters_s = thread_ray_counters;
+
+		int rows = 0;
+		while (rows < max_rows && render_row(index)) ++rows;
+
+		if (telemetry && rows > 0) {
+			const tile& t = tiles[index];
+			telemetry->add({ frame, index, worker_index, t.x, t.y, t.width, t.height,
+				start_ms, telemetry->now_ms(), thread_ray_counters - counters_s });
+		}
+		return rows;
+	};
+
+	auto worker = [&] {
+		const int worker_index = next_worker.fetch_add(1);
+
+		// Claim whole tiles while there are any
+		while (true) {
+			int slot = next_tile.fetch_add(1);
+			if (slot >= tile_count) break;
+
+			render_span(worker_index, order[slot], tiles[order[slot]].height);
+		}
+
+		if (!is_draining.exchange(true)) {
+			std::lock_guard<std::mutex> lock(timing_mutex);
+			first_idle = std::chrono::high_resolution_clock::now();
+		}
+
+		// Then help whichever running tile has the most rows left
+		while (true) {
+			int best = -1;
+			int best_rows = 0;
+			for (int i = 0; i < tile_count; ++i) {
+				int rows_left = tiles[i].height - work[i].next_row.load();
+				if (rows_left > best_rows) {
+					best = i;
+					best_rows = rows_left;
+				}
+			}
+
+			if (best == -1) break;
+			steals += render_span(worker_index, best, 1);
+		}
+
+		std::lock_guard<std::mutex> lock(timing_mutex);
+		last_finish = std::max(last_finish, std::chrono::high_resolution_clock::now());
+	};
+
+	const int worker_count = std::max(1, int(pool.ThreadCount()));
+	for (int i = 0; i < worker_count; ++i) {
+		pool.QueueJob(worker);
+	}
+	pool.Wait();
+
+	tile_costs.resize(tile_count);
+	for (int i = 0; i < tile_count; ++i) {
+		tile_costs[i] = work[i].cost_ns * 1e-6;
+	}
+
+	tail_ms = std::chrono::duration<double, std::milli>(last_finish - first_idle).count();
+	stolen_rows = steals;
+}
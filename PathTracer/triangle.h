@@ -8,7 +8,7 @@ using glm::vec3;
 class triangle : public hittable {
 	public:
 		triangle() {}
-		triangle(vec3 p0, vec3 p1, vec3 p2, shared_ptr<material> m) : p{ p0, p1, p2 }, mat_ptr(m) {
+		triangle(vec3 p0, vec3 p1, vec3 p2, const material* m) : p{ p0, p1, p2 }, mat_ptr(m) {
 			vec3 e1 = p[1] - p[0];
 			vec3 e2 = p[2] - p[0];
 
@@ -18,18 +18,23 @@ class triangle : public hittable {
 			n[2] = _n;
 		}
 
-		triangle(vec3 p0, vec3 p1, vec3 p2, vec3 n0, vec3 n1, vec3 n2, shared_ptr<material>m) : p{ p0, p1, p2 }, n{ normalize(n0), normalize(n1), normalize(n2) }, mat_ptr(m) {}
+		triangle(vec3 p0, vec3 p1, vec3 p2, vec3 n0, vec3 n1, vec3 n2, const material* m) : p{ p0, p1, p2 }, n{ normalize(n0), normalize(n1), normalize(n2) }, mat_ptr(m) {}
 
 		virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override;
+		virtual bool bounding_box(aabb& output_box) const override;
+		virtual bool clipped_box(int axis, float min, float max, aabb& output_box) const override;
+
+		// Fill in a hit at distance t and barycentric coordinates u, v
+		void set_hit(const ray& r, float t, float u, float v, hit_record& rec) const;
 
 	public:
 		vec3 p[3];
 		vec3 n[3];
-		shared_ptr<material> mat_ptr;
+		const material* mat_ptr;
 };
 
 bool triangle::hit(const ray& r, float t_min, float t_max, hit_record& rec) const {
-	vec3 d = normalize(r.direction());
+	vec3 d = r.direction();
 
 	vec3 e1 = p[1] - p[0];
 	vec3 e2 = p[2] - p[0];
@@ -52,16 +57,62 @@ bool triangle::hit(const ray& r, float t_min, float t_max, hit_record& rec) cons
 		return false;
 	}
 
-	rec.t = out.x;
-	rec.p = r.at(rec.t / r.direction().length());
+	set_hit(r, out.x, out.y, out.z, rec);
+	return true;
+}
+
+void triangle::set_hit(const ray& r, float t, float u, float v, hit_record& rec) const {
+	rec.t = t;
+	rec.p = r.at(rec.t);
 
 	vec3 outward_normal =
-		n[0] * (1 - out.y - out.z) +
-		n[1] * out.y +
-		n[2] * out.z;
+		n[0] * (1 - u - v) +
+		n[1] * u +
+		n[2] * v;
 
 	rec.set_face_normal(r, normalize(outward_normal));
 	rec.mat_ptr = mat_ptr;
+}
+
+bool triangle::bounding_box(aabb& output_box) const {
+	output_box = aabb(glm::min(glm::min(p[0], p[1]), p[2]), glm::max(glm::max(p[0], p[1]), p[2]));
+
+	// Pad axis aligned triangles so the box never has zero thickness
+	const float padding = 1e-4f;
+	output_box.minimum -= padding;
+	output_box.maximum += padding;
+	return true;
+}
+
+// Clip each edge against the slab, keeping the inside vertices and the crossing points
+bool triangle::clipped_box(int axis, float min, float max, aabb& output_box) const {
+	output_box = aabb();
+
+	for (int i = 0; i < 3; ++i) {
+		const vec3& a = p[i];
+		const vec3& b = p[(i + 1) % 3];
+		float va = a[axis];
+		float vb = b[axis];
+
+		if (va >= min && va <= max) output_box.expand(a);
+
+		if ((va < min && vb > min) || (va > min && vb < min)) {
+			vec3 q = glm::mix(a, b, (min - va) / (vb - va));
+			q[axis] = min;
+			output_box.expand(q);
+		}
+
+		if ((va < max && vb > max) || (va > max && vb < max)) {
+			vec3 q = glm::mix(a, b, (max - va) / (vb - va));
+			q[axis] = max;
+			output_box.expand(q);
+		}
+	}
+
+	if (output_box.is_empty()) return true;
 
+	const float padding = 1e-4f;
+	output_box.minimum -= padding;
+	output_box.maximum += padding;
 	return true;
-}
\ No newline at end of file
+}
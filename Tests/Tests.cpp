@@ -0,0 +1,165 @@
+// Checks the kernels compiled per instruction set against the generic ones, and each BVH builder against testing
+// every primitive. Prints one line per check and fails when any check does.
+//
+// Usage: Tests [--rays N] [--seed N]
+
+#include "PathTracer.h"
+
+#include "bvh.h"
+#include "cpu_dispatch.h"
+#include "hittable_list.h"
+#include "mesh.h"
+#include "sphere.h"
+#include "thread_pool.h"
+#include "triangle.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct test_settings {
+	int ray_count = 10000;
+	uint32_t seed = 1;
+};
+
+struct test_scene {
+	std::string name;
+	hittable_list world;
+};
+
+// Triangles of every size and orientation, a smooth mesh, and one list where spheres go through the kernels' callback
+std::vector<test_scene> make_test_scenes() {
+	std::vector<test_scene> scenes(3);
+
+	scenes[0].name = "triangle soup";
+	for (int i = 0; i < 4000; ++i) {
+		vec3 center = random_vec3(-2.f, 2.f);
+		float size = random_float(0.01f, 0.4f);
+		scenes[0].world.add(scenes[0].world.make<triangle>(center + random_vec3(-size, size), center + random_vec3(-size, size),
+			center + random_vec3(-size, size), nullptr));
+	}
+
+	scenes[1].name = "uv sphere";
+	add_triangles(make_uv_sphere(32, 64), nullptr, scenes[1].world);
+
+	scenes[2].name = "triangles and spheres";
+	add_triangles(make_uv_sphere(16, 32), nullptr, scenes[2].world);
+	for (int i = 0; i < 64; ++i) {
+		scenes[2].world.add(scenes[2].world.make<sphere>(random_vec3(-2.f, 2.f), random_float(0.05f, 0.3f), nullptr));
+	}
+
+	return scenes;
+}
+
+// From outside the scene towards it, and from inside it in every direction
+std::vector<ray> make_test_rays(int count) {
+	std::vector<ray> rays;
+	for (int i = 0; i < count; ++i) {
+		vec3 origin = i % 2 == 0 ? normalize(random_vec3(-1.f, 1.f) + vec3(0.f, 0.f, 1e-3f)) * 6.f : random_vec3(-2.f, 2.f);
+		vec3 target = random_vec3(-2.5f, 2.5f);
+		rays.push_back(ray(origin, target - origin));
+	}
+	return rays;
+}
+
+bool same_hit(bool hit_a, const hit_record& a, bool hit_b, const hit_record& b) {
+	if (hit_a != hit_b) return false;
+	return !hit_a || (a.t == b.t && a.p == b.p && a.normal == b.normal && a.front_face == b.front_face);
+}
+
+bool report(const std::string& name, int failures, int count) {
+	if (failures == 0) printf("PASS %s\n", name.c_str());
+	else printf("FAIL %s: %d of %d differ\n", name.c_str(), failures, count);
+	return failures == 0;
+}
+
+int main(int argc, char** argv) {
+	test_settings settings;
+
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--rays") == 0) settings.ray_count = std::max(1, atoi(argv[i + 1]));
+		else if (strcmp(argv[i], "--seed") == 0) settings.seed = uint32_t(atoi(argv[i + 1]));
+		else {
+			printf("Unknown argument: %s\n", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	seed_random(settings.seed);
+	std::vector<test_scene> scenes = make_test_scenes();
+	std::vector<ray> rays = make_test_rays(settings.ray_count);
+
+	const cpu_isa detected = detect_cpu_isa();
+	printf("Kernels up to %s\n", cpu_isa_name(detected));
+
+	thread_pool pool;
+	pool.Start();
+
+	bool passed = true;
+	for (const test_scene& scene : scenes) {
+		for (bvh_build_method method : { bvh_build_method::sah, bvh_build_method::lbvh, bvh_build_method::sbvh }) {
+			bvh_build_options options;
+			options.method = method;
+			bvh tree(scene.world, pool, options);
+
+			const std::string name = scene.name + ", " + bvh_build_method_name(method);
+			passed &= report(name + " tree", tree.is_well_formed() ? 0 : 1, 1);
+
+			// Closest hits match every primitive tested in turn. The kernels test triangles with their own
+			// arithmetic, so distances may differ by rounding.
+			int failures = 0;
+			for (const ray& r : rays) {
+				hit_record tree_rec, list_rec;
+				bool tree_hit = tree.hit_with(generic_kernels, r, 0.001f, infinity, tree_rec);
+				bool list_hit = scene.world.hit(r, 0.001f, infinity, list_rec);
+
+				if (tree_hit != list_hit || (tree_hit && std::fabs(tree_rec.t - list_rec.t) > 1e-4f * std::max(1.f, list_rec.t))) {
+					++failures;
+				}
+			}
+			passed &= report(name + " against every primitive", failures, int(rays.size()));
+
+			// Every instruction set must find the same hits as the generic kernels, to the bit
+			for (cpu_isa isa : { cpu_isa::sse42, cpu_isa::avx2, cpu_isa::avx512 }) {
+				if (detected < isa) break;
+
+				const kernel_table& kernels = kernels_for(isa);
+				failures = 0;
+				for (const ray& r : rays) {
+					hit_record generic_rec, isa_rec;
+					bool generic_hit = tree.hit_with(generic_kernels, r, 0.001f, infinity, generic_rec);
+					bool isa_hit = tree.hit_with(kernels, r, 0.001f, infinity, isa_rec);
+					if (!same_hit(generic_hit, generic_rec, isa_hit, isa_rec)) ++failures;
+				}
+				passed &= report(name + ", " + kernels.name + " against generic", failures, int(rays.size()));
+			}
+		}
+	}
+
+	pool.Stop();
+
+	// Odd lengths leave a remainder past the last full vector
+	std::vector<float> colors(3 * 1001);
+	for (size_t i = 0; i < colors.size(); ++i) colors[i] = i % 17 == 0 ? 0.f : random_float(0.f, 96.f);
+
+	std::vector<unsigned char> expected(colors.size());
+	generic_kernels.resolve_rgb8(colors.data(), int(colors.size()), 1.f / 64.f, expected.data());
+
+	for (cpu_isa isa : { cpu_isa::sse42, cpu_isa::avx2, cpu_isa::avx512 }) {
+		if (detected < isa) break;
+
+		const kernel_table& kernels = kernels_for(isa);
+		std::vector<unsigned char> rgb(colors.size());
+		kernels.resolve_rgb8(colors.data(), int(colors.size()), 1.f / 64.f, rgb.data());
+
+		int failures = 0;
+		for (size_t i = 0; i < rgb.size(); ++i) failures += rgb[i] != expected[i];
+		passed &= report(std::string("resolve_rgb8, ") + kernels.name + " against generic", failures, int(rgb.size()));
+	}
+
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}